@@ -21,8 +21,10 @@
 #include "Task.h"
 #include "Transforms.h"
 #include "Environment.h"
+#include "RegionStream.h"
 #include <cmath>
 #include <algorithm>
+#include <vector>
 
 //#define CHUNKED 1
 
@@ -171,47 +173,35 @@ void CVT::run( Session* session, const std::string& a ){
     session->out->printf( (const char*) str );
 #endif
 
-    // Get our requested region from our TileManager
-    TileManager tilemanager( session->tileCache, *session->image, session->watermark, session->jpeg, session->logfile, session->loglevel );
-    RawTile complete_image = tilemanager.getRegion( requested_res,
-						    session->view->xangle, session->view->yangle,
-						    session->view->getLayers(),
-						    view_left, view_top, view_width, view_height );
+    // Set up our requested region to be produced a strip at a time
+    RegionStream region( session->tileCache, session->watermark, session->logfile, session->loglevel,
+			 *session->image, requested_res,
+			 session->view->xangle, session->view->yangle,
+			 session->view->getLayers(),
+			 view_left, view_top, view_width, view_height );
+    region.setPipeline( Environment::getPipelineDepth() );
 
     if( session->loglevel >= 4 ){
       if( session->view->getContrast() != 1.0 ){
 	*(session->logfile) << "CVT :: Applying contrast of: " << session->view->getContrast() << endl;
       }
-      if( complete_image.bpc > 8 ) *(session->logfile) << "CVT :: Rescaling " <<  complete_image.bpc
-						       << " bit data to 8" << endl;
+      if( (*session->image)->getNumBitsPerPixel() > 8 ) *(session->logfile) << "CVT :: Rescaling "
+									 << (*session->image)->getNumBitsPerPixel()
+									 << " bit data to 8" << endl;
     }
 
 
-    // Convert CIELAB to sRGB
-    if( (*session->image)->getColourSpace() == CIELAB ){
-      Timer cielab_timer;
-      if( session->loglevel >= 3 ){
-	*(session->logfile) << "CVT :: Converting from CIELAB->sRGB" << endl;
-	cielab_timer.start();
-      }
-      filter_LAB2sRGB( complete_image );
-      if( session->loglevel >= 3 ){
-	*(session->logfile) << "CVT :: CIELAB->sRGB conversion in " << cielab_timer.getTime()
-			    << " microseconds" << endl;
-      }
+    // CIELAB is converted to sRGB as each row is decoded
+    if( (*session->image)->getColourSpace() == CIELAB && session->loglevel >= 3 ){
+      *(session->logfile) << "CVT :: Converting from CIELAB->sRGB" << endl;
     }
 
-    // Apply normalization and float conversion
-    filter_normalize( complete_image, (*session->image)->max, (*session->image)->min );
-
     // Apply hill shading if requested
     if( session->view->shaded ){
       if( session->loglevel >= 3 ){
 	*(session->logfile) << "CVT :: Applying hill-shading" << endl;
       }
-      filter_shade( complete_image, session->view->shade[0], session->view->shade[1] );
-      // Don't forget to reset our channels variable as hill shades are greyscale and this variable is used later
-      channels = 1;
+      region.setShading( session->view->shade[0], session->view->shade[1] );
     }
 
     // Apply any gamma correction
@@ -220,7 +210,7 @@ void CVT::run( Session* session, const std::string& a ){
       if( session->loglevel >= 3 ){
         *(session->logfile) << "CVT :: Applying gamma of " << gamma << endl; 
       }
-      filter_gamma( complete_image, gamma );
+      region.setGamma( gamma );
     }
 
     // Apply inversion if requested
@@ -228,7 +218,7 @@ void CVT::run( Session* session, const std::string& a ){
       if( session->loglevel >= 3 ){
 	*(session->logfile) << "CVT :: Applying inversion" << endl;
       }
-      filter_inv( complete_image );
+      region.setInversion();
     }
 
     // Apply color mapping if requested
@@ -236,86 +226,68 @@ void CVT::run( Session* session, const std::string& a ){
       if( session->loglevel >= 3 ){
 	*(session->logfile) << "CVT :: Applying color map" << endl;
       }
-      filter_cmap( complete_image, session->view->cmap );
-      // Don't forget to reset our channels variable as this is used later
-      channels = 3;
+      region.setColourMap( session->view->cmap );
     }
 
     // Resize our image as requested. Use the interpolation method requested in the server configuration.
     //  - Use bilinear interpolation by default
     if( (view_width!=resampled_width) && (view_height!=resampled_height) ){
-      Timer interpolation_timer;
-      string interpolation_type;
-      if( session->loglevel >= 5 ){
-	interpolation_timer.start();
-      }
       unsigned int interpolation = Environment::getInterpolation();
-      switch( interpolation ){
-        case 0:
-	  interpolation_type = "nearest neighbour";
-	  filter_interpolate_nearestneighbour( complete_image, resampled_width, resampled_height );
-	  break;
-        default:
-	  interpolation_type = "bilinear";
-	  filter_interpolate_bilinear( complete_image, resampled_width, resampled_height );
-	  break;
-      }
       if( session->loglevel >= 5 ){
-	*(session->logfile) << "CVT :: Resizing using " << interpolation_type << " interpolation in "
-			    << interpolation_timer.getTime() << " microseconds" << endl;
+	*(session->logfile) << "CVT :: Resizing using " << ( interpolation == 0 ? "nearest neighbour" : "bilinear" )
+			    << " interpolation" << endl;
       }
+      region.setSize( resampled_width, resampled_height, interpolation );
     }
 
     // Apply any contrast adjustments and/or clipping to 8bit from 16bit or 32bit
-    filter_contrast( complete_image, session->view->getContrast() );
-
+    region.setContrast( session->view->getContrast() );
 
     // Convert to greyscale if requested
     if( (*session->image)->getColourSpace() == sRGB && session->view->colourspace == GREYSCALE ){
-
-      Timer greyscale_timer;
-      if( session->loglevel >= 5 ){
-	greyscale_timer.start();
-      }
-
-      filter_greyscale( complete_image );
-      channels = 1;
-
       if( session->loglevel >= 5 ){
-	*(session->logfile) << "CVT :: Converting to greyscale in "
-			    << greyscale_timer.getTime() << " microseconds" << endl;
+	*(session->logfile) << "CVT :: Converting to greyscale" << endl;
       }
+      region.setGreyscale();
     }
 
-
     // Apply rotation - can apply this safely after gamma and contrast adjustment
     if( session->view->getRotation() != 0.0 ){
-      Timer rotation_timer;
+      float rotation = session->view->getRotation();
       if( session->loglevel >= 5 ){
-	rotation_timer.start();
+        *(session->logfile) << "CVT :: Rotating image by " << rotation << " degrees" << endl; 
       }
+      region.setRotation( rotation );
+    }
 
-      float rotation = session->view->getRotation();
-      filter_rotate( complete_image, rotation );
+    // Our final image size, which for 90 and 270 rotation has width and height swapped
+    resampled_width = region.getWidth();
+    resampled_height = region.getHeight();
+    channels = region.getChannels();
 
-      // For 90 and 270 rotation swap width and height
-      resampled_width = complete_image.width;
-      resampled_height = complete_image.height;
 
-      if( session->loglevel >= 5 ){
-        *(session->logfile) << "CVT :: Rotating image by " << rotation << " degrees in "
-			    << rotation_timer.getTime() << " microseconds" << endl; 
-      }
-    }
+    // Get any XMP metadata before our pipeline starts decoding the image
+    string xmp = (*session->image)->getMetadata("xmp");
+
+    // Produce our first strip before we start compressing, so that the image is
+    // opened and its first tiles decoded before anything is sent
+    Timer strip_timer;
+    if( session->loglevel >= 3 ) strip_timer.start();
+
+    unsigned int strip_height = 128;
+    vector<unsigned char> input( resampled_width*channels*strip_height );
+    unsigned int rows = region.read( &input[0], strip_height );
 
 
     // Initialise our JPEG compression object
-    session->jpeg->InitCompression( complete_image, resampled_height );
+    RawTile output_image( 0, requested_res, session->view->xangle, session->view->yangle,
+			  resampled_width, resampled_height, channels, 8 );
+    session->jpeg->InitCompression( output_image, strip_height );
 
     // Add XMP metadata if this exists
-    if( (*session->image)->getMetadata("xmp").size() > 0 ){
+    if( xmp.size() > 0 ){
       if( session->loglevel >= 4 ) *(session->logfile) << "CVT :: Adding XMP metadata" << endl;
-      session->jpeg->addMetadata( (*session->image)->getMetadata("xmp") );
+      session->jpeg->addMetadata( xmp );
     }
 
     len = session->jpeg->getHeaderSize();
@@ -344,27 +316,19 @@ void CVT::run( Session* session, const std::string& a ){
     }
 
 
-    // Send out the data per strip of fixed height.
+    // Send out the data per strip of fixed height, producing each strip as we go.
     // Allocate enough memory for this plus an extra 16k for instances where compressed
     // data is greater than uncompressed
-    unsigned int strip_height = 128;
-    unsigned char* output = new unsigned char[resampled_width*channels*strip_height+16536];
-    int strips = (resampled_height/strip_height) + (resampled_height%strip_height == 0 ? 0 : 1);
+    vector<unsigned char> output( resampled_width*channels*strip_height+16536 );
 
-    for( int n=0; n<strips; n++ ){
-
-      // Get the starting index for this strip of data
-      unsigned char* input = &((unsigned char*)complete_image.data)[n*strip_height*resampled_width*channels];
-
-      // The last strip may have a different height
-      if( (n==strips-1) && (resampled_height%strip_height!=0) ) strip_height = resampled_height % strip_height;
+    while( rows > 0 ){
 
       if( session->loglevel >= 3 ){
-	*(session->logfile) << "CVT :: About to JPEG compress strip with height " << strip_height << endl;
+	*(session->logfile) << "CVT :: About to JPEG compress strip with height " << rows << endl;
       }
 
       // Compress the strip
-      len = session->jpeg->CompressStrip( input, output, strip_height );
+      len = session->jpeg->CompressStrip( &input[0], &output[0], rows );
 
       if( session->loglevel >= 3 ){
 	*(session->logfile) << "CVT :: Compressed data strip length is " << len << endl;
@@ -378,7 +342,7 @@ void CVT::run( Session* session, const std::string& a ){
 #endif
 
       // Send this strip out to the client
-      if( len != session->out->putStr( (const char*) output, len ) ){
+      if( len != session->out->putStr( (const char*) &output[0], len ) ){
 	if( session->loglevel >= 1 ){
 	  *(session->logfile) << "CVT :: Error writing jpeg strip data: " << len << endl;
 	}
@@ -396,10 +360,20 @@ void CVT::run( Session* session, const std::string& a ){
 	}
       }
 
+      // Produce our next strip
+      rows = region.read( &input[0], strip_height );
+
+    }
+
+    if( session->loglevel >= 3 ){
+      *(session->logfile) << "CVT :: Region processed and compressed in " << strip_timer.getTime()
+			  << " microseconds" << endl;
+      *(session->logfile) << "CVT :: Stages: " << region.getStatistics() << endl;
     }
 
+
     // Finish off the image compression
-    len = session->jpeg->Finish( output );
+    len = session->jpeg->Finish( &output[0] );
 
 #ifdef CHUNKED
     snprintf( str, 1024, "%X\r\n", len );
@@ -407,14 +381,12 @@ void CVT::run( Session* session, const std::string& a ){
     session->out->printf( str );
 #endif
 
-    if( session->out->putStr( (const char*) output, len ) != len ){
+    if( session->out->putStr( (const char*) &output[0], len ) != len ){
       if( session->loglevel >= 1 ){
 	*(session->logfile) << "CVT :: Error writing jpeg EOI markers" << endl;
       }
     }
 
-    delete[] output;
-
 
 #ifdef CHUNKED
     // Send closing chunk CRLF
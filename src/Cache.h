@@ -38,11 +38,12 @@
 #if defined(HAVE_UNORDERED_MAP)
 #include <unordered_map>
 #define HASHMAP std::unordered_map
-// Need to define the hash function
+// Need to define the hash function. Note that hash<const char*> only hashes the
+// pointer value, so we must hash the string contents themselves
 namespace std {
   template<> struct hash< const std::string > {
     size_t operator()( const std::string& x ) const {
-      return hash< const char* >()( x.c_str() );
+      return hash< std::string >()( x );
     }
   };
 }
@@ -55,7 +56,7 @@ namespace std {
   namespace tr1 {
     template<> struct hash< const std::string > {
       size_t operator()( const std::string& x ) const {
-	return hash< const char* >()( x.c_str() );
+	return hash< std::string >()( x );
       }
     };
   }
@@ -90,69 +91,528 @@ namespace __gnu_cxx {
 
 
 
+#include <algorithm>
+#include <deque>
 #include <iostream>
 #include <list>
+#include <map>
+#include <set>
 #include <string>
+#include <vector>
 #include "RawTile.h"
+#include "Mutex.h"
+#include "DiskCache.h"
+#include "SharedCache.h"
 
 
+/// Default number of independently locked partitions of the tile cache
+#define CACHE_SHARDS 16
+
+/// Minimum number of average sized tiles held by the TinyLFU window of each shard
+#define TINYLFU_WINDOW 16
+
+/// Number of independently locked partitions of the interned image ids
+#define IMAGE_ID_PARTITIONS 16
+
+/// Number of image ids without any cached tiles kept by each partition before they are released
+#define IMAGE_ID_IDLE 256
+
+
+// Whether HASHMAP is a hashed container taking a hash functor as its third template parameter
+#if defined(HAVE_UNORDERED_MAP) || defined(HAVE_TR1_UNORDERED_MAP) || defined(HAVE_EXT_HASH_MAP)
+#define HASHMAP_IS_HASHED
+#endif
+
+
+
+/// Fixed size key identifying a tile within the cache
+/** Images are referred to by an id interned by the cache rather than by
+    their full path, so keys can be built, compared and hashed without any
+    string formatting or memory allocation.
+ */
+
+struct CacheKey {
+
+  /// Interned image id
+  unsigned long long image;
+
+  /// Resolution number
+  int resolution;
+
+  /// Tile number
+  int tile;
+
+  /// Horizontal sequence number
+  int hSequence;
+
+  /// Vertical sequence number
+  int vSequence;
+
+  /// Compression type
+  int compression;
+
+  /// Compression quality
+  int quality;
+
+
+  /// 64 bit finalizer from MurmurHash3
+  static unsigned long long mix( unsigned long long x ) {
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return x;
+  }
+
+
+  /// Return a 64 bit hash of all the fields
+  unsigned long long hash() const {
+    unsigned long long h = mix( ( image << 32 ) | (unsigned int) tile ) ^ ( image >> 32 );
+    h = mix( h ^ ( ((unsigned long long)(unsigned int) resolution << 32) |
+		   ( ((unsigned int) compression << 16) ^ (unsigned int) quality ) ) );
+    h = mix( h ^ ( ((unsigned long long)(unsigned int) hSequence << 32) | (unsigned int) vSequence ) );
+    return h;
+  }
+
+
+  /// Return a 64 bit hash of the tile parameters and the image path rather than its id
+  /** Unlike hash(), this does not depend on the order in which images were interned,
+      so can identify tiles shared with other processes or kept across restarts
+      @param f image path
+      @return non-zero hash
+   */
+  unsigned long long hash( const std::string& f ) const {
+    // FNV-1a over the path, then fold in the remaining fields
+    unsigned long long h = 14695981039346656037ULL;
+    for( unsigned int i=0; i<f.length(); i++ ){
+      h ^= (unsigned char) f[i];
+      h *= 1099511628211ULL;
+    }
+    CacheKey k = *this;
+    k.image = 0;
+    h = mix( h ^ k.hash() );
+    return h ? h : 1;
+  }
+
+
+  /// Equality operator
+  bool operator == ( const CacheKey& k ) const {
+    return image == k.image && resolution == k.resolution && tile == k.tile &&
+      hSequence == k.hSequence && vSequence == k.vSequence &&
+      compression == k.compression && quality == k.quality;
+  }
+
+
+  /// Ordering operator for use with std::map
+  bool operator < ( const CacheKey& k ) const {
+    if( image != k.image ) return image < k.image;
+    if( resolution != k.resolution ) return resolution < k.resolution;
+    if( tile != k.tile ) return tile < k.tile;
+    if( hSequence != k.hSequence ) return hSequence < k.hSequence;
+    if( vSequence != k.vSequence ) return vSequence < k.vSequence;
+    if( compression != k.compression ) return compression < k.compression;
+    return quality < k.quality;
+  }
+
+};
+
+
+
+/// Hash functor for CacheKey
+struct CacheKeyHash {
+  size_t operator()( const CacheKey& k ) const { return (size_t) k.hash(); }
+};
+
+
+
+
+/// Tile cache replacement policies
+/** LRU: plain least recently used eviction.
+    TINYLFU: W-TinyLFU. New tiles enter a small LRU window. Tiles leaving the window are only
+    admitted to the main segmented LRU if their estimated access frequency per byte beats that
+    of the tiles they would displace, so one-off scans cannot flush frequently used tiles.
+ */
+enum CachePolicy { LRU, TINYLFU };
 
-/// Cache to store raw tile data
 
-class Cache {
 
+/// Approximate access frequency counter used by the TinyLFU policy
+/** A count-min sketch with saturating 4 bit counters. All counters are halved
+    periodically so that the estimates favour recent history.
+ */
+
+class FrequencySketch {
 
  private:
 
+  /// Counters
+  std::vector<unsigned char> table;
+
+  /// Mask selecting a counter index
+  unsigned int mask;
+
+  /// Number of increments since the counters were last halved
+  unsigned int additions;
+
+  /// Number of increments after which the counters are halved
+  unsigned int sampleSize;
+
+
+  /// Return the index of counter i for a key hash
+  unsigned int index( unsigned long long h, unsigned int i ) const {
+    unsigned int a = (unsigned int) h;
+    unsigned int b = (unsigned int)( h >> 32 ) | 1;
+    return ( a + i*b ) & mask;
+  }
+
+
+ public:
+
+  /// Constructor
+  /** @param n expected number of entries */
+  FrequencySketch( unsigned int n = 0 ) : mask( 0 ), additions( 0 ), sampleSize( 0 ) {
+    if( n == 0 ) return;
+    unsigned int size = 64;
+    while( size < 4*n ) size <<= 1;
+    table.assign( size, 0 );
+    mask = size - 1;
+    sampleSize = 10*n;
+  };
+
+
+  /// Return the estimated frequency of a key
+  /** @param key cache key */
+  unsigned int frequency( const CacheKey& key ) const {
+    if( table.empty() ) return 0;
+    unsigned long long h = CacheKey::mix( key.hash() ^ 0x9e3779b97f4a7c15ULL );
+    unsigned int f = 15;
+    for( unsigned int i=0; i<4; i++ ){
+      unsigned int c = table[ index( h, i ) ];
+      if( c < f ) f = c;
+    }
+    return f;
+  }
+
+
+  /// Record an access to a key
+  /** @param key cache key */
+  void increment( const CacheKey& key ) {
+    if( table.empty() ) return;
+    unsigned long long h = CacheKey::mix( key.hash() ^ 0x9e3779b97f4a7c15ULL );
+    unsigned int f = this->frequency( key );
+    if( f < 15 ){
+      // Conservative update: only increment the counters at the minimum
+      for( unsigned int i=0; i<4; i++ ){
+	unsigned char& c = table[ index( h, i ) ];
+	if( c == f ) c++;
+      }
+    }
+    if( ++additions >= sampleSize ){
+      for( unsigned int i=0; i<table.size(); i++ ) table[i] >>= 1;
+      additions /= 2;
+    }
+  }
+
+};
+
+
+
+
+/// Image paths interned into integer ids
+/** Paths are held in independently locked partitions chosen by a hash of the path, so
+    that requests for different images rarely contend for the same lock. Ids are 64 bit
+    and are never reused, so an id still held elsewhere once its image has been released
+    can never come to refer to another image.
+
+    Each id counts the tiles cached under it. An id left with no tiles, because its last
+    tile has been evicted or because it has only been used for lookups, becomes idle, and
+    each partition releases its oldest idle ids once it has more than IMAGE_ID_IDLE of
+    them. The table therefore only grows with the number of images which have tiles cached.
+ */
+
+class ImageIds {
+
+
+ private:
+
+  /// An interned path
+  struct Entry {
+
+    /// Image path
+    std::string name;
+
+    /// Number of cached tiles stored under this id
+    unsigned int tiles;
+
+    /// Whether the id is queued for release
+    bool idle;
+  };
+
+  /// A partition of the ids
+  struct Partition {
+
+    /// Ids of the interned paths
+#ifdef HASHMAP_IS_HASHED
+    HASHMAP < const std::string, unsigned long long > ids;
+#else
+    std::map < const std::string, unsigned long long > ids;
+#endif
+
+    /// Interned paths indexed by id
+    std::map < unsigned long long, Entry > entries;
+
+    /// Ids with no tiles, oldest first
+    std::deque < unsigned long long > idle;
+
+    /// Sequence number of the next id
+    unsigned long long next;
+
+    /// Lock protecting this partition
+    Mutex mutex;
+
+    Partition() : next( 0 ) {};
+  };
+
+  Partition partitions[IMAGE_ID_PARTITIONS];
+
+
+  /// Select the partition for a path
+  Partition& partition( const std::string& f ) {
+    unsigned int h = 2166136261U;
+    for( unsigned int i=0; i<f.length(); i++ ) h = ( h ^ (unsigned char) f[i] ) * 16777619U;
+    return partitions[ h % IMAGE_ID_PARTITIONS ];
+  }
+
+
+  /// Select the partition holding an id
+  Partition& partition( unsigned long long id ) { return partitions[ id % IMAGE_ID_PARTITIONS ]; }
+
+
+  /// Return the entry of a path, allocating a new id if this path has not been seen before
+  /** Must be called with the partition locked */
+  std::map<unsigned long long,Entry>::iterator _get( Partition& p, const std::string& f ) {
+    if( p.ids.count( f ) ) return p.entries.find( p.ids.find( f )->second );
+
+    unsigned long long id = p.next++ * IMAGE_ID_PARTITIONS + (unsigned int)( &p - partitions );
+    p.ids[f] = id;
+    Entry& e = p.entries[id];
+    e.name = f;
+    e.tiles = 0;
+    e.idle = false;
+    this->_idle( p, id );
+    return p.entries.find( id );
+  }
+
+
+  /// Queue an id which has no tiles for release and release the oldest if too many are queued
+  /** Must be called with the partition locked */
+  void _idle( Partition& p, unsigned long long id ) {
+    Entry& e = p.entries[id];
+    if( e.idle ) return;
+    e.idle = true;
+    p.idle.push_back( id );
+
+    while( p.idle.size() > IMAGE_ID_IDLE ){
+      std::map<unsigned long long,Entry>::iterator i = p.entries.find( p.idle.front() );
+      p.idle.pop_front();
+      if( i == p.entries.end() ) continue;
+      if( i->second.tiles > 0 ) i->second.idle = false;
+      else{
+	p.ids.erase( i->second.name );
+	p.entries.erase( i );
+      }
+    }
+  }
+
+
+ public:
+
+  /// Return the id of a path, allocating a new one if this path has not been seen before
+  unsigned long long get( const std::string& f ) {
+    Partition& p = this->partition( f );
+    ScopedLock lock( p.mutex );
+    return this->_get( p, f )->first;
+  }
+
+
+  /// Return the id of a path if it has one
+  /** @return false if the path has not been interned */
+  bool find( const std::string& f, unsigned long long& id ) {
+    Partition& p = this->partition( f );
+    ScopedLock lock( p.mutex );
+    if( p.ids.count( f ) == 0 ) return false;
+    id = p.ids.find( f )->second;
+    return true;
+  }
+
+
+  /// Return the path for an id, or an empty string if the id has been released
+  std::string name( unsigned long long id ) {
+    Partition& p = this->partition( id );
+    ScopedLock lock( p.mutex );
+    std::map<unsigned long long,Entry>::iterator i = p.entries.find( id );
+    return ( i == p.entries.end() ) ? std::string() : i->second.name;
+  }
+
+
+  /// Count a tile cached under an id
+  /** @return false if the id has been released, in which case the tile should not be cached */
+  bool retain( unsigned long long id ) {
+    Partition& p = this->partition( id );
+    ScopedLock lock( p.mutex );
+    std::map<unsigned long long,Entry>::iterator i = p.entries.find( id );
+    if( i == p.entries.end() ) return false;
+    i->second.tiles++;
+    return true;
+  }
+
+
+  /// Stop counting tiles which are no longer cached under an id
+  /** @param id image id
+      @param n number of tiles
+   */
+  void unref( unsigned long long id, unsigned int n = 1 ) {
+    Partition& p = this->partition( id );
+    ScopedLock lock( p.mutex );
+    std::map<unsigned long long,Entry>::iterator i = p.entries.find( id );
+    if( i == p.entries.end() ) return;
+    i->second.tiles -= std::min( n, i->second.tiles );
+    if( i->second.tiles == 0 ) this->_idle( p, id );
+  }
+
+
+  /// Release the id of a path straight away
+  void release( const std::string& f ) {
+    Partition& p = this->partition( f );
+    ScopedLock lock( p.mutex );
+    if( p.ids.count( f ) == 0 ) return;
+    p.entries.erase( p.ids.find( f )->second );
+    p.ids.erase( f );
+  }
+
+
+  /// Return the number of interned paths
+  unsigned int size() {
+    unsigned int n = 0;
+    for( unsigned int i=0; i<IMAGE_ID_PARTITIONS; i++ ){
+      ScopedLock lock( partitions[i].mutex );
+      n += partitions[i].entries.size();
+    }
+    return n;
+  }
+
+};
+
+
+
+
+/// A single independently locked partition of the tile cache
+
+class CacheShard {
+
+
+ private:
+
+  /// Segments in which entries are held: new entries, main probationary and main protected
+  enum Segment { WINDOW = 0, PROBATION = 1, PROTECTED = 2 };
+
   /// Basic object storage size
   int tileSize;
 
   /// Max memory size in bytes
   unsigned long maxSize;
 
-  /// Current memory running total
-  unsigned long currentSize;
+  /// Max size in bytes of the window and protected segments
+  unsigned long windowSize, protectedSize;
+
+  /// Current memory running total for each segment
+  unsigned long currentSize[3];
+
+  /// Replacement policy
+  CachePolicy policy;
+
+  /// Access frequency estimates for TinyLFU admission
+  FrequencySketch sketch;
+
+  /// Image ids, which count the tiles we hold of each image
+  ImageIds* imageIds;
+
+  /// Lock protecting all of the data structures below
+  Mutex mutex;
 
   /// Main cache storage typedef
 #ifdef HAVE_EXT_POOL_ALLOCATOR
-  typedef std::list < std::pair<const std::string,RawTile>,
-    __gnu_cxx::__pool_alloc< std::pair<const std::string,RawTile> > > TileList;
+  typedef std::list < std::pair<const CacheKey,RawTile>,
+    __gnu_cxx::__pool_alloc< std::pair<const CacheKey,RawTile> > > TileList;
 #else
-  typedef std::list < std::pair<const std::string,RawTile> > TileList;
+  typedef std::list < std::pair<const CacheKey,RawTile> > TileList;
 #endif
 
   /// Main cache list iterator typedef
-  typedef std::list < std::pair<const std::string,RawTile> >::iterator List_Iter;
+  typedef TileList::iterator List_Iter;
+
+  /// Position of an entry within our storage
+  struct Location {
+    List_Iter iter;
+    Segment segment;
+  };
 
   /// Index typedef
-#ifdef HAVE_EXT_POOL_ALLOCATOR
-  typedef HASHMAP < const std::string, List_Iter,
-    __gnu_cxx::hash< const std::string >,
-    std::equal_to< const std::string >,
-    __gnu_cxx::__pool_alloc< std::pair<const std::string, List_Iter> >
+#if defined(HASHMAP_IS_HASHED) && defined(HAVE_EXT_POOL_ALLOCATOR)
+  typedef HASHMAP < CacheKey, Location, CacheKeyHash, std::equal_to< CacheKey >,
+    __gnu_cxx::__pool_alloc< std::pair<const CacheKey, Location> >
     > TileMap;
+#elif defined(HASHMAP_IS_HASHED)
+  typedef HASHMAP < CacheKey, Location, CacheKeyHash > TileMap;
 #else
-  typedef HASHMAP < const std::string,List_Iter > TileMap;
+  typedef std::map < CacheKey, Location > TileMap;
 #endif
 
 
-  /// Main cache storage object
-  TileList tileList;
+  /// Main cache storage objects, one per segment, most recently used first
+  TileList tileList[3];
 
   /// Main Cache storage index object
   TileMap tileMap;
 
 
+  /// Return the memory used by an entry
+  unsigned long _size( const RawTile& r ) const { return r.dataLength + tileSize; }
+
+
+  /// Move an entry to the head of a segment
+  /** @param miter Map_Iter that points to the entry
+      @param s destination segment
+   */
+  void _move( TileMap::iterator miter, Segment s ) {
+    Location& loc = miter->second;
+    unsigned long size = this->_size( loc.iter->second );
+    tileList[s].splice( tileList[s].begin(), tileList[loc.segment], loc.iter );
+    currentSize[loc.segment] -= size;
+    currentSize[s] += size;
+    loc.segment = s;
+  }
+
+
   /// Internal touch function
   /** Touches a key in the Cache and makes it the most recently used
    *  @param key to be touched
    *  @return a Map_Iter pointing to the key that was touched.
    */
-  TileMap::iterator _touch( const std::string &key ) {
+  TileMap::iterator _touch( const CacheKey &key ) {
     TileMap::iterator miter = tileMap.find( key );
     if( miter == tileMap.end() ) return miter;
-    // Move the found node to the head of the list.
-    tileList.splice( tileList.begin(), tileList, miter->second );
+
+    // A second hit in the main space promotes an entry to the protected segment
+    Segment s = miter->second.segment;
+    if( s == PROBATION ) s = PROTECTED;
+    this->_move( miter, s );
+
+    // Demote the least recently used protected entries if this segment is now too large
+    while( currentSize[PROTECTED] > protectedSize ){
+      this->_move( tileMap.find( tileList[PROTECTED].back().first ), PROBATION );
+    }
     return miter;
   }
 
@@ -164,122 +624,780 @@ class Cache {
    */
   void _remove( const TileMap::iterator &miter ) {
     // Reduce our current size counter
-    currentSize -= ( (miter->second->second).dataLength +
-		     ( (miter->second->second).filename.capacity() + (miter->second->first).capacity() )*sizeof(char) +
-		     tileSize );
-    tileList.erase( miter->second );
+    Location& loc = miter->second;
+    currentSize[loc.segment] -= this->_size( loc.iter->second );
+    if( imageIds ) imageIds->unref( miter->first.image );
+    tileList[loc.segment].erase( loc.iter );
     tileMap.erase( miter );
   }
 
 
   /// Interal remove function
   /** @param key to remove */
-  void _remove( const std::string &key ) {
+  void _remove( const CacheKey &key ) {
     TileMap::iterator miter = tileMap.find( key );
     this->_remove( miter );
   }
 
 
+  /// Return the least recently used entry of the main space, protected entries last
+  /** @param n number of entries to skip
+      @return pointer to the entry or NULL if there are not enough entries
+   */
+  const std::pair<const CacheKey,RawTile>* _victim( unsigned int n ) const {
+    for( int s = PROBATION; s <= PROTECTED; s++ ){
+      for( TileList::const_reverse_iterator i = tileList[s].rbegin(); i != tileList[s].rend(); ++i ){
+	if( n-- == 0 ) return &(*i);
+      }
+    }
+    return NULL;
+  }
 
- public:
 
-  /// Constructor
-  /** @param max Maximum cache size in MB */
-  Cache( float max ) {
-    maxSize = (unsigned long)(max*1024000) ; currentSize = 0;
-    // 64 chars added at the end represents an average string length
-    tileSize = sizeof( RawTile ) + sizeof( std::pair<const std::string,RawTile> ) +
-      sizeof( std::pair<const std::string, List_Iter> ) + sizeof(char)*64 + sizeof(List_Iter);
-  };
+  /// TinyLFU admission filter
+  /** Decide whether an entry leaving the window should replace the main space entries
+      which would need to be evicted to make room for it. Frequencies are weighted by size
+      so that a large tile must be proportionately more popular than the tiles it displaces.
+      @param candidate entry leaving the window
+      @param free free space in bytes in the main space
+      @return true if the candidate should be admitted
+   */
+  bool _admit( const std::pair<const CacheKey,RawTile>& candidate, unsigned long free ) const {
+    unsigned long size = this->_size( candidate.second );
+    unsigned long long victimSize = 0, victimFrequency = 0;
+    const std::pair<const CacheKey,RawTile>* victim;
+    for( unsigned int n=0; free + victimSize < size; n++ ){
+      if( !(victim = this->_victim( n )) ) return false;
+      victimSize += this->_size( victim->second );
+      victimFrequency += sketch.frequency( victim->first );
+    }
+    return (unsigned long long) sketch.frequency( candidate.first ) * victimSize > victimFrequency * size;
+  }
 
 
-  /// Destructor
-  ~Cache() {
-    tileList.clear();
-    tileMap.clear();
+  /// Evict entries until we are back within our size limits
+  void _evict() {
+
+    // Entries leaving the window either move to the main space or are evicted
+    while( currentSize[WINDOW] > windowSize ){
+
+      TileMap::iterator miter = tileMap.find( tileList[WINDOW].back().first );
+      unsigned long size = this->_size( miter->second.iter->second );
+      unsigned long used = currentSize[PROBATION] + currentSize[PROTECTED];
+      unsigned long free = ( maxSize - windowSize > used ) ? maxSize - windowSize - used : 0;
+
+      if( policy == TINYLFU && ( size <= free || this->_admit( *(miter->second.iter), free ) ) ){
+	while( currentSize[PROBATION] + currentSize[PROTECTED] + size > maxSize - windowSize ){
+	  Segment s = tileList[PROBATION].empty() ? PROTECTED : PROBATION;
+	  this->_remove( tileList[s].back().first );
+	}
+	this->_move( miter, PROBATION );
+      }
+      else this->_remove( miter );
+    }
   }
 
 
-  /// Insert a tile
-  /** @param r Tile to be inserted */
-  void insert( const RawTile& r ) {
+  /// Shards cannot be copied
+  CacheShard( const CacheShard& );
+  CacheShard& operator = ( const CacheShard& );
 
-    if( maxSize == 0 ) return;
 
-    std::string key = this->getIndex( r.filename, r.resolution, r.tileNum,
-				      r.hSequence, r.vSequence, r.compressionType, r.quality );
+ public:
 
-    // Touch the key, if it exists
-    TileMap::iterator miter = this->_touch( key );
+  /// Constructor
+  /** @param max Maximum shard size in bytes
+      @param p replacement policy
+      @param ids image ids in which to count the tiles held, or NULL
+   */
+  CacheShard( unsigned long max, CachePolicy p = LRU, ImageIds* ids = NULL ) {
+    maxSize = max; policy = p; imageIds = ids;
+    currentSize[WINDOW] = currentSize[PROBATION] = currentSize[PROTECTED] = 0;
+    tileSize = sizeof( RawTile ) + sizeof( std::pair<const CacheKey,RawTile> ) +
+      sizeof( std::pair<const CacheKey, Location> ) + sizeof(List_Iter);
+
+    if( policy == TINYLFU ){
+      // A 1% window, but one holding at least a few tiles, as a window smaller than a tile
+      // would send every new tile straight to admission. The main space is split 20:80
+      // between probation and protected. Size the sketch assuming an average tile of around 8kB
+      windowSize = std::min( std::max( maxSize / 100, (unsigned long) TINYLFU_WINDOW * 8192 ), maxSize / 4 );
+      protectedSize = ( maxSize - windowSize ) / 5 * 4;
+      sketch = FrequencySketch( maxSize/8192 + 1 );
+    }
+    else{
+      // Plain LRU simply uses the window for everything
+      windowSize = maxSize;
+      protectedSize = 0;
+    }
+  };
+
+
+  /// Insert a tile
+  /** The filename is not stored with the cached tile as the key already identifies the image
+      @param key cache index of the tile
+      @param r Tile to be inserted
+   */
+  void insert( const CacheKey& key, const RawTile& r ) {
+
+    ScopedLock lock( mutex );
 
     // Check whether this tile exists in our cache
+    TileMap::iterator miter = tileMap.find( key );
     if( miter != tileMap.end() ){
       // Check the timestamp and delete if necessary
-      if( miter->second->second.timestamp < r.timestamp ){
+      if( miter->second.iter->second.timestamp < r.timestamp ){
 	this->_remove( miter );
       }
-      // If this index already exists and it is up to date, do nothing
-      else return;
+      // If this index already exists and it is up to date, just touch it
+      else{
+	this->_touch( key );
+	return;
+      }
     }
 
-    // Store the key if it doesn't already exist in our cache
-    // Ok, do the actual insert at the head of the list
-    tileList.push_front( std::make_pair(key,r) );
+    // Tiles of an image whose id has just been released are never found again, so are not kept
+    if( imageIds && !imageIds->retain( key.image ) ) return;
+
+    // Ok, do the actual insert at the head of the window
+    tileList[WINDOW].push_front( std::make_pair(key,r) );
+    std::string().swap( tileList[WINDOW].front().second.filename );
 
     // And store this in our map
-    List_Iter liter = tileList.begin();
-    tileMap[ key ] = liter;
-
-    // Update our total current size variable. Use the string::capacity function
-    // rather than length() as std::string can allocate slightly more than necessary
-    // The +1 is for the terminating null byte
-    currentSize += (r.dataLength + (r.filename.capacity()+key.capacity())*sizeof(char) + tileSize);
-
-    // Check to see if we need to remove an element due to exceeding max_size
-    while( currentSize > maxSize ) {
-      // Remove the last element
-      liter = tileList.end();
-      --liter;
-      this->_remove( liter->first );
+    Location loc;
+    loc.iter = tileList[WINDOW].begin();
+    loc.segment = WINDOW;
+    tileMap[ key ] = loc;
+
+    // Update our total current size variable
+    currentSize[WINDOW] += this->_size( r );
+
+    // Check to see if we need to remove or move entries due to exceeding our size limits
+    this->_evict();
+  }
+
+
+  /// Get a tile from the shard
+  /** The returned tile refers to the cached data buffer, which remains valid
+      even if the entry is subsequently evicted
+      @param key cache index of the tile
+      @param tile tile into which the cached entry is copied. The filename is not set
+      @return true if the tile was found
+   */
+  bool getTile( const CacheKey& key, RawTile& tile ) {
+
+    ScopedLock lock( mutex );
+
+    // Record all accesses, including misses, for admission decisions
+    if( policy == TINYLFU ) sketch.increment( key );
+
+    TileMap::iterator miter = this->_touch( key );
+    if( miter == tileMap.end() ) return false;
+
+    // Take our reference while we still hold the lock as the entry may be evicted by another thread
+    tile = miter->second.iter->second;
+    return true;
+  }
+
+
+  /// Remove all tiles of an image
+  /** @param id image id */
+  void remove( unsigned long long id ) {
+    ScopedLock lock( mutex );
+    for( int s = WINDOW; s <= PROTECTED; s++ ){
+      for( List_Iter i = tileList[s].begin(); i != tileList[s].end(); ){
+	const CacheKey& key = (i++)->first;
+	if( key.image == id ) this->_remove( key );
+      }
     }
+  }
 
+
+  /// Return the hottest JPEG tiles
+  /** Protected entries are returned first, followed by those of the window and then
+      the probationary entries, each most recently used first
+      @param max maximum number of bytes of tile data to return
+      @param tiles vector to which the tiles, which refer to the cached data, are added
+      @return number of bytes of tile data added
+   */
+  unsigned long getHottest( unsigned long max, std::vector< std::pair<CacheKey,RawTile> >& tiles ) {
+    ScopedLock lock( mutex );
+    const Segment order[3] = { PROTECTED, WINDOW, PROBATION };
+    unsigned long size = 0;
+    for( int s=0; s<3; s++ ){
+      for( List_Iter i = tileList[order[s]].begin(); i != tileList[order[s]].end(); ++i ){
+	if( i->first.compression != JPEG || size + i->second.dataLength > max ) continue;
+	size += i->second.dataLength;
+	tiles.push_back( *i );
+      }
+    }
+    return size;
+  }
+
+
+  /// Return the number of tiles in the shard
+  unsigned int getNumElements() { ScopedLock lock( mutex ); return tileMap.size(); }
+
+
+  /// Return the number of bytes stored
+  unsigned long getMemorySize() {
+    ScopedLock lock( mutex );
+    return currentSize[WINDOW] + currentSize[PROBATION] + currentSize[PROTECTED];
+  }
+
+};
+
+
+
+
+/// Partition of the tile cache which keeps the lowest resolutions of recently used images resident
+/** The first requests for an image are for its lowest resolutions, which viewers use
+    for thumbnails and navigation. JPEG tiles of the lowest few resolutions are held here
+    rather than in the shards, so they are never displaced by deep zoom tiles however
+    much pressure the main cache is under. The partition has its own budget and, when
+    this is exceeded, releases all of the pinned tiles of the least recently used image.
+ */
+
+class PinnedCache {
+
+
+ private:
+
+  /// Pinned tiles of a single image
+  struct Image {
+    std::map < CacheKey, RawTile > tiles;
+    unsigned long size;
+    Image() : size( 0 ) {};
+  };
+
+  /// Max memory size in bytes
+  unsigned long maxSize;
+
+  /// Current memory running total
+  unsigned long currentSize;
+
+  /// Number of resolutions to pin
+  unsigned int levels;
+
+  /// Basic object storage size
+  int tileSize;
+
+  /// Pinned images indexed by image id
+  std::map < unsigned long long, Image > images;
+
+  /// Image ids, most recently used first
+  std::list < unsigned long long > order;
+
+  /// Image ids, which count the tiles we hold of each image
+  ImageIds* imageIds;
+
+  /// Lock protecting all of the above
+  Mutex mutex;
+
+
+  /// Return the memory used by an entry
+  unsigned long _size( const RawTile& r ) const { return r.dataLength + tileSize; }
+
+
+  /// Move an image to the head of the usage order
+  void _touch( unsigned long long id ) {
+    std::list<unsigned long long>::iterator i = std::find( order.begin(), order.end(), id );
+    if( i != order.end() ) order.splice( order.begin(), order, i );
+    else order.push_front( id );
+  }
+
+
+  /// The partition cannot be copied
+  PinnedCache( const PinnedCache& );
+  PinnedCache& operator = ( const PinnedCache& );
+
+
+ public:
+
+  /// Constructor
+  /** @param ids image ids in which to count the tiles held, or NULL */
+  PinnedCache( ImageIds* ids = NULL ) : maxSize( 0 ), currentSize( 0 ), levels( 0 ), imageIds( ids ) {
+    tileSize = sizeof( RawTile ) + sizeof( std::pair<const CacheKey,RawTile> ) + 4*sizeof(void*);
+  };
+
+
+  /// Set the size of the partition
+  /** @param max Maximum size in MB. Pinning is disabled if this is 0
+      @param n number of resolutions to pin, counting from the smallest
+   */
+  void configure( float max, unsigned int n ) {
+    ScopedLock lock( mutex );
+    maxSize = (unsigned long)(max*1024000);
+    levels = ( maxSize > 0 ) ? n : 0;
+    for( std::map<unsigned long long,Image>::iterator i = images.begin(); i != images.end(); i++ ){
+      if( imageIds ) imageIds->unref( i->first, i->second.tiles.size() );
+    }
+    images.clear();
+    order.clear();
+    currentSize = 0;
+  }
+
+
+  /// Return the number of pinned resolutions, or 0 if pinning is disabled
+  unsigned int getLevels() const { return levels; };
+
+
+  /// Whether a tile belongs in this partition
+  /** @param key cache index of the tile */
+  bool accepts( const CacheKey& key ) const {
+    return key.resolution >= 0 && (unsigned int) key.resolution < levels && key.compression == JPEG;
+  }
+
+
+  /// Whether any tiles of an image are pinned
+  /** @param id image id */
+  bool contains( unsigned long long id ) {
+    ScopedLock lock( mutex );
+    return images.find( id ) != images.end();
+  }
+
+
+  /// Insert a tile
+  /** Tiles of the least recently used images are released until the tile fits
+      @param key cache index of the tile
+      @param r tile, whose data must already be shared
+      @return true if the tile was pinned, false if it is larger than the whole budget
+      available to its image
+   */
+  bool insert( const CacheKey& key, const RawTile& r ) {
+
+    unsigned long size = this->_size( r );
+
+    ScopedLock lock( mutex );
+
+    Image& image = images[ key.image ];
+    this->_touch( key.image );
+
+    std::map<CacheKey,RawTile>::iterator i = image.tiles.find( key );
+    if( i != image.tiles.end() ){
+      image.size -= this->_size( i->second );
+      currentSize -= this->_size( i->second );
+      image.tiles.erase( i );
+      if( imageIds ) imageIds->unref( key.image );
+    }
+
+    // Release whole images, oldest first, but never the one we are adding to
+    while( currentSize + size > maxSize && order.back() != key.image ){
+      std::map<unsigned long long,Image>::iterator victim = images.find( order.back() );
+      currentSize -= victim->second.size;
+      if( imageIds ) imageIds->unref( victim->first, victim->second.tiles.size() );
+      images.erase( victim );
+      order.pop_back();
+    }
+
+    // Nor do we keep tiles of an image whose id has just been released
+    if( currentSize + size > maxSize || ( imageIds && !imageIds->retain( key.image ) ) ){
+      if( image.tiles.empty() ){
+	images.erase( key.image );
+	order.remove( key.image );
+      }
+      return false;
+    }
+
+    image.tiles.insert( std::make_pair( key, r ) );
+    image.size += size;
+    currentSize += size;
+    return true;
+  }
+
+
+  /// Get a tile
+  /** @param key cache index of the tile
+      @param tile tile which will refer to the pinned data. The filename is not set
+      @return true if the tile was found
+   */
+  bool getTile( const CacheKey& key, RawTile& tile ) {
+    ScopedLock lock( mutex );
+    std::map<unsigned long long,Image>::iterator i = images.find( key.image );
+    if( i == images.end() ) return false;
+    std::map<CacheKey,RawTile>::iterator j = i->second.tiles.find( key );
+    if( j == i->second.tiles.end() ) return false;
+    this->_touch( key.image );
+    tile = j->second;
+    return true;
+  }
+
+
+  /// Remove all pinned tiles of an image
+  /** @param id image id */
+  void remove( unsigned long long id ) {
+    ScopedLock lock( mutex );
+    std::map<unsigned long long,Image>::iterator i = images.find( id );
+    if( i == images.end() ) return;
+    currentSize -= i->second.size;
+    if( imageIds ) imageIds->unref( id, i->second.tiles.size() );
+    images.erase( i );
+    order.remove( id );
+  }
+
+
+  /// Return the pinned tiles
+  /** @param max maximum number of bytes of tile data to return
+      @param tiles vector to which the tiles of the most recently used images are added first
+      @return number of bytes of tile data added
+   */
+  unsigned long getHottest( unsigned long max, std::vector< std::pair<CacheKey,RawTile> >& tiles ) {
+    ScopedLock lock( mutex );
+    unsigned long size = 0;
+    for( std::list<unsigned long long>::iterator i = order.begin(); i != order.end(); i++ ){
+      Image& image = images[ *i ];
+      for( std::map<CacheKey,RawTile>::iterator j = image.tiles.begin(); j != image.tiles.end(); j++ ){
+	if( size + j->second.dataLength > max ) continue;
+	size += j->second.dataLength;
+	tiles.push_back( *j );
+      }
+    }
+    return size;
+  }
+
+
+  /// Return the number of pinned tiles
+  unsigned int getNumElements() {
+    ScopedLock lock( mutex );
+    unsigned int n = 0;
+    for( std::map<unsigned long long,Image>::iterator i = images.begin(); i != images.end(); i++ ) n += i->second.tiles.size();
+    return n;
+  }
+
+
+  /// Return the number of bytes stored
+  unsigned long getMemorySize() { ScopedLock lock( mutex ); return currentSize; }
+
+};
+
+
+
+
+/// Cache to store raw tile data
+/** The cache is split into a number of independent shards, each with
+    its own lock and its own share of the memory budget. A tile is always
+    stored in the shard selected by the hash of its key, so concurrent
+    requests for different tiles rarely contend for the same lock. Each
+    shard applies the chosen replacement policy (see CachePolicy).
+
+    Image paths are interned once into small integer ids (see ImageIds), which
+    callers making several lookups for the same image can obtain with getImageId().
+    The id of an image is released when the image is removed, or some time after
+    the last of its tiles has been evicted.
+
+    Cached tile data is held in reference counted shared buffers. A cache hit
+    returns a tile referring to the cached buffer rather than a copy of it, and
+    that buffer stays valid until its last user releases it, even if the entry
+    is evicted in the meantime. Memory held only by such tiles after eviction
+    is not counted against the cache size.
+
+    An optional SharedCache, held in shared memory and used by all server
+    processes on the host, and an optional DiskCache for encoded JPEG tiles can
+    be attached as further tiers. Tiles are written through to these on insertion
+    and misses are looked up in each in turn before the caller has to decode the
+    tile from the source image.
+
+    JPEG tiles of the lowest resolutions of recently used images can be pinned
+    in a separate partition with its own budget (see PinnedCache and pin()).
+
+    Callers which miss should claim() the tile before decoding it, so that
+    concurrent misses on the same tile, from other threads or, through the shared
+    cache, from other processes, wait for a single decode rather than repeating it.
+ */
+
+class Cache {
+
+
+ private:
+
+  /// Max memory size in bytes
+  unsigned long maxSize;
+
+  /// Our independently locked partitions
+  std::vector<CacheShard*> shards;
+
+  /// Interned image paths
+  ImageIds imageIds;
+
+  /// Tiles currently being decoded within this process
+  std::set<CacheKey> flights;
+
+  /// Lock protecting the tiles being decoded
+  Mutex flightMutex;
+
+  /// Signalled whenever a tile has finished being decoded
+  Condition flightDone;
+
+  /// Lowest resolutions of recently used images
+  PinnedCache pinned;
+
+  /// Optional cache shared with other processes
+  SharedCache *sharedCache;
+
+  /// Optional disk cache
+  DiskCache *diskCache;
+
+
+  /// Select the shard responsible for a given key
+  /** Uses the upper bits of the key hash, leaving the lower bits for each shard's map
+      @param key cache key
+   */
+  CacheShard* getShard( const CacheKey& key ) {
+    return shards[ (unsigned int)( key.hash() >> 32 ) % shards.size() ];
+  }
+
+
+  /// The cache cannot be copied
+  Cache( const Cache& );
+  Cache& operator = ( const Cache& );
+
+
+ public:
+
+  /// Constructor
+  /** @param max Maximum cache size in MB
+      @param p replacement policy
+      @param n number of independently locked shards
+   */
+  Cache( float max, CachePolicy p = LRU, unsigned int n = CACHE_SHARDS ) : pinned( &imageIds ) {
+    maxSize = (unsigned long)(max*1024000);
+    sharedCache = NULL;
+    diskCache = NULL;
+    if( n == 0 ) n = 1;
+    for( unsigned int i=0; i<n; i++ ) shards.push_back( new CacheShard( maxSize/n, p, &imageIds ) );
+  };
+
+
+  /// Destructor
+  ~Cache() {
+    for( unsigned int i=0; i<shards.size(); i++ ) delete shards[i];
+    shards.clear();
+  }
+
+
+  /// Return the id of an image, allocating a new one if this image has not been seen before
+  /** @param f filename
+      @return image id
+   */
+  unsigned long long getImageId( const std::string& f ) { return imageIds.get( f ); }
+
+
+  /// Return the image path for an id
+  /** @param id image id obtained from getImageId()
+      @return path, or an empty string if the image has since been removed
+   */
+  std::string getImageName( unsigned long long id ) { return imageIds.name( id ); }
+
+
+  /// Attach a cache shared with other processes
+  /** @param s attached shared cache, which must outlive this cache, or NULL to detach */
+  void setSharedCache( SharedCache* s ) { sharedCache = ( s && s->connected() ) ? s : NULL; };
+
+
+  /// Attach a disk cache
+  /** @param d opened disk cache, which must outlive this cache, or NULL to detach */
+  void setDiskCache( DiskCache* d ) { diskCache = ( d && d->connected() ) ? d : NULL; };
+
+
+  /// Pin the JPEG tiles of the lowest resolutions of recently used images
+  /** @param max size in MB of the pinned partition, which is in addition to the main cache size
+      @param n number of resolutions to pin, counting from the smallest
+   */
+  void pin( float max, unsigned int n ) { pinned.configure( max, n ); };
+
+
+  /// Return the number of pinned resolutions, or 0 if pinning is disabled
+  unsigned int getPinnedLevels() const { return pinned.getLevels(); };
+
+
+  /// Whether any tiles of an image are currently pinned
+  /** @param id image id obtained from getImageId() */
+  bool isPinned( unsigned long long id ) { return pinned.contains( id ); };
+
+
+  /// Insert a tile
+  /** The tile's data is converted into a shared buffer, so that the cache and the
+      caller refer to the same copy of the data rather than the cache taking its own
+      @param r Tile to be inserted
+   */
+  void insert( RawTile& r ) {
+    if( sharedCache ) sharedCache->insert( r );
+    if( diskCache && r.compressionType == JPEG ) diskCache->insert( r );
+    this->restore( r );
+  }
+
+
+  /// Insert a tile into this process's cache only, without writing it through to any attached tiers
+  /** Used to restore tiles saved by a previous process with getHottest()
+      @param r Tile to be inserted, which must have its filename set
+   */
+  void restore( RawTile& r ) {
+
+    CacheKey key = this->getKey( this->getImageId( r.filename ), r.resolution, r.tileNum,
+				 r.hSequence, r.vSequence, r.compressionType, r.quality );
+
+    bool pin = pinned.accepts( key );
+    if( maxSize == 0 && !pin ) return;
+
+    r.share();
+
+    if( pin && pinned.insert( key, r ) ) return;
+    if( maxSize > 0 ) this->getShard( key )->insert( key, r );
+  }
+
+
+  /// Remove all tiles of an image from the cache and from any attached tiers
+  /** Finding an image's tiles in the shared and disk caches means examining their
+      whole index, so this should only be used when an image is known to have changed
+      @param f image path
+   */
+  void remove( const std::string& f ) {
+
+    if( sharedCache ) sharedCache->remove( f );
+    if( diskCache ) diskCache->remove( f );
+
+    unsigned long long id;
+    if( !imageIds.find( f, id ) ) return;
+
+    pinned.remove( id );
+    for( unsigned int i=0; i<shards.size(); i++ ) shards[i]->remove( id );
+
+    // Tiles inserted under the old id from now on are refused, and any which slipped
+    // in before it was released are never found again and are simply evicted in time
+    imageIds.release( f );
+  }
+
+
+  /// Claim the right to decode a tile, waiting if somebody else is already doing so
+  /**
+   *  @param id image id obtained from getImageId()
+   *  @param r resolution number
+   *  @param t tile number
+   *  @param h horizontal sequence number
+   *  @param v vertical sequence number
+   *  @param c compression type
+   *  @param q compression quality
+   *  @return true if the caller should decode the tile, insert it and then call release(),
+   *  or false if another thread or process has just finished doing so, in which case the
+   *  caller should look in the cache again
+   */
+  bool claim( unsigned long long id, int r, int t, int h, int v, CompressionType c, int q ) {
+
+    CacheKey key = this->getKey( id, r, t, h, v, c, q );
+
+    {
+      ScopedLock lock( flightMutex );
+      if( flights.count( key ) ){
+	while( flights.count( key ) ) flightDone.wait( flightMutex );
+	return false;
+      }
+      flights.insert( key );
+    }
+
+    // We are the only thread in this process decoding this tile, but other processes may also be
+    if( sharedCache && !sharedCache->claim( this->getImageName( id ), r, t, h, v, c, q ) ){
+      ScopedLock lock( flightMutex );
+      flights.erase( key );
+      flightDone.broadcast();
+      return false;
+    }
+
+    return true;
+  }
+
+
+  /// Release a claim obtained with claim() once the tile has been inserted or has failed to decode
+  void release( unsigned long long id, int r, int t, int h, int v, CompressionType c, int q ) {
+
+    if( sharedCache ) sharedCache->release( this->getImageName( id ), r, t, h, v, c, q );
+
+    CacheKey key = this->getKey( id, r, t, h, v, c, q );
+    ScopedLock lock( flightMutex );
+    flights.erase( key );
+    flightDone.broadcast();
+  }
+
+
+  /// Return the hottest JPEG tiles in the cache
+  /** Pinned tiles are returned first. The remaining budget is shared between the shards,
+      each of which contributes its most frequently or recently used tiles
+      @param max maximum size in MB of tile data to return
+      @param tiles vector to which the tiles are added, hottest first within each shard. The
+      tiles refer to the cached data and have their filename set
+   */
+  void getHottest( float max, std::vector<RawTile>& tiles ) {
+    unsigned long budget = (unsigned long)(max*1024000);
+    std::vector< std::pair<CacheKey,RawTile> > hottest;
+    unsigned long used = pinned.getHottest( budget, hottest );
+    for( unsigned int i=0; i<shards.size(); i++ ){
+      used += shards[i]->getHottest( ( budget - used ) / ( shards.size() - i ), hottest );
+    }
+    tiles.reserve( tiles.size() + hottest.size() );
+    for( unsigned int i=0; i<hottest.size(); i++ ){
+      std::string f = this->getImageName( hottest[i].first.image );
+      if( f.empty() ) continue;
+      tiles.push_back( hottest[i].second );
+      tiles.back().filename = f;
+    }
   }
 
 
   /// Return the number of tiles in the cache
-  unsigned int getNumElements() { return tileList.size(); }
+  unsigned int getNumElements() {
+    unsigned int n = 0;
+    for( unsigned int i=0; i<shards.size(); i++ ) n += shards[i]->getNumElements();
+    return n + pinned.getNumElements();
+  }
+
+
+  /// Return the number of image ids currently interned
+  unsigned int getNumImages() { return imageIds.size(); }
 
 
   /// Return the number of MB stored
-  float getMemorySize() { return (float) ( currentSize / 1024000.0 ); }
+  float getMemorySize() {
+    unsigned long currentSize = pinned.getMemorySize();
+    for( unsigned int i=0; i<shards.size(); i++ ) currentSize += shards[i]->getMemorySize();
+    return (float) ( currentSize / 1024000.0 );
+  }
 
 
   /// Get a tile from the cache
   /** 
-   *  @param f filename
+   *  @param id image id obtained from getImageId()
    *  @param r resolution number
    *  @param t tile number
    *  @param h horizontal sequence number
    *  @param v vertical sequence number
    *  @param c compression type
    *  @param q compression quality
-   *  @return pointer to data or NULL on error
+   *  @param tile tile which will refer to the cached data. The filename is not set
+   *  @return true if the tile was found
    */
-  RawTile* getTile( std::string f, int r, int t, int h, int v, CompressionType c, int q ) {
+  bool getTile( unsigned long long id, int r, int t, int h, int v, CompressionType c, int q, RawTile& tile ) {
 
-    if( maxSize == 0 ) return NULL;
+    CacheKey key = this->getKey( id, r, t, h, v, c, q );
 
-    std::string key = this->getIndex( f, r, t, h, v, c, q );
+    bool pin = pinned.accepts( key );
+    if( pin && pinned.getTile( key, tile ) ) return true;
+    if( maxSize > 0 && this->getShard( key )->getTile( key, tile ) ) return true;
 
-    TileMap::iterator miter = tileMap.find( key );
-    if( miter == tileMap.end() ) return NULL;
-    this->_touch( key );
+    if( !sharedCache && !( diskCache && c == JPEG ) ) return false;
 
-    return &(miter->second->second);
+    // Fall back to the shared cache and then to the disk cache for encoded tiles,
+    // keeping any hit in the faster tiers
+    std::string f = this->getImageName( id );
+    if( !sharedCache || !sharedCache->getTile( f, r, t, h, v, c, q, tile ) ){
+      if( !diskCache || c != JPEG || !diskCache->getTile( f, r, t, h, v, c, q, tile ) ) return false;
+      if( sharedCache ) sharedCache->insert( tile );
+    }
+    if( pin || maxSize > 0 ) tile.share();
+    if( !( pin && pinned.insert( key, tile ) ) && maxSize > 0 ) this->getShard( key )->insert( key, tile );
+    std::string().swap( tile.filename );
+    return true;
   }
 
 
-  /// Create a hash index
+  /// Get a tile from the cache
   /** 
    *  @param f filename
    *  @param r resolution number
@@ -288,12 +1406,38 @@ class Cache {
    *  @param v vertical sequence number
    *  @param c compression type
    *  @param q compression quality
-   *  @return string
+   *  @param tile tile which will refer to the cached data
+   *  @return true if the tile was found
+   */
+  bool getTile( const std::string& f, int r, int t, int h, int v, CompressionType c, int q, RawTile& tile ) {
+
+    if( !this->getTile( this->getImageId( f ), r, t, h, v, c, q, tile ) ) return false;
+    tile.filename = f;
+    return true;
+  }
+
+
+  /// Create a cache key
+  /** 
+   *  @param id image id
+   *  @param r resolution number
+   *  @param t tile number
+   *  @param h horizontal sequence number
+   *  @param v vertical sequence number
+   *  @param c compression type
+   *  @param q compression quality
+   *  @return CacheKey
    */
-  std::string getIndex( std::string f, int r, int t, int h, int v, CompressionType c, int q ) {
-    char tmp[1024];
-    snprintf( tmp, 1024, "%s:%d:%d:%d:%d:%d:%d", f.c_str(), r, t, h, v, c, q );
-    return std::string( tmp );
+  static CacheKey getKey( unsigned long long id, int r, int t, int h, int v, CompressionType c, int q ) {
+    CacheKey key;
+    key.image = id;
+    key.resolution = r;
+    key.tile = t;
+    key.hSequence = h;
+    key.vSequence = v;
+    key.compression = c;
+    key.quality = q;
+    return key;
   }
 
 
@@ -0,0 +1,163 @@
+/*
+    IIPImage Server - Tile cache contention benchmark
+
+    Measures the throughput of concurrent tile cache lookups and insertions, as made by
+    request threads, for increasing numbers of threads with a single locked shard (as
+    before the cache was sharded) and with the default number of shards.
+
+    Build with "make cachebench" and run as:
+
+      cachebench [operations] [max threads]
+
+    Copyright (C) 2014 Ruven Pillay.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#include "Cache.h"
+#include "Thread.h"
+#include "Timer.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <sstream>
+#include <vector>
+
+
+using namespace std;
+
+
+// Number of images over which requests are spread
+#define BENCH_IMAGES 20
+
+// Number of distinct tiles of each image
+#define BENCH_TILES 1000
+
+// Size in bytes of each tile, roughly that of a 256x256 JPEG tile
+#define BENCH_TILE_SIZE 8000
+
+// Size in MB of the cache, which holds about half of all tiles
+#define BENCH_CACHE_SIZE 80
+
+
+
+/// The work of a single thread
+struct Worker {
+  Cache* cache;
+  unsigned long operations;
+  unsigned int seed;
+  unsigned long hits;
+};
+
+
+
+// Next value of a simple per thread linear congruential generator
+static unsigned int next( unsigned int& seed ){
+  seed = seed * 1103515245 + 12345;
+  return seed >> 8;
+}
+
+
+
+// Request tiles as a request thread would: look up the image id, then the tile,
+// and decode and insert the tile on a miss
+static void work( void* w ){
+
+  Worker* worker = (Worker*) w;
+  Cache* cache = worker->cache;
+
+  vector<string> names;
+  for( unsigned int i=0; i<BENCH_IMAGES; i++ ){
+    ostringstream name;
+    name << "image" << i << ".tif";
+    names.push_back( name.str() );
+  }
+
+  for( unsigned long n=0; n<worker->operations; n++ ){
+
+    // Favour lower tile numbers so that about 90% of requests hit
+    unsigned int r = next( worker->seed );
+    const string& f = names[ r % BENCH_IMAGES ];
+    unsigned int t = ( r / BENCH_IMAGES ) % BENCH_TILES;
+    if( next( worker->seed ) % 4 ) t /= 4;
+
+    unsigned long long id = cache->getImageId( f );
+    RawTile tile;
+    if( cache->getTile( id, 0, t, 0, 0, JPEG, 75, tile ) ){
+      worker->hits++;
+      continue;
+    }
+
+    RawTile decoded( t, 0, 0, 0, 256, 256, 3, 8 );
+    decoded.filename = f;
+    decoded.compressionType = JPEG;
+    decoded.quality = 75;
+    decoded.allocate( BENCH_TILE_SIZE );
+    cache->insert( decoded );
+  }
+}
+
+
+
+int main( int argc, char *argv[] ){
+
+  unsigned long operations = ( argc > 1 ) ? strtoul( argv[1], NULL, 10 ) : 2000000;
+  unsigned int maxThreads = ( argc > 2 ) ? atoi( argv[2] ) : 32;
+
+  printf( "%lu operations on %u processors\n\n", operations, Thread::getNumProcessors() );
+  printf( "threads  shards  operations/s  hit ratio\n" );
+
+  unsigned int shards[2] = { 1, CACHE_SHARDS };
+
+  for( unsigned int threads=1; threads<=maxThreads; threads*=2 ){
+    for( unsigned int s=0; s<2; s++ ){
+
+      Cache cache( BENCH_CACHE_SIZE, LRU, shards[s] );
+
+      vector<Worker> workers( threads );
+      for( unsigned int i=0; i<threads; i++ ){
+	workers[i].cache = &cache;
+	workers[i].operations = operations / threads;
+	workers[i].seed = i + 1;
+	workers[i].hits = 0;
+      }
+
+      // Fill the cache before timing
+      Worker fill = workers[0];
+      fill.seed = 0;
+      work( &fill );
+
+      Timer timer;
+      timer.start();
+
+      vector<Thread*> pool;
+      for( unsigned int i=0; i<threads; i++ ){
+	pool.push_back( new Thread() );
+	pool.back()->start( work, &workers[i] );
+      }
+      for( unsigned int i=0; i<threads; i++ ) delete pool[i];
+
+      double seconds = timer.getTime() / 1000000.0;
+      unsigned long hits = 0;
+      for( unsigned int i=0; i<threads; i++ ) hits += workers[i].hits;
+      unsigned long total = threads * ( operations / threads );
+
+      printf( "%7u  %6u  %12.0f  %9.3f\n", threads, shards[s], total / seconds, (double) hits / total );
+    }
+  }
+
+  return 0;
+}
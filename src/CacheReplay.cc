@@ -0,0 +1,146 @@
+/*
+    IIPImage Server - Tile cache trace replay
+
+    Replays a trace of tile requests, such as one written by cachetrace, through the
+    tile cache with each replacement policy and several cache sizes, and reports the
+    resulting hit ratios. Each request which misses is inserted as the server would
+    after decoding the tile.
+
+    Build with "make cachereplay" and run as:
+
+      cachereplay trace [size in MB ...]
+
+    The trace may be "-" to read from standard input. The default sizes are 10, 50
+    and 200MB.
+
+    Copyright (C) 2014 Ruven Pillay.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#include "Cache.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <map>
+
+
+using namespace std;
+
+
+
+/// A single request of the trace
+struct Request {
+  unsigned int image;
+  int resolution;
+  int tile;
+  CompressionType compression;
+  unsigned int bytes;
+};
+
+
+
+int main( int argc, char *argv[] ){
+
+  if( argc < 2 ){
+    fprintf( stderr, "Usage: cachereplay trace [size in MB ...]\n" );
+    return 1;
+  }
+
+  vector<float> sizes;
+  for( int i=2; i<argc; i++ ) sizes.push_back( atof( argv[i] ) );
+  if( sizes.empty() ){
+    sizes.push_back( 10 );
+    sizes.push_back( 50 );
+    sizes.push_back( 200 );
+  }
+
+  // Read the whole trace, interning the image names
+  ifstream file;
+  string path( argv[1] );
+  if( path != "-" ){
+    file.open( path.c_str() );
+    if( !file ){
+      fprintf( stderr, "cachereplay: unable to open %s\n", path.c_str() );
+      return 1;
+    }
+  }
+  istream& in = ( path == "-" ) ? cin : file;
+
+  vector<string> names;
+  map<string,unsigned int> ids;
+  vector<Request> trace;
+  unsigned long jpeg = 0;
+
+  string line;
+  while( getline( in, line ) ){
+    istringstream fields( line );
+    string image, compression;
+    Request r;
+    if( !( fields >> image >> r.resolution >> r.tile >> compression >> r.bytes ) ) continue;
+    map<string,unsigned int>::iterator i = ids.find( image );
+    if( i == ids.end() ){
+      i = ids.insert( make_pair( image, (unsigned int) names.size() ) ).first;
+      names.push_back( image );
+    }
+    r.image = i->second;
+    r.compression = ( compression == "J" ) ? JPEG : UNCOMPRESSED;
+    if( r.compression == JPEG ) jpeg++;
+    trace.push_back( r );
+  }
+
+  printf( "%lu requests, %lu for JPEG tiles, of %lu images\n\n", (unsigned long) trace.size(),
+	  jpeg, (unsigned long) names.size() );
+  printf( "policy    size MB  JPEG hit ratio  hit ratio\n" );
+
+  const char* policies[2] = { "lru", "tinylfu" };
+
+  for( unsigned int s=0; s<sizes.size(); s++ ){
+    for( unsigned int p=0; p<2; p++ ){
+
+      Cache cache( sizes[s], p ? TINYLFU : LRU );
+      unsigned long hits = 0, jpegHits = 0;
+
+      for( vector<Request>::const_iterator r = trace.begin(); r != trace.end(); r++ ){
+
+	int quality = ( r->compression == JPEG ) ? 75 : 0;
+	RawTile tile;
+	if( cache.getTile( names[r->image], r->resolution, r->tile, 0, 0, r->compression, quality, tile ) ){
+	  hits++;
+	  if( r->compression == JPEG ) jpegHits++;
+	  continue;
+	}
+
+	RawTile decoded( r->tile, r->resolution, 0, 0, 256, 256, 3, 8 );
+	decoded.filename = names[r->image];
+	decoded.compressionType = r->compression;
+	decoded.quality = quality;
+	decoded.allocate( r->bytes );
+	cache.insert( decoded );
+      }
+
+      printf( "%-8s  %7.0f  %14.3f  %9.3f\n", policies[p], sizes[s],
+	      jpeg ? (double) jpegHits / jpeg : 0.0,
+	      trace.empty() ? 0.0 : (double) hits / trace.size() );
+    }
+  }
+
+  return 0;
+}
@@ -0,0 +1,470 @@
+/*
+    IIPImage Server - Member functions for CacheSnapshot.h
+
+    Copyright (C) 2014 Ruven Pillay.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#include "CacheSnapshot.h"
+#include "Environment.h"
+#include <cstring>
+#include <cstdio>
+#include <cerrno>
+#include <ctime>
+#include <fstream>
+#include <sstream>
+#include <set>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifndef WIN32
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#endif
+
+
+using namespace std;
+
+
+#define CACHESNAPSHOT_MAGIC "IIPSN001"
+#define CACHESNAPSHOT_BYTEORDER 0x01020304
+
+
+
+/// Header at the start of a snapshot, followed by the image records and then the tile records
+struct CacheSnapshotHeader {
+  char magic[8];
+  unsigned int byteOrder;           ///< Detects snapshots written on a host of different byte order
+  unsigned int images;
+  unsigned int tiles;
+  unsigned int reserved;
+  unsigned long long size;          ///< Size of the whole snapshot, which detects truncated files
+};
+
+
+
+// Append the native representation of a value to a buffer
+template <class T> static void put( string& buffer, T value ){
+  buffer.append( (const char*) &value, sizeof(T) );
+}
+
+
+// Append a string preceded by its length
+static void putString( string& buffer, const string& s ){
+  put<unsigned int>( buffer, s.length() );
+  buffer.append( s );
+}
+
+
+
+/// Bounds checked sequential reader of snapshot data
+class SnapshotReader {
+
+  const char *p, *end;
+
+ public:
+
+  SnapshotReader( const char* data, size_t length ) : p( data ), end( data + length ) {};
+
+  /// Return a pointer to the next n bytes and skip over them
+  const char* skip( size_t n ){
+    if( (size_t)( end - p ) < n ) throw string( "CacheSnapshot :: snapshot is truncated" );
+    const char *q = p;
+    p += n;
+    return q;
+  }
+
+  /// Read a value
+  template <class T> T get(){
+    T value;
+    memcpy( &value, this->skip( sizeof(T) ), sizeof(T) );
+    return value;
+  }
+
+  /// Read a string written with putString()
+  string getString(){
+    unsigned int n = this->get<unsigned int>();
+    return string( this->skip( n ), n );
+  }
+
+  /// Read the number of elements of a sequence, checking that they can all be present
+  unsigned int getCount( size_t elementSize ){
+    unsigned int n = this->get<unsigned int>();
+    if( (size_t)( end - p ) / elementSize < n ) throw string( "CacheSnapshot :: snapshot is truncated" );
+    return n;
+  }
+
+};
+
+
+
+// Write a buffer to a file
+static void writeBuffer( FILE* f, const string& buffer ) throw(string){
+  if( buffer.length() && fwrite( buffer.data(), buffer.length(), 1, f ) != 1 ){
+    throw string( "CacheSnapshot :: unable to write snapshot: " ) + strerror( errno );
+  }
+}
+
+
+
+void CacheSnapshot::save( ImageCache& imageCache, Cache& tileCache ) throw(string){
+
+  numImages = numTiles = 0;
+  tileSize = 0;
+
+  vector< pair<string,const IIPImage*> > images;
+  imageCache.getImages( images );
+
+  vector<RawTile> tiles;
+  if( maxSize > 0 ) tileCache.getHottest( maxSize / 1024000.0, tiles );
+
+  // Write to a file of our own and rename it into place once complete
+  ostringstream tmp;
+  tmp << path << ".tmp" <<
+#ifdef WIN32
+    (unsigned long) time( NULL );
+#else
+    getpid();
+#endif
+  string tmppath = tmp.str();
+
+  FILE *f = fopen( tmppath.c_str(), "wb" );
+  if( !f ) throw string( "CacheSnapshot :: unable to create " ) + tmppath + ": " + strerror( errno );
+
+  try{
+
+    CacheSnapshotHeader header;
+    memset( &header, 0, sizeof(header) );
+    memcpy( header.magic, CACHESNAPSHOT_MAGIC, 8 );
+    header.byteOrder = CACHESNAPSHOT_BYTEORDER;
+    header.images = images.size();
+    header.tiles = tiles.size();
+
+    // Fill in the size once we know it
+    string buffer( (const char*) &header, sizeof(header) );
+    writeBuffer( f, buffer );
+    unsigned long long size = buffer.length();
+    buffer.clear();
+
+    for( unsigned int i=0; i<images.size(); i++ ){
+
+      const IIPImage& image = *(images[i].second);
+
+      putString( buffer, images[i].first );
+      putString( buffer, image.imagePath );
+      putString( buffer, image.fileSystemPrefix );
+      putString( buffer, image.fileNamePattern );
+      putString( buffer, image.type );
+      put<unsigned char>( buffer, image.isFile );
+
+      put<unsigned int>( buffer, image.horizontalAnglesList.size() );
+      for( list<int>::const_iterator a = image.horizontalAnglesList.begin(); a != image.horizontalAnglesList.end(); a++ ){
+	put<int>( buffer, *a );
+      }
+      put<unsigned int>( buffer, image.verticalAnglesList.size() );
+      for( list<int>::const_iterator a = image.verticalAnglesList.begin(); a != image.verticalAnglesList.end(); a++ ){
+	put<int>( buffer, *a );
+      }
+
+      put<unsigned int>( buffer, image.image_widths.size() );
+      for( unsigned int n=0; n<image.image_widths.size(); n++ ) put<unsigned int>( buffer, image.image_widths[n] );
+      put<unsigned int>( buffer, image.image_heights.size() );
+      for( unsigned int n=0; n<image.image_heights.size(); n++ ) put<unsigned int>( buffer, image.image_heights[n] );
+      put<unsigned int>( buffer, image.directory_offsets.size() );
+      for( unsigned int n=0; n<image.directory_offsets.size(); n++ ) put<unsigned long long>( buffer, image.directory_offsets[n] );
+
+      put<unsigned int>( buffer, image.tile_width );
+      put<unsigned int>( buffer, image.tile_height );
+      put<int>( buffer, image.colourspace );
+      put<unsigned int>( buffer, image.numResolutions );
+      put<unsigned int>( buffer, image.bpp );
+      put<unsigned int>( buffer, image.channels );
+      put<int>( buffer, image.sampleType );
+
+      put<unsigned int>( buffer, image.min.size() );
+      for( unsigned int n=0; n<image.min.size(); n++ ) put<float>( buffer, image.min[n] );
+      put<unsigned int>( buffer, image.max.size() );
+      for( unsigned int n=0; n<image.max.size(); n++ ) put<float>( buffer, image.max[n] );
+
+      put<unsigned int>( buffer, image.quality_layers );
+      put<unsigned char>( buffer, image.isSet );
+      put<int>( buffer, image.currentX );
+      put<int>( buffer, image.currentY );
+
+      put<unsigned int>( buffer, image.metadata.size() );
+      for( map<const string,string>::const_iterator m = image.metadata.begin(); m != image.metadata.end(); m++ ){
+	putString( buffer, m->first );
+	putString( buffer, m->second );
+      }
+
+      put<long long>( buffer, image.timestamp );
+
+      writeBuffer( f, buffer );
+      size += buffer.length();
+      buffer.clear();
+      numImages++;
+    }
+
+    for( unsigned int i=0; i<tiles.size(); i++ ){
+
+      const RawTile& tile = tiles[i];
+
+      putString( buffer, tile.filename );
+      put<int>( buffer, tile.resolution );
+      put<int>( buffer, tile.tileNum );
+      put<int>( buffer, tile.hSequence );
+      put<int>( buffer, tile.vSequence );
+      put<int>( buffer, tile.compressionType );
+      put<int>( buffer, tile.quality );
+      put<long long>( buffer, tile.timestamp );
+      put<unsigned int>( buffer, tile.width );
+      put<unsigned int>( buffer, tile.height );
+      put<int>( buffer, tile.channels );
+      put<int>( buffer, tile.bpc );
+      put<int>( buffer, tile.sampleType );
+      put<unsigned char>( buffer, tile.padded );
+      put<unsigned int>( buffer, tile.dataLength );
+      writeBuffer( f, buffer );
+      size += buffer.length();
+      buffer.clear();
+
+      // Write the tile data directly from the cached buffer
+      if( tile.dataLength > 0 && fwrite( tile.data, tile.dataLength, 1, f ) != 1 ){
+	throw string( "CacheSnapshot :: unable to write snapshot: " ) + strerror( errno );
+      }
+      size += tile.dataLength;
+
+      numTiles++;
+      tileSize += tile.dataLength;
+    }
+
+    header.size = size;
+    if( fseek( f, 0, SEEK_SET ) != 0 ) throw string( "CacheSnapshot :: unable to write snapshot: " ) + strerror( errno );
+    writeBuffer( f, string( (const char*) &header, sizeof(header) ) );
+
+    if( fclose( f ) != 0 ){
+      f = NULL;
+      throw string( "CacheSnapshot :: unable to write snapshot: " ) + strerror( errno );
+    }
+    f = NULL;
+
+    if( rename( tmppath.c_str(), path.c_str() ) != 0 ){
+      throw string( "CacheSnapshot :: unable to rename snapshot to " ) + path + ": " + strerror( errno );
+    }
+
+  }
+  catch( const string& error ){
+    if( f ) fclose( f );
+    remove( tmppath.c_str() );
+    throw;
+  }
+}
+
+
+
+bool CacheSnapshot::load( ImageCache& imageCache, Cache& tileCache, FileWatcher* watcher ) throw(string){
+
+  numImages = numTiles = 0;
+  tileSize = 0;
+
+#ifndef WIN32
+
+  int fd = open( path.c_str(), O_RDONLY );
+  if( fd < 0 ){
+    if( errno == ENOENT ) return false;
+    throw string( "CacheSnapshot :: unable to open " ) + path + ": " + strerror( errno );
+  }
+
+  struct stat sb;
+  if( fstat( fd, &sb ) != 0 || sb.st_size == 0 ){
+    close( fd );
+    throw string( "CacheSnapshot :: unable to read " ) + path;
+  }
+
+  void *data = mmap( NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+  close( fd );
+  if( data == MAP_FAILED ) throw string( "CacheSnapshot :: unable to map " ) + path + ": " + strerror( errno );
+
+  // We read the whole snapshot once from start to finish
+  madvise( data, sb.st_size, MADV_SEQUENTIAL | MADV_WILLNEED );
+
+  try{
+    this->restore( (const char*) data, sb.st_size, imageCache, tileCache, watcher );
+  }
+  catch( const string& error ){
+    munmap( data, sb.st_size );
+    throw;
+  }
+  munmap( data, sb.st_size );
+
+#else
+
+  // No mapping on this platform, so simply read the whole snapshot in
+  ifstream in( path.c_str(), ios::in | ios::binary );
+  if( !in ) return false;
+  ostringstream data;
+  data << in.rdbuf();
+  string buffer = data.str();
+  this->restore( buffer.data(), buffer.length(), imageCache, tileCache, watcher );
+
+#endif
+
+  return true;
+}
+
+
+
+void CacheSnapshot::restore( const char* data, size_t length, ImageCache& imageCache, Cache& tileCache,
+			     FileWatcher* watcher ) throw(string){
+
+  SnapshotReader reader( data, length );
+
+  CacheSnapshotHeader header = reader.get<CacheSnapshotHeader>();
+  if( memcmp( header.magic, CACHESNAPSHOT_MAGIC, 8 ) != 0 || header.byteOrder != CACHESNAPSHOT_BYTEORDER ){
+    throw string( "CacheSnapshot :: " ) + path + " is not a snapshot written by this version of the server";
+  }
+  if( header.size != length ) throw string( "CacheSnapshot :: snapshot is truncated" );
+
+  string filesystem_prefix = Environment::getFileSystemPrefix();
+  string filename_pattern = Environment::getFileNamePattern();
+  time_t now = time( NULL );
+
+  // Images which are still valid, most recently used first, and their timestamps
+  vector< pair<string,IIPImage> > images;
+  map<string,time_t> timestamps;
+
+  for( unsigned int i=0; i<header.images; i++ ){
+
+    string name = reader.getString();
+    IIPImage image;
+
+    image.imagePath = reader.getString();
+    image.fileSystemPrefix = reader.getString();
+    image.fileNamePattern = reader.getString();
+    image.type = reader.getString();
+    image.isFile = reader.get<unsigned char>();
+
+    unsigned int n = reader.getCount( sizeof(int) );
+    for( unsigned int j=0; j<n; j++ ) image.horizontalAnglesList.push_back( reader.get<int>() );
+    n = reader.getCount( sizeof(int) );
+    for( unsigned int j=0; j<n; j++ ) image.verticalAnglesList.push_back( reader.get<int>() );
+
+    n = reader.getCount( sizeof(unsigned int) );
+    for( unsigned int j=0; j<n; j++ ) image.image_widths.push_back( reader.get<unsigned int>() );
+    n = reader.getCount( sizeof(unsigned int) );
+    for( unsigned int j=0; j<n; j++ ) image.image_heights.push_back( reader.get<unsigned int>() );
+    n = reader.getCount( sizeof(unsigned long long) );
+    for( unsigned int j=0; j<n; j++ ) image.directory_offsets.push_back( reader.get<unsigned long long>() );
+
+    image.tile_width = reader.get<unsigned int>();
+    image.tile_height = reader.get<unsigned int>();
+    image.colourspace = (ColourSpaces) reader.get<int>();
+    image.numResolutions = reader.get<unsigned int>();
+    image.bpp = reader.get<unsigned int>();
+    image.channels = reader.get<unsigned int>();
+    image.sampleType = (SampleType) reader.get<int>();
+
+    n = reader.getCount( sizeof(float) );
+    for( unsigned int j=0; j<n; j++ ) image.min.push_back( reader.get<float>() );
+    n = reader.getCount( sizeof(float) );
+    for( unsigned int j=0; j<n; j++ ) image.max.push_back( reader.get<float>() );
+
+    image.quality_layers = reader.get<unsigned int>();
+    image.isSet = reader.get<unsigned char>();
+    image.currentX = reader.get<int>();
+    image.currentY = reader.get<int>();
+
+    n = reader.getCount( 2*sizeof(unsigned int) );
+    for( unsigned int j=0; j<n; j++ ){
+      string key = reader.getString();
+      image.metadata[key] = reader.getString();
+    }
+
+    image.timestamp = (time_t) reader.get<long long>();
+
+    // Only restore images opened with our current configuration whose file has not changed
+    if( image.fileSystemPrefix != filesystem_prefix || image.fileNamePattern != filename_pattern ) continue;
+    struct stat sb;
+    if( stat( image.getFileName( image.currentX, image.currentY ).c_str(), &sb ) != 0 ||
+	sb.st_mtime != image.timestamp ) continue;
+    image.validated = now;
+
+    timestamps[name] = image.timestamp;
+    images.push_back( make_pair( name, image ) );
+  }
+
+  // Restore tiles of valid images which are at least as recent as the image itself
+  vector<RawTile> tiles;
+
+  for( unsigned int i=0; i<header.tiles; i++ ){
+
+    RawTile tile;
+    tile.filename = reader.getString();
+    tile.resolution = reader.get<int>();
+    tile.tileNum = reader.get<int>();
+    tile.hSequence = reader.get<int>();
+    tile.vSequence = reader.get<int>();
+    tile.compressionType = (CompressionType) reader.get<int>();
+    tile.quality = reader.get<int>();
+    tile.timestamp = (time_t) reader.get<long long>();
+    tile.width = reader.get<unsigned int>();
+    tile.height = reader.get<unsigned int>();
+    tile.channels = reader.get<int>();
+    tile.bpc = reader.get<int>();
+    tile.sampleType = (SampleType) reader.get<int>();
+    tile.padded = reader.get<unsigned char>();
+    unsigned int dataLength = reader.get<unsigned int>();
+    const char *tiledata = reader.skip( dataLength );
+
+    map<string,time_t>::const_iterator t = timestamps.find( tile.filename );
+    if( t == timestamps.end() || tile.timestamp < t->second || tile.compressionType != JPEG ) continue;
+
+    tile.allocate( dataLength );
+    memcpy( tile.data, tiledata, dataLength );
+    tiles.push_back( tile );
+  }
+
+  // Insert everything least recently used first, so that the most recently used end up at the head
+  for( unsigned int i=images.size(); i-- > 0; ) imageCache.insert( images[i].first, images[i].second );
+  for( unsigned int i=tiles.size(); i-- > 0; ){
+    tileCache.restore( tiles[i] );
+    numTiles++;
+    tileSize += tiles[i].dataLength;
+  }
+
+  // Watch the files of the images which made it into the cache
+  vector< pair<string,const IIPImage*> > cached;
+  imageCache.getImages( cached );
+  numImages = cached.size();
+
+  if( watcher && watcher->active() ){
+    set<string> present;
+    for( unsigned int i=0; i<cached.size(); i++ ) present.insert( cached[i].first );
+    for( unsigned int i=0; i<images.size(); i++ ){
+      IIPImage& image = images[i].second;
+      if( present.count( images[i].first ) == 0 ) continue;
+      list<int> hlist = image.getHorizontalViewsList();
+      list<int> vlist = image.getVerticalViewsList();
+      for( list<int>::iterator h = hlist.begin(); h != hlist.end(); h++ ){
+	for( list<int>::iterator v = vlist.begin(); v != vlist.end(); v++ ){
+	  if( !watcher->watch( image.getFileName( *h, *v ), images[i].first ) ) return;
+	}
+      }
+    }
+  }
+}
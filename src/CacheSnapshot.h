@@ -0,0 +1,117 @@
+// Image and Tile Cache Snapshots
+
+/*  IIP Image Server
+
+    Copyright (C) 2014 Ruven Pillay.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#ifndef _CACHESNAPSHOT_H
+#define _CACHESNAPSHOT_H
+
+
+#include <string>
+#include "ImageCache.h"
+#include "Cache.h"
+#include "FileWatcher.h"
+
+
+
+/// Saves the image metadata cache and the hottest tiles to a file so that they survive restarts
+/** On shutdown, the metadata of every image in the image cache and the hottest JPEG
+    tiles of the tile cache, up to a size limit, are written to a local snapshot file.
+    The file is written under a temporary name and renamed into place, so that several
+    server processes can share the same snapshot path and a reader never sees a partially
+    written file.
+
+    On startup the snapshot is memory mapped and loaded back into the caches. Each image
+    is checked against the modification time of its file and is only restored, together
+    with its tiles, if the file has not changed since the snapshot was taken. Images whose
+    filesystem prefix or file name pattern differ from our current configuration are not
+    restored either. Entries are restored least recently used first, so the caches end up
+    in the same order as when they were saved.
+
+    Snapshots are written in the native byte order and are not portable between hosts.
+ */
+
+class CacheSnapshot {
+
+ private:
+
+  /// Snapshot file path
+  std::string path;
+
+  /// Maximum number of bytes of tile data to save
+  unsigned long maxSize;
+
+  /// Number of images and tiles saved or restored by the last operation
+  unsigned int numImages, numTiles;
+
+  /// Number of bytes of tile data saved or restored by the last operation
+  unsigned long tileSize;
+
+  /// Restore the contents of a snapshot
+  /** Throws a string exception if the snapshot is invalid
+      @param data snapshot data
+      @param length length of the data
+      @param imageCache image cache into which images are restored
+      @param tileCache tile cache into which tiles are restored
+      @param watcher if not NULL, the files of restored images are watched for changes
+   */
+  void restore( const char* data, size_t length, ImageCache& imageCache, Cache& tileCache,
+		FileWatcher* watcher ) throw(std::string);
+
+
+ public:
+
+  /// Constructor
+  /** @param p snapshot file path
+      @param max maximum size in MB of the tile data to save
+   */
+  CacheSnapshot( const std::string& p, float max ) :
+    path( p ), maxSize( (unsigned long)(max*1024000) ), numImages( 0 ), numTiles( 0 ), tileSize( 0 ) {};
+
+  /// Save the contents of our caches
+  /** Throws a string exception on error
+      @param imageCache image cache to save
+      @param tileCache tile cache from which the hottest JPEG tiles are saved
+   */
+  void save( ImageCache& imageCache, Cache& tileCache ) throw(std::string);
+
+  /// Restore the contents of a snapshot into our caches
+  /** Throws a string exception if the snapshot cannot be read or is invalid
+      @param imageCache image cache into which images are restored
+      @param tileCache tile cache into which tiles are restored
+      @param watcher if not NULL, the files of restored images are watched for changes
+      @return false if there is no snapshot
+   */
+  bool load( ImageCache& imageCache, Cache& tileCache, FileWatcher* watcher ) throw(std::string);
+
+  /// Return the number of images saved or restored
+  unsigned int getNumImages() const { return numImages; };
+
+  /// Return the number of tiles saved or restored
+  unsigned int getNumTiles() const { return numTiles; };
+
+  /// Return the number of MB of tile data saved or restored
+  float getTileSize() const { return (float) ( tileSize / 1024000.0 ); };
+
+};
+
+
+
+#endif
@@ -0,0 +1,98 @@
+/*
+    IIPImage Server - Tile request trace generator
+
+    Writes a synthetic trace of tile requests for cachereplay. Viewers request JPEG
+    tiles following a Zipf distribution over a fixed set of tiles, and at regular
+    intervals a full resolution export walks through a run of uncompressed tiles of
+    an image which is never requested again, as a CVT or IIIF export does.
+
+    Build with "make cachetrace" and run as:
+
+      cachetrace [requests] [tiles] [exponent] [export interval] [export tiles] > trace
+
+    The defaults are 1000000 requests over 20000 tiles with an exponent of 0.9 and
+    an export of 3000 tiles every 50000 requests. Each line of the trace is a request:
+
+      image resolution tile compression bytes
+
+    where compression is J for JPEG or U for uncompressed tiles.
+
+    Copyright (C) 2014 Ruven Pillay.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#include <cstdio>
+#include <cstdlib>
+#include <cmath>
+#include <vector>
+#include <algorithm>
+
+
+using namespace std;
+
+
+// Number of images over which the viewed tiles are spread
+#define TRACE_IMAGES 20
+
+// Size in bytes of an uncompressed 256x256 RGB tile
+#define TRACE_RAW_SIZE ( 256 * 256 * 3 )
+
+
+
+int main( int argc, char *argv[] ){
+
+  unsigned long requests = ( argc > 1 ) ? strtoul( argv[1], NULL, 10 ) : 1000000;
+  unsigned int tiles = ( argc > 2 ) ? atoi( argv[2] ) : 20000;
+  double exponent = ( argc > 3 ) ? atof( argv[3] ) : 0.9;
+  unsigned long interval = ( argc > 4 ) ? strtoul( argv[4], NULL, 10 ) : 50000;
+  unsigned int scan = ( argc > 5 ) ? atoi( argv[5] ) : 3000;
+
+  if( tiles == 0 ){
+    fprintf( stderr, "cachetrace: the number of tiles must be at least 1\n" );
+    return 1;
+  }
+
+  // Cumulative distribution of tile popularity, with the most popular tile first
+  vector<double> cdf( tiles );
+  double total = 0;
+  for( unsigned int i=0; i<tiles; i++ ){
+    total += 1.0 / pow( (double) ( i + 1 ), exponent );
+    cdf[i] = total;
+  }
+
+  srand( 1 );
+  unsigned int exports = 0;
+
+  for( unsigned long n=1; n<=requests; n++ ){
+
+    // A viewer request for a JPEG tile. Popular tiles are spread over all images
+    double u = ( rand() / ( RAND_MAX + 1.0 ) ) * total;
+    unsigned int k = lower_bound( cdf.begin(), cdf.end(), u ) - cdf.begin();
+    if( k >= tiles ) k = tiles - 1;
+    printf( "view%u.tif 0 %u J %u\n", k % TRACE_IMAGES, k / TRACE_IMAGES, 8000 + ( k * 7919 ) % 16000 );
+
+    // An export of a new image, walking its tiles once
+    if( interval > 0 && n % interval == 0 ){
+      for( unsigned int t=0; t<scan; t++ ){
+	printf( "export%u.tif 0 %u U %u\n", exports, t, TRACE_RAW_SIZE );
+      }
+      exports++;
+    }
+  }
+
+  return 0;
+}
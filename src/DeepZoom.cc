@@ -186,6 +186,12 @@ void DeepZoom::run( Session* session, const std::string& argument ){
   RawTile rawtile = tilemanager.getTile( resolution, tile, session->view->xangle,
 					 session->view->yangle, session->view->getLayers(), ct );
 
+  // Queue the surrounding tiles and those beneath this one for background decoding
+  if( session->prefetcher ){
+    session->prefetcher->prefetch( **session->image, resolution, tile, session->view->xangle, session->view->yangle,
+				   session->view->getLayers(), ct, session->jpeg->getQuality() );
+  }
+
   int len = rawtile.dataLength;
 
   if( session->loglevel >= 3 ){
@@ -212,11 +218,12 @@ void DeepZoom::run( Session* session, const std::string& argument ){
     }
   }
 
-  // Apply normalization and float conversion
-  filter_normalize( rawtile, (*session->image)->max, (*session->image)->min );
-
-  // Apply any contrast adjustments and/or clipping to 8bit
-  filter_contrast( rawtile, session->view->getContrast() );
+  // Apply normalization, float conversion and any contrast adjustments and/or
+  // clipping to 8bit. JPEG tiles are sent untouched directly from the cache
+  if( rawtile.compressionType == UNCOMPRESSED ){
+    filter_normalize( rawtile, (*session->image)->max, (*session->image)->min );
+    filter_contrast( rawtile, session->view->getContrast() );
+  }
 
   // Compress to JPEG
   if( ct == UNCOMPRESSED ){
@@ -0,0 +1,489 @@
+/*
+    IIPImage Server - Member functions for DiskCache.h
+
+    Copyright (C) 2014 Ruven Pillay.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#include "DiskCache.h"
+#include "Cache.h"
+#include <cstring>
+#include <cstdio>
+#include <cerrno>
+
+#ifndef WIN32
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/uio.h>
+#endif
+
+
+using namespace std;
+
+
+// Number of segments making up the log
+#define DISKCACHE_SEGMENTS 8
+
+// Number of index slots examined for each key
+#define DISKCACHE_PROBES 8
+
+#define DISKCACHE_MAGIC "IIPDC002"
+#define DISKCACHE_RECORD 0x49495054
+
+
+
+/// Header at the start of the index file
+struct DiskCacheHeader {
+  char magic[8];
+  unsigned int slots;
+  unsigned int segments;
+  unsigned long long segmentSize;
+  unsigned int oldest;              ///< Oldest live segment generation
+  unsigned int current;             ///< Segment generation currently appended to
+  unsigned long long offset;        ///< Append offset within the current segment
+};
+
+
+/// Index slot: an empty slot has generation 0
+/** The offset is 64 bit as segments of caches larger than 32GB exceed 4GB */
+struct DiskCacheSlot {
+  unsigned long long key;
+  unsigned int generation;
+  unsigned long long offset;
+};
+
+
+/// Header preceding each tile in a segment, followed by the image path and the data
+struct DiskCacheRecord {
+  unsigned int magic;
+  unsigned int pathLength;
+  unsigned long long key;
+  long long timestamp;
+  int resolution, tileNum, hSequence, vSequence, compressionType, quality;
+  unsigned int width, height;
+  int channels, bpc, sampleType;
+  unsigned int dataLength;
+};
+
+
+
+/// Hold an advisory lock on a file for the lifetime of this object
+class FileLock {
+  int fd;
+ public:
+  FileLock( int f, int operation ) : fd( f ) {
+#ifndef WIN32
+    flock( fd, operation );
+#endif
+  };
+  ~FileLock() {
+#ifndef WIN32
+    flock( fd, LOCK_UN );
+#endif
+  };
+};
+
+
+
+// Size of a record rounded up to keep records 8 byte aligned
+static unsigned long long recordSize( unsigned int pathLength, unsigned int dataLength ){
+  return ( sizeof(DiskCacheRecord) + pathLength + dataLength + 7 ) & ~7ULL;
+}
+
+
+
+#ifndef WIN32
+
+
+DiskCache::~DiskCache(){
+  for( map<unsigned int,void*>::iterator i = segments.begin(); i != segments.end(); ++i ){
+    munmap( i->second, ((DiskCacheHeader*)index)->segmentSize );
+  }
+  if( writeFd >= 0 ) close( writeFd );
+  if( index ) munmap( index, indexSize );
+  if( fd >= 0 ) close( fd );
+}
+
+
+
+string DiskCache::segmentName( unsigned int generation ) const {
+  char name[32];
+  snprintf( name, 32, "/segment.%08x", generation );
+  return path + name;
+}
+
+
+
+void DiskCache::open() throw(string) {
+
+  if( path.empty() ) throw string( "DiskCache :: no cache directory given" );
+
+  // Each segment must at least be able to hold a reasonable number of tiles
+  unsigned long long segmentSize = maxSize / DISKCACHE_SEGMENTS;
+  if( segmentSize < 1048576 ) segmentSize = 1048576;
+
+  // Allow for twice as many slots as tiles of an average 4kB
+  unsigned int slots = 1024;
+  while( (unsigned long long) slots < 2 * maxSize / 4096 && slots < (1U<<30) ) slots <<= 1;
+
+  if( mkdir( path.c_str(), 0755 ) != 0 && errno != EEXIST ){
+    throw string( "DiskCache :: unable to create directory " + path + ": " + strerror(errno) );
+  }
+
+  string indexName = path + "/index";
+  fd = ::open( indexName.c_str(), O_RDWR | O_CREAT, 0644 );
+  if( fd < 0 ) throw string( "DiskCache :: unable to open " + indexName + ": " + strerror(errno) );
+
+  FileLock lock( fd, LOCK_EX );
+
+  struct stat st;
+  if( fstat( fd, &st ) != 0 ) throw string( "DiskCache :: unable to stat " + indexName );
+
+  indexSize = sizeof(DiskCacheHeader) + (size_t) slots * sizeof(DiskCacheSlot);
+  bool valid = ( (size_t) st.st_size == indexSize );
+  if( !valid && ftruncate( fd, indexSize ) != 0 ){
+    throw string( "DiskCache :: unable to size " + indexName + ": " + strerror(errno) );
+  }
+
+  index = mmap( NULL, indexSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+  if( index == MAP_FAILED ){
+    index = NULL;
+    throw string( "DiskCache :: unable to map " + indexName + ": " + strerror(errno) );
+  }
+
+  // Reinitialize an index created with different settings
+  DiskCacheHeader *header = (DiskCacheHeader*) index;
+  if( !valid || memcmp( header->magic, DISKCACHE_MAGIC, 8 ) != 0 || header->slots != slots ||
+      header->segments != DISKCACHE_SEGMENTS || header->segmentSize != segmentSize ){
+    header->slots = slots;
+    header->segments = DISKCACHE_SEGMENTS;
+    header->segmentSize = segmentSize;
+    this->reset();
+  }
+
+  _connected = true;
+}
+
+
+
+void DiskCache::reset(){
+
+  DiskCacheHeader *header = (DiskCacheHeader*) index;
+
+  // Continue the generation sequence of a previous cache, so that processes which
+  // still have its segments mapped cannot confuse them with our new ones
+  unsigned int generation = 1;
+  if( memcmp( header->magic, DISKCACHE_MAGIC, 8 ) == 0 ) generation = header->current + 1;
+
+  DIR *dir = opendir( path.c_str() );
+  if( dir ){
+    struct dirent *entry;
+    while( (entry = readdir( dir )) ){
+      if( strncmp( entry->d_name, "segment.", 8 ) == 0 ) unlink( (path + "/" + entry->d_name).c_str() );
+    }
+    closedir( dir );
+  }
+
+  memset( (char*)index + sizeof(DiskCacheHeader), 0, indexSize - sizeof(DiskCacheHeader) );
+  memcpy( header->magic, DISKCACHE_MAGIC, 8 );
+  header->oldest = generation;
+  header->current = generation - 1;
+  this->rotate();
+}
+
+
+
+bool DiskCache::rotate(){
+
+  DiskCacheHeader *header = (DiskCacheHeader*) index;
+
+  if( writeFd >= 0 ){
+    close( writeFd );
+    writeFd = -1;
+  }
+
+  header->current++;
+  header->offset = 0;
+
+  // Delete the oldest segment once we have reached our budget
+  while( header->current - header->oldest >= header->segments ){
+    unlink( segmentName( header->oldest ).c_str() );
+    header->oldest++;
+  }
+
+  // Segments are created at their full size, sparsely, so that they can be mapped once
+  writeFd = ::open( segmentName( header->current ).c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644 );
+  writeGeneration = header->current;
+  if( writeFd < 0 ) return false;
+  if( ftruncate( writeFd, header->segmentSize ) != 0 ) return false;
+
+  this->unmapDeadSegments();
+  return true;
+}
+
+
+
+void DiskCache::unmapDeadSegments(){
+  DiskCacheHeader *header = (DiskCacheHeader*) index;
+  map<unsigned int,void*>::iterator i = segments.begin();
+  while( i != segments.end() && ( i->first < header->oldest || i->first > header->current ) ){
+    munmap( i->second, header->segmentSize );
+    segments.erase( i++ );
+  }
+}
+
+
+
+const char* DiskCache::segment( unsigned int generation ){
+
+  map<unsigned int,void*>::iterator i = segments.find( generation );
+  if( i != segments.end() ) return (const char*) i->second;
+
+  this->unmapDeadSegments();
+
+  DiskCacheHeader *header = (DiskCacheHeader*) index;
+  int sfd = ::open( segmentName( generation ).c_str(), O_RDONLY );
+  if( sfd < 0 ) return NULL;
+  void *m = mmap( NULL, header->segmentSize, PROT_READ, MAP_SHARED, sfd, 0 );
+  close( sfd );
+  if( m == MAP_FAILED ) return NULL;
+
+  segments[generation] = m;
+  return (const char*) m;
+}
+
+
+
+bool DiskCache::getTile( const string& f, int r, int t, int h, int v, CompressionType c, int q, RawTile& tile ){
+
+  if( !_connected ) return false;
+
+  unsigned long long key = Cache::getKey( 0, r, t, h, v, c, q ).hash( f );
+
+  ScopedLock lock( mutex );
+  FileLock filelock( fd, LOCK_SH );
+
+  DiskCacheHeader *header = (DiskCacheHeader*) index;
+  DiskCacheSlot *slots = (DiskCacheSlot*)( (char*)index + sizeof(DiskCacheHeader) );
+
+  for( unsigned int n=0; n<DISKCACHE_PROBES; n++ ){
+
+    DiskCacheSlot& slot = slots[ (key + n) & (header->slots - 1) ];
+    if( slot.key != key || slot.generation < header->oldest || slot.generation > header->current ) continue;
+
+    const char *base = this->segment( slot.generation );
+    if( !base || slot.offset + sizeof(DiskCacheRecord) > header->segmentSize ) return false;
+
+    // Check that the record really is the tile we want
+    const DiskCacheRecord *record = (const DiskCacheRecord*)( base + slot.offset );
+    if( record->magic != DISKCACHE_RECORD || record->key != key ||
+	slot.offset + recordSize( record->pathLength, record->dataLength ) > header->segmentSize ||
+	record->pathLength != f.length() ||
+	memcmp( (const char*)(record+1), f.data(), f.length() ) != 0 ||
+	record->resolution != r || record->tileNum != t || record->hSequence != h ||
+	record->vSequence != v || record->compressionType != c || record->quality != q ){
+      return false;
+    }
+
+    tile.deallocate();
+    tile.resolution = record->resolution;
+    tile.tileNum = record->tileNum;
+    tile.hSequence = record->hSequence;
+    tile.vSequence = record->vSequence;
+    tile.compressionType = (CompressionType) record->compressionType;
+    tile.quality = record->quality;
+    tile.timestamp = (time_t) record->timestamp;
+    tile.width = record->width;
+    tile.height = record->height;
+    tile.channels = record->channels;
+    tile.bpc = record->bpc;
+    tile.sampleType = (SampleType) record->sampleType;
+    tile.padded = false;
+    tile.filename = f;
+    tile.allocate( record->dataLength );
+    memcpy( tile.data, (const char*)(record+1) + record->pathLength, record->dataLength );
+    return true;
+  }
+
+  return false;
+}
+
+
+
+void DiskCache::insert( const RawTile& r ){
+
+  if( !_connected || !r.data || r.dataLength <= 0 ) return;
+
+  DiskCacheRecord record;
+  memset( &record, 0, sizeof(record) );
+  record.magic = DISKCACHE_RECORD;
+  record.pathLength = r.filename.length();
+  record.key = Cache::getKey( 0, r.resolution, r.tileNum, r.hSequence, r.vSequence,
+			       r.compressionType, r.quality ).hash( r.filename );
+  record.timestamp = r.timestamp;
+  record.resolution = r.resolution;
+  record.tileNum = r.tileNum;
+  record.hSequence = r.hSequence;
+  record.vSequence = r.vSequence;
+  record.compressionType = r.compressionType;
+  record.quality = r.quality;
+  record.width = r.width;
+  record.height = r.height;
+  record.channels = r.channels;
+  record.bpc = r.bpc;
+  record.sampleType = r.sampleType;
+  record.dataLength = r.dataLength;
+
+  unsigned long long size = recordSize( record.pathLength, record.dataLength );
+
+  ScopedLock lock( mutex );
+  FileLock filelock( fd, LOCK_EX );
+
+  DiskCacheHeader *header = (DiskCacheHeader*) index;
+  DiskCacheSlot *slots = (DiskCacheSlot*)( (char*)index + sizeof(DiskCacheHeader) );
+
+  if( size > header->segmentSize ) return;
+
+  // Move on to a new segment if this one is full
+  if( header->offset + size > header->segmentSize ){
+    if( !this->rotate() ) return;
+  }
+
+  // Another process may have moved on to a new segment since we last wrote
+  if( writeFd < 0 || writeGeneration != header->current ){
+    if( writeFd >= 0 ) close( writeFd );
+    writeFd = ::open( segmentName( header->current ).c_str(), O_RDWR );
+    writeGeneration = header->current;
+    if( writeFd < 0 ) return;
+  }
+
+  // Write the record before publishing it in the index
+  struct iovec parts[3];
+  parts[0].iov_base = &record;
+  parts[0].iov_len = sizeof(record);
+  parts[1].iov_base = (void*) r.filename.data();
+  parts[1].iov_len = record.pathLength;
+  parts[2].iov_base = r.data;
+  parts[2].iov_len = record.dataLength;
+  ssize_t expected = sizeof(record) + record.pathLength + record.dataLength;
+  if( pwritev( writeFd, parts, 3, header->offset ) != expected ) return;
+
+  // Use the slot holding an older copy of this tile, otherwise a free slot,
+  // otherwise the slot pointing into the oldest segment
+  DiskCacheSlot *target = NULL;
+  bool targetLive = true;
+  for( unsigned int n=0; n<DISKCACHE_PROBES; n++ ){
+    DiskCacheSlot *slot = &slots[ (record.key + n) & (header->slots - 1) ];
+    if( slot->key == record.key ){
+      target = slot;
+      break;
+    }
+    bool live = ( slot->generation >= header->oldest && slot->generation <= header->current );
+    if( targetLive && ( !live || !target || slot->generation < target->generation ) ){
+      target = slot;
+      targetLive = live;
+    }
+  }
+
+  target->key = record.key;
+  target->generation = header->current;
+  target->offset = header->offset;
+  header->offset += size;
+}
+
+
+
+void DiskCache::remove( const string& f ){
+
+  if( !_connected ) return;
+
+  ScopedLock lock( mutex );
+  FileLock filelock( fd, LOCK_EX );
+
+  DiskCacheHeader *header = (DiskCacheHeader*) index;
+  DiskCacheSlot *slots = (DiskCacheSlot*)( (char*)index + sizeof(DiskCacheHeader) );
+
+  for( unsigned int i=0; i<header->slots; i++ ){
+
+    DiskCacheSlot& slot = slots[i];
+    if( slot.generation < header->oldest || slot.generation > header->current ) continue;
+
+    const char *base = this->segment( slot.generation );
+    if( !base || slot.offset + sizeof(DiskCacheRecord) > header->segmentSize ) continue;
+
+    const DiskCacheRecord *record = (const DiskCacheRecord*)( base + slot.offset );
+    if( record->magic == DISKCACHE_RECORD && record->pathLength == f.length() &&
+	slot.offset + sizeof(DiskCacheRecord) + f.length() <= header->segmentSize &&
+	memcmp( (const char*)(record+1), f.data(), f.length() ) == 0 ){
+      slot.key = 0;
+      slot.generation = 0;
+      slot.offset = 0;
+    }
+  }
+}
+
+
+
+float DiskCache::getMemorySize(){
+  if( !_connected ) return 0.0;
+  ScopedLock lock( mutex );
+  FileLock filelock( fd, LOCK_SH );
+  DiskCacheHeader *header = (DiskCacheHeader*) index;
+  unsigned long long size = (unsigned long long)( header->current - header->oldest ) * header->segmentSize + header->offset;
+  return (float) ( size / 1024000.0 );
+}
+
+
+
+#else
+
+
+// Memory mapped files and advisory locking are only implemented for POSIX systems
+
+DiskCache::~DiskCache(){}
+
+string DiskCache::segmentName( unsigned int generation ) const { return string(); }
+
+void DiskCache::open() throw(string) {
+  throw string( "DiskCache :: not supported on this platform" );
+}
+
+void DiskCache::reset(){}
+
+bool DiskCache::rotate(){ return false; }
+
+void DiskCache::unmapDeadSegments(){}
+
+const char* DiskCache::segment( unsigned int generation ){ return NULL; }
+
+bool DiskCache::getTile( const string& f, int r, int t, int h, int v, CompressionType c, int q, RawTile& tile ){
+  return false;
+}
+
+void DiskCache::insert( const RawTile& r ){}
+
+void DiskCache::remove( const string& f ){}
+
+float DiskCache::getMemorySize(){ return 0.0; }
+
+
+#endif
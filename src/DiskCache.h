@@ -0,0 +1,159 @@
+// On-disk Second Tier Tile Cache
+
+/*  IIP Image Server
+
+    Copyright (C) 2014 Ruven Pillay.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#ifndef _DISKCACHE_H
+#define _DISKCACHE_H
+
+
+#include <string>
+#include <map>
+#include "RawTile.h"
+#include "Mutex.h"
+
+
+
+/// Persistent tile cache held in a directory on local disk
+/** Encoded tiles are appended to a log made up of a fixed number of fixed size
+    segment files. When the current segment is full, a new one is started and,
+    once the size budget is reached, the oldest segment is deleted along with
+    all the tiles it contains. Tiles are located through an open addressing hash
+    index which is memory mapped from a file in the same directory. Segments are
+    also memory mapped, so a hit costs a hash probe and a copy of the encoded data.
+
+    The cache survives restarts and may be shared by several server processes on
+    the same host: the index is protected by an advisory file lock. Entries are
+    keyed on the image path and tile parameters and carry the image timestamp,
+    so stale tiles can be detected by the caller exactly as for the memory cache.
+ */
+
+class DiskCache {
+
+ private:
+
+  /// Cache directory
+  std::string path;
+
+  /// Size budget in bytes
+  unsigned long long maxSize;
+
+  /// Index file descriptor
+  int fd;
+
+  /// Index file mapping
+  void *index;
+
+  /// Size of the index mapping
+  size_t indexSize;
+
+  /// Descriptor of the segment currently being appended to
+  int writeFd;
+
+  /// Generation number of the segment open for writing
+  unsigned int writeGeneration;
+
+  /// Mapped segments by generation number
+  std::map<unsigned int, void*> segments;
+
+  /// Lock protecting our mappings from other threads in this process
+  Mutex mutex;
+
+  /// Whether we have successfully opened the cache
+  bool _connected;
+
+
+  /// Return the file name of a segment
+  /** @param generation segment generation number */
+  std::string segmentName( unsigned int generation ) const;
+
+  /// Return the mapping of a segment, mapping it if necessary
+  /** @param generation segment generation number
+      @return pointer to the mapped segment or NULL on failure
+   */
+  const char* segment( unsigned int generation );
+
+  /// Unmap any segments which have been deleted
+  void unmapDeadSegments();
+
+  /// Delete all segments and reset the index
+  void reset();
+
+  /// Start a new segment, deleting the oldest if necessary
+  /** @return true on success */
+  bool rotate();
+
+  /// The cache cannot be copied
+  DiskCache( const DiskCache& );
+  DiskCache& operator = ( const DiskCache& );
+
+
+ public:
+
+  /// Constructor
+  /** @param p cache directory
+      @param max maximum size in MB
+   */
+  DiskCache( const std::string& p, float max ) :
+    path( p ), maxSize( (unsigned long long)(max*1024000.0) ),
+    fd( -1 ), index( NULL ), indexSize( 0 ), writeFd( -1 ), writeGeneration( 0 ),
+    _connected( false ) {};
+
+  /// Destructor
+  ~DiskCache();
+
+  /// Open the cache, creating or reinitializing it if necessary
+  /** Throws a string exception on error */
+  void open() throw(std::string);
+
+  /// Indicate whether the cache is open and usable
+  bool connected() const { return _connected; };
+
+  /// Get a tile from the cache
+  /** @param f image path
+      @param r resolution number
+      @param t tile number
+      @param h horizontal sequence number
+      @param v vertical sequence number
+      @param c compression type
+      @param q compression quality
+      @param tile tile into which the cached data is copied
+      @return true if the tile was found
+   */
+  bool getTile( const std::string& f, int r, int t, int h, int v, CompressionType c, int q, RawTile& tile );
+
+  /// Insert a tile
+  /** @param r tile to be inserted, which must have its filename set */
+  void insert( const RawTile& r );
+
+  /// Remove all tiles of an image from the index
+  /** This examines every index slot. The tiles' data remains in its segment until
+      the segment is deleted
+      @param f image path
+   */
+  void remove( const std::string& f );
+
+  /// Return the number of MB stored
+  float getMemorySize();
+
+};
+
+
+#endif
@@ -39,10 +39,38 @@
 #define LIBMEMCACHED_SERVERS "localhost"
 #define LIBMEMCACHED_TIMEOUT 86400  // 24 hours
 #define INTERPOLATION 1
+#define CACHE_POLICY "lru"
+#define METADATA_CACHE_SIZE 16.0
+#define METADATA_CACHE_ENTRIES 500
+#define NEGATIVE_CACHE_ENTRIES 1000
+#define NEGATIVE_CACHE_TTL 30
+#define SHARED_CACHE_NAME "/iipsrv"
+#define SHARED_CACHE_SIZE 0
+#define DISK_CACHE_PATH ""
+#define DISK_CACHE_SIZE 1024.0
+#define CACHE_SNAPSHOT ""
+#define CACHE_SNAPSHOT_SIZE 100.0
+#define WARMUP_MANIFEST ""
+#define WARMUP_LEVELS 3
+#define WARMUP_TIME 60
+#define WARMUP_SIZE 0
+#define REQUEST_THREADS 1
+#define REGION_THREADS 0
+#define PIPELINE_DEPTH 0
+#define PREFETCH_THREADS 0
+#define PREFETCH_QUEUE 64
+#define PINNED_CACHE_SIZE 0
+#define PINNED_LEVELS 3
+#define TIFF_POOL_SIZE 32
+#define JPEG_PASSTHROUGH true
+#define TIFF_MMAP true
+#define METADATA_REVALIDATE 0
+#define WATCH_IMAGES false
 
 
 
 #include <string>
+#include <cctype>
 
 
 /// Class to obtain environment variables
@@ -80,6 +108,303 @@ class Environment {
   }
 
 
+  static float getMetadataCacheSize(){
+    float metadata_cache_size = METADATA_CACHE_SIZE;
+    char* envpara = getenv( "METADATA_CACHE_SIZE" );
+    if( envpara ){
+      metadata_cache_size = atof( envpara );
+      if( metadata_cache_size < 0 ) metadata_cache_size = 0;
+    }
+    return metadata_cache_size;
+  }
+
+
+  static unsigned int getMetadataCacheEntries(){
+    int metadata_cache_entries = METADATA_CACHE_ENTRIES;
+    char* envpara = getenv( "METADATA_CACHE_ENTRIES" );
+    if( envpara ){
+      metadata_cache_entries = atoi( envpara );
+      if( metadata_cache_entries < 0 ) metadata_cache_entries = 0;
+    }
+    return metadata_cache_entries;
+  }
+
+
+  static unsigned int getNegativeCacheEntries(){
+    int negative_cache_entries = NEGATIVE_CACHE_ENTRIES;
+    char* envpara = getenv( "NEGATIVE_CACHE_ENTRIES" );
+    if( envpara ){
+      negative_cache_entries = atoi( envpara );
+      if( negative_cache_entries < 0 ) negative_cache_entries = 0;
+    }
+    return negative_cache_entries;
+  }
+
+
+  static unsigned int getNegativeCacheTTL(){
+    int negative_cache_ttl = NEGATIVE_CACHE_TTL;
+    char* envpara = getenv( "NEGATIVE_CACHE_TTL" );
+    if( envpara ){
+      negative_cache_ttl = atoi( envpara );
+      if( negative_cache_ttl < 0 ) negative_cache_ttl = 0;
+    }
+    return negative_cache_ttl;
+  }
+
+
+  static std::string getCachePolicy(){
+    char* envpara = getenv( "CACHE_POLICY" );
+    std::string cache_policy;
+    if( envpara ){
+      cache_policy = std::string( envpara );
+      // Make lower case
+      for( unsigned int i=0; i<cache_policy.length(); i++ ) cache_policy[i] = tolower( cache_policy[i] );
+    }
+    else cache_policy = CACHE_POLICY;
+
+    return cache_policy;
+  }
+
+
+  static std::string getSharedCacheName(){
+    char* envpara = getenv( "SHARED_CACHE_NAME" );
+    std::string shared_cache_name;
+    if( envpara ){
+      shared_cache_name = std::string( envpara );
+      // POSIX shared memory names must begin with a slash
+      if( shared_cache_name.length() > 0 && shared_cache_name[0] != '/' ) shared_cache_name = "/" + shared_cache_name;
+    }
+    else shared_cache_name = SHARED_CACHE_NAME;
+
+    return shared_cache_name;
+  }
+
+
+  static float getSharedCacheSize(){
+    float shared_cache_size = SHARED_CACHE_SIZE;
+    char* envpara = getenv( "SHARED_CACHE_SIZE" );
+    if( envpara ){
+      shared_cache_size = atof( envpara );
+      if( shared_cache_size < 0 ) shared_cache_size = 0;
+    }
+    return shared_cache_size;
+  }
+
+
+  static std::string getDiskCachePath(){
+    char* envpara = getenv( "DISK_CACHE_PATH" );
+    std::string disk_cache_path;
+    if( envpara ){
+      disk_cache_path = std::string( envpara );
+    }
+    else disk_cache_path = DISK_CACHE_PATH;
+
+    return disk_cache_path;
+  }
+
+
+  static float getDiskCacheSize(){
+    float disk_cache_size = DISK_CACHE_SIZE;
+    char* envpara = getenv( "DISK_CACHE_SIZE" );
+    if( envpara ){
+      disk_cache_size = atof( envpara );
+      if( disk_cache_size < 0 ) disk_cache_size = 0;
+    }
+    return disk_cache_size;
+  }
+
+
+  static std::string getCacheSnapshot(){
+    char* envpara = getenv( "CACHE_SNAPSHOT" );
+    std::string cache_snapshot;
+    if( envpara ){
+      cache_snapshot = std::string( envpara );
+    }
+    else cache_snapshot = CACHE_SNAPSHOT;
+
+    return cache_snapshot;
+  }
+
+
+  static float getCacheSnapshotSize(){
+    float cache_snapshot_size = CACHE_SNAPSHOT_SIZE;
+    char* envpara = getenv( "CACHE_SNAPSHOT_SIZE" );
+    if( envpara ){
+      cache_snapshot_size = atof( envpara );
+      if( cache_snapshot_size < 0 ) cache_snapshot_size = 0;
+    }
+    return cache_snapshot_size;
+  }
+
+
+  static std::string getWarmupManifest(){
+    char* envpara = getenv( "WARMUP_MANIFEST" );
+    std::string warmup_manifest;
+    if( envpara ){
+      warmup_manifest = std::string( envpara );
+    }
+    else warmup_manifest = WARMUP_MANIFEST;
+
+    return warmup_manifest;
+  }
+
+
+  static unsigned int getWarmupLevels(){
+    int warmup_levels = WARMUP_LEVELS;
+    char* envpara = getenv( "WARMUP_LEVELS" );
+    if( envpara ){
+      warmup_levels = atoi( envpara );
+      if( warmup_levels < 0 ) warmup_levels = 0;
+    }
+    return warmup_levels;
+  }
+
+
+  static unsigned int getWarmupTime(){
+    int warmup_time = WARMUP_TIME;
+    char* envpara = getenv( "WARMUP_TIME" );
+    if( envpara ){
+      warmup_time = atoi( envpara );
+      if( warmup_time < 0 ) warmup_time = 0;
+    }
+    return warmup_time;
+  }
+
+
+  static float getWarmupSize(){
+    float warmup_size = WARMUP_SIZE;
+    char* envpara = getenv( "WARMUP_SIZE" );
+    if( envpara ){
+      warmup_size = atof( envpara );
+      if( warmup_size < 0 ) warmup_size = 0;
+    }
+    return warmup_size;
+  }
+
+
+  static unsigned int getRequestThreads(){
+    int request_threads = REQUEST_THREADS;
+    char* envpara = getenv( "REQUEST_THREADS" );
+    if( envpara ){
+      request_threads = atoi( envpara );
+      if( request_threads < 1 ) request_threads = 1;
+    }
+    return request_threads;
+  }
+
+
+  static unsigned int getRegionThreads(){
+    int region_threads = REGION_THREADS;
+    char* envpara = getenv( "REGION_THREADS" );
+    if( envpara ){
+      region_threads = atoi( envpara );
+      if( region_threads < 0 ) region_threads = 0;
+    }
+    return region_threads;
+  }
+
+
+  static unsigned int getPipelineDepth(){
+    int pipeline_depth = PIPELINE_DEPTH;
+    char* envpara = getenv( "PIPELINE_DEPTH" );
+    if( envpara ){
+      pipeline_depth = atoi( envpara );
+      if( pipeline_depth < 0 ) pipeline_depth = 0;
+    }
+    return pipeline_depth;
+  }
+
+
+  static unsigned int getPrefetchThreads(){
+    int prefetch_threads = PREFETCH_THREADS;
+    char* envpara = getenv( "PREFETCH_THREADS" );
+    if( envpara ){
+      prefetch_threads = atoi( envpara );
+      if( prefetch_threads < 0 ) prefetch_threads = 0;
+    }
+    return prefetch_threads;
+  }
+
+
+  static unsigned int getPrefetchQueue(){
+    int prefetch_queue = PREFETCH_QUEUE;
+    char* envpara = getenv( "PREFETCH_QUEUE" );
+    if( envpara ){
+      prefetch_queue = atoi( envpara );
+      if( prefetch_queue < 1 ) prefetch_queue = PREFETCH_QUEUE;
+    }
+    return prefetch_queue;
+  }
+
+
+  static float getPinnedCacheSize(){
+    float pinned_cache_size = PINNED_CACHE_SIZE;
+    char* envpara = getenv( "PINNED_CACHE_SIZE" );
+    if( envpara ){
+      pinned_cache_size = atof( envpara );
+      if( pinned_cache_size < 0 ) pinned_cache_size = 0;
+    }
+    return pinned_cache_size;
+  }
+
+
+  static unsigned int getPinnedLevels(){
+    int pinned_levels = PINNED_LEVELS;
+    char* envpara = getenv( "PINNED_LEVELS" );
+    if( envpara ){
+      pinned_levels = atoi( envpara );
+      if( pinned_levels < 0 ) pinned_levels = 0;
+    }
+    return pinned_levels;
+  }
+
+
+  static unsigned int getTIFFPoolSize(){
+    int tiff_pool_size = TIFF_POOL_SIZE;
+    char* envpara = getenv( "TIFF_POOL_SIZE" );
+    if( envpara ){
+      tiff_pool_size = atoi( envpara );
+      if( tiff_pool_size < 0 ) tiff_pool_size = 0;
+    }
+    return tiff_pool_size;
+  }
+
+
+  static unsigned int getMetadataRevalidate(){
+    int revalidate = METADATA_REVALIDATE;
+    char* envpara = getenv( "METADATA_REVALIDATE" );
+    if( envpara ){
+      revalidate = atoi( envpara );
+      if( revalidate < 0 ) revalidate = 0;
+    }
+    return revalidate;
+  }
+
+
+  static bool getWatchImages(){
+    char* envpara = getenv( "WATCH_IMAGES" );
+    bool watch = WATCH_IMAGES;
+    if( envpara ) watch = ( atoi( envpara ) != 0 );
+    return watch;
+  }
+
+
+  static bool getTIFFMmap(){
+    char* envpara = getenv( "TIFF_MMAP" );
+    bool mmap = TIFF_MMAP;
+    if( envpara ) mmap = ( atoi( envpara ) != 0 );
+    return mmap;
+  }
+
+
+  static bool getJPEGPassthrough(){
+    char* envpara = getenv( "JPEG_PASSTHROUGH" );
+    bool passthrough = JPEG_PASSTHROUGH;
+    if( envpara ) passthrough = ( atoi( envpara ) != 0 );
+    return passthrough;
+  }
+
+
   static std::string getFileNamePattern(){
     char* envpara = getenv( "FILENAME_PATTERN" );
     std::string filename_pattern;
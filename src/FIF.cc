@@ -20,17 +20,10 @@
 
 
 #include <algorithm>
+#include <cerrno>
+#include <sys/stat.h>
 #include "Task.h"
 #include "Environment.h"
-#include "TPTImage.h"
-
-#ifdef HAVE_KAKADU
-#include "KakaduImage.h"
-#endif
-
-#define MAXIMAGECACHE 500  // Max number of items in image cache
-
-
 
 using namespace std;
 
@@ -108,45 +101,78 @@ void FIF::run( Session* session, const string& src ){
   }
 
 
-  // Create our IIPImage object
+  // Our image object if it is not already in the image cache
   IIPImage test;
 
+  // The image we are serving: the cached object itself or our newly opened one
+  const IIPImage* source = &test;
+
   // Get our image pattern variable
   string filesystem_prefix = Environment::getFileSystemPrefix();
 
   // Get our image pattern variable
   string filename_pattern = Environment::getFileNamePattern();
 
+  // Whether this is the first time this process has opened the image
+  bool opened = false;
+
+  // Timestamps of the cached image, so that we can tell whether it needs updating
+  time_t timestamp = 0, validated = 0;
+
+  // Whether a failure should be remembered in our negative cache: only for missing images
+  bool remember = false;
+
   // Put the image setup into a try block as object creation can throw an exception
   try{
 
-    // Check whether cache is empty
-    if( session->imageCache->empty() ){
-      if( session->loglevel >= 1 ) *(session->logfile) << "FIF :: Image cache initialisation" << endl;
-      test = IIPImage( argument );
-      test.setFileNamePattern( filename_pattern );
-      test.setFileSystemPrefix( filesystem_prefix );
-      test.Initialise();
+    // Look up our object. Hits are used in place rather than copied, so we hold the cache's
+    // lock, which it shares with other request threads, until we have created our own image
+    ScopedLock lock( session->imageCache->getMutex() );
+    const IIPImage* cached = session->imageCache->find( argument );
+
+    // Cache Hit
+    if( cached ){
+      source = cached;
+      timestamp = cached->timestamp;
+      validated = cached->validated;
+      if( session->loglevel >= 2 ){
+	*(session->logfile) << "FIF :: Image cache hit. Number of elements: " << session->imageCache->getNumElements()
+			    << ", " << session->imageCache->getMemorySize() << " MB" << endl;
+      }
     }
-    // If not, look up our object
+    // Cache Miss
     else{
-      // Cache Hit
-      if( session->imageCache->find(argument) != session->imageCache->end() ){
-	test = (*session->imageCache)[ argument ];
-	if( session->loglevel >= 2 ){
-	  *(session->logfile) << "FIF :: Image cache hit. Number of elements: " << session->imageCache->size() << endl;
-	}
+
+      bool initialising = session->imageCache->empty();
+      lock.unlock();
+
+      // Fail immediately for images which we have recently been unable to open
+      string failure;
+      if( session->negativeCache && session->negativeCache->find( argument, failure ) ){
+	if( session->loglevel >= 2 ) *(session->logfile) << "FIF :: Negative cache hit" << endl;
+	throw failure;
       }
-      // Cache Miss
-      else{
-	if( session->loglevel >= 2 ) *(session->logfile) << "FIF :: Image cache miss" << endl;
-	test = IIPImage( argument );
-	test.setFileNamePattern( filename_pattern );
-	test.setFileSystemPrefix( filesystem_prefix );
+
+      if( initialising ){
+	if( session->loglevel >= 1 ) *(session->logfile) << "FIF :: Image cache initialisation" << endl;
+      }
+      else if( session->loglevel >= 2 ) *(session->logfile) << "FIF :: Image cache miss" << endl;
+      test = IIPImage( argument );
+      test.setFileNamePattern( filename_pattern );
+      test.setFileSystemPrefix( filesystem_prefix );
+      try{
 	test.Initialise();
-	// Delete items if our list of images is too long.
-	if( session->imageCache->size() >= MAXIMAGECACHE ) session->imageCache->erase( session->imageCache->begin() );
       }
+      catch( const string& error ){
+	// Only remember paths which do not exist, not failures which may be transient, such as
+	// running out of file descriptors, or which may not recur, such as a partly copied file
+	struct stat sb;
+	string path = filesystem_prefix + argument;
+	remember = ( session->negativeCache != NULL ) && stat( path.c_str(), &sb ) == -1 &&
+	  ( errno == ENOENT || errno == ENOTDIR );
+	throw;
+      }
+      opened = true;
     }
 
 
@@ -155,22 +181,12 @@ void FIF::run( Session* session, const string& src ){
       Test for different image types - only TIFF is native for now
     ***************************************************************/
 
-    string imtype = test.getImageType();
-
-    // Transform the suffix to lower case
-    transform( imtype.begin(), imtype.end(), imtype.begin(), ::tolower );
-
-    if( imtype=="tif" || imtype=="tiff" || imtype=="ptif" || imtype=="dat" ){
-      if( session->loglevel >= 2 ) *(session->logfile) << "FIF :: TIFF image requested" << endl;
-      *session->image = new TPTImage( test );
-    }
-#ifdef HAVE_KAKADU
-    else if( imtype=="jpx" || imtype=="jp2" || imtype=="j2k" ){
-      if( session->loglevel >= 2 ) *(session->logfile) << "FIF :: JPEG2000 image requested" << endl;
-      *session->image = new KakaduImage( test );
+    *session->image = IIPImage::create( *source );
+    if( session->loglevel >= 2 ){
+      *(session->logfile) << "FIF :: Image type '" << source->getImageType() << "' requested" << endl;
     }
-#endif
-    else throw string( "Unsupported image type: " + imtype );
+
+    lock.unlock();
 
     /* Disable module loading for now!
     else{
@@ -190,7 +206,7 @@ void FIF::run( Session* session, const string& src ){
 	}
 	else{
 	  // Construct our dynamic loading image decoder 
-	  session->image = new DSOImage( test );
+	  session->image = new DSOImage( *source );
 	  (*session->image)->Load( (*mod_it).second );
 
 	  if( session->loglevel >= 2 ){
@@ -207,9 +223,43 @@ void FIF::run( Session* session, const string& src ){
     */
 
 
-    // Open image, update timestamp and add it to our cache
+    // Open image and update timestamp
     (*session->image)->openImage();
-    (*session->imageCache)[argument] = *(*session->image);
+
+
+    // Watch the files of newly opened images so that they can be dropped from our caches
+    // as soon as they change. If this fails, we fall back to checking modification times
+    bool verify = false;
+    if( opened && session->watcher ){
+      list<int> hlist = (*session->image)->getHorizontalViewsList();
+      list<int> vlist = (*session->image)->getVerticalViewsList();
+      bool watching = true;
+      for( list<int>::iterator h = hlist.begin(); watching && h != hlist.end(); h++ ){
+	for( list<int>::iterator v = vlist.begin(); watching && v != vlist.end(); v++ ){
+	  watching = session->watcher->watch( (*session->image)->getFileName( *h, *v ), argument );
+	}
+      }
+      if( !watching && session->loglevel >= 1 ){
+	*(session->logfile) << "FIF :: Unable to watch image files for changes" << endl;
+      }
+      verify = watching;
+    }
+
+
+    // Add newly opened images to our cache, and update cached ones only if their metadata
+    // has been revalidated or reloaded. Stop watching any images evicted to make room
+    if( opened || (*session->image)->timestamp != timestamp || (*session->image)->validated != validated ){
+      vector<string> evicted;
+      ScopedLock insertion( session->imageCache->getMutex() );
+      session->imageCache->insert( argument, **session->image, &evicted );
+      for( unsigned int i=0; session->watcher && i<evicted.size(); i++ ) session->watcher->unwatch( evicted[i] );
+    }
+
+    // Make sure the file did not change between our reading it and watching it
+    if( verify ){
+      IIPImage* image = *session->image;
+      session->watcher->verify( image->getFileName( image->currentX, image->currentY ), argument, image->timestamp );
+    }
 
 
     if( session->loglevel >= 3 ){
@@ -225,14 +275,13 @@ void FIF::run( Session* session, const string& src ){
 			  << " x " << (*session->image)->getImageHeight() << endl
 			  << "FIF :: Image contains " << (*session->image)->channels
 			  << " channels with " << (*session->image)->bpp << " bits per pixel" << endl;
-      tm *t = gmtime( &(*session->image)->timestamp );
-      char strt[64];
-      strftime( strt, 64, "%a, %d %b %Y %H:%M:%S GMT", t );
-      *(session->logfile) << "FIF :: Image timestamp: " << strt << endl;
+      *(session->logfile) << "FIF :: Image timestamp: " << (*session->image)->getTimestamp() << endl;
     }
 
   }
   catch( const string& error ){
+    // Remember images which do not exist
+    if( remember ) session->negativeCache->insert( argument, error );
     // Unavailable file error code is 1 3
     session->response->setError( "1 3", "FIF" );
     throw error;
@@ -271,6 +320,39 @@ void FIF::run( Session* session, const string& src ){
   session->view->yangle = 90;
 
 
+  // Load the JPEG tiles of the lowest resolutions of a newly opened image into the pinned
+  // part of the tile cache, so that the first requests from a viewer are cache hits
+  unsigned int levels = session->tileCache->getPinnedLevels();
+  if( opened && levels > 0 && (*session->image)->getNumBitsPerPixel() <= 8 &&
+      (*session->image)->getColourSpace() != CIELAB ){
+
+    if( session->prefetcher ){
+      session->prefetcher->preload( **session->image, levels, session->view->xangle, session->view->yangle,
+				    session->view->getLayers(), JPEG, session->jpeg->getQuality() );
+      if( session->loglevel >= 3 ){
+	*(session->logfile) << "FIF :: Queued the lowest " << levels << " resolutions for pinning" << endl;
+      }
+    }
+    else{
+      Timer function_timer;
+      if( session->loglevel >= 2 ) function_timer.start();
+      try{
+	TileManager tilemanager( session->tileCache, *session->image, session->watermark, session->jpeg,
+				 session->logfile, session->loglevel );
+	unsigned int n = tilemanager.preload( levels, session->view->xangle, session->view->yangle,
+					      session->view->getLayers(), JPEG );
+	if( session->loglevel >= 2 ){
+	  *(session->logfile) << "FIF :: Pinned " << n << " tiles in " << function_timer.getTime() << " microseconds" << endl;
+	}
+      }
+      catch( const string& error ){
+	// The image itself has been opened successfully, so just report this
+	if( session->loglevel >= 1 ) *(session->logfile) << "FIF :: Unable to pin tiles: " << error << endl;
+      }
+    }
+  }
+
+
   if( session->loglevel >= 2 ){
     *(session->logfile)	<< "FIF :: Total command time " << command_timer.getTime() << " microseconds" << endl;
   }
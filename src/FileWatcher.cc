@@ -0,0 +1,284 @@
+/*
+    IIPImage Server - Member functions for FileWatcher.h
+
+    Copyright (C) 2014 Ruven Pillay.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#include "FileWatcher.h"
+#include <sstream>
+#include <sys/stat.h>
+
+#ifdef HAVE_SYS_INOTIFY_H
+#include <unistd.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#endif
+
+
+using namespace std;
+
+
+#ifdef HAVE_SYS_INOTIFY_H
+
+// Events on files within a watched directory and on the directory itself which invalidate an image
+#define WATCH_EVENTS ( IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_MOVED_FROM | IN_MOVED_TO | \
+		       IN_CREATE | IN_DELETE | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR )
+
+
+// Return the directory holding a file
+static string directory( const string& file ){
+  size_t n = file.find_last_of( '/' );
+  if( n == string::npos ) return ".";
+  if( n == 0 ) return "/";
+  return file.substr( 0, n );
+}
+
+#endif
+
+
+
+FileWatcher::~FileWatcher(){
+  ScopedLock lock( mutex );
+  this->_close();
+}
+
+
+
+bool FileWatcher::open(){
+#ifdef HAVE_SYS_INOTIFY_H
+  ScopedLock lock( mutex );
+  if( fd < 0 ) fd = inotify_init1( IN_NONBLOCK | IN_CLOEXEC );
+#endif
+  return fd >= 0;
+}
+
+
+
+void FileWatcher::_close(){
+#ifdef HAVE_SYS_INOTIFY_H
+  if( fd >= 0 ) ::close( fd );
+#endif
+  fd = -1;
+  directories.clear();
+  watches.clear();
+  files.clear();
+  images.clear();
+  pending.clear();
+  verified.set( 0 );
+}
+
+
+
+bool FileWatcher::watch( const string& file, const string& image ){
+
+  ScopedLock lock( mutex );
+  if( fd < 0 ) return false;
+
+#ifdef HAVE_SYS_INOTIFY_H
+
+  map< string, set<string> >::iterator f = files.find( file );
+  if( f != files.end() ){
+    f->second.insert( image );
+    images[image].insert( file );
+    return true;
+  }
+
+  string dir = directory( file );
+
+  map<string,int>::iterator w = watches.find( dir );
+  if( w == watches.end() ){
+    int wd = inotify_add_watch( fd, dir.c_str(), WATCH_EVENTS );
+    // The same directory reached through another path would have its events
+    // reported under the wrong path, so treat this as a failure too
+    if( wd < 0 || directories.find( wd ) != directories.end() ){
+      this->_close();
+      return false;
+    }
+    Directory d;
+    d.path = dir;
+    d.files = 0;
+    directories[wd] = d;
+    w = watches.insert( make_pair( dir, wd ) ).first;
+  }
+
+  directories[w->second].files++;
+  files[file].insert( image );
+  images[image].insert( file );
+  return true;
+
+#else
+  return false;
+#endif
+}
+
+
+
+void FileWatcher::verify( const string& file, const string& image, time_t mtime ){
+  struct stat sb;
+  if( stat( file.c_str(), &sb ) == 0 && sb.st_mtime == mtime ) return;
+  ScopedLock lock( mutex );
+  if( fd >= 0 ){
+    pending.insert( image );
+    verified.set( 1 );
+  }
+}
+
+
+
+void FileWatcher::forget( const string& file ){
+
+#ifdef HAVE_SYS_INOTIFY_H
+
+  map< string, set<string> >::iterator f = files.find( file );
+  if( f == files.end() ) return;
+
+  for( set<string>::iterator i = f->second.begin(); i != f->second.end(); i++ ){
+    map< string, set<string> >::iterator im = images.find( *i );
+    if( im == images.end() ) continue;
+    im->second.erase( file );
+    if( im->second.empty() ) images.erase( im );
+  }
+  files.erase( f );
+
+  // Stop watching directories which no longer hold any files of interest
+  map<string,int>::iterator w = watches.find( directory( file ) );
+  if( w != watches.end() && --directories[w->second].files == 0 ){
+    inotify_rm_watch( fd, w->second );
+    directories.erase( w->second );
+    watches.erase( w );
+  }
+
+#endif
+}
+
+
+
+void FileWatcher::unwatch( const string& image ){
+  ScopedLock lock( mutex );
+  map< string, set<string> >::iterator im = images.find( image );
+  if( im == images.end() ) return;
+  set<string> paths = im->second;
+  for( set<string>::iterator i = paths.begin(); i != paths.end(); i++ ) this->forget( *i );
+}
+
+
+
+void FileWatcher::changed( const string& image, set<string>& changedFiles, set<string>& changedImages ){
+  changedImages.insert( image );
+  map< string, set<string> >::iterator im = images.find( image );
+  if( im == images.end() ) return;
+  set<string> paths = im->second;
+  for( set<string>::iterator i = paths.begin(); i != paths.end(); i++ ){
+    changedFiles.insert( *i );
+    this->forget( *i );
+  }
+}
+
+
+
+bool FileWatcher::changes( set<string>& changedFiles, set<string>& changedImages ){
+
+  ScopedLock lock( mutex );
+  if( fd < 0 ) return false;
+
+  unsigned int before = changedImages.size();
+
+  for( set<string>::iterator i = pending.begin(); i != pending.end(); i++ ){
+    this->changed( *i, changedFiles, changedImages );
+  }
+  pending.clear();
+  verified.set( 0 );
+
+#ifdef HAVE_SYS_INOTIFY_H
+
+  char buffer[4096] __attribute__ (( aligned( __alignof__( struct inotify_event ) ) ));
+  ssize_t length;
+
+  while( ( length = read( fd, buffer, sizeof(buffer) ) ) > 0 ){
+
+    for( char *p = buffer; p < buffer + length; p += sizeof(struct inotify_event) + ((struct inotify_event*) p)->len ){
+
+      const struct inotify_event *event = (const struct inotify_event*) p;
+      numEvents++;
+
+      // Events have been lost, so we can no longer tell what has changed
+      if( event->mask & IN_Q_OVERFLOW ){
+	while( !images.empty() ) this->changed( images.begin()->first, changedFiles, changedImages );
+	continue;
+      }
+
+      map<int,Directory>::iterator d = directories.find( event->wd );
+      if( d == directories.end() ) continue;
+      string dir = d->second.path;
+
+      // The directory itself has gone, so everything within it has changed
+      if( event->mask & ( IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED | IN_UNMOUNT ) ){
+	set<string> affected;
+	for( map< string, set<string> >::iterator f = files.begin(); f != files.end(); f++ ){
+	  if( directory( f->first ) == dir ) affected.insert( f->second.begin(), f->second.end() );
+	}
+	for( set<string>::iterator i = affected.begin(); i != affected.end(); i++ ){
+	  this->changed( *i, changedFiles, changedImages );
+	}
+	continue;
+      }
+
+      if( event->len == 0 ) continue;
+
+      string file = ( dir == "." ) ? string( event->name ) : ( dir == "/" ? dir : dir + "/" ) + event->name;
+      map< string, set<string> >::iterator f = files.find( file );
+      if( f == files.end() ) continue;
+
+      set<string> affected = f->second;
+      for( set<string>::iterator i = affected.begin(); i != affected.end(); i++ ){
+	this->changed( *i, changedFiles, changedImages );
+      }
+    }
+  }
+
+#endif
+
+  numChanged += changedImages.size() - before;
+  return changedImages.size() > before;
+}
+
+
+
+bool FileWatcher::ready(){
+  if( verified.get() ) return true;
+#ifdef HAVE_SYS_INOTIFY_H
+  struct pollfd p;
+  p.fd = fd;
+  p.events = POLLIN;
+  p.revents = 0;
+  // A descriptor closed in the meantime is also reported, as POLLNVAL
+  return p.fd < 0 || poll( &p, 1, 0 ) > 0;
+#else
+  return true;
+#endif
+}
+
+
+
+string FileWatcher::getStatistics(){
+  ScopedLock lock( mutex );
+  ostringstream s;
+  s << files.size() << " files of " << images.size() << " images in " << directories.size()
+    << " directories watched, " << numEvents << " events, " << numChanged << " images changed";
+  return s.str();
+}
@@ -0,0 +1,164 @@
+// Image File Watcher
+
+/*  IIP Image Server
+
+    Copyright (C) 2014 Ruven Pillay.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#ifndef _FILEWATCHER_H
+#define _FILEWATCHER_H
+
+
+#include <string>
+#include <map>
+#include <set>
+#include <ctime>
+#include "Mutex.h"
+
+
+
+/// Tells us when the files of cached images are modified, moved or deleted
+/** The directories holding the files of each cached image are watched with inotify,
+    so that everything held for an image can be dropped as soon as one of its files
+    changes rather than checking the modification time of the file on every request.
+
+    Events are queued by the kernel and collected without blocking with changes(),
+    which is called before each request is handled. If the kernel's queue overflows,
+    every watched image is reported as changed. Watching is only available on Linux.
+    If a directory cannot be watched, for instance because the limit on the number of
+    watches has been reached, the watcher closes itself and callers should fall back
+    to checking modification times.
+ */
+
+class FileWatcher {
+
+ private:
+
+  /// A watched directory
+  struct Directory {
+    std::string path;
+    unsigned int files;
+  };
+
+  /// inotify descriptor or -1 if we are not watching
+  int fd;
+
+  /// Watched directories indexed by watch descriptor
+  std::map<int,Directory> directories;
+
+  /// Watch descriptors indexed by directory path
+  std::map<std::string,int> watches;
+
+  /// Image names indexed by the path of each of their files
+  std::map< std::string, std::set<std::string> > files;
+
+  /// File paths indexed by image name
+  std::map< std::string, std::set<std::string> > images;
+
+  /// Images found to have changed other than through an event, to be reported by changes()
+  std::set<std::string> pending;
+
+  /// Whether there are pending images, readable without the lock
+  Atomic verified;
+
+  /// Lock protecting all of the above
+  Mutex mutex;
+
+  /// Statistics
+  unsigned long numEvents, numChanged;
+
+  /// Stop watching a file
+  /** Must be called with the lock held
+      @param file file path
+   */
+  void forget( const std::string& file );
+
+  /// Report an image as changed and stop watching its files
+  /** Must be called with the lock held
+      @param image image name
+      @param changedFiles set to which the paths of the image's files are added
+      @param changedImages set to which the image is added
+   */
+  void changed( const std::string& image, std::set<std::string>& changedFiles,
+		std::set<std::string>& changedImages );
+
+  /// Stop watching everything
+  /** Must be called with the lock held */
+  void _close();
+
+  /// Watchers cannot be copied
+  FileWatcher( const FileWatcher& );
+  FileWatcher& operator = ( const FileWatcher& );
+
+
+ public:
+
+  /// Constructor
+  FileWatcher() : fd( -1 ), numEvents( 0 ), numChanged( 0 ) {};
+
+  /// Destructor
+  ~FileWatcher();
+
+  /// Start watching
+  /** @return true on success, false if watching is unavailable */
+  bool open();
+
+  /// Indicate whether we are watching
+  bool active() const { return fd >= 0; };
+
+  /// Watch a file of an image
+  /** @param file full file path
+      @param image image name under which the image is cached
+      @return true on success. On failure the watcher is closed
+   */
+  bool watch( const std::string& file, const std::string& image );
+
+  /// Check that a file which has just been watched is still the one which was read
+  /** A file replaced after it was read but before it was watched raises no event, so
+      the image is instead reported as changed by the next call to changes() if the
+      file's modification time no longer matches
+      @param file full file path
+      @param image image name under which the image is cached
+      @param mtime modification time of the file when it was read
+   */
+  void verify( const std::string& file, const std::string& image, time_t mtime );
+
+  /// Stop watching the files of an image which is no longer cached
+  /** @param image image name */
+  void unwatch( const std::string& image );
+
+  /// Collect the images which have changed since we were last called
+  /** Changed images are no longer watched until watch() is called for them again
+      @param changedFiles set to which the paths of all files of changed images are added
+      @param changedImages set to which the names of changed images are added
+      @return true if anything has changed
+   */
+  bool changes( std::set<std::string>& changedFiles, std::set<std::string>& changedImages );
+
+  /// Indicate without taking the lock or reading any events whether changes() may have anything to report
+  /** Also true if the watcher has been closed, so that callers notice */
+  bool ready();
+
+  /// Return a summary of the watcher statistics
+  std::string getStatistics();
+
+};
+
+
+
+#endif
@@ -0,0 +1,296 @@
+/*
+    IIPImage Server - HTTP load generator
+
+    Requests random tiles of an image over persistent HTTP/1.1 connections, while
+    a number of other connections repeatedly export the whole image with CVT, and
+    reports the throughput and latency percentiles of each. Used by httpbench.sh to
+    compare the embedded HTTP server with iipsrv behind a web server over FastCGI.
+
+    Build with "make httpbench" and run as:
+
+      httpbench host:port image [connections] [exports] [seconds]
+
+    The defaults are 16 tile connections, 2 export connections and 20 seconds.
+    Only available where the embedded HTTP server is.
+
+    Copyright (C) 2014 Ruven Pillay.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#include "Thread.h"
+#include "Timer.h"
+#include "Mutex.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cctype>
+#include <string>
+#include <vector>
+#include <sstream>
+#include <algorithm>
+
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+
+using namespace std;
+
+
+// Path under which iipsrv is reached
+#define BENCH_PATH "/fcgi-bin/iipsrv.fcgi?FIF="
+
+
+
+/// A persistent connection to the server
+class Connection {
+
+ private:
+
+  std::string host, port;
+  int fd;
+  std::string input;
+
+  /// Read more input, returning false if the connection has closed
+  bool fill() {
+    char buffer[65536];
+    ssize_t n = ::recv( fd, buffer, sizeof(buffer), 0 );
+    if( n <= 0 ) return false;
+    input.append( buffer, n );
+    return true;
+  };
+
+  void close() {
+    if( fd >= 0 ) ::close( fd );
+    fd = -1;
+    input.clear();
+  };
+
+  bool open() {
+    struct addrinfo hints, *addresses;
+    memset( &hints, 0, sizeof(hints) );
+    hints.ai_socktype = SOCK_STREAM;
+    if( getaddrinfo( host.c_str(), port.c_str(), &hints, &addresses ) ) return false;
+    for( struct addrinfo* a = addresses; a && fd < 0; a = a->ai_next ){
+      fd = socket( a->ai_family, a->ai_socktype, a->ai_protocol );
+      if( fd >= 0 && connect( fd, a->ai_addr, a->ai_addrlen ) ) this->close();
+    }
+    freeaddrinfo( addresses );
+    int one = 1;
+    if( fd >= 0 ) setsockopt( fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one) );
+    return fd >= 0;
+  };
+
+ public:
+
+  Connection( const std::string& h, const std::string& p ) : host( h ), port( p ), fd( -1 ) {};
+  ~Connection() { this->close(); };
+
+  /// Make a request and read its response
+  /** @param target request target
+      @param body set to the response body
+      @return true if the response had a 200 status
+   */
+  bool get( const std::string& target, std::string& body ) {
+
+    body.clear();
+    if( fd < 0 && !this->open() ) return false;
+
+    string request = "GET " + target + " HTTP/1.1\r\nHost: " + host + "\r\n\r\n";
+    if( ::send( fd, request.data(), request.length(), MSG_NOSIGNAL ) != (ssize_t) request.length() ){
+      this->close();
+      return false;
+    }
+
+    size_t end;
+    while( ( end = input.find( "\r\n\r\n" ) ) == string::npos ){
+      if( !this->fill() ){ this->close(); return false; }
+    }
+    string head = input.substr( 0, end + 2 );
+    input.erase( 0, end + 4 );
+    for( size_t i = 0; i < head.length(); i++ ) head[i] = tolower( head[i] );
+    bool ok = ( head.compare( 9, 3, "200" ) == 0 );
+
+    size_t n = head.find( "\r\ncontent-length:" );
+    if( n != string::npos ){
+      size_t length = strtoul( head.c_str() + n + 17, NULL, 10 );
+      while( input.length() < length ){
+	if( !this->fill() ){ this->close(); return false; }
+      }
+      body = input.substr( 0, length );
+      input.erase( 0, length );
+    }
+    else if( head.find( "\r\ntransfer-encoding: chunked" ) != string::npos ){
+      while( true ){
+	while( ( end = input.find( "\r\n" ) ) == string::npos ){
+	  if( !this->fill() ){ this->close(); return false; }
+	}
+	size_t length = strtoul( input.c_str(), NULL, 16 );
+	while( input.length() < end + 2 + length + 2 ){
+	  if( !this->fill() ){ this->close(); return false; }
+	}
+	body.append( input, end + 2, length );
+	input.erase( 0, end + 2 + length + 2 );
+	if( length == 0 ) break;
+      }
+    }
+    else{
+      while( this->fill() );
+      body = input;
+      this->close();
+    }
+
+    if( head.find( "\r\nconnection: close" ) != string::npos ) this->close();
+    return ok;
+  };
+
+};
+
+
+
+/// Shared settings and results of all connections
+struct Bench {
+  string host, port, image;
+  vector<int> tiles;
+  unsigned int seconds;
+  Mutex mutex;
+  vector<long> tileTimes, exportTimes;
+  unsigned long errors;
+};
+
+/// The work of a single connection
+struct Client {
+  Bench* bench;
+  bool exporting;
+  unsigned int seed;
+};
+
+
+
+// Request tiles or exports until our time is up
+static void run( void* c ){
+
+  Client* client = (Client*) c;
+  Bench* bench = client->bench;
+  Connection connection( bench->host, bench->port );
+  vector<long> times;
+  unsigned long errors = 0;
+  string body;
+
+  Timer elapsed;
+  elapsed.start();
+
+  while( elapsed.getTime() < (long) bench->seconds * 1000000 ){
+
+    ostringstream target;
+    target << BENCH_PATH << bench->image;
+    if( client->exporting ) target << "&WID=4000&CVT=jpeg";
+    else{
+      client->seed = client->seed * 1103515245 + 12345;
+      unsigned int r = ( client->seed >> 8 ) % bench->tiles.size();
+      client->seed = client->seed * 1103515245 + 12345;
+      target << "&JTL=" << r << "," << ( client->seed >> 8 ) % bench->tiles[r];
+    }
+
+    Timer timer;
+    timer.start();
+    if( connection.get( target.str(), body ) ) times.push_back( timer.getTime() );
+    else errors++;
+  }
+
+  ScopedLock lock( bench->mutex );
+  vector<long>& all = client->exporting ? bench->exportTimes : bench->tileTimes;
+  all.insert( all.end(), times.begin(), times.end() );
+  bench->errors += errors;
+}
+
+
+
+// Print the throughput and latency percentiles of a set of requests
+static void report( const char* name, vector<long>& times, unsigned int seconds ){
+  if( times.empty() ){
+    printf( "%-8s no successful requests\n", name );
+    return;
+  }
+  sort( times.begin(), times.end() );
+  size_t n = times.size();
+  printf( "%-8s %8lu requests  %8.1f/s  p50 %7.2fms  p90 %7.2fms  p99 %7.2fms  max %7.2fms\n",
+	  name, (unsigned long) n, (double) n / seconds, times[n/2] / 1000.0, times[n*9/10] / 1000.0,
+	  times[n*99/100] / 1000.0, times[n-1] / 1000.0 );
+}
+
+
+
+int main( int argc, char *argv[] ){
+
+  if( argc < 3 ){
+    fprintf( stderr, "Usage: httpbench host:port image [connections] [exports] [seconds]\n" );
+    return 1;
+  }
+
+  Bench bench;
+  string address( argv[1] );
+  size_t colon = address.rfind( ':' );
+  bench.host = ( colon == string::npos ) ? "localhost" : address.substr( 0, colon );
+  bench.port = ( colon == string::npos ) ? address : address.substr( colon + 1 );
+  bench.image = argv[2];
+  unsigned int connections = ( argc > 3 ) ? atoi( argv[3] ) : 16;
+  unsigned int exports = ( argc > 4 ) ? atoi( argv[4] ) : 2;
+  bench.seconds = ( argc > 5 ) ? atoi( argv[5] ) : 20;
+  bench.errors = 0;
+
+  // Find the number of tiles at each resolution of our image
+  Connection connection( bench.host, bench.port );
+  string info;
+  if( !connection.get( string( BENCH_PATH ) + bench.image + "&OBJ=Max-size&OBJ=Tile-size&OBJ=Resolution-number", info ) ){
+    fprintf( stderr, "httpbench: unable to get the size of %s from %s\n", bench.image.c_str(), address.c_str() );
+    return 1;
+  }
+  unsigned int width = 0, height = 0, tw = 0, th = 0, levels = 0;
+  size_t n;
+  if( ( n = info.find( "Max-size:" ) ) != string::npos ) sscanf( info.c_str() + n + 9, "%u %u", &width, &height );
+  if( ( n = info.find( "Tile-size:" ) ) != string::npos ) sscanf( info.c_str() + n + 10, "%u %u", &tw, &th );
+  if( ( n = info.find( "Resolution-number:" ) ) != string::npos ) sscanf( info.c_str() + n + 18, "%u", &levels );
+  if( !width || !height || !tw || !th || !levels ){
+    fprintf( stderr, "httpbench: unable to parse the size of %s\n", bench.image.c_str() );
+    return 1;
+  }
+  for( unsigned int r = 0; r < levels; r++ ){
+    unsigned int w = width >> ( levels - 1 - r ), h = height >> ( levels - 1 - r );
+    bench.tiles.push_back( std::max( 1u, ( ( w + tw - 1 ) / tw ) * ( ( h + th - 1 ) / th ) ) );
+  }
+
+  vector<Client> clients( connections + exports );
+  vector<Thread*> threads;
+  for( unsigned int i = 0; i < clients.size(); i++ ){
+    clients[i].bench = &bench;
+    clients[i].exporting = ( i >= connections );
+    clients[i].seed = i + 1;
+    threads.push_back( new Thread() );
+    threads.back()->start( run, &clients[i] );
+  }
+  for( unsigned int i = 0; i < threads.size(); i++ ) delete threads[i];
+
+  report( "tiles", bench.tileTimes, bench.seconds );
+  report( "exports", bench.exportTimes, bench.seconds );
+  printf( "%lu failed requests\n", bench.errors );
+
+  return 0;
+}
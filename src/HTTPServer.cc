@@ -0,0 +1,670 @@
+/*
+    IIPImage Server - Member functions for HTTPServer.h
+
+    Copyright (C) 2014 Ruven Pillay.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#include "HTTPServer.h"
+#include <sstream>
+#include <cstdlib>
+#include <cctype>
+#include <set>
+
+#ifdef HAVE_SYS_EPOLL_H
+#include <unistd.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <errno.h>
+#include <sys/epoll.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#endif
+
+
+using namespace std;
+
+
+// Limit on the size of a request head
+#define MAX_HEAD 32768
+
+// Number of bytes read from a connection at a time
+#define READ_SIZE 16384
+
+// Output beyond which we stop answering pipelined requests until it has been sent,
+// and beyond which a response being streamed waits for the client
+#define MAX_OUTPUT 262144
+
+// Seconds after which idle connections are closed
+#define IDLE_TIMEOUT 15
+
+
+
+// Compare two strings ignoring case
+static bool iequals( const string& a, const char* b ){
+  if( a.length() != strlen( b ) ) return false;
+  for( size_t i = 0; i < a.length(); i++ ){
+    if( tolower( (unsigned char) a[i] ) != tolower( (unsigned char) b[i] ) ) return false;
+  }
+  return true;
+}
+
+
+// Strip surrounding white space from a string
+static string trim( const string& s ){
+  size_t first = s.find_first_not_of( " \t\r" );
+  if( first == string::npos ) return "";
+  size_t last = s.find_last_not_of( " \t\r" );
+  return s.substr( first, last - first + 1 );
+}
+
+
+// Check whether a comma separated header value contains a token
+static bool hasToken( const string& value, const char* token ){
+  size_t start = 0;
+  while( start <= value.length() ){
+    size_t end = value.find( ',', start );
+    if( end == string::npos ) end = value.length();
+    if( iequals( trim( value.substr( start, end - start ) ), token ) ) return true;
+    start = end + 1;
+  }
+  return false;
+}
+
+
+// Map a request target onto an iipsrv query
+static string toQuery( const string& target ){
+  if( target.compare( 0, 6, "/iiif/" ) == 0 ) return "IIIF=" + target.substr( 6 );
+  if( target.compare( 0, 10, "/deepzoom/" ) == 0 ) return "DeepZoom=" + target.substr( 10 );
+  if( target.compare( 0, 9, "/zoomify/" ) == 0 ) return "Zoomify=" + target.substr( 9 );
+  size_t n = target.find( '?' );
+  return ( n == string::npos ) ? "" : target.substr( n + 1 );
+}
+
+
+// Return the reason phrase of the statuses with which we reject requests
+static const char* reason( int status ){
+  switch( status ){
+    case 400: return "Bad Request";
+    case 405: return "Method Not Allowed";
+    case 413: return "Payload Too Large";
+    case 431: return "Request Header Fields Too Large";
+    case 501: return "Not Implemented";
+    case 505: return "HTTP Version Not Supported";
+    default: return "Error";
+  }
+}
+
+
+// Format the current time for a Date header
+static string date(){
+  char str[64];
+  time_t now = time( NULL );
+  struct tm t;
+#ifdef WIN32
+  gmtime_s( &t, &now );
+#else
+  gmtime_r( &now, &t );
+#endif
+  strftime( str, sizeof(str), "%a, %d %b %Y %H:%M:%S GMT", &t );
+  return str;
+}
+
+
+
+bool HTTPWriter::head( bool complete ){
+
+  // Split our output into its CGI headers and body
+  size_t n = buffer.find( "\r\n\r\n" ), start = n + 4;
+  if( n == string::npos ){
+    n = buffer.find( "\n\n" );
+    start = n + 2;
+  }
+  if( n == string::npos ){
+    if( !complete ) return false;
+    n = start = 0;
+  }
+
+  string status, headers;
+  bool length = false, chunked = false, location = false;
+
+  size_t i = 0;
+  while( i < n ){
+    size_t end = buffer.find( '\n', i );
+    if( end == string::npos || end > n ) end = n;
+    string line = trim( buffer.substr( i, end - i ) );
+    i = end + 1;
+    size_t colon = line.find( ':' );
+    if( colon == string::npos ) continue;
+    string name = line.substr( 0, colon );
+    string value = trim( line.substr( colon + 1 ) );
+    if( iequals( name, "Status" ) ){ status = value; continue; }
+    if( iequals( name, "Connection" ) ) continue;
+    if( iequals( name, "Content-Length" ) ) length = true;
+    else if( iequals( name, "Transfer-Encoding" ) && hasToken( value, "chunked" ) ) chunked = true;
+    else if( iequals( name, "Location" ) ) location = true;
+    headers += line + "\r\n";
+  }
+
+  if( status.empty() ) status = location ? "302 Found" : "200 OK";
+  int code = atoi( status.c_str() );
+  bool empty = ( code < 200 || code == 204 || code == 304 );
+  body = ( request.method != "HEAD" && !empty );
+
+  string& out = connection.output;
+  out += "HTTP/1.1 " + status + "\r\nDate: " + date() + "\r\n" + headers;
+
+  // Delimit our body by its length if we have all of it, otherwise chunk it where we can
+  bool delimited = length || chunked || empty;
+  if( !delimited && complete ){
+    ostringstream s;
+    s << "Content-Length: " << ( buffer.length() - start ) << "\r\n";
+    out += s.str();
+    delimited = true;
+  }
+  else if( !delimited && request.version == 1 ){
+    out += "Transfer-Encoding: chunked\r\n";
+    chunking = delimited = true;
+  }
+
+  // Chunked output cannot be understood by HTTP/1.0 clients, so it is delimited by closing instead
+  if( !request.keepAlive || !delimited || ( chunked && request.version == 0 ) ){
+    out += "Connection: close\r\n";
+    connection.closing = true;
+  }
+  else if( request.version == 0 ) out += "Connection: keep-alive\r\n";
+  out += "\r\n";
+
+  buffer.erase( 0, start );
+  started = true;
+  return true;
+}
+
+
+
+void HTTPWriter::write( const char* msg, size_t len ){
+
+  if( failed || finished ) return;
+
+  // Output following a flush, or more than we want to hold, is streamed
+  if( !started && flushed ) this->head( false );
+  buffer.append( msg, len );
+  if( !started && buffer.length() >= MAX_OUTPUT ) this->head( false );
+  if( started && buffer.length() >= MAX_OUTPUT ) this->send();
+}
+
+
+
+int HTTPWriter::flush(){
+  if( failed ) return -1;
+  flushed = true;
+  if( started && !finished && !this->send() ) return -1;
+  return 0;
+}
+
+
+
+bool HTTPWriter::send(){
+
+  if( body && buffer.length() ){
+    if( chunking ){
+      ostringstream s;
+      s << hex << uppercase << buffer.length() << "\r\n";
+      connection.output += s.str();
+    }
+    connection.output += buffer;
+    if( chunking ) connection.output += "\r\n";
+  }
+  buffer.clear();
+
+#ifdef HAVE_SYS_EPOLL_H
+  // Send what we can, only waiting for the client while it has too much left to take
+  while( true ){
+    if( !HTTPServer::send( connection ) ) break;
+    connection.output.erase( 0, connection.sent );
+    connection.sent = 0;
+    if( connection.output.length() < MAX_OUTPUT ) return true;
+    struct pollfd p;
+    p.fd = connection.fd;
+    p.events = POLLOUT;
+    int n = poll( &p, 1, IDLE_TIMEOUT * 1000 );
+    if( n == 0 || ( n < 0 && errno != EINTR ) ) break;
+  }
+#endif
+
+  // Give up on a client which has gone or stopped reading
+  failed = true;
+  connection.closing = true;
+  connection.output.clear();
+  connection.sent = 0;
+  return false;
+}
+
+
+
+void HTTPWriter::finish(){
+
+  if( finished ) return;
+
+  if( !started ){
+    this->head( true );
+    if( !body ) buffer.clear();
+    connection.output += buffer;
+    buffer.clear();
+  }
+  else if( !failed ){
+    this->send();
+    if( chunking && body && !failed ) connection.output += "0\r\n\r\n";
+  }
+
+  finished = true;
+  HTTPServer::send( connection );
+}
+
+
+
+HTTPServer::~HTTPServer(){
+#ifdef HAVE_SYS_EPOLL_H
+  for( set<HTTPConnection*>::iterator c = connections.begin(); c != connections.end(); c++ ){
+    ::close( (*c)->fd );
+    delete *c;
+  }
+  if( ep >= 0 ) ::close( ep );
+  if( listener >= 0 ) ::close( listener );
+  if( wake[0] >= 0 ) ::close( wake[0] );
+  if( wake[1] >= 0 ) ::close( wake[1] );
+#endif
+}
+
+
+
+void HTTPServer::open() throw(string){
+
+#ifdef HAVE_SYS_EPOLL_H
+
+  // Split our address into a host and port, either of which may be left out
+  string host, port = address;
+  size_t n = address.rfind( ':' );
+  if( n != string::npos ){
+    host = address.substr( 0, n );
+    port = address.substr( n + 1 );
+  }
+  if( host.length() > 1 && host[0] == '[' && host[host.length()-1] == ']' ) host = host.substr( 1, host.length() - 2 );
+  if( host == "*" ) host = "";
+
+  struct addrinfo hints, *addresses;
+  memset( &hints, 0, sizeof(hints) );
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_PASSIVE;
+  int status = getaddrinfo( host.length() ? host.c_str() : NULL, port.c_str(), &hints, &addresses );
+  if( status ) throw string( "HTTP server :: unable to resolve " ) + address + ": " + gai_strerror( status );
+
+  int error = 0;
+  for( struct addrinfo* a = addresses; a && listener < 0; a = a->ai_next ){
+    int fd = socket( a->ai_family, a->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, a->ai_protocol );
+    if( fd < 0 ){ error = errno; continue; }
+    int one = 1;
+    setsockopt( fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one) );
+    if( bind( fd, a->ai_addr, a->ai_addrlen ) || listen( fd, SOMAXCONN ) ){
+      error = errno;
+      ::close( fd );
+      continue;
+    }
+    listener = fd;
+  }
+  freeaddrinfo( addresses );
+
+  if( listener < 0 ) throw string( "HTTP server :: unable to listen on " ) + address + ": " + strerror( error );
+
+  if( pipe2( wake, O_NONBLOCK | O_CLOEXEC ) ){
+    throw string( "HTTP server :: unable to create pipe: " ) + strerror( errno );
+  }
+
+  // Our listening socket and pipe are told apart from connections by their event data.
+  // Our pipe is watched continuously, so that every event loop sees it once written to
+  ep = epoll_create1( EPOLL_CLOEXEC );
+  struct epoll_event event;
+  memset( &event, 0, sizeof(event) );
+  event.events = EPOLLIN;
+  event.data.ptr = wake;
+  if( ep < 0 || epoll_ctl( ep, EPOLL_CTL_ADD, wake[0], &event ) || !this->arm( listener, &listener, EPOLLIN, true ) ){
+    throw string( "HTTP server :: unable to create event loop: " ) + strerror( errno );
+  }
+
+#else
+  throw string( "HTTP server :: not available on this platform" );
+#endif
+
+}
+
+
+
+void HTTPServer::stop(){
+#ifdef HAVE_SYS_EPOLL_H
+  // Our pipe is never read, so every event loop sees it as readable from now on
+  char c = 0;
+  if( wake[1] >= 0 && ::write( wake[1], &c, 1 ) < 0 ) return;
+#endif
+}
+
+
+
+bool HTTPServer::send( HTTPConnection& connection ){
+#ifdef HAVE_SYS_EPOLL_H
+  while( connection.sent < connection.output.length() ){
+    ssize_t n = ::send( connection.fd, connection.output.data() + connection.sent,
+			connection.output.length() - connection.sent, MSG_NOSIGNAL );
+    if( n > 0 ) connection.sent += n;
+    else if( n < 0 && errno == EINTR ) continue;
+    else if( n < 0 && ( errno == EAGAIN || errno == EWOULDBLOCK ) ) return true;
+    else return false;
+  }
+  connection.output.clear();
+  connection.sent = 0;
+  return true;
+#else
+  return false;
+#endif
+}
+
+
+
+size_t HTTPServer::parse( HTTPConnection& connection, HTTPRequest& request, int& error ){
+
+  const string& input = connection.input;
+
+  // Ignore any empty lines before the request line
+  size_t start = input.find_first_not_of( "\r\n" );
+  if( start == string::npos ) start = input.length();
+
+  // Find the end of the request head
+  size_t end = string::npos, length = 0;
+  for( size_t n = input.find( '\n', start ); n != string::npos; n = input.find( '\n', n + 1 ) ){
+    if( n + 1 < input.length() && input[n+1] == '\n' ){ end = n; length = n + 2; break; }
+    if( n + 2 < input.length() && input[n+1] == '\r' && input[n+2] == '\n' ){ end = n; length = n + 3; break; }
+  }
+  if( end == string::npos ){
+    if( input.length() - start > MAX_HEAD ) error = 431;
+    return 0;
+  }
+  if( end - start > MAX_HEAD ){
+    error = 431;
+    return length;
+  }
+
+  // Request line
+  size_t n = input.find( '\n', start );
+  string line = trim( input.substr( start, n - start ) );
+  size_t a = line.find( ' ' ), b = line.rfind( ' ' );
+  if( a == string::npos || a == b ){
+    error = 400;
+    return length;
+  }
+  request.method = line.substr( 0, a );
+  request.target = trim( line.substr( a + 1, b - a - 1 ) );
+  string version = line.substr( b + 1 );
+  if( version.compare( 0, 5, "HTTP/" ) != 0 || request.target.empty() ){
+    error = 400;
+    return length;
+  }
+  if( version.compare( 5, string::npos, "1.0" ) == 0 ) request.version = 0;
+  else if( version.compare( 5, string::npos, "1.1" ) == 0 ) request.version = 1;
+  else{
+    error = 505;
+    return length;
+  }
+
+  // Headers
+  string connectionHeader;
+  while( n < end ){
+    size_t next = input.find( '\n', n + 1 );
+    line = input.substr( n + 1, next - n - 1 );
+    n = next;
+    size_t colon = line.find( ':' );
+    if( colon == string::npos || colon == 0 ){
+      error = 400;
+      return length;
+    }
+    string name = line.substr( 0, colon );
+    string value = trim( line.substr( colon + 1 ) );
+    if( iequals( name, "Connection" ) ) connectionHeader += value + ",";
+    else if( iequals( name, "If-Modified-Since" ) ) request.ifModifiedSince = value;
+    else if( iequals( name, "Transfer-Encoding" ) ) error = 501;
+    else if( iequals( name, "Content-Length" ) && atol( value.c_str() ) != 0 ) error = 413;
+  }
+  if( error ) return length;
+
+  if( request.method != "GET" && request.method != "HEAD" ){
+    error = 405;
+    return length;
+  }
+
+  request.keepAlive = ( request.version == 1 ) ? !hasToken( connectionHeader, "close" )
+    : hasToken( connectionHeader, "keep-alive" );
+
+  // Reduce absolute targets to their path
+  string target = request.target;
+  if( target[0] != '/' ){
+    size_t scheme = target.find( "://" );
+    if( scheme == string::npos ){
+      error = 400;
+      return length;
+    }
+    size_t path = target.find( '/', scheme + 3 );
+    target = ( path == string::npos ) ? "/" : target.substr( path );
+  }
+  request.query = toQuery( target );
+
+  return length;
+}
+
+
+
+bool HTTPServer::process( HTTPConnection& connection, HTTPHandler handler, void* data ){
+
+  // Answer pipelined requests in order until we have too much output waiting to be sent
+  while( !connection.closing && connection.output.length() < MAX_OUTPUT ){
+
+    HTTPRequest request;
+    int error = 0;
+    size_t length = this->parse( connection, request, error );
+
+    if( error ){
+      ostringstream response;
+      const char* message = reason( error );
+      response << "HTTP/1.1 " << error << " " << message << "\r\n"
+	       << "Date: " << date() << "\r\n"
+	       << "Content-Type: text/plain\r\n"
+	       << "Content-Length: " << strlen( message ) + 2 << "\r\n";
+      if( error == 405 ) response << "Allow: GET, HEAD\r\n";
+      response << "Connection: close\r\n\r\n" << message << "\r\n";
+      connection.output += response.str();
+      connection.closing = true;
+      ScopedLock lock( mutex );
+      numErrors++;
+      break;
+    }
+
+    if( length == 0 ) break;
+    connection.input.erase( 0, length );
+
+    {
+      ScopedLock lock( mutex );
+      numRequests++;
+    }
+
+    HTTPWriter writer( connection, request );
+    (*handler)( data, request, writer );
+    writer.finish();
+  }
+
+  return HTTPServer::send( connection );
+}
+
+
+
+bool HTTPServer::receive( HTTPConnection& connection, HTTPHandler handler, void* data ){
+#ifdef HAVE_SYS_EPOLL_H
+  char buffer[READ_SIZE];
+  ssize_t n = ::recv( connection.fd, buffer, READ_SIZE, 0 );
+  if( n < 0 ) return ( errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK );
+
+  // Answer whatever complete requests have been sent before the client closed its side
+  if( n == 0 ){
+    if( !this->process( connection, handler, data ) ) return false;
+    connection.closing = true;
+    return true;
+  }
+
+  // Hold off reading more while we have output waiting to be sent
+  connection.input.append( buffer, n );
+  if( connection.output.length() ) return true;
+  return this->process( connection, handler, data );
+#else
+  return false;
+#endif
+}
+
+
+
+bool HTTPServer::arm( int fd, void* ptr, unsigned int events, bool add ){
+#ifdef HAVE_SYS_EPOLL_H
+  struct epoll_event event;
+  memset( &event, 0, sizeof(event) );
+  event.events = events | EPOLLONESHOT;
+  event.data.ptr = ptr;
+  return epoll_ctl( ep, add ? EPOLL_CTL_ADD : EPOLL_CTL_MOD, fd, &event ) == 0;
+#else
+  return false;
+#endif
+}
+
+
+
+void HTTPServer::drop( HTTPConnection* connection ){
+#ifdef HAVE_SYS_EPOLL_H
+  {
+    ScopedLock lock( mutex );
+    connections.erase( connection );
+  }
+  ::close( connection->fd );
+  delete connection;
+#endif
+}
+
+
+
+void HTTPServer::serve( HTTPHandler handler, void* data ){
+
+#ifdef HAVE_SYS_EPOLL_H
+
+  if( ep < 0 ) return;
+
+  while( true ){
+
+    // Take a single event at a time, leaving any others to threads which are not busy.
+    // Each connection, and our listening socket, is disarmed until we have dealt with it
+    struct epoll_event event;
+    int num = epoll_wait( ep, &event, 1, 1000 );
+    if( num < 0 && errno != EINTR ) break;
+    time_t now = time( NULL );
+
+    if( num > 0 && event.data.ptr == wake ) break;
+
+    // Accept a single connection and let the next be accepted by whichever thread is free
+    if( num > 0 && event.data.ptr == &listener ){
+      int fd = accept4( listener, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC );
+      this->arm( listener, &listener, EPOLLIN, false );
+      if( fd >= 0 ){
+	int one = 1;
+	setsockopt( fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one) );
+	HTTPConnection* connection = new HTTPConnection();
+	connection->fd = fd;
+	connection->sent = 0;
+	connection->active = now;
+	connection->busy = false;
+	connection->closing = false;
+	{
+	  ScopedLock lock( mutex );
+	  connections.insert( connection );
+	  numConnections++;
+	}
+	if( !this->arm( fd, connection, EPOLLIN, true ) ) this->drop( connection );
+      }
+    }
+
+    else if( num > 0 ){
+
+      HTTPConnection* connection = (HTTPConnection*) event.data.ptr;
+      {
+	ScopedLock lock( mutex );
+	connection->busy = true;
+      }
+
+      bool ok = true;
+
+      // Once our output has been sent, answer any requests which were held back
+      if( event.events & EPOLLOUT ){
+	ok = HTTPServer::send( *connection );
+	if( ok && connection->output.empty() ) ok = this->process( *connection, handler, data );
+      }
+      else if( event.events & ( EPOLLIN | EPOLLHUP | EPOLLERR ) ){
+	ok = this->receive( *connection, handler, data );
+      }
+
+      if( ok && connection->closing && connection->output.empty() ) ok = false;
+
+      if( ok ){
+	ScopedLock lock( mutex );
+	connection->busy = false;
+	connection->active = time( NULL );
+      }
+
+      // Only wait for a connection to be writable while we have output for it, and stop reading
+      // meanwhile. Once re-armed, the connection may be taken by another thread at any time
+      if( !ok || !this->arm( connection->fd, connection, connection->output.empty() ? EPOLLIN : EPOLLOUT, false ) ){
+	this->drop( connection );
+      }
+    }
+
+    // Shut down connections which have been idle for too long. Whichever thread is woken by
+    // their hanging up then closes them, so that a connection is only ever closed by the
+    // thread which holds it
+    ScopedLock lock( mutex );
+    if( now != checked ){
+      checked = now;
+      for( set<HTTPConnection*>::iterator c = connections.begin(); c != connections.end(); c++ ){
+	if( !(*c)->busy && now - (*c)->active > IDLE_TIMEOUT ) shutdown( (*c)->fd, SHUT_RDWR );
+      }
+    }
+  }
+
+#endif
+
+}
+
+
+
+string HTTPServer::getStatistics(){
+  ScopedLock lock( mutex );
+  ostringstream s;
+  s << numConnections << " connections, " << numRequests << " requests, " << numErrors << " rejected";
+  return s.str();
+}
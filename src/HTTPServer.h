@@ -0,0 +1,263 @@
+// Embedded HTTP/1.1 Server
+
+/*  IIP Image Server
+
+    Copyright (C) 2014 Ruven Pillay.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#ifndef _HTTPSERVER_H
+#define _HTTPSERVER_H
+
+
+#include <string>
+#include <set>
+#include <ctime>
+#include <cstring>
+#include "Writer.h"
+#include "Mutex.h"
+
+
+
+/// A client connection to our HTTP server
+struct HTTPConnection {
+  int fd;
+  std::string input;
+  std::string output;
+  size_t sent;
+  time_t active;
+  bool busy;
+  bool closing;
+};
+
+
+
+/// A parsed HTTP request
+struct HTTPRequest {
+
+  /// Request method and target as sent
+  std::string method, target;
+
+  /// iipsrv query string to which the target maps
+  std::string query;
+
+  /// If-Modified-Since header or empty if not sent
+  std::string ifModifiedSince;
+
+  /// Minor HTTP version, 0 or 1
+  int version;
+
+  /// Whether the connection is kept open after our response
+  bool keepAlive;
+
+};
+
+
+
+/// Writer which turns our CGI style output into an HTTP/1.1 response on a connection
+/** A Status header becomes the status line, defaulting to 200 OK, and Connection
+    headers are added where needed. The body is left out of responses to HEAD requests.
+
+    Responses written in one go, and so completed by finish() without anything being
+    written after a flush(), are sent with a Content-Length. Otherwise, or once more
+    than a limited amount of output is held, the response is streamed as it is flushed:
+    chunked to HTTP/1.1 clients and delimited by closing the connection for HTTP/1.0,
+    unless the handler set its own Content-Length or Transfer-Encoding. While streaming,
+    we wait for a slow client to take our output rather than holding it all.
+ */
+class HTTPWriter : public Writer {
+
+ private:
+
+  /// Connection and request being answered
+  HTTPConnection& connection;
+  const HTTPRequest& request;
+
+  /// Output written and not yet added to our connection
+  std::string buffer;
+
+  /// Whether our response has been completed
+  bool finished;
+
+  /// Whether we have been flushed, whether our headers have been sent and whether
+  /// our body is sent, chunked, or not at all
+  bool flushed, started, chunking, body;
+
+  /// Whether our connection has failed while streaming
+  bool failed;
+
+  /// Add a response to our connection
+  void write( const char* msg, size_t len );
+
+  /// Add our status line and headers to our connection
+  /** @param complete whether the whole response has been written
+      @return false if our headers are not yet complete
+   */
+  bool head( bool complete );
+
+  /// Add what we hold of our body to our connection and send what we can
+  /** Waits for the client while too much output is queued
+      @return false if our connection has failed
+   */
+  bool send();
+
+ public:
+
+  /// Constructor
+  /** @param c connection
+      @param r request being answered
+   */
+  HTTPWriter( HTTPConnection& c, const HTTPRequest& r ) : connection( c ), request( r ), finished( false ),
+    flushed( false ), started( false ), chunking( false ), body( true ), failed( false ) {};
+
+  int putStr( const char* msg, int len ){ this->write( msg, len ); return failed ? -1 : len; };
+  int putS( const char* msg ){ this->write( msg, strlen( msg ) ); return failed ? -1 : strlen( msg ); };
+  int printf( const char* msg ){ this->write( msg, strlen( msg ) ); return failed ? -1 : strlen( msg ); };
+  int flush();
+
+  /// Return our whole response, or NULL once part of it has been streamed
+  const char* getBuffer() const { return started ? NULL : buffer.data(); };
+  size_t getSize() const { return started ? 0 : buffer.size(); };
+
+  /// Complete our response and start sending it. Later calls do nothing
+  void finish();
+
+};
+
+
+
+/// Callback which answers an HTTP request
+/** @param data data passed to HTTPServer::serve()
+    @param request request
+    @param writer writer for the response
+ */
+typedef void (*HTTPHandler)( void* data, const HTTPRequest& request, HTTPWriter& writer );
+
+
+
+/// Serves requests over HTTP/1.1 without a separate web server
+/** Requests are read from persistent, optionally pipelined, connections by the threads
+    calling serve(), which all wait on a single epoll set. Each thread takes one ready
+    connection at a time, which is only watched again once that thread is done with it,
+    so that the other connections are served by threads which are not busy rather than
+    waiting behind a slow request. The requests of a connection are answered in order,
+    one at a time.
+
+    Only GET and HEAD requests without a body are supported. Targets map onto iipsrv
+    queries as follows:
+
+    /iiif/path     IIIF=path
+    /deepzoom/path DeepZoom=path
+    /zoomify/path  Zoomify=path
+    /any?query     query
+
+    Connections which are idle for longer than a timeout are closed. Serving is only
+    available on Linux.
+ */
+
+class HTTPServer {
+
+ private:
+
+  /// Address on which to listen as host:port or port
+  std::string address;
+
+  /// Listening socket or -1 if we are not open
+  int listener;
+
+  /// Pipe to which a byte is written to stop our event loops
+  int wake[2];
+
+  /// Epoll set shared by all our event loops
+  int ep;
+
+  /// Open connections
+  std::set<HTTPConnection*> connections;
+
+  /// Time at which idle connections were last looked for
+  time_t checked;
+
+  /// Statistics
+  unsigned long numConnections, numRequests, numErrors;
+
+  /// Lock protecting our connections, their busy and active times, and our statistics
+  Mutex mutex;
+
+  /// Watch a connection, or our listening socket, for a single event
+  /** @return false if it cannot be watched */
+  bool arm( int fd, void* ptr, unsigned int events, bool add );
+
+  /// Forget, close and delete a connection
+  void drop( HTTPConnection* connection );
+
+  /// Read what a connection has sent and answer its complete requests
+  /** @return false if the connection should be closed */
+  bool receive( HTTPConnection& connection, HTTPHandler handler, void* data );
+
+  /// Answer the complete requests in a connection's input buffer
+  /** @return false if the connection should be closed */
+  bool process( HTTPConnection& connection, HTTPHandler handler, void* data );
+
+  /// Parse a request from the head of a connection's input buffer
+  /** @param connection connection
+      @param request set to the request
+      @param error set to the status with which to reject a malformed request
+      @return length of the request head, or 0 if it is not yet complete
+   */
+  size_t parse( HTTPConnection& connection, HTTPRequest& request, int& error );
+
+  /// Server cannot be copied
+  HTTPServer( const HTTPServer& );
+  HTTPServer& operator = ( const HTTPServer& );
+
+
+ public:
+
+  /// Constructor
+  /** @param a address on which to listen as host:port or port */
+  HTTPServer( const std::string& a ) : address( a ), listener( -1 ), ep( -1 ), checked( 0 ),
+    numConnections( 0 ), numRequests( 0 ), numErrors( 0 ) { wake[0] = wake[1] = -1; };
+
+  /// Destructor - closes any connections left open once serving has stopped
+  ~HTTPServer();
+
+  /// Start listening
+  /** Throws a string exception if we cannot listen on our address */
+  void open() throw(std::string);
+
+  /// Answer requests until stop() is called
+  /** Called once from each serving thread
+      @param handler callback answering each request
+      @param data data passed to the handler
+   */
+  void serve( HTTPHandler handler, void* data );
+
+  /// Stop all our event loops. Can be called from a signal handler
+  void stop();
+
+  /// Send whatever we can of a connection's output without blocking
+  /** @return false if the connection has failed */
+  static bool send( HTTPConnection& connection );
+
+  /// Return a summary of the server statistics
+  std::string getStatistics();
+
+};
+
+
+
+#endif
@@ -22,7 +22,9 @@ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
 #include <algorithm>
 #include <cmath>
 #include <sstream>
+#include <vector>
 #include "Environment.h"
+#include "RegionStream.h"
 #include "Task.h"
 #include "Tokenizer.h"
 #include "Transforms.h"
@@ -861,124 +863,144 @@ void IIIF::run( Session* session, const std::string& argument ){
 #endif
 
 
-    // *** GET REQUESTED REGION ***
-
-    // Get our requested region from our TileManager
     TileManager tilemanager( session->tileCache, *session->image, session->watermark, session->jpeg, session->logfile,
       session->loglevel );
-    
-    RawTile complete_image = tilemanager.getRegion( requested_res, session->view->xangle, session->view->yangle,
+
+
+    // *** TILE ALIGNED REQUESTS ***
+
+    // Requests for exactly one unscaled and unrotated tile are served as a JPEG tile,
+    // which can come straight from the cache or be passed through from the image
+    unsigned int view_left = session->view->getViewLeft();
+    unsigned int view_top = session->view->getViewTop();
+    unsigned int view_width = session->view->getViewWidth();
+    unsigned int view_height = session->view->getViewHeight();
+    unsigned int res_width = (*session->image)->image_widths[numResolutions-requested_res-1];
+    unsigned int res_height = (*session->image)->image_heights[numResolutions-requested_res-1];
+
+    if( Environment::getJPEGPassthrough() && (int)rotation % 360 == 0 &&
+        (*session->image)->getNumBitsPerPixel() == 8 && (*session->image)->getColourSpace() != CIELAB &&
+        ( (*session->image)->getNumChannels() == 1 || (*session->image)->getNumChannels() == 3 ) &&
+        !( cropLeft || cropTop || cropRight || cropBottom ) &&
+        view_left % tw == 0 && view_top % th == 0 &&
+        view_width == std::min( tw, res_width - view_left ) &&
+        view_height == std::min( th, res_height - view_top ) &&
+        (unsigned int) reqSizeWidth == view_width && (unsigned int) reqSizeHeight == view_height ){
+
+      unsigned int ntlx = ( res_width + tw - 1 ) / tw;
+      unsigned int tile = (view_top / th) * ntlx + (view_left / tw);
+
+      if( session->loglevel >= 3 ){
+        *(session->logfile) << "IIIF :: Region is tile " << tile << " at resolution " << requested_res << endl;
+      }
+
+      if( qualityNum ){
+        session->jpeg->setQuality(qualityNum);
+      }
+
+      RawTile rawtile = tilemanager.getTile( requested_res, tile, session->view->xangle, session->view->yangle,
+        session->view->getLayers(), JPEG );
+
+      if( session->prefetcher ){
+        session->prefetcher->prefetch( **session->image, requested_res, tile, session->view->xangle, session->view->yangle,
+          session->view->getLayers(), JPEG, session->jpeg->getQuality() );
+      }
+
+      if( session->out->putStr( (const char*) rawtile.data, rawtile.dataLength ) != (int) rawtile.dataLength ){
+        if( session->loglevel >= 1 ){
+          *(session->logfile) << "IIIF :: Error writing jpeg tile" << endl;
+        }
+      }
+
+      if( session->out->flush() == -1 ) {
+        if( session->loglevel >= 1 ){
+          *(session->logfile) << "IIIF :: Error flushing jpeg tile" << endl;
+        }
+      }
+
+      session->response->setImageSent();
+
+      if( session->loglevel >= 2 ){
+        *(session->logfile) << "IIIF :: Total command time " << command_timer.getTime() << " microseconds" << endl;
+      }
+      return;
+    }
+
+
+    // *** GET REQUESTED REGION ***
+
+    // Set up our requested region to be produced a strip at a time
+    RegionStream region( session->tileCache, session->watermark, session->logfile, session->loglevel,
+      *session->image, requested_res, session->view->xangle, session->view->yangle,
       session->view->getLayers(), session->view->getViewLeft(), session->view->getViewTop(),
       session->view->getViewWidth(), session->view->getViewHeight() );
+    region.setPipeline( Environment::getPipelineDepth() );
 
     if( session->loglevel >= 4 ){
-      *(session->logfile) << "IIIF :: Requested region retrieved, requested resolution: "<< requested_res
+      *(session->logfile) << "IIIF :: Requested region set up, requested resolution: "<< requested_res
         << ", region in this resolution X,Y,W,H: "<< session->view->getViewLeft() <<","<< session->view->getViewTop()<<","
         << session->view->getViewWidth()<<"," << session->view->getViewHeight()<< endl;
     }
 
-
-    // Convert CIELAB to sRGB
-    if( (*session->image)->getColourSpace() == CIELAB ){
-      Timer cielab_timer;
-      if( session->loglevel >= 3 ){
-        *(session->logfile) << "IIIF :: Converting from CIELAB->sRGB" << endl;
-        cielab_timer.start();
-      }
-      filter_LAB2sRGB( complete_image );
-      if( session->loglevel >= 3 ){
-        *(session->logfile) << "IIIF :: CIELAB->sRGB conversion in " << cielab_timer.getTime()
-          << " microseconds" << endl;
-      }
+    // CIELAB is converted to sRGB as each row is decoded
+    if( (*session->image)->getColourSpace() == CIELAB && session->loglevel >= 3 ){
+      *(session->logfile) << "IIIF :: Converting from CIELAB->sRGB" << endl;
     }
 
-    // Apply normalization and float conversion
-    filter_normalize( complete_image, (*session->image)->max, (*session->image)->min );
-
     // *** RESIZE IMAGE ***
 
     // Resize our image as requested. Use the interpolation method requested in the server configuration - bilinear default
-    if( (reqSizeWidth != complete_image.width) || (reqSizeHeight != complete_image.height) ){
-      if( session->loglevel >= 5 ){
-        *(session->logfile) << "Resizing is required." << endl;
-      }
-      
-      Timer interpolation_timer;
-      string interpolation_type;
-      if( session->loglevel >= 5 ){
-        interpolation_timer.start();
-      }
+    if( (reqSizeWidth != session->view->getViewWidth()) || (reqSizeHeight != session->view->getViewHeight()) ){
       unsigned int interpolation = Environment::getInterpolation();
-      switch( interpolation ){
-      case 0:
-        interpolation_type = "nearest neighbour";
-        filter_interpolate_nearestneighbour( complete_image, reqSizeWidth, reqSizeHeight );
-        break;
-      default:
-        interpolation_type = "bilinear";
-        filter_interpolate_bilinear( complete_image, reqSizeWidth, reqSizeHeight );
-        break;
-      }
-
       if( session->loglevel >= 5 ){
-        *(session->logfile) << "IIIF :: Resizing using " << interpolation_type << " interpolation in "
-          << interpolation_timer.getTime() << " microseconds, new width: "<< reqSizeWidth
-          << ", new height:" << reqSizeHeight << endl;
+        *(session->logfile) << "IIIF :: Resizing using " << ( interpolation == 0 ? "nearest neighbour" : "bilinear" )
+          << " interpolation, new width: "<< reqSizeWidth << ", new height:" << reqSizeHeight << endl;
       }
+      region.setSize( reqSizeWidth, reqSizeHeight, interpolation );
     }//END OF RESIZING
 
     // *** CROP IMAGE ***
     if(cropBottom || cropLeft || cropRight || cropTop){
-      Timer crop_timer;
-      if( session->loglevel >= 5 ){
-        crop_timer.start();
-      }
-
-      filter_crop( complete_image, cropLeft, cropTop, cropRight, cropBottom );
-      reqSizeWidth = reqSizeWidth - cropLeft - cropRight;
-      reqSizeHeight = reqSizeHeight - cropTop - cropBottom;
-
       if( session->loglevel >= 5 ){
-        *(session->logfile) << "IIIF :: Cropping in "
-          << crop_timer.getTime() << " microseconds, cropped by: "<< cropLeft
+        *(session->logfile) << "IIIF :: Cropping by: "<< cropLeft
           << "," << cropTop << "," << cropRight << "," << cropBottom <<endl;
       }
+      region.setCrop( cropLeft, cropTop, cropRight, cropBottom );
     }//END OF CROPPING
 
-    // Convert from float to 8bit RGB
-    filter_contrast( complete_image, 1.0f );
-
     // *** ROTATE IMAGE ***
     if((int)rotation % 360 != 0){
-      Timer rotationTimer;
       if( session->loglevel >= 4 ){
-        rotationTimer.start();
+        *(session->logfile) << "IIIF :: Rotating image by " << (int) rotation % 360 << " degrees" << endl;
       }
+      region.setRotation( rotation );
+    }//END OF ROTATION
 
-      filter_rotate(complete_image, rotation);
-
-      //switch required width and height
-      if((int) rotation % 180 == 90){
-        int tmp = reqSizeHeight;
-        reqSizeHeight = reqSizeWidth;
-        reqSizeWidth = tmp;
-      }
+    // Our final image size, which for 90 and 270 rotation has width and height swapped
+    reqSizeWidth = region.getWidth();
+    reqSizeHeight = region.getHeight();
+    int channels = region.getChannels();
 
-      if( session->loglevel >= 4 ){
-        *(session->logfile) << "IIIF :: Rotating image by " << (int) rotation % 360 << " degrees in "
-          << rotationTimer.getTime() << " microseconds" << endl;
-      }
-    }//END OF ROTATION
-    
 
     // *** SEND RESULT ***
 
+    // Produce our first strip before we start compressing, so that the image is
+    // opened and its first tiles decoded before anything is sent
+    Timer strip_timer;
+    if( session->loglevel >= 3 ) strip_timer.start();
+
+    unsigned int strip_height = 128;
+    vector<unsigned char> input( reqSizeWidth*channels*strip_height );
+    unsigned int rows = region.read( &input[0], strip_height );
+
     //set quality if specified in request
     if( qualityNum ){
       session->jpeg->setQuality(qualityNum);
     }
     // Initialise our JPEG compression object
-    session->jpeg->InitCompression( complete_image, reqSizeHeight );
+    RawTile output_image( 0, requested_res, session->view->xangle, session->view->yangle,
+      reqSizeWidth, reqSizeHeight, channels, 8 );
+    session->jpeg->InitCompression( output_image, strip_height );
     int len = session->jpeg->getHeaderSize();
 
     if( session->out->putStr( (const char*) session->jpeg->getHeader(), len ) != len ){
@@ -994,34 +1016,26 @@ void IIIF::run( Session* session, const std::string& argument ){
       }
     }
 
-    // Send out the data per strip of fixed height.
+    // Send out the data per strip of fixed height, producing each strip as we go.
     // Allocate enough memory for this plus an extra 16k for instances where compressed
     // data is greater than uncompressed
-    unsigned int strip_height = 128;
-    unsigned char* output = new unsigned char[reqSizeWidth*complete_image.channels*strip_height+16536];
-    int strips = (reqSizeHeight/strip_height) + (reqSizeHeight % strip_height == 0 ? 0 : 1);
-
-    for( int n=0; n<strips; n++ ){
+    vector<unsigned char> output( reqSizeWidth*channels*strip_height+16536 );
 
-      // Get the starting index for this strip of data
-      unsigned char* input = &((unsigned char*)complete_image.data)[n*strip_height*reqSizeWidth*complete_image.channels];
-
-      // The last strip may have a different height
-      if( (n==strips-1) && (reqSizeHeight%strip_height!=0) ) strip_height = reqSizeHeight % strip_height;
+    while( rows > 0 ){
 
       if( session->loglevel >= 3 ){
-        *(session->logfile) << "IIIF :: About to JPEG compress strip with height " << strip_height << endl;
+        *(session->logfile) << "IIIF :: About to JPEG compress strip with height " << rows << endl;
       }
 
       // Compress the strip
-      len = session->jpeg->CompressStrip( input, output, strip_height );
+      len = session->jpeg->CompressStrip( &input[0], &output[0], rows );
 
       if( session->loglevel >= 3 ){
         *(session->logfile) << "IIIF :: Compressed data strip length is " << len << endl;
       }
 
       // Send this strip out to the client
-      if( len != session->out->putStr( (const char*) output, len ) ){
+      if( len != session->out->putStr( (const char*) &output[0], len ) ){
         if( session->loglevel >= 1 ){
           *(session->logfile) << "IIIF :: Error writing jpeg strip data: " << len << endl;
         }
@@ -1034,19 +1048,33 @@ void IIIF::run( Session* session, const std::string& argument ){
         }
       }
 
-    }//END OF FOR
+      // Produce our next strip
+      rows = region.read( &input[0], strip_height );
+
+    }//END OF WHILE
+
+    if( session->loglevel >= 3 ){
+      *(session->logfile) << "IIIF :: Region processed and compressed in " << strip_timer.getTime()
+        << " microseconds" << endl;
+      *(session->logfile) << "IIIF :: Stages: " << region.getStatistics() << endl;
+    }
+
+    // Queue the tiles surrounding this region and those beneath it for background decoding
+    if( session->prefetcher ){
+      session->prefetcher->prefetchRegion( **session->image, requested_res, session->view->xangle, session->view->yangle,
+        session->view->getLayers(), session->view->getViewLeft(), session->view->getViewTop(),
+        session->view->getViewWidth(), session->view->getViewHeight() );
+    }
 
     // Finish off the image compression
-    len = session->jpeg->Finish( output );
+    len = session->jpeg->Finish( &output[0] );
 
-    if( session->out->putStr( (const char*) output, len ) != len ){
+    if( session->out->putStr( (const char*) &output[0], len ) != len ){
       if( session->loglevel >= 1 ){
         *(session->logfile) << "IIIF :: Error writing jpeg EOI markers" << endl;
       }
     }
 
-    delete[] output;
-
     if( session->out->flush()  == -1 ) {
       if( session->loglevel >= 1 ){
         *(session->logfile) << "IIIF :: Error flushing jpeg tile" << endl;
@@ -22,6 +22,10 @@
 
 
 #include "IIPImage.h"
+#include "TPTImage.h"
+#ifdef HAVE_KAKADU
+#include "KakaduImage.h"
+#endif
 
 #ifdef HAVE_GLOB_H
 #include <glob.h>
@@ -32,6 +36,7 @@
 #endif
 
 #include <cstdio>
+#include <ctime>
 #include <sys/stat.h>
 #include <sstream>
 #include <iostream>
@@ -41,6 +46,24 @@
 using namespace std;
 
 
+Atomic IIPImage::revalidation( 0 );
+
+
+
+IIPImage* IIPImage::create( const IIPImage& image ) throw( string )
+{
+  // Transform the suffix to lower case
+  string imtype = image.type;
+  transform( imtype.begin(), imtype.end(), imtype.begin(), ::tolower );
+
+  if( imtype=="tif" || imtype=="tiff" || imtype=="ptif" || imtype=="dat" ) return new TPTImage( image );
+#ifdef HAVE_KAKADU
+  if( imtype=="jpx" || imtype=="jp2" || imtype=="j2k" ) return new KakaduImage( image );
+#endif
+  throw string( "Unsupported image type: " + imtype );
+}
+
+
 
 // Swap function
 void IIPImage::swap( IIPImage& first, IIPImage& second ) // nothrow
@@ -55,6 +78,7 @@ void IIPImage::swap( IIPImage& first, IIPImage& second ) // nothrow
   std::swap( first.verticalAnglesList, second.verticalAnglesList );
   std::swap( first.image_widths, second.image_widths );
   std::swap( first.image_heights, second.image_heights );
+  std::swap( first.directory_offsets, second.directory_offsets );
   std::swap( first.tile_width, second.tile_width );
   std::swap( first.tile_height, second.tile_height );
   std::swap( first.numResolutions, second.numResolutions );
@@ -68,6 +92,7 @@ void IIPImage::swap( IIPImage& first, IIPImage& second ) // nothrow
   std::swap( first.currentY, second.currentY );
   std::swap( first.metadata, second.metadata );
   std::swap( first.timestamp, second.timestamp );
+  std::swap( first.validated, second.validated );
   std::swap( first.min, second.min );
   std::swap( first.max, second.max );
 }
@@ -86,6 +111,7 @@ void IIPImage::testImageType()
     int dot = imagePath.find_last_of( "." );
     type = imagePath.substr( dot + 1, imagePath.length() );
     timestamp = sb.st_mtime;
+    validated = time( NULL );
   }
   else{
 
@@ -139,23 +165,62 @@ void IIPImage::updateTimestamp( const string& path ) throw(string)
     throw message;
   }
   timestamp = sb.st_mtime;
+  validated = time( NULL );
+}
+
+
+
+bool IIPImage::revalidate( const string& path ) throw(string)
+{
+  time_t now = time( NULL );
+  if( validated != 0 && now >= validated && now - validated < (time_t) revalidation.get() ) return false;
+
+  time_t previous = timestamp;
+  updateTimestamp( path );
+  return timestamp != previous;
 }
 
 
 
 const std::string IIPImage::getTimestamp()
 {
-  tm *t;
+  tm t;
   const time_t tm1 = timestamp;
-  t = gmtime( &tm1 );
+  // Requests may be handled by several threads, so use the reentrant gmtime
+#ifdef WIN32
+  gmtime_s( &t, &tm1 );
+#else
+  gmtime_r( &tm1, &t );
+#endif
   char strt[64];
-  strftime( strt, 64, "%a, %d %b %Y %H:%M:%S GMT", t );
+  strftime( strt, 64, "%a, %d %b %Y %H:%M:%S GMT", &t );
 
   return string(strt);
 }
 
 
 
+unsigned long IIPImage::getMemorySize() const
+{
+  // Allow a few pointers of overhead for each list and map node
+  const unsigned long node = 4 * sizeof(void*);
+
+  unsigned long size = imagePath.capacity() + fileSystemPrefix.capacity() +
+    fileNamePattern.capacity() + type.capacity();
+  size += ( horizontalAnglesList.size() + verticalAnglesList.size() ) * ( sizeof(int) + node );
+  size += ( image_widths.capacity() + image_heights.capacity() ) * sizeof(unsigned int);
+  size += directory_offsets.capacity() * sizeof(unsigned long long);
+  size += ( min.capacity() + max.capacity() ) * sizeof(float);
+
+  for( map<const string,string>::const_iterator i = metadata.begin(); i != metadata.end(); i++ ){
+    size += sizeof( pair<const string,string> ) + node + i->first.capacity() + i->second.capacity();
+  }
+
+  return size;
+}
+
+
+
 void IIPImage::measureVerticalAngles()
 {
   verticalAnglesList.clear();
@@ -36,6 +36,7 @@
 #include <map>
 
 #include "RawTile.h"
+#include "Mutex.h"
 
 //enum ImageType { TIFF, JPEG2000 };
 
@@ -88,6 +89,9 @@ class IIPImage {
   /// The image pixel dimensions
   std::vector <unsigned int> image_widths, image_heights;
 
+  /// File offsets of the directory holding each resolution, for formats which have them
+  std::vector <unsigned long long> directory_offsets;
+
   /// The base tile pixel dimensions
   unsigned int tile_width, tile_height;
 
@@ -124,6 +128,19 @@ class IIPImage {
   /// Image modification timestamp
   time_t timestamp;
 
+  /// Time at which the timestamp was last checked against the file
+  time_t validated;
+
+  /// Minimum interval in seconds between checks of an image's timestamp
+  /** Atomic, as it is changed if watching of image files stops while requests are being served */
+  static Atomic revalidation;
+
+  /// Update the timestamp unless it has been checked within the revalidation interval
+  /** @param path file path
+      @return true if the file has been modified since the timestamp was last updated
+   */
+  bool revalidate( const std::string& path ) throw( std::string );
+
 
  public:
 
@@ -138,7 +155,8 @@ class IIPImage {
     isSet( false ),
     currentX( 0 ),
     currentY( 90 ),
-    timestamp( 0 ) {};
+    timestamp( 0 ),
+    validated( 0 ) {};
 
   /// Constructer taking the image path as parameter
   /** @param s image path
@@ -154,7 +172,8 @@ class IIPImage {
     isSet( false ),
     currentX( 0 ),
     currentY( 90 ),
-    timestamp( 0 ) {};
+    timestamp( 0 ),
+    validated( 0 ) {};
 
   /// Copy Constructor taking reference to another IIPImage object
   /** @param im IIPImage object
@@ -169,6 +188,7 @@ class IIPImage {
     type( image.type ),
     image_widths( image.image_widths ),
     image_heights( image.image_heights ),
+    directory_offsets( image.directory_offsets ),
     tile_width( image.tile_width ),
     tile_height( image.tile_height ),
     colourspace( image.colourspace ),
@@ -183,7 +203,8 @@ class IIPImage {
     currentX( image.currentX ),
     currentY( image.currentY ),
     metadata( image.metadata ),
-    timestamp( image.timestamp ) {};
+    timestamp( image.timestamp ),
+    validated( image.validated ) {};
 
   /// Virtual Destructor
   virtual ~IIPImage() { ; };
@@ -191,6 +212,12 @@ class IIPImage {
   /// Test the image and initialise some parameters
   void Initialise();
 
+  /// Create a decoder of the right type for an image
+  /** @param image initialised image whose type selects the decoder
+      @return newly allocated decoder, which the caller must delete
+   */
+  static IIPImage* create( const IIPImage& image ) throw( std::string );
+
   /// Swap function
   /** @param a Object to copy to
       @param b Object to copy from
@@ -213,7 +240,7 @@ class IIPImage {
   const std::string getFileName( int x, int y );
 
   /// Get the image type
-  const std::string& getImageType() { return type; };
+  const std::string& getImageType() const { return type; };
      //  ImageType getImageType() { return type; };
 
   /// Get the image timestamp
@@ -221,9 +248,20 @@ class IIPImage {
    */
   void updateTimestamp( const std::string& s ) throw( std::string );
 
+  /// Set the minimum interval between checks of whether cached images have been modified
+  /** Within this interval, an image whose metadata is cached can be served without
+      any filesystem access at all
+      @param s interval in seconds. Images are checked on every request if this is 0
+   */
+  static void setRevalidationInterval( unsigned int s ) { revalidation.set( s ); };
+
   /// Get a HTTP RFC 1123 formatted timestamp
   const std::string getTimestamp();
 
+  /// Return an estimate of the memory in bytes used by the image's metadata
+  /** This excludes the size of the object itself */
+  unsigned long getMemorySize() const;
+
   /// Check whether this object has been initialised
   bool set() { return isSet; };
 
@@ -315,6 +353,30 @@ class IIPImage {
    */
   virtual RawTile getTile( int h, int v, unsigned int r, int l, unsigned int t ) { return RawTile(); };
 
+  /// Return an individual tile exactly as it is encoded in the file, if it is stored as JPEG
+  /** Avoids decoding and re-encoding tiles which need no processing: Overloaded by child class.
+      The tile holds a complete JPEG image of the full padded tile, so edge tiles are still
+      marked as padded and must be cropped
+      @param h horizontal angle
+      @param v vertical angle
+      @param r resolution
+      @param l quality layers
+      @param t tile number
+      @param tile tile to fill
+      @return false if the tile cannot be supplied in this way
+   */
+  virtual bool getJPEGTile( int h, int v, unsigned int r, int l, unsigned int t, RawTile& tile ) { return false; };
+
+  /// Hint that a range of tiles is about to be read so that their data can be read in ahead
+  /** Overloaded by child class
+      @param h horizontal angle
+      @param v vertical angle
+      @param r resolution
+      @param first first tile number
+      @param last last tile number
+   */
+  virtual void adviseTiles( int h, int v, unsigned int r, unsigned int first, unsigned int last ) {};
+
 
   /// Return a region for a given angle and resolution
   /** Return a RawTile object: Overloaded by child class.
@@ -343,6 +405,9 @@ class IIPImage {
   /// Comparison non-equality operator
   friend int operator != ( const IIPImage&, const IIPImage& );
 
+  /// Snapshots save and restore all of our metadata
+  friend class CacheSnapshot;
+
 };
 
 
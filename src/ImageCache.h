@@ -0,0 +1,196 @@
+// Image Metadata Cache
+
+/*  IIP Image Server
+
+    Copyright (C) 2014 Ruven Pillay.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#ifndef _IMAGECACHE_H
+#define _IMAGECACHE_H
+
+
+#include <string>
+#include <list>
+#include <vector>
+#include <utility>
+
+#include "IIPImage.h"
+#include "Cache.h"
+#include "Mutex.h"
+
+
+
+/// Least recently used cache of image metadata
+/** Holds the IIPImage objects of recently opened images, indexed by the image path
+    supplied in the request, so that their metadata need not be read from the file for
+    every request. The cache is bounded both by a number of entries and by an estimate
+    of the memory used, which includes any metadata strings such as XMP packets. The
+    least recently used images are evicted to stay within both limits.
+
+    Hits are returned as a pointer to the cached object rather than as a copy. The
+    cache does not lock itself: threads sharing it must hold the lock returned by
+    getMutex() around each use, and for as long as they use a returned pointer.
+ */
+
+class ImageCache {
+
+
+ private:
+
+  /// A cached image
+  struct Entry {
+    std::string name;
+    IIPImage image;
+    unsigned long size;
+  };
+
+  /// Main cache storage typedef
+  typedef std::list<Entry> ImageList;
+
+  /// Main cache list iterator typedef
+  typedef ImageList::iterator List_Iter;
+
+  /// Index typedef
+#ifdef HASHMAP_IS_HASHED
+  typedef HASHMAP < const std::string, List_Iter > ImageMap;
+#else
+  typedef std::map < const std::string, List_Iter > ImageMap;
+#endif
+
+  /// Max memory size in bytes
+  unsigned long maxSize;
+
+  /// Max number of images
+  unsigned int maxEntries;
+
+  /// Current memory running total
+  unsigned long currentSize;
+
+  /// Cached images, most recently used first
+  ImageList imageList;
+
+  /// Index of our cached images
+  ImageMap imageMap;
+
+  /// Lock for threads sharing the cache
+  Mutex mutex;
+
+
+  /// Internal remove function
+  /** @param miter iterator pointing to the entry to remove */
+  void _remove( ImageMap::iterator miter ) {
+    currentSize -= miter->second->size;
+    imageList.erase( miter->second );
+    imageMap.erase( miter );
+  }
+
+
+  /// The cache cannot be copied
+  ImageCache( const ImageCache& );
+  ImageCache& operator = ( const ImageCache& );
+
+
+ public:
+
+  /// Constructor
+  /** @param max Maximum cache size in MB
+      @param n Maximum number of images. Caching is disabled if either limit is 0
+   */
+  ImageCache( float max, unsigned int n ) :
+    maxSize( (unsigned long)(max*1024000) ), maxEntries( n ), currentSize( 0 ) {};
+
+
+  /// Look up an image and make it the most recently used
+  /** @param name image path as supplied in the request
+      @return pointer to the cached image, which remains valid until the cache is next
+      modified, or NULL if the image is not cached
+   */
+  const IIPImage* find( const std::string& name ) {
+    ImageMap::iterator miter = imageMap.find( name );
+    if( miter == imageMap.end() ) return NULL;
+    imageList.splice( imageList.begin(), imageList, miter->second );
+    return &(miter->second->image);
+  }
+
+
+  /// Insert an image, replacing any existing entry with the same name
+  /** @param name image path as supplied in the request
+      @param image image to be copied into the cache
+      @param evicted if not NULL, the names of any images evicted to make room are added
+      to this, including the image itself if it does not fit in the cache at all
+   */
+  void insert( const std::string& name, const IIPImage& image, std::vector<std::string>* evicted = NULL ) {
+
+    ImageMap::iterator miter = imageMap.find( name );
+    if( miter != imageMap.end() ) this->_remove( miter );
+
+    imageList.push_front( Entry() );
+    Entry& entry = imageList.front();
+    entry.name = name;
+    entry.image = image;
+    entry.size = sizeof( Entry ) + 4*sizeof( void* ) + 2*name.capacity() + entry.image.getMemorySize();
+    imageMap[ name ] = imageList.begin();
+    currentSize += entry.size;
+
+    // Evict the least recently used images until we are within both of our limits
+    while( !imageList.empty() && ( imageMap.size() > maxEntries || currentSize > maxSize ) ){
+      if( evicted ) evicted->push_back( imageList.back().name );
+      this->_remove( imageMap.find( imageList.back().name ) );
+    }
+  }
+
+
+  /// Remove an image
+  /** @param name image path as supplied in the request */
+  void erase( const std::string& name ) {
+    ImageMap::iterator miter = imageMap.find( name );
+    if( miter != imageMap.end() ) this->_remove( miter );
+  }
+
+
+  /// Return the cached images
+  /** @param images vector to which the name of each image and a pointer to it are added,
+      most recently used first. The pointers remain valid until the cache is next modified
+   */
+  void getImages( std::vector< std::pair<std::string,const IIPImage*> >& images ) const {
+    for( ImageList::const_iterator i = imageList.begin(); i != imageList.end(); ++i ){
+      images.push_back( std::make_pair( i->name, &(i->image) ) );
+    }
+  }
+
+
+  /// Return whether the cache is empty
+  bool empty() const { return imageList.empty(); };
+
+
+  /// Return the number of images in the cache
+  unsigned int getNumElements() const { return imageMap.size(); };
+
+
+  /// Return the number of MB stored
+  float getMemorySize() const { return (float) ( currentSize / 1024000.0 ); };
+
+
+  /// Return the lock to be held by threads sharing the cache
+  Mutex& getMutex() { return mutex; };
+
+};
+
+
+
+#endif
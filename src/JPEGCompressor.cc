@@ -289,7 +289,7 @@ unsigned int JPEGCompressor::Finish( unsigned char* output ) throw (string)
 
   // Tidy up and de-allocate memory
   dest->pub.next_output_byte = dest->buffer;
-  cinfo.next_scanline = dest->strip_height;
+  cinfo.next_scanline = cinfo.image_height;
   jpeg_finish_compress( &cinfo );
 
   size_t datacount = dest->size;
@@ -417,11 +417,11 @@ int JPEGCompressor::Compress( RawTile& rawtile ) throw (string)
 
   // Check that we have enough memory in our tile for the JPEG data.
   // This can happen on small tiles with high quality factors. If so
-  // delete and reallocate memory.
+  // delete and reallocate memory. We also need a new buffer if our
+  // data is shared or not our own
   y = dest->size;
-  if( y > rawtile.width*rawtile.height*rawtile.channels ){
-    delete[] (unsigned char*) rawtile.data;
-    rawtile.data = new unsigned char[y];
+  if( y > rawtile.width*rawtile.height*rawtile.channels || rawtile.getOwnership() != OWNED ){
+    rawtile.allocate( y );
   }
 
   // Copy memory back to the tile
@@ -443,6 +443,144 @@ int JPEGCompressor::Compress( RawTile& rawtile ) throw (string)
 
 
 
+/*
+ * Source and destination managers for transcoding between memory buffers
+ */
+
+METHODDEF(void)
+iip_init_source( j_decompress_ptr cinfo ){}
+
+
+METHODDEF(boolean)
+iip_fill_input_buffer( j_decompress_ptr cinfo )
+{
+  // We have the whole image already, so the data must be truncated: insert a fake EOI marker
+  static const JOCTET eoi[2] = { 0xFF, JPEG_EOI };
+  cinfo->src->next_input_byte = eoi;
+  cinfo->src->bytes_in_buffer = 2;
+  return TRUE;
+}
+
+
+METHODDEF(void)
+iip_skip_input_data( j_decompress_ptr cinfo, long num_bytes )
+{
+  if( num_bytes <= 0 ) return;
+  if( (size_t) num_bytes > cinfo->src->bytes_in_buffer ) num_bytes = (long) cinfo->src->bytes_in_buffer;
+  cinfo->src->next_input_byte += num_bytes;
+  cinfo->src->bytes_in_buffer -= num_bytes;
+}
+
+
+METHODDEF(void)
+iip_term_source( j_decompress_ptr cinfo ){}
+
+
+METHODDEF(void)
+iip_init_transcode_destination( j_compress_ptr cinfo )
+{
+  iip_dest_ptr dest = (iip_dest_ptr) cinfo->dest;
+  dest->pub.next_output_byte = dest->buffer;
+  dest->pub.free_in_buffer = dest->size;
+}
+
+
+METHODDEF(boolean)
+iip_empty_transcode_buffer( j_compress_ptr cinfo )
+{
+  // Double the size of our buffer. The library expects the whole buffer to have been filled
+  iip_dest_ptr dest = (iip_dest_ptr) cinfo->dest;
+  JOCTET *buffer = new JOCTET[ 2 * dest->size ];
+  memcpy( buffer, dest->buffer, dest->size );
+  delete[] dest->buffer;
+  dest->buffer = buffer;
+  dest->pub.next_output_byte = buffer + dest->size;
+  dest->pub.free_in_buffer = dest->size;
+  dest->size *= 2;
+  return TRUE;
+}
+
+
+METHODDEF(void)
+iip_term_transcode_destination( j_compress_ptr cinfo ){}
+
+
+
+unsigned int JPEGCompressor::Crop( RawTile& rawtile ) throw (string)
+{
+  struct jpeg_decompress_struct srcinfo;
+  struct jpeg_compress_struct dstinfo;
+  struct jpeg_error_mgr srcerr, dsterr;
+  struct jpeg_source_mgr src;
+  iip_destination_mgr dst;
+
+  srcinfo.err = jpeg_std_error( &srcerr );
+  srcerr.error_exit = iip_error_exit;
+  dstinfo.err = jpeg_std_error( &dsterr );
+  dsterr.error_exit = iip_error_exit;
+
+  // The cropped tile is never larger than the padded one
+  dst.size = rawtile.dataLength + MX;
+  dst.buffer = new JOCTET[dst.size];
+  dst.source = NULL;
+  dst.strip_height = 0;
+
+  jpeg_create_decompress( &srcinfo );
+  jpeg_create_compress( &dstinfo );
+
+  try{
+
+    src.next_input_byte = (const JOCTET*) rawtile.data;
+    src.bytes_in_buffer = rawtile.dataLength;
+    src.init_source = iip_init_source;
+    src.fill_input_buffer = iip_fill_input_buffer;
+    src.skip_input_data = iip_skip_input_data;
+    src.resync_to_restart = jpeg_resync_to_restart;
+    src.term_source = iip_term_source;
+    srcinfo.src = &src;
+
+    dst.pub.init_destination = iip_init_transcode_destination;
+    dst.pub.empty_output_buffer = iip_empty_transcode_buffer;
+    dst.pub.term_destination = iip_term_transcode_destination;
+    dstinfo.dest = (struct jpeg_destination_mgr*) &dst;
+
+    jpeg_read_header( &srcinfo, TRUE );
+    jvirt_barray_ptr *coefficients = jpeg_read_coefficients( &srcinfo );
+
+    if( rawtile.width > srcinfo.image_width || rawtile.height > srcinfo.image_height ){
+      throw string( "JPEGCompressor: Crop size larger than the encoded tile" );
+    }
+
+    // As the crop starts at the origin, the source coefficients can be written out
+    // as they are: only the blocks within the new image size are used
+    jpeg_copy_critical_parameters( &srcinfo, &dstinfo );
+    dstinfo.image_width = rawtile.width;
+    dstinfo.image_height = rawtile.height;
+    dstinfo.optimize_coding = TRUE;
+
+    jpeg_write_coefficients( &dstinfo, coefficients );
+    jpeg_finish_compress( &dstinfo );
+    jpeg_finish_decompress( &srcinfo );
+  }
+  catch( ... ){
+    jpeg_destroy_compress( &dstinfo );
+    jpeg_destroy_decompress( &srcinfo );
+    delete[] dst.buffer;
+    throw;
+  }
+
+  jpeg_destroy_compress( &dstinfo );
+  jpeg_destroy_decompress( &srcinfo );
+
+  unsigned int length = dst.size - dst.pub.free_in_buffer;
+  rawtile.adopt( dst.buffer, length );
+  rawtile.padded = false;
+
+  return length;
+}
+
+
+
 void JPEGCompressor::addMetadata( const string& metadata ){
   jpeg_write_marker( &cinfo, JPEG_APP0, (const JOCTET*) metadata.c_str(), metadata.size() );
 }
@@ -107,8 +107,8 @@ class JPEGCompressor{
   /** If we are doing a strip based encoding, we need to first initialise
       with InitCompression, then compress a single strip at a time using
       CompressStrip and finally clean up using Finish
-      @param rawtile tile containing the image to be compressed
-      @param strip_height pixel height of the strip we want to compress
+      @param rawtile tile describing the image to be compressed, whose data is not used
+      @param strip_height pixel height of the strips we want to compress, which sets the size of our output buffer
       @return header size
    */
   void InitCompression( const RawTile& rawtile, unsigned int strip_height ) throw (std::string);
@@ -132,6 +132,15 @@ class JPEGCompressor{
   int Compress( RawTile& t ) throw (std::string);
 
 
+  /// Losslessly crop an already JPEG encoded tile to its width and height
+  /** Used for edge tiles which are stored padded to the full tile size. The DCT
+      coefficients are copied without being decoded, so no further loss is introduced
+      @param t JPEG encoded tile with width and height set to the size to crop to
+      @return size of the cropped data
+   */
+  unsigned int Crop( RawTile& t ) throw (std::string);
+
+
   /// Add metadata to the JPEG header
   /** @param m metadata */
   void addMetadata( const std::string& m );
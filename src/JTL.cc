@@ -88,6 +88,7 @@ void JTL::run( Session* session, const std::string& argument ){
   else if( session->view->shaded ) ct = UNCOMPRESSED;
   else if( session->view->cmapped ) ct = UNCOMPRESSED;
   else if( session->view->inverted ) ct = UNCOMPRESSED;
+  else if( session->view->colourspace == GREYSCALE ) ct = UNCOMPRESSED;
   else ct = JPEG;
 
   //next block cares about jpeg 2000 difference of ceiling image dimensions (tiff truncates it)
@@ -110,6 +111,12 @@ void JTL::run( Session* session, const std::string& argument ){
   RawTile rawtile = tilemanager.getTile( resolution, tile, session->view->xangle,
 					 session->view->yangle, session->view->getLayers(), ct );
 
+  // Queue the surrounding tiles and those beneath this one for background decoding
+  if( session->prefetcher ){
+    session->prefetcher->prefetch( **session->image, resolution, tile, session->view->xangle, session->view->yangle,
+				   session->view->getLayers(), ct, session->jpeg->getQuality() );
+  }
+
   // For image sequences where images are not all the same bitdepth, the TileManager will return an uncompressed tile
   if( rawtile.bpc > 8 ) ct = UNCOMPRESSED;
 
@@ -139,14 +146,17 @@ void JTL::run( Session* session, const std::string& argument ){
     }
   }
 
-  // Apply normalization and float conversion
-  if( session->loglevel >= 3 ){
-    *(session->logfile) << "JTL :: Normalizing and converting to float" << endl;
-  }
+  // Apply normalization and float conversion. JPEG tiles are sent untouched
+  // directly from the cache
+  if( ct == UNCOMPRESSED ){
+    if( session->loglevel >= 3 ){
+      *(session->logfile) << "JTL :: Normalizing and converting to float" << endl;
+    }
 
-  filter_normalize( rawtile, (*session->image)->max, (*session->image)->min );
-  if( session->loglevel >= 3 ){
-    *(session->logfile) << "JTL :: Normalization applied in " << function_timer.getTime() << " microseconds" << endl;
+    filter_normalize( rawtile, (*session->image)->max, (*session->image)->min );
+    if( session->loglevel >= 3 ){
+      *(session->logfile) << "JTL :: Normalization applied in " << function_timer.getTime() << " microseconds" << endl;
+    }
   }
 
   // Apply hill shading if requested
@@ -187,14 +197,16 @@ void JTL::run( Session* session, const std::string& argument ){
   }
 
   // Apply any contrast adjustments and/or clipping to 8bit from 16 or 32 bit
-  float contrast = session->view->getContrast();
-  if( session->loglevel >= 3 ){
-    *(session->logfile) << "JTL :: Applying contrast of " << contrast << endl;
-    function_timer.start();
-  }
-  filter_contrast( rawtile, contrast );
-  if( session->loglevel >= 3 ){
-    *(session->logfile) << "JTL :: Conversion to 8 bit applied in " << function_timer.getTime() << " microseconds" << endl;
+  if( ct == UNCOMPRESSED ){
+    float contrast = session->view->getContrast();
+    if( session->loglevel >= 3 ){
+      *(session->logfile) << "JTL :: Applying contrast of " << contrast << endl;
+      function_timer.start();
+    }
+    filter_contrast( rawtile, contrast );
+    if( session->loglevel >= 3 ){
+      *(session->logfile) << "JTL :: Conversion to 8 bit applied in " << function_timer.getTime() << " microseconds" << endl;
+    }
   }
 
 
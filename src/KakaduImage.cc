@@ -324,11 +324,8 @@ RawTile KakaduImage::getTile( int seq, int ang, unsigned int res, int layers, un
 
 
   // Create our raw tile buffer and initialize some values
-  if( obpp == 16 ) rawtile.data = new unsigned short[tw*th*channels];
-  else if( obpp == 8 ) rawtile.data = new unsigned char[tw*th*channels];
-  else throw string( "Kakadu :: Unsupported number of bits" );
-
-  rawtile.dataLength = tw*th*channels*obpp/8;
+  if( obpp != 16 && obpp != 8 ) throw string( "Kakadu :: Unsupported number of bits" );
+  rawtile.allocate( tw*th*channels*obpp/8 );
   rawtile.filename = getImagePath();
   rawtile.timestamp = timestamp;
 
@@ -361,11 +358,8 @@ RawTile KakaduImage::getRegion( int seq, int ang, unsigned int res, int layers,
 
   RawTile rawtile( 0, res, seq, ang, w, h, channels, obpp );
 
-  if( obpp == 16 ) rawtile.data = new unsigned short[w*h*channels];
-  else if( obpp == 8 ) rawtile.data = new unsigned char[w*h*channels];
-  else throw string( "Kakadu :: Unsupported number of bits" );
-
-  rawtile.dataLength = w*h*channels*obpp/8;
+  if( obpp != 16 && obpp != 8 ) throw string( "Kakadu :: Unsupported number of bits" );
+  rawtile.allocate( w*h*channels*obpp/8 );
   rawtile.filename = getImagePath();
   rawtile.timestamp = timestamp;
   process( res, layers, x, y, w, h, rawtile.data );
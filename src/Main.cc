@@ -26,11 +26,16 @@
 
 #include <ctime>
 #include <csignal>
+#include <cstring>
 #include <iostream>
 #include <fstream>
 #include <string>
 #include <utility>
 #include <map>
+#include <set>
+#include <climits>
+#include <sstream>
+#include <vector>
 
 #include "TPTImage.h"
 #include "JPEGCompressor.h"
@@ -41,7 +46,14 @@
 #include "TileManager.h"
 #include "Task.h"
 #include "Environment.h"
+#include "Prefetcher.h"
+#include "RegionPool.h"
+#include "CacheSnapshot.h"
+#include "Warmup.h"
 #include "Writer.h"
+#include "HTTPServer.h"
+#include "Thread.h"
+#include "Mutex.h"
 
 #ifdef HAVE_MEMCACHED
 #ifdef WIN32
@@ -90,11 +102,37 @@ ofstream logfile;
 unsigned long IIPcount;
 char *tz = NULL;
 
+/* Lock held by our request threads while writing to the log file or
+   updating IIPcount
+*/
+Mutex log_mutex;
 
+/* Lock serialising our request threads' waits for a new connection, and
+   the thread currently waiting if any, which must be woken when we are
+   stopped so that it notices
+*/
+Mutex accept_mutex;
+#ifndef WIN32
+pthread_t acceptor;
+volatile sig_atomic_t accepting = 0;
+#endif
 
-/* Handle a signal - print out some stats and exit
+/* Our embedded HTTP server if we are serving requests over HTTP ourselves
  */
-void IIPSignalHandler( int signal )
+HTTPServer* http_server = NULL;
+
+/* Whether a signal should let us finish the current request and save a
+   snapshot of our caches rather than exit immediately, and the signal
+   caught if so
+*/
+bool graceful_shutdown = false;
+volatile sig_atomic_t caught_signal = 0;
+
+
+
+/* Print out some stats on being stopped by a signal
+ */
+void IIPSignalLog( int signal )
 {
   if( loglevel >= 1 ){
 
@@ -119,12 +157,524 @@ void IIPSignalHandler( int signal )
 	    << "<----------------------------------->" << endl << endl;
     logfile.close();
   }
+}
+
+
+
+/* Handle a signal - print out some stats and exit
+ */
+void IIPSignalHandler( int signal )
+{
+  // Stop accepting requests and leave the main loop to exit once it has saved
+  // our caches. A second signal while we are doing so stops us immediately
+  if( graceful_shutdown && !caught_signal ){
+    caught_signal = signal;
+    FCGX_ShutdownPending();
+    if( http_server ) http_server->stop();
+#ifndef WIN32
+    // The thread waiting for a connection may not be the one we were delivered to
+    if( accepting ) pthread_kill( acceptor, SIGURG );
+#endif
+    return;
+  }
 
+  IIPSignalLog( signal );
   exit( 1 );
 }
 
 
 
+/* Do nothing other than interrupt the thread waiting for a connection
+ */
+void IIPWakeHandler( int signal )
+{
+}
+
+
+
+/* Everything our request threads share, set up once in main()
+ */
+struct Server {
+  string version;
+  int listen_socket;
+  unsigned int threads;
+  int jpeg_quality;
+  int max_CVT;
+  int max_layers;
+  unsigned int metadata_revalidate;
+  Atomic watch_images;
+  ImageCache* imageCache;
+  NegativeCache* negativeCache;
+  Cache* tileCache;
+  TIFFPool* tiffPool;
+  Prefetcher* prefetcher;
+  FileWatcher* watcher;
+  Watermark* watermark;
+  HTTPServer* http;
+#ifdef DEBUG
+  char** argv;
+#endif
+};
+
+
+
+/* A request thread and the objects it does not share with the others
+ */
+struct Worker {
+  Server* server;
+  Thread thread;
+  Timer timer;
+  bool buffered;
+  ostringstream buffer;
+  ostream* log;
+#ifdef HAVE_MEMCACHED
+  Memcache* memcached;
+#endif
+};
+
+
+
+/* Wait for our next request. Only one thread at a time waits for a connection and it is
+   recorded so that it can be interrupted when we are stopped
+ */
+int IIPAccept( FCGX_Request* request )
+{
+  ScopedLock lock( accept_mutex );
+#ifndef WIN32
+  acceptor = pthread_self();
+  accepting = 1;
+#endif
+  int status = FCGX_Accept_r( request );
+#ifndef WIN32
+  accepting = 0;
+#endif
+  return status;
+}
+
+
+
+/* Handle a request, writing our response to a writer, and return the server count
+ */
+unsigned long IIPHandle( Worker* worker, Writer& writer, const string& request_string, const char* if_modified_since )
+{
+  Server* server = worker->server;
+#ifdef HAVE_MEMCACHED
+  Memcache* memcached = worker->memcached;
+#endif
+  ostream& log = *worker->log;
+  Task* task = NULL;
+
+
+  // Time each request
+  if( loglevel >= 2 ) worker->timer.start();
+
+  // Hold off any prefetching until we have finished
+  server->prefetcher->begin();
+
+
+  // Drop everything we hold for images whose files have been modified, moved or deleted.
+  // Only one thread at a time does so, while holding the lock on the image cache, and
+  // only once the watcher has events to read, which is checked without the lock
+  if( server->watch_images.get() && server->watcher->ready() ){
+    ScopedLock lock( server->imageCache->getMutex() );
+    set<string> files, images;
+    if( server->watcher->changes( files, images ) ){
+      for( set<string>::iterator i = images.begin(); i != images.end(); i++ ){
+        server->imageCache->erase( *i );
+        server->tileCache->remove( *i );
+      }
+      for( set<string>::iterator i = files.begin(); i != files.end(); i++ ) server->tiffPool->invalidate( *i );
+      if( loglevel >= 2 ) log << "Dropped " << images.size() << " modified images from our caches" << endl;
+    }
+    // Fall back to checking modification times if we have had to stop watching
+    if( server->watch_images.get() && !server->watcher->active() ){
+      if( loglevel >= 1 ) log << "No longer watching image files for changes" << endl;
+      IIPImage::setRevalidationInterval( server->metadata_revalidate );
+      server->tiffPool->setWatched( false );
+      server->watch_images.set( false );
+    }
+  }
+
+
+  // Declare our image pointer here outside of the try scope
+  //  so that we can close the image on exceptions
+  IIPImage *image = NULL;
+  JPEGCompressor jpeg( server->jpeg_quality );
+
+
+  // View object for use with the CVT command etc
+  View view;
+  if( server->max_CVT != -1 ){
+    view.setMaxSize( server->max_CVT );
+    if( loglevel >= 2 ) log << "CVT maximum viewport size set to " << server->max_CVT << endl;
+  }
+  if( server->max_layers != 0 ) view.setMaxLayers( server->max_layers );
+
+
+
+
+
+  // Create an IIPResponse object - we use this for the OBJ requests.
+  // As the commands return images etc, they handle their own responses.
+  IIPResponse response;
+
+
+  try{
+    
+    // Check that we actually have a request string
+    if( request_string.length() == 0 ) {
+      throw string( "QUERY_STRING not set" );
+    }
+
+    if( loglevel >=2 ){
+      log << "Full Request is " << request_string << endl;
+    }
+
+    
+
+    // Set up our session data object
+    Session session;
+    session.image = &image;
+    session.response = &response;
+    session.view = &view;
+    session.jpeg = &jpeg;
+    session.loglevel = loglevel;
+    session.logfile = &log;
+    session.imageCache = server->imageCache;
+    session.negativeCache = server->negativeCache->enabled() ? server->negativeCache : NULL;
+    session.tileCache = server->tileCache;
+    session.prefetcher = server->prefetcher->enabled() ? server->prefetcher : NULL;
+    session.watcher = server->watcher->active() ? server->watcher : NULL;
+    session.out = &writer;
+    session.watermark = server->watermark;
+    session.headers.empty();
+
+    // Get certain HTTP headers, such as if_modified_since and the query_string
+    if( if_modified_since ){
+      session.headers["HTTP_IF_MODIFIED_SINCE"] = string(if_modified_since);
+      if( loglevel >= 2 ){
+        log << "HTTP Header: If-Modified-Since: " << session.headers["HTTP_IF_MODIFIED_SINCE"] << endl;
+      }
+    }
+    session.headers["QUERY_STRING"] = request_string;
+
+
+#ifdef HAVE_MEMCACHED
+    // Check whether this exists in memcached, but only if we haven't had an if_modified_since
+    // request, which should always be faster to send
+    if( !if_modified_since ){
+      char* memcached_response = NULL;
+      if( (memcached_response = memcached->retrieve( request_string )) ){
+        writer.putStr( memcached_response, memcached->length() );
+        writer.flush();
+        free( memcached_response );
+        throw( 100 );
+      }
+    }
+#endif
+
+
+    // Parse up the command list
+
+    list < pair<string,string> > requests;
+    list < pair<string,string> > :: const_iterator commands;
+
+    Tokenizer izer( request_string, "&" );
+    while( izer.hasMoreTokens() ){
+      pair <string,string> p;
+      string token = izer.nextToken();
+      int n = token.find_first_of( "=" );
+      p.first = token.substr( 0, n );
+      p.second = token.substr( n+1, token.length() );
+      if( p.first.length() && p.second.length() ) requests.push_back( p );
+    }
+
+
+    int i = 0;
+    for( commands = requests.begin(); commands != requests.end(); commands++ ){
+
+      string command = (*commands).first;
+      string argument = (*commands).second;
+
+      if( loglevel >= 2 ){
+        log << "[" << i+1 << "/" << requests.size() << "]: Command / Argument is " << command << " : " << argument << endl;
+        i++;
+      }
+
+      task = Task::factory( command );
+      if( task ) task->run( &session, argument );
+
+      if( !task ){
+        if( loglevel >= 1 ) log << "Unsupported command: " << command << endl;
+        // Unsupported command error code is 2 2
+        response.setError( "2 2", command );
+      }
+
+
+      // Delete our task
+      if( task ){
+        delete task;
+        task = NULL;
+      }
+
+    }
+
+
+
+    ////////////////////////////////////////////////////////
+    ////////// Send out our Errors if necessary ////////////
+    ////////////////////////////////////////////////////////
+
+    /* Make sure something has actually been sent to the client
+       If no response has been sent by now, we must have a malformed command
+     */
+    if( (!response.imageSent()) && (!response.isSet()) ){
+      // Malformed command syntax error code is 2 1
+      response.setError( "2 1", request_string );
+    }
+
+
+    /* Once we have finished parsing all our OBJ and COMMAND requests
+       send out our response.
+     */
+    if( response.isSet() ){
+      if( loglevel >= 4 ){
+        log << "---" << endl <<
+          response.formatResponse() <<
+          endl << "---" << endl;
+      }
+      if( writer.printf( response.formatResponse().c_str() ) == -1 ){
+        if( loglevel >= 1 ) log << "Error sending IIPResponse" << endl;
+      }
+    }
+
+
+    ////////////////////////////////////////////////////////
+    ////////// Insert the result into Memcached  ///////////
+    ////////// - Note that we never store errors ///////////
+    //////////   or 304 replies                  ///////////
+    ////////////////////////////////////////////////////////
+
+#ifdef HAVE_MEMCACHED
+    if( memcached->connected() && writer.getBuffer() ){
+      Timer memcached_timer;
+      memcached_timer.start();
+      memcached->store( session.headers["QUERY_STRING"], (void*) writer.getBuffer(), writer.getSize() );
+      if( loglevel >= 3 ){
+        log << "Memcached :: stored " << writer.getSize() << " bytes in "
+            << memcached_timer.getTime() << " microseconds" << endl;
+      }
+    }
+#endif
+
+
+
+    //////////////////////////////////////////////////////
+    //////////////// End of try block ////////////////////
+    //////////////////////////////////////////////////////
+  }
+
+  /* Use this for sending various HTTP status codes
+   */
+  catch( const int& code ){
+
+    string status;
+
+    switch( code ){
+
+      case 304:
+        status = "Status: 304 Not Modified\r\nServer: iipsrv/" + server->version + "\r\n\r\n";
+        writer.printf( status.c_str() );
+        writer.flush();
+        if( loglevel >= 2 ){
+          log << "Sending HTTP 304 Not Modified" << endl;
+        }
+        break;
+
+      case 100:
+        if( loglevel >= 2 ){
+          log << "Memcached hit" << endl;
+        }
+        break;
+
+      default:
+        if( loglevel >= 1 ){
+          log << "Unsupported HTTP status code: " << code << endl << endl;
+        }
+     }
+  }
+
+  /* Catch any errors
+   */
+  catch( const string& error ){
+
+    if( loglevel >= 1 ){
+      log << error << endl << endl;
+    }
+
+    if( response.errorIsSet() ){
+      if( loglevel >= 4 ){
+        log << "---" << endl <<
+          response.formatResponse() <<
+          endl << "---" << endl;
+      }
+      if( writer.printf( response.formatResponse().c_str() ) == -1 ){
+        if( loglevel >= 1 ) log << "Error sending IIPResponse" << endl;
+      }
+    }
+    else{
+      /* Display our advertising banner ;-)
+       */
+      writer.printf( response.getAdvert( server->version ).c_str() );
+    }
+
+  }
+
+  /* Default catch
+   */
+  catch( ... ){
+
+    if( loglevel >= 1 ){
+      log << "Error: Default Catch: " << endl << endl;
+    }
+
+    /* Display our advertising banner ;-)
+     */
+    writer.printf( response.getAdvert( server->version ).c_str() );
+
+  }
+
+
+  /* Do some cleaning up etc. here after all the potential exceptions
+     have been handled
+   */
+  if( task ){
+    delete task;
+    task = NULL;
+  }
+  delete image;
+  image = NULL;
+  ScopedLock lock( log_mutex );
+  return ++IIPcount;
+}
+
+
+
+/* Finish off a request once our response has been completed
+ */
+void IIPComplete( Worker* worker, unsigned long count )
+{
+  Server* server = worker->server;
+  ostream& log = *worker->log;
+
+  server->prefetcher->end();
+
+
+  // How long did this request take?
+  if( loglevel >= 2 ){
+    log << "Total Request Time: " << worker->timer.getTime() << " microseconds" << endl;
+  }
+
+
+  if( loglevel >= 2 ){
+    log << "image closed and deleted" << endl;
+    if( server->prefetcher->enabled() ) log << "Prefetcher: " << server->prefetcher->getStatistics() << endl;
+    log << "TIFF pool: " << server->tiffPool->getStatistics() << endl;
+    if( server->negativeCache->enabled() ) log << "Negative cache: " << server->negativeCache->getStatistics() << endl;
+    if( server->watcher->active() ) log << "File watcher: " << server->watcher->getStatistics() << endl;
+    log << "Server count is " << count << endl << endl;
+  }
+
+  // Write out the log of this request in one go if it has been buffered
+  if( worker->buffered && loglevel >= 1 ){
+    ScopedLock lock( log_mutex );
+    logfile << worker->buffer.str();
+    logfile.flush();
+    worker->buffer.str( "" );
+  }
+}
+
+
+
+#ifdef HAVE_SYS_EPOLL_H
+/* Answer a request made to our embedded HTTP server
+ */
+void IIPHTTPHandler( void* p, const HTTPRequest& request, HTTPWriter& writer )
+{
+  Worker* worker = (Worker*) p;
+  if( loglevel >= 2 ){
+    *worker->log << "HTTP Request: " << request.method << " " << request.target << endl;
+  }
+  unsigned long count = IIPHandle( worker, writer, request.query,
+				   request.ifModifiedSince.length() ? request.ifModifiedSince.c_str() : NULL );
+  // Complete our response before letting any queued prefetching proceed
+  writer.finish();
+  IIPComplete( worker, count );
+}
+#endif
+
+
+
+/* Handle requests until we are stopped
+ */
+void IIPWorker( void* p )
+{
+  Worker* worker = (Worker*) p;
+  Server* server = worker->server;
+
+  // When several threads are handling requests, each request is logged to a buffer which is
+  // written out in one go once it has finished, so that the logs of different requests are not mixed up
+  worker->buffered = ( server->threads > 1 );
+  worker->log = worker->buffered ? (ostream*) &worker->buffer : (ostream*) &logfile;
+
+
+#ifdef DEBUG
+
+  // Debug mode handles a single request given on the command line
+  FILE *f = fopen( "test.jpg", "w" );
+  FileWriter writer( f );
+  unsigned long count = IIPHandle( worker, writer, server->argv[1], NULL );
+  fclose( f );
+  IIPComplete( worker, count );
+
+#else
+
+  // Our embedded HTTP server runs its own event loop in each thread
+#ifdef HAVE_SYS_EPOLL_H
+  if( server->http ){
+    server->http->serve( &IIPHTTPHandler, worker );
+    return;
+  }
+#endif
+
+
+  /****************
+    Main FCGI loop
+  ****************/
+
+  FCGX_Request request;
+  if( FCGX_InitRequest( &request, server->listen_socket, 0 ) ) return;
+
+  while( IIPAccept( &request ) >= 0 ){
+
+    FCGIWriter writer( request.out );
+
+    const char* query = FCGX_GetParam( "QUERY_STRING", request.envp );
+    unsigned long count = IIPHandle( worker, writer, query ? query : "",
+				     FCGX_GetParam( "HTTP_IF_MODIFIED_SINCE", request.envp ) );
+
+    // Complete our response before letting any queued prefetching proceed
+    FCGX_Finish_r( &request );
+    IIPComplete( worker, count );
+
+  }
+
+#endif
+
+}
+
+
+
 
 
 int main( int argc, char *argv[] )
@@ -187,14 +737,39 @@ int main( int argc, char *argv[] )
 
   // Set up some FCGI items and make sure we are in FCGI mode
 
+  int listen_socket = 0;
+
+  // Get the number of threads with which to handle requests
+  unsigned int threads = Environment::getRequestThreads();
+
+  // Address of our embedded HTTP server if we are to run one
+  string http_address;
+
 #ifndef DEBUG
 
-  FCGX_Request request;
-  int listen_socket = 0;
   bool standalone = false;
 
-  if( argv[1] && (string(argv[1]) == "--bind") ){
-    string socket = argv[2];
+  for( i = 1; i < argc; i++ ){
+
+    string arg = argv[i];
+
+    // Number of request threads given on the command line
+    if( arg == "--threads" && i+1 < argc ){
+      int n = atoi( argv[++i] );
+      threads = ( n > 0 ) ? n : 1;
+      continue;
+    }
+
+    // Serve requests over HTTP ourselves rather than over FCGI
+    if( arg == "--http" && i+1 < argc ){
+      http_address = argv[++i];
+      standalone = true;
+      continue;
+    }
+
+    if( arg != "--bind" ) continue;
+
+    string socket = ( i+1 < argc ) ? argv[++i] : "";
     if( !socket.length() ){
       logfile << "No socket specified" << endl << endl;
       exit(1);
@@ -208,7 +783,8 @@ int main( int argc, char *argv[] )
     logfile << "Running in standalone mode on socket: " << socket << endl << endl;
   }
 
-  if( FCGX_InitRequest( &request, listen_socket, 0 ) ) return(1);
+  // Each of our threads sets up its own request, so initialise the library for them first
+  if( FCGX_Init() ) return(1);
 
   // Check whether we are really in FCGI mode - only if we are not in standalone mode
   if( FCGX_IsCGI() ){
@@ -218,15 +794,87 @@ int main( int argc, char *argv[] )
     }
   }
   else{
-    if( loglevel >= 1 ) logfile << "Running in FCGI mode" << endl << endl;
+    if( loglevel >= 1 && !http_address.length() ) logfile << "Running in FCGI mode" << endl << endl;
   }
 
+#else
+
+  // Debug mode handles a single request
+  threads = 1;
+
 #endif
 
 
   // Set our maximum image cache size
   float max_image_cache_size = Environment::getMaxImageCacheSize();
-  imageCacheMapType imageCache;
+
+
+  // Set up our image metadata cache
+  float metadata_cache_size = Environment::getMetadataCacheSize();
+  unsigned int metadata_cache_entries = Environment::getMetadataCacheEntries();
+  ImageCache imageCache( metadata_cache_size, metadata_cache_entries );
+
+
+  // Set up our cache of images which could not be opened
+  unsigned int negative_cache_entries = Environment::getNegativeCacheEntries();
+  unsigned int negative_cache_ttl = Environment::getNegativeCacheTTL();
+  NegativeCache negativeCache( negative_cache_entries, negative_cache_ttl );
+
+
+  // Get our tile cache replacement policy
+  string cache_policy = Environment::getCachePolicy();
+  if( cache_policy != "lru" && cache_policy != "tinylfu" ) cache_policy = CACHE_POLICY;
+
+
+  // Get the size of the pinned part of the tile cache and how many resolutions it holds
+  float pinned_cache_size = Environment::getPinnedCacheSize();
+  unsigned int pinned_levels = Environment::getPinnedLevels();
+
+
+  // Get the maximum number of TIFF files to keep open between requests
+  unsigned int tiff_pool_size = Environment::getTIFFPoolSize();
+
+
+  // Get the minimum interval between checks of whether cached images have been modified
+  unsigned int metadata_revalidate = Environment::getMetadataRevalidate();
+
+
+  // Whether to watch the files of cached images for changes
+  bool watch_images = Environment::getWatchImages();
+
+
+  // Whether to read TIFF files through a memory mapping
+  bool tiff_mmap = Environment::getTIFFMmap();
+
+
+  // Whether JPEG encoded tiles may be sent without being decoded and re-encoded
+  bool jpeg_passthrough = Environment::getJPEGPassthrough();
+
+
+  // Get the number of threads shared by our requests with which to decode the tiles of large regions
+  unsigned int region_threads = Environment::getRegionThreads();
+
+
+  // Get the number of rows of tiles and strips which may be queued between the stages of image exports
+  unsigned int pipeline_depth = Environment::getPipelineDepth();
+
+
+  // Get the number of background prefetch threads and the size of their queue
+  unsigned int prefetch_threads = Environment::getPrefetchThreads();
+  unsigned int prefetch_queue = Environment::getPrefetchQueue();
+
+
+  // Get the path of our cache snapshot and the amount of tile data to save in it
+  string cache_snapshot = Environment::getCacheSnapshot();
+  float cache_snapshot_size = Environment::getCacheSnapshotSize();
+
+
+  // Get our warm-up manifest, the number of resolutions to load for each image and our limits
+  string warmup_manifest = Environment::getWarmupManifest();
+  unsigned int warmup_levels = Environment::getWarmupLevels();
+  unsigned int warmup_time = Environment::getWarmupTime();
+  float warmup_size = Environment::getWarmupSize();
+  if( warmup_size == 0 ) warmup_size = max_image_cache_size + pinned_cache_size;
 
 
   // Get our image pattern variable
@@ -257,7 +905,43 @@ int main( int argc, char *argv[] )
 
   // Print out some information
   if( loglevel >= 1 ){
+    logfile << "Handling requests with " << threads << " thread" << ( threads > 1 ? "s" : "" ) << endl;
+    if( region_threads > 0 ){
+      logfile << "Decoding the tiles of regions in parallel with " << region_threads << " shared threads" << endl;
+    }
+    if( pipeline_depth > 0 ){
+      logfile << "Overlapping the decoding, processing and compression of exports with queues of "
+	      << pipeline_depth << " strips" << endl;
+    }
     logfile << "Setting maximum image cache size to " << max_image_cache_size << "MB" << endl;
+    logfile << "Setting tile cache replacement policy to " << cache_policy << endl;
+    logfile << "Setting image metadata cache to " << metadata_cache_entries << " images in at most "
+	    << metadata_cache_size << "MB" << endl;
+    if( negativeCache.enabled() ){
+      logfile << "Remembering up to " << negative_cache_entries << " images which could not be opened for "
+	      << negative_cache_ttl << "s" << endl;
+    }
+    if( pinned_cache_size > 0 && pinned_levels > 0 ){
+      logfile << "Pinning the lowest " << pinned_levels << " resolutions of recently used images in "
+	      << pinned_cache_size << "MB" << endl;
+    }
+    logfile << "Setting maximum number of TIFF files kept open to " << tiff_pool_size << endl;
+    logfile << "Setting image metadata revalidation interval to " << metadata_revalidate << "s" << endl;
+    logfile << "Watching of image files for changes is " << ( watch_images ? "enabled" : "disabled" ) << endl;
+    logfile << "Memory mapped TIFF reading is " << ( tiff_mmap ? "enabled" : "disabled" ) << endl;
+    logfile << "JPEG tile passthrough is " << ( jpeg_passthrough ? "enabled" : "disabled" ) << endl;
+    if( cache_snapshot.length() > 0 ){
+      logfile << "Saving image metadata and up to " << cache_snapshot_size << "MB of tiles to cache snapshot '"
+	      << cache_snapshot << "' on exit" << endl;
+    }
+    if( warmup_manifest.length() > 0 ){
+      logfile << "Warming up caches from manifest '" << warmup_manifest << "' with the lowest " << warmup_levels
+	      << " resolutions, for at most " << warmup_time << "s and " << warmup_size << "MB" << endl;
+    }
+    if( prefetch_threads > 0 ){
+      logfile << "Setting up " << prefetch_threads << " tile prefetch threads with a queue of "
+	      << prefetch_queue << " tiles" << endl;
+    }
     logfile << "Setting filesystem prefix to '" << filesystem_prefix << "'" << endl;
     logfile << "Setting default JPEG quality to " << jpeg_quality << endl;
     logfile << "Setting maximum CVT size to " << max_CVT << endl;
@@ -289,6 +973,43 @@ int main( int argc, char *argv[] )
   }
 
 
+  // Attach to the cache shared by all processes on this host, creating it if necessary
+  string shared_cache_name = Environment::getSharedCacheName();
+  float shared_cache_size = Environment::getSharedCacheSize();
+  SharedCache sharedCache( shared_cache_name, shared_cache_size );
+  if( shared_cache_size > 0 ){
+    try{
+      sharedCache.open();
+      if( loglevel >= 1 ){
+	if( sharedCache.replaced() ) logfile << "Replaced stale shared memory tile cache '" << shared_cache_name << "'" << endl;
+	logfile << "Shared memory tile cache '" << shared_cache_name << "' attached with size "
+		<< sharedCache.getSize() << "MB" << endl;
+      }
+    }
+    catch( const string& error ){
+      if( loglevel >= 1 ) logfile << "Unable to attach shared memory tile cache: " << error << endl;
+    }
+  }
+
+
+  // Set up our disk cache if we have been given a directory
+  string disk_cache_path = Environment::getDiskCachePath();
+  float disk_cache_size = Environment::getDiskCacheSize();
+  DiskCache diskCache( disk_cache_path, disk_cache_size );
+  if( disk_cache_path.length() > 0 ){
+    try{
+      diskCache.open();
+      if( loglevel >= 1 ){
+	logfile << "Disk tile cache enabled in '" << disk_cache_path << "' with maximum size "
+		<< disk_cache_size << "MB" << endl;
+      }
+    }
+    catch( const string& error ){
+      if( loglevel >= 1 ) logfile << "Unable to open disk tile cache: " << error << endl;
+    }
+  }
+
+
 #ifdef HAVE_MEMCACHED
 
   // Get our list of memcached servers if we have any and the timeout
@@ -366,12 +1087,25 @@ int main( int argc, char *argv[] )
   ***********************************************************/
 
 #ifndef WIN32
-  signal( SIGUSR1, IIPSignalHandler );
-  signal( SIGHUP, IIPSignalHandler );
-#endif
-
+  // Signals must interrupt the wait for a new connection rather than restart it,
+  // so that we can leave the main loop when saving a snapshot of our caches
+  struct sigaction action;
+  memset( &action, 0, sizeof(action) );
+  action.sa_handler = IIPSignalHandler;
+  sigemptyset( &action.sa_mask );
+  action.sa_flags = 0;
+  sigaction( SIGUSR1, &action, NULL );
+  sigaction( SIGHUP, &action, NULL );
+  sigaction( SIGTERM, &action, NULL );
+  sigaction( SIGINT, &action, NULL );
+
+  // Interrupts our thread waiting for a connection when we are stopped
+  action.sa_handler = IIPWakeHandler;
+  sigaction( SIGURG, &action, NULL );
+#else
   signal( SIGTERM, IIPSignalHandler );
   signal( SIGINT, IIPSignalHandler );
+#endif
 
 
 
@@ -382,332 +1116,206 @@ int main( int argc, char *argv[] )
   }
 
 
-  // Set up our request timers and seed our random number generator with the millisecond count from it
-  Timer request_timer;
-  srand( request_timer.getTime() );
+  // Seed our random number generator with the millisecond count from a timer
+  Timer timer;
+  srand( timer.getTime() );
 
   // Create our tile cache
-  Cache tileCache( max_image_cache_size );
-  Task* task = NULL;
-
-
-
-  /****************
-    Main FCGI loop
-  ****************/
-
-#ifdef DEBUG
-  int status = true;
-  while( status ){
-
-    FILE *f = fopen( "test.jpg", "w" );
-    FileWriter writer( f );
-    status = false;
-
-#else
-
-  while( FCGX_Accept_r( &request ) >= 0 ){
-
-    FCGIWriter writer( request.out );
-
-#endif
-
-
-    // Time each request
-    if( loglevel >= 2 ) request_timer.start();
-
+  Cache tileCache( max_image_cache_size, ( cache_policy == "tinylfu" ) ? TINYLFU : LRU );
+  tileCache.setSharedCache( &sharedCache );
+  tileCache.setDiskCache( &diskCache );
+  tileCache.pin( pinned_cache_size, pinned_levels );
+
+  // Keep TIFF files open between requests
+  TIFFPool tiffPool( tiff_pool_size );
+  IIPImage::setRevalidationInterval( metadata_revalidate );
+  TIFFMap::setEnabled( tiff_mmap );
+  TPTImage::setPool( &tiffPool );
+  TPTImage::setJPEGPassthrough( jpeg_passthrough );
+  TileManager::setPassthroughQuality( jpeg_quality );
+
+  // Watch the files of cached images, so that we can drop them from our caches as soon as they
+  // change instead of checking their modification times. Cached metadata then never needs revalidating
+  FileWatcher watcher;
+  if( watch_images ){
+    if( watcher.open() ){
+      IIPImage::setRevalidationInterval( UINT_MAX );
+      tiffPool.setWatched( true );
+    }
+    else{
+      if( loglevel >= 1 ) logfile << "Unable to watch image files for changes on this platform" << endl;
+      watch_images = false;
+    }
+  }
 
-    // Declare our image pointer here outside of the try scope
-    //  so that we can close the image on exceptions
-    IIPImage *image = NULL;
-    JPEGCompressor jpeg( jpeg_quality );
+  // Restore the caches saved by a previous process and save them again when we are stopped
+  CacheSnapshot snapshot( cache_snapshot, cache_snapshot_size );
+  if( cache_snapshot.length() > 0 ){
+    Timer snapshot_timer;
+    snapshot_timer.start();
+    try{
+      if( snapshot.load( imageCache, tileCache, watcher.active() ? &watcher : NULL ) && loglevel >= 1 ){
+	logfile << "Restored " << snapshot.getNumImages() << " images and " << snapshot.getNumTiles() << " tiles ("
+		<< snapshot.getTileSize() << "MB) from cache snapshot in " << snapshot_timer.getTime()
+		<< " microseconds" << endl;
+      }
+    }
+    catch( const string& error ){
+      if( loglevel >= 1 ) logfile << "Unable to restore cache snapshot: " << error << endl;
+    }
+    graceful_shutdown = true;
+  }
 
+  // With several request threads, a signal also lets those which are busy finish their requests,
+  // so that we do not exit while they are writing to the log or responding
+  if( threads > 1 ) graceful_shutdown = true;
 
-    // View object for use with the CVT command etc
-    View view;
-    if( max_CVT != -1 ){
-      view.setMaxSize( max_CVT );
-      if( loglevel >= 2 ) logfile << "CVT maximum viewport size set to " << max_CVT << endl;
+  // Load the images we have been told to expect before accepting any requests
+  if( warmup_manifest.length() > 0 ){
+    View defaults;
+    if( max_layers != 0 ) defaults.setMaxLayers( max_layers );
+    Warmup warmup( &tileCache, &imageCache, watcher.active() ? &watcher : NULL, &watermark,
+		   jpeg_quality, defaults.getLayers() );
+    try{
+      warmup.read( warmup_manifest );
+      warmup.load( warmup_levels, Thread::getNumProcessors(), warmup_time, warmup_size, &logfile, loglevel );
     }
-    if( max_layers != 0 ) view.setMaxLayers( max_layers );
-
+    catch( const string& error ){
+      if( loglevel >= 1 ) logfile << error << endl;
+    }
+  }
 
+  // Start the threads with which regions are composed if requested
+  RegionPool regionPool( region_threads );
+  regionPool.start();
+  TileManager::setRegionPool( &regionPool );
 
+  // Start our background tile prefetcher if requested
+  Prefetcher prefetcher( &tileCache, &watermark, prefetch_threads, prefetch_queue );
+  prefetcher.start();
 
 
-    // Create an IIPResponse object - we use this for the OBJ requests.
-    // As the commands return images etc, they handle their own responses.
-    IIPResponse response;
+  // Listen for HTTP requests ourselves if asked to. Each of our request threads runs an event loop
+  HTTPServer http( http_address );
+  if( http_address.length() ){
+    try{
+      http.open();
+      http_server = &http;
+      if( loglevel >= 1 ) logfile << "Running embedded HTTP server on " << http_address << endl << endl;
+    }
+    catch( const string& error ){
+      logfile << error << endl << endl;
+      exit(1);
+    }
+  }
 
 
-    try{
-      
-      // Get the query into a string
+  // Set up the state shared by our request threads
+  Server server;
+  server.version = version;
+  server.listen_socket = listen_socket;
+  server.threads = threads;
+  server.jpeg_quality = jpeg_quality;
+  server.max_CVT = max_CVT;
+  server.max_layers = max_layers;
+  server.metadata_revalidate = metadata_revalidate;
+  server.watch_images.set( watch_images );
+  server.imageCache = &imageCache;
+  server.negativeCache = &negativeCache;
+  server.tileCache = &tileCache;
+  server.tiffPool = &tiffPool;
+  server.prefetcher = &prefetcher;
+  server.watcher = &watcher;
+  server.watermark = &watermark;
+  server.http = http_server;
 #ifdef DEBUG
-      const string request_string = argv[1];
-#else
-      const string request_string = FCGX_GetParam( "QUERY_STRING", request.envp );
+  server.argv = argv;
 #endif
 
-      // Check that we actually have a request string
-      if( request_string.length() == 0 ) {
-	throw string( "QUERY_STRING not set" );
-      }
-
-      if( loglevel >=2 ){
-	logfile << "Full Request is " << request_string << endl;
-      }
-
-      
-
-      // Set up our session data object
-      Session session;
-      session.image = &image;
-      session.response = &response;
-      session.view = &view;
-      session.jpeg = &jpeg;
-      session.loglevel = loglevel;
-      session.logfile = &logfile;
-      session.imageCache = &imageCache;
-      session.tileCache = &tileCache;
-      session.out = &writer;
-      session.watermark = &watermark;
-      session.headers.empty();
-
-      // Get certain HTTP headers, such as if_modified_since and the query_string
-      char* header = NULL;
-      if( (header = FCGX_GetParam("HTTP_IF_MODIFIED_SINCE", request.envp)) ){
-	session.headers["HTTP_IF_MODIFIED_SINCE"] = string(header);
-	if( loglevel >= 2 ){
-	  logfile << "HTTP Header: If-Modified-Since: " << session.headers["HTTP_IF_MODIFIED_SINCE"] << endl;
-	}
-      }
-      session.headers["QUERY_STRING"] = request_string;
-
 
+  // Start our extra request threads, each with its own FastCGI request. Our signals are blocked in
+  // these so that they are delivered to this thread, which handles requests as the first of them
+  vector<Worker*> workers;
+  for( unsigned int n = 0; n < threads; n++ ){
+    Worker* worker = new Worker();
+    worker->server = &server;
 #ifdef HAVE_MEMCACHED
-      // Check whether this exists in memcached, but only if we haven't had an if_modified_since
-      // request, which should always be faster to send
-      if( !header ){
-	char* memcached_response = NULL;
-	if( (memcached_response = memcached.retrieve( request_string )) ){
-	  writer.putStr( memcached_response, memcached.length() );
-	  writer.flush();
-	  free( memcached_response );
-	  throw( 100 );
-	}
-      }
+    worker->memcached = ( n == 0 ) ? &memcached : new Memcache( memcached_servers, memcached_timeout );
 #endif
+    workers.push_back( worker );
+  }
 
-
-      // Parse up the command list
-
-      list < pair<string,string> > requests;
-      list < pair<string,string> > :: const_iterator commands;
-
-      Tokenizer izer( request_string, "&" );
-      while( izer.hasMoreTokens() ){
-	pair <string,string> p;
-	string token = izer.nextToken();
-	int n = token.find_first_of( "=" );
-	p.first = token.substr( 0, n );
-	p.second = token.substr( n+1, token.length() );
-	if( p.first.length() && p.second.length() ) requests.push_back( p );
-      }
-
-
-      i = 0;
-      for( commands = requests.begin(); commands != requests.end(); commands++ ){
-
-	string command = (*commands).first;
-	string argument = (*commands).second;
-
-	if( loglevel >= 2 ){
-	  logfile << "[" << i+1 << "/" << requests.size() << "]: Command / Argument is " << command << " : " << argument << endl;
-	  i++;
-	}
-
-	task = Task::factory( command );
-	if( task ) task->run( &session, argument );
-
-	if( !task ){
-	  if( loglevel >= 1 ) logfile << "Unsupported command: " << command << endl;
-	  // Unsupported command error code is 2 2
-	  response.setError( "2 2", command );
-	}
-
-
-	// Delete our task
-	if( task ){
-	  delete task;
-	  task = NULL;
-	}
-
-      }
-
-
-
-      ////////////////////////////////////////////////////////
-      ////////// Send out our Errors if necessary ////////////
-      ////////////////////////////////////////////////////////
-
-      /* Make sure something has actually been sent to the client
-	 If no response has been sent by now, we must have a malformed command
-       */
-      if( (!response.imageSent()) && (!response.isSet()) ){
-	// Malformed command syntax error code is 2 1
-	response.setError( "2 1", request_string );
-      }
-
-
-      /* Once we have finished parsing all our OBJ and COMMAND requests
-	 send out our response.
-       */
-      if( response.isSet() ){
-	if( loglevel >= 4 ){
-	  logfile << "---" << endl <<
-	    response.formatResponse() <<
-	    endl << "---" << endl;
-	}
-	if( writer.printf( response.formatResponse().c_str() ) == -1 ){
-	  if( loglevel >= 1 ) logfile << "Error sending IIPResponse" << endl;
-	}
-      }
-
-
-      ////////////////////////////////////////////////////////
-      ////////// Insert the result into Memcached  ///////////
-      ////////// - Note that we never store errors ///////////
-      //////////   or 304 replies                  ///////////
-      ////////////////////////////////////////////////////////
-
-#ifdef HAVE_MEMCACHED
-      if( memcached.connected() ){
-	Timer memcached_timer;
-	memcached_timer.start();
-	memcached.store( session.headers["QUERY_STRING"], writer.buffer, writer.sz );
-	if( loglevel >= 3 ){
-	  logfile << "Memcached :: stored " << writer.sz << " bytes in "
-		  << memcached_timer.getTime() << " microseconds" << endl;
-	}
-      }
+#ifndef WIN32
+  sigset_t signals, mask;
+  sigemptyset( &signals );
+  sigaddset( &signals, SIGUSR1 );
+  sigaddset( &signals, SIGHUP );
+  sigaddset( &signals, SIGTERM );
+  sigaddset( &signals, SIGINT );
+  pthread_sigmask( SIG_BLOCK, &signals, &mask );
 #endif
-
-
-
-      //////////////////////////////////////////////////////
-      //////////////// End of try block ////////////////////
-      //////////////////////////////////////////////////////
-    }
-
-    /* Use this for sending various HTTP status codes
-     */
-    catch( const int& code ){
-
-      string status;
-
-      switch( code ){
-
-        case 304:
-	  status = "Status: 304 Not Modified\r\nServer: iipsrv/" + version + "\r\n\r\n";
-	  writer.printf( status.c_str() );
-	  writer.flush();
-          if( loglevel >= 2 ){
-	    logfile << "Sending HTTP 304 Not Modified" << endl;
-	  }
-	  break;
-
-        case 100:
-	  if( loglevel >= 2 ){
-	    logfile << "Memcached hit" << endl;
-	  }
-	  break;
-
-        default:
-          if( loglevel >= 1 ){
-	    logfile << "Unsupported HTTP status code: " << code << endl << endl;
-	  }
-       }
+  for( unsigned int n = 1; n < workers.size(); n++ ){
+    if( !workers[n]->thread.start( &IIPWorker, workers[n] ) && loglevel >= 1 ){
+      logfile << "Unable to start request thread " << n << endl;
     }
+  }
+#ifndef WIN32
+  pthread_sigmask( SIG_SETMASK, &mask, NULL );
+#endif
 
-    /* Catch any errors
-     */
-    catch( const string& error ){
-
-      if( loglevel >= 1 ){
-	logfile << error << endl << endl;
-      }
+  IIPWorker( workers[0] );
 
-      if( response.errorIsSet() ){
-	if( loglevel >= 4 ){
-	  logfile << "---" << endl <<
-	    response.formatResponse() <<
-	    endl << "---" << endl;
-	}
-	if( writer.printf( response.formatResponse().c_str() ) == -1 ){
-	  if( loglevel >= 1 ) logfile << "Error sending IIPResponse" << endl;
-	}
-      }
-      else{
-	/* Display our advertising banner ;-)
-	 */
-	writer.printf( response.getAdvert( version ).c_str() );
-      }
+  // Wait for our other threads to finish their last requests
+  for( unsigned int n = 0; n < workers.size(); n++ ){
+    workers[n]->thread.join();
+#ifdef HAVE_MEMCACHED
+    if( n > 0 ) delete workers[n]->memcached;
+#endif
+    delete workers[n];
+  }
 
-    }
 
-    /* Default catch
-     */
-    catch( ... ){
 
+  // Save our caches for the next process
+  if( cache_snapshot.length() > 0 ){
+    Timer snapshot_timer;
+    snapshot_timer.start();
+    prefetcher.begin();
+    try{
+      snapshot.save( imageCache, tileCache );
       if( loglevel >= 1 ){
-	logfile << "Error: Default Catch: " << endl << endl;
+	logfile << endl << "Saved " << snapshot.getNumImages() << " images and " << snapshot.getNumTiles() << " tiles ("
+		<< snapshot.getTileSize() << "MB) to cache snapshot in " << snapshot_timer.getTime()
+		<< " microseconds" << endl;
       }
-
-      /* Display our advertising banner ;-)
-       */
-      writer.printf( response.getAdvert( version ).c_str() );
-
     }
-
-
-    /* Do some cleaning up etc. here after all the potential exceptions
-       have been handled
-     */
-    if( task ){
-      delete task;
-      task = NULL;
-    }
-    delete image;
-    image = NULL;
-    IIPcount ++;
-
-#ifdef DEBUG
-    fclose( f );
-#endif
-
-
-
-    // How long did this request take?
-    if( loglevel >= 2 ){
-      logfile << "Total Request Time: " << request_timer.getTime() << " microseconds" << endl;
+    catch( const string& error ){
+      if( loglevel >= 1 ) logfile << endl << "Unable to save cache snapshot: " << error << endl;
     }
+  }
 
 
-    if( loglevel >= 2 ){
-      logfile << "image closed and deleted" << endl
-	      << "Server count is " << IIPcount << endl << endl;
-      
+  if( caught_signal ){
+    if( loglevel >= 1 ){
+      if( prefetcher.enabled() ) logfile << endl << "Prefetcher: " << prefetcher.getStatistics();
+      if( regionPool.enabled() ) logfile << endl << "Region pool: " << regionPool.getStatistics();
+      logfile << endl << "TIFF pool: " << tiffPool.getStatistics();
+      if( negativeCache.enabled() ) logfile << endl << "Negative cache: " << negativeCache.getStatistics();
+      if( watcher.active() ) logfile << endl << "File watcher: " << watcher.getStatistics();
+      if( http_server ) logfile << endl << "HTTP server: " << http.getStatistics();
     }
-
-
-
-    ///////// End of FCGI_ACCEPT while loop or for loop in debug mode //////////
+    IIPSignalLog( caught_signal );
+    return( 1 );
   }
 
 
-
   if( loglevel >= 1 ){
+    if( prefetcher.enabled() ) logfile << endl << "Prefetcher: " << prefetcher.getStatistics();
+    if( regionPool.enabled() ) logfile << endl << "Region pool: " << regionPool.getStatistics();
+    logfile << endl << "TIFF pool: " << tiffPool.getStatistics();
+    if( negativeCache.enabled() ) logfile << endl << "Negative cache: " << negativeCache.getStatistics();
+    if( watcher.active() ) logfile << endl << "File watcher: " << watcher.getStatistics();
+    if( http_server ) logfile << endl << "HTTP server: " << http.getStatistics();
     logfile << endl << "Terminating after " << IIPcount << " iterations" << endl;
     logfile.close();
   }
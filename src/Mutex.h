@@ -0,0 +1,244 @@
+// Mutex Class
+
+/*  IIP Image Server
+
+    Copyright (C) 2014 Ruven Pillay.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#ifndef _MUTEX_H
+#define _MUTEX_H
+
+
+#ifdef WIN32
+#include <windows.h>
+#include <intrin.h>
+#else
+#include <pthread.h>
+#endif
+
+
+
+/// Simple portable mutual exclusion lock
+
+class Mutex {
+
+ private:
+
+#ifdef WIN32
+  CRITICAL_SECTION mutex;
+#else
+  pthread_mutex_t mutex;
+#endif
+
+  /// Conditions need access to the underlying lock
+  friend class Condition;
+
+  /// Mutexes cannot be copied
+  Mutex( const Mutex& );
+  Mutex& operator = ( const Mutex& );
+
+
+ public:
+
+  /// Constructor
+  Mutex() {
+#ifdef WIN32
+    InitializeCriticalSection( &mutex );
+#else
+    pthread_mutex_init( &mutex, NULL );
+#endif
+  };
+
+
+  /// Destructor
+  ~Mutex() {
+#ifdef WIN32
+    DeleteCriticalSection( &mutex );
+#else
+    pthread_mutex_destroy( &mutex );
+#endif
+  };
+
+
+  /// Acquire the lock, blocking if necessary
+  void lock() {
+#ifdef WIN32
+    EnterCriticalSection( &mutex );
+#else
+    pthread_mutex_lock( &mutex );
+#endif
+  };
+
+
+  /// Release the lock
+  void unlock() {
+#ifdef WIN32
+    LeaveCriticalSection( &mutex );
+#else
+    pthread_mutex_unlock( &mutex );
+#endif
+  };
+
+};
+
+
+
+/// Condition variable used together with a Mutex
+
+class Condition {
+
+ private:
+
+#ifdef WIN32
+  CONDITION_VARIABLE condition;
+#else
+  pthread_cond_t condition;
+#endif
+
+  /// Conditions cannot be copied
+  Condition( const Condition& );
+  Condition& operator = ( const Condition& );
+
+
+ public:
+
+  /// Constructor
+  Condition() {
+#ifdef WIN32
+    InitializeConditionVariable( &condition );
+#else
+    pthread_cond_init( &condition, NULL );
+#endif
+  };
+
+
+  /// Destructor
+  ~Condition() {
+#ifndef WIN32
+    pthread_cond_destroy( &condition );
+#endif
+  };
+
+
+  /// Atomically release a locked mutex and wait to be woken, reacquiring the mutex before returning
+  /** @param m mutex held by the caller */
+  void wait( Mutex& m ) {
+#ifdef WIN32
+    SleepConditionVariableCS( &condition, &m.mutex, INFINITE );
+#else
+    pthread_cond_wait( &condition, &m.mutex );
+#endif
+  };
+
+
+  /// Wake all waiting threads
+  void broadcast() {
+#ifdef WIN32
+    WakeAllConditionVariable( &condition );
+#else
+    pthread_cond_broadcast( &condition );
+#endif
+  };
+
+};
+
+
+
+/// Lock a mutex for the lifetime of this object
+
+class ScopedLock {
+
+ private:
+
+  Mutex& mutex;
+
+  /// Whether we still hold the lock
+  bool locked;
+
+  ScopedLock( const ScopedLock& );
+  ScopedLock& operator = ( const ScopedLock& );
+
+
+ public:
+
+  /// Constructor
+  /** @param m mutex to lock */
+  ScopedLock( Mutex& m ) : mutex( m ), locked( true ) { mutex.lock(); };
+
+  /// Destructor - releases the lock if we still hold it
+  ~ScopedLock() { if( locked ) mutex.unlock(); };
+
+  /// Release the lock before going out of scope
+  void unlock() {
+    if( locked ){
+      mutex.unlock();
+      locked = false;
+    }
+  };
+
+};
+
+
+
+/// Unsigned integer setting which can be read and changed by several threads without a lock
+
+class Atomic {
+
+ private:
+
+#ifdef WIN32
+  mutable volatile long value;
+#else
+  mutable volatile unsigned int value;
+#endif
+
+  Atomic( const Atomic& );
+  Atomic& operator = ( const Atomic& );
+
+
+ public:
+
+  /// Constructor
+  /** @param v initial value */
+  Atomic( unsigned int v = 0 ) : value( v ) {};
+
+  /// Return the current value
+  unsigned int get() const {
+#ifdef WIN32
+    return (unsigned int) _InterlockedCompareExchange( &value, 0, 0 );
+#else
+    return __sync_fetch_and_add( &value, 0 );
+#endif
+  };
+
+  /// Change the value
+  /** @param v new value */
+  void set( unsigned int v ) {
+#ifdef WIN32
+    _InterlockedExchange( &value, (long) v );
+#else
+    __sync_lock_test_and_set( &value, v );
+    __sync_synchronize();
+#endif
+  };
+
+};
+
+
+
+#endif
@@ -0,0 +1,195 @@
+// Negative Cache of Missing Images
+
+/*  IIP Image Server
+
+    Copyright (C) 2014 Ruven Pillay.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#ifndef _NEGATIVECACHE_H
+#define _NEGATIVECACHE_H
+
+
+#include <string>
+#include <list>
+#include <sstream>
+#include <ctime>
+
+#include "Cache.h"
+#include "Mutex.h"
+
+
+
+/// Remembers images which do not exist so that repeated requests for them fail immediately
+/** Requests for missing images each cost a stat() and, as the path might name an
+    image sequence, a glob() before failing. Crawlers and broken manifests can repeat
+    such requests many times. Failures are remembered here, keyed on the decoded image
+    path, together with the error they produced, for a fixed time to live after which
+    the path is tried again. The cache holds a bounded number of paths and forgets the
+    oldest when full. Images which exist but could not be opened are not remembered.
+
+    The cache is thread safe.
+ */
+
+class NegativeCache {
+
+
+ private:
+
+  /// A remembered failure
+  struct Entry {
+    std::string name;
+    std::string error;
+    time_t expires;
+  };
+
+  /// Storage typedef
+  typedef std::list<Entry> EntryList;
+
+  /// Storage iterator typedef
+  typedef EntryList::iterator List_Iter;
+
+  /// Index typedef
+#ifdef HASHMAP_IS_HASHED
+  typedef HASHMAP < const std::string, List_Iter > EntryMap;
+#else
+  typedef std::map < const std::string, List_Iter > EntryMap;
+#endif
+
+  /// Max number of paths
+  unsigned int maxEntries;
+
+  /// Time to live in seconds
+  unsigned int ttl;
+
+  /// Remembered failures, most recent first
+  EntryList entryList;
+
+  /// Index of our remembered failures
+  EntryMap entryMap;
+
+  /// Statistics
+  unsigned long numHits, numExpired, numInserted;
+
+  /// Lock protecting everything above
+  mutable Mutex mutex;
+
+
+  /// The cache cannot be copied
+  NegativeCache( const NegativeCache& );
+  NegativeCache& operator = ( const NegativeCache& );
+
+
+ public:
+
+  /// Constructor
+  /** @param n maximum number of paths
+      @param t time to live in seconds. The cache is disabled if either is 0
+   */
+  NegativeCache( unsigned int n, unsigned int t ) :
+    maxEntries( n ), ttl( t ), numHits( 0 ), numExpired( 0 ), numInserted( 0 ) {};
+
+
+  /// Whether failures are remembered
+  bool enabled() const { return maxEntries > 0 && ttl > 0; };
+
+
+  /// Look up a path
+  /** @param name decoded image path
+      @param error set to the error produced when the image failed to open
+      @return true if the image failed to open within the time to live
+   */
+  bool find( const std::string& name, std::string& error ) {
+    ScopedLock lock( mutex );
+    EntryMap::iterator miter = entryMap.find( name );
+    if( miter == entryMap.end() ) return false;
+    if( time( NULL ) >= miter->second->expires ){
+      entryList.erase( miter->second );
+      entryMap.erase( miter );
+      numExpired++;
+      return false;
+    }
+    error = miter->second->error;
+    numHits++;
+    return true;
+  }
+
+
+  /// Remember a failure
+  /** @param name decoded image path
+      @param error error produced when the image failed to open
+   */
+  void insert( const std::string& name, const std::string& error ) {
+
+    if( !this->enabled() ) return;
+
+    ScopedLock lock( mutex );
+    EntryMap::iterator miter = entryMap.find( name );
+    if( miter != entryMap.end() ){
+      entryList.erase( miter->second );
+      entryMap.erase( miter );
+    }
+
+    Entry entry;
+    entry.name = name;
+    entry.error = error;
+    entry.expires = time( NULL ) + ttl;
+    entryList.push_front( entry );
+    entryMap[ name ] = entryList.begin();
+    numInserted++;
+
+    // Forget the oldest failures if we are full
+    while( entryMap.size() > maxEntries ){
+      entryMap.erase( entryList.back().name );
+      entryList.pop_back();
+    }
+  }
+
+
+  /// Forget a path
+  /** @param name decoded image path */
+  void erase( const std::string& name ) {
+    ScopedLock lock( mutex );
+    EntryMap::iterator miter = entryMap.find( name );
+    if( miter == entryMap.end() ) return;
+    entryList.erase( miter->second );
+    entryMap.erase( miter );
+  }
+
+
+  /// Return the number of paths remembered
+  unsigned int getNumElements() const { ScopedLock lock( mutex ); return entryMap.size(); };
+
+
+  /// Return the number of requests answered from the cache
+  unsigned long getHits() const { ScopedLock lock( mutex ); return numHits; };
+
+
+  /// Return a summary of the cache statistics
+  std::string getStatistics() const {
+    ScopedLock lock( mutex );
+    std::ostringstream s;
+    s << entryMap.size() << " paths, " << numHits << " hits, " << numInserted << " inserted, "
+      << numExpired << " expired";
+    return s.str();
+  }
+
+};
+
+
+
+#endif
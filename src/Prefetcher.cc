@@ -0,0 +1,375 @@
+/*
+    IIPImage Server - Member functions for Prefetcher.h
+
+    Copyright (C) 2014 Ruven Pillay.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#include "Prefetcher.h"
+#include "TileManager.h"
+
+#include <algorithm>
+#include <sstream>
+
+
+using namespace std;
+
+
+// Number of prefetched tiles remembered in order to tell whether they were used
+#define PREFETCH_HISTORY 1024
+
+// Number of images whose metadata we keep before discarding those with nothing queued
+#define PREFETCH_IMAGES 32
+
+
+
+Prefetcher::Prefetcher( Cache* tc, Watermark* w, unsigned int n, unsigned int q ){
+  tileCache = tc;
+  watermark = w;
+  numThreads = n;
+  maxQueue = ( q > 0 ) ? q : 1;
+  active = 0;
+  stopping = false;
+  numQueued = numDropped = numCached = numDecoded = numFailed = numUseful = numWasted = 0;
+}
+
+
+
+Prefetcher::~Prefetcher(){
+  {
+    ScopedLock lock( mutex );
+    stopping = true;
+    wake.broadcast();
+  }
+  for( unsigned int i=0; i<threads.size(); i++ ) delete threads[i];
+  threads.clear();
+}
+
+
+
+void Prefetcher::start(){
+  while( threads.size() < numThreads ){
+    Thread* thread = new Thread();
+    if( !thread->start( &Prefetcher::run, this ) ){
+      delete thread;
+      break;
+    }
+    threads.push_back( thread );
+  }
+}
+
+
+
+void Prefetcher::begin(){
+  ScopedLock lock( mutex );
+  active++;
+}
+
+
+
+void Prefetcher::end(){
+  ScopedLock lock( mutex );
+  if( active > 0 ) active--;
+  if( active == 0 ) wake.broadcast();
+}
+
+
+
+void Prefetcher::run( void* p ){
+  ((Prefetcher*) p)->work();
+}
+
+
+
+void Prefetcher::work(){
+
+  Thread::lowerPriority();
+
+  // Each worker keeps its own decoder open for as long as it keeps working on the same image
+  IIPImage* image = NULL;
+  bool opened = false;
+
+  while( true ){
+
+    Job job;
+
+    {
+      ScopedLock lock( mutex );
+
+      // Only start new work while no request is in progress
+      while( !stopping && ( queue.empty() || active > 0 ) ) wake.wait( mutex );
+      if( stopping ) break;
+
+      // Take the most recently queued tile
+      job = queue.back();
+      queue.pop_back();
+      queued.erase( job.key );
+
+      map<string,IIPImage>::iterator i = images.find( job.path );
+      if( i == images.end() ){
+	numDropped++;
+	continue;
+      }
+
+      // Switch decoders if we have moved on to another image or this one has been modified
+      if( image && ( image->getImagePath() != job.path || image->timestamp < i->second.timestamp ) ){
+	delete image;
+	image = NULL;
+      }
+      if( !image ){
+	try{
+	  image = IIPImage::create( i->second );
+	}
+	catch( const string& ){
+	  numFailed++;
+	  continue;
+	}
+	opened = false;
+      }
+    }
+
+    bool decoded = false;
+    try{
+      if( !opened ){
+	image->openImage();
+	opened = true;
+      }
+      decoded = this->decode( job, image );
+    }
+    catch( ... ){
+      // Start afresh with the next tile
+      delete image;
+      image = NULL;
+      ScopedLock lock( mutex );
+      numFailed++;
+      continue;
+    }
+
+    ScopedLock lock( mutex );
+    if( !decoded ){
+      numCached++;
+      continue;
+    }
+
+    numDecoded++;
+    history.push_back( job.key );
+    prefetched.insert( job.key );
+    while( history.size() > PREFETCH_HISTORY ){
+      if( prefetched.erase( history.front() ) ) numWasted++;
+      history.pop_front();
+    }
+  }
+
+  delete image;
+}
+
+
+
+bool Prefetcher::decode( const Job& job, IIPImage* image ){
+
+  const CacheKey& k = job.key;
+  CompressionType c = (CompressionType) k.compression;
+
+  // The tile may have been requested, or prefetched by another worker, since it was queued
+  RawTile rawtile;
+  if( tileCache->getTile( k.image, k.resolution, k.tile, k.hSequence, k.vSequence, c, k.quality, rawtile ) ){
+    return false;
+  }
+
+  // Decode, compress and cache the tile just as a request would, but without logging
+  JPEGCompressor jpeg( k.quality );
+  TileManager tilemanager( tileCache, image, watermark, &jpeg, NULL, 0 );
+  tilemanager.getTile( k.resolution, k.tile, k.hSequence, k.vSequence, job.layers, c );
+
+  return true;
+}
+
+
+
+void Prefetcher::keep( IIPImage& image ){
+
+  const string& path = image.getImagePath();
+
+  // Only copy the metadata, which may include large XMP or ICC profiles, if it has changed
+  map<string,IIPImage>::iterator k = images.find( path );
+  if( k != images.end() && k->second.timestamp == image.timestamp ) return;
+
+  // Discard the metadata of images with nothing left queued if we have too many
+  if( images.size() >= PREFETCH_IMAGES && k == images.end() ){
+    set<string> needed;
+    for( list<Job>::const_iterator i = queue.begin(); i != queue.end(); i++ ) needed.insert( i->path );
+    for( map<string,IIPImage>::iterator i = images.begin(); i != images.end(); ){
+      if( needed.count( i->first ) ) i++;
+      else images.erase( i++ );
+    }
+  }
+  images[path] = image;
+}
+
+
+
+void Prefetcher::add( unsigned long long id, const string& path, int r, int x0, int y0, int x1, int y1, int ntlx,
+		      int h, int v, int l, CompressionType c, int q ){
+
+  for( int y=y0; y<=y1; y++ ){
+    for( int x=x0; x<=x1; x++ ){
+
+      Job job;
+      job.key = Cache::getKey( id, r, y*ntlx + x, h, v, c, q );
+      job.path = path;
+      job.layers = l;
+
+      if( !queued.insert( job.key ).second ) continue;
+
+      // Make room by dropping the oldest queued tile
+      while( queue.size() >= maxQueue ){
+	queued.erase( queue.front().key );
+	queue.pop_front();
+	numDropped++;
+      }
+
+      queue.push_back( job );
+      numQueued++;
+    }
+  }
+}
+
+
+
+void Prefetcher::prefetch( IIPImage& image, int r, int t, int h, int v, int l, CompressionType c, int q ){
+
+  if( !this->enabled() ) return;
+
+  int numResolutions = image.getNumResolutions();
+  unsigned int tw = image.getTileWidth();
+  if( r < 0 || r >= numResolutions || tw == 0 ) return;
+
+  unsigned int width = image.getImageWidth( numResolutions - r - 1 );
+  int ntlx = ( width + tw - 1 ) / tw;
+  int x = t % ntlx;
+  int y = t / ntlx;
+
+  this->prefetchRegion( image, r, h, v, l, x * tw, y * image.getTileHeight(), 1, 1, c, q );
+}
+
+
+
+void Prefetcher::prefetchRegion( IIPImage& image, int r, int h, int v, int l,
+				 unsigned int x, unsigned int y, unsigned int w, unsigned int ht ){
+
+  // Regions are composed from uncompressed tiles unless the decoder handles them directly
+  if( image.regionDecoding() ) return;
+  this->prefetchRegion( image, r, h, v, l, x, y, w, ht, UNCOMPRESSED, 0 );
+}
+
+
+
+void Prefetcher::prefetchRegion( IIPImage& image, int r, int h, int v, int l,
+				 unsigned int x, unsigned int y, unsigned int w, unsigned int ht,
+				 CompressionType c, int q ){
+
+  if( !this->enabled() ) return;
+
+  int numResolutions = image.getNumResolutions();
+  unsigned int tw = image.getTileWidth();
+  unsigned int th = image.getTileHeight();
+  if( r < 0 || r >= numResolutions || tw == 0 || th == 0 || w == 0 || ht == 0 ) return;
+
+  // Tile range served at this resolution
+  unsigned int width = image.getImageWidth( numResolutions - r - 1 );
+  unsigned int height = image.getImageHeight( numResolutions - r - 1 );
+  int ntlx = ( width + tw - 1 ) / tw;
+  int ntly = ( height + th - 1 ) / th;
+  int x0 = x / tw;
+  int y0 = y / th;
+  int x1 = std::min( (int)( (x + w - 1) / tw ), ntlx - 1 );
+  int y1 = std::min( (int)( (y + ht - 1) / th ), ntly - 1 );
+
+  const string& path = image.getImagePath();
+  unsigned long long id = tileCache->getImageId( path );
+
+  ScopedLock lock( mutex );
+
+  // Count the served tiles which we had prefetched
+  for( int j=y0; j<=y1; j++ ){
+    for( int i=x0; i<=x1; i++ ){
+      if( prefetched.erase( Cache::getKey( id, r, j*ntlx + i, h, v, c, q ) ) ) numUseful++;
+    }
+  }
+
+  this->keep( image );
+
+  // Workers take the most recently queued tiles first, so queue the tiles covering
+  // this region at the next resolution before its neighbours at this one
+  if( r + 1 < numResolutions ){
+    unsigned int cwidth = image.getImageWidth( numResolutions - r - 2 );
+    unsigned int cheight = image.getImageHeight( numResolutions - r - 2 );
+    int cntlx = ( cwidth + tw - 1 ) / tw;
+    int cntly = ( cheight + th - 1 ) / th;
+    this->add( id, path, r+1, std::min( 2*x0, cntlx-1 ), std::min( 2*y0, cntly-1 ),
+	       std::min( 2*x1+1, cntlx-1 ), std::min( 2*y1+1, cntly-1 ), cntlx, h, v, l, c, q );
+  }
+
+  // The ring of tiles around the region
+  int left = std::max( x0-1, 0 ), right = std::min( x1+1, ntlx-1 );
+  int top = std::max( y0-1, 0 ), bottom = std::min( y1+1, ntly-1 );
+  if( y0 > 0 ) this->add( id, path, r, left, top, right, top, ntlx, h, v, l, c, q );
+  if( y1 < ntly-1 ) this->add( id, path, r, left, bottom, right, bottom, ntlx, h, v, l, c, q );
+  if( x0 > 0 ) this->add( id, path, r, left, y0, left, y1, ntlx, h, v, l, c, q );
+  if( x1 < ntlx-1 ) this->add( id, path, r, right, y0, right, y1, ntlx, h, v, l, c, q );
+
+  wake.broadcast();
+}
+
+
+
+void Prefetcher::preload( IIPImage& image, unsigned int levels, int h, int v, int l, CompressionType c, int q ){
+
+  if( !this->enabled() ) return;
+
+  unsigned int numResolutions = image.getNumResolutions();
+  unsigned int tw = image.getTileWidth();
+  unsigned int th = image.getTileHeight();
+  if( tw == 0 || th == 0 ) return;
+
+  const string& path = image.getImagePath();
+  unsigned long long id = tileCache->getImageId( path );
+
+  ScopedLock lock( mutex );
+
+  this->keep( image );
+
+  // Queue the largest of these resolutions first so that the smallest are decoded first
+  for( int r = (int) std::min( levels, numResolutions ) - 1; r >= 0; r-- ){
+    int ntlx = ( image.getImageWidth( numResolutions - r - 1 ) + tw - 1 ) / tw;
+    int ntly = ( image.getImageHeight( numResolutions - r - 1 ) + th - 1 ) / th;
+    this->add( id, path, r, 0, 0, ntlx-1, ntly-1, ntlx, h, v, l, c, q );
+  }
+
+  wake.broadcast();
+}
+
+
+
+string Prefetcher::getStatistics(){
+  ScopedLock lock( mutex );
+  ostringstream s;
+  s << numQueued << " tiles queued, " << numDropped << " dropped, " << numCached << " already cached, "
+    << numDecoded << " decoded, " << numFailed << " failed, " << numUseful << " useful, "
+    << numWasted << " wasted, " << queue.size() << " pending";
+  return s.str();
+}
@@ -0,0 +1,237 @@
+// Background Tile Prefetcher
+
+/*  IIP Image Server
+
+    Copyright (C) 2014 Ruven Pillay.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#ifndef _PREFETCHER_H
+#define _PREFETCHER_H
+
+
+#include <string>
+#include <list>
+#include <map>
+#include <set>
+#include <vector>
+
+#include "IIPImage.h"
+#include "Cache.h"
+#include "Mutex.h"
+#include "Thread.h"
+#include "Watermark.h"
+
+
+
+/// Decodes tiles which are likely to be requested next into the tile cache in the background
+/** After each tile or region is served, the tiles surrounding it at the same
+    resolution and the tiles covering it at the next higher resolution are queued.
+    A small pool of low priority worker threads decodes and compresses these into
+    the tile cache exactly as a request would, so that subsequent pans and zooms
+    become cache hits.
+
+    Prefetching never competes with requests: workers only start a new tile while
+    no request is in progress, and run at idle scheduling priority where the
+    platform allows. The queue is bounded and favours the most recent requests,
+    with the oldest queued tiles being dropped when it is full.
+
+    Each prefetched tile is remembered for a while so that we can count how many
+    were subsequently requested (useful) and how many were not (wasted).
+ */
+
+class Prefetcher {
+
+ private:
+
+  /// A queued tile
+  struct Job {
+    CacheKey key;
+    std::string path;
+    int layers;
+  };
+
+  /// Tile cache to prefetch into
+  Cache* tileCache;
+
+  /// Watermark applied to decoded tiles
+  Watermark* watermark;
+
+  /// Number of worker threads
+  unsigned int numThreads;
+
+  /// Maximum number of queued tiles
+  unsigned int maxQueue;
+
+  /// Worker threads
+  std::vector<Thread*> threads;
+
+  /// Queued tiles, oldest first
+  std::list<Job> queue;
+
+  /// Keys of queued tiles
+  std::set<CacheKey> queued;
+
+  /// Copies of the metadata of images with queued tiles
+  std::map<std::string,IIPImage> images;
+
+  /// Recently prefetched tiles which have not yet been requested, oldest first
+  std::list<CacheKey> history;
+  std::set<CacheKey> prefetched;
+
+  /// Lock protecting all of the above
+  Mutex mutex;
+
+  /// Signalled when work is queued, a request finishes or we are stopping
+  Condition wake;
+
+  /// Number of requests in progress
+  unsigned int active;
+
+  /// Whether the workers should exit
+  bool stopping;
+
+  /// Statistics
+  unsigned long numQueued, numDropped, numCached, numDecoded, numFailed, numUseful, numWasted;
+
+
+  /// Worker thread entry point
+  /** @param p this prefetcher */
+  static void run( void* p );
+
+  /// Worker loop
+  void work();
+
+  /// Decode a single queued tile
+  /** @param job tile to decode
+      @param image opened image to decode it from
+      @return true if the tile was decoded, false if it was already cached
+   */
+  bool decode( const Job& job, IIPImage* image );
+
+  /// Keep a copy of the metadata of an image for the workers
+  /** The copy is only replaced if the image's timestamp has changed. Must be called
+      with the lock held
+      @param image image being served
+   */
+  void keep( IIPImage& image );
+
+  /// Queue a rectangle of tiles
+  /** Must be called with the lock held
+      @param id image id
+      @param path image path
+      @param r resolution
+      @param x0,y0,x1,y1 tile column and row range, inclusive
+      @param ntlx number of tiles across this resolution
+      @param h horizontal sequence number
+      @param v vertical sequence number
+      @param l quality layers
+      @param c compression type
+      @param q compression quality
+   */
+  void add( unsigned long long id, const std::string& path, int r, int x0, int y0, int x1, int y1, int ntlx,
+	    int h, int v, int l, CompressionType c, int q );
+
+  /// Queue the tiles surrounding and beneath a region
+  /** @param image image being served
+      @param r resolution
+      @param h horizontal sequence number
+      @param v vertical sequence number
+      @param l quality layers
+      @param x,y,w,ht region at this resolution
+      @param c compression type
+      @param q compression quality
+   */
+  void prefetchRegion( IIPImage& image, int r, int h, int v, int l,
+		       unsigned int x, unsigned int y, unsigned int w, unsigned int ht,
+		       CompressionType c, int q );
+
+  /// Prefetchers cannot be copied
+  Prefetcher( const Prefetcher& );
+  Prefetcher& operator = ( const Prefetcher& );
+
+
+ public:
+
+  /// Constructor
+  /** @param tc tile cache
+      @param w watermark
+      @param n number of worker threads. Prefetching is disabled if this is 0
+      @param q maximum number of queued tiles
+   */
+  Prefetcher( Cache* tc, Watermark* w, unsigned int n, unsigned int q );
+
+  /// Destructor - stops the workers
+  ~Prefetcher();
+
+  /// Start the worker threads
+  void start();
+
+  /// Whether prefetching is running
+  bool enabled() const { return !threads.empty(); };
+
+  /// Mark the start of a request. Workers do not start new tiles until it ends
+  void begin();
+
+  /// Mark the end of a request
+  void end();
+
+  /// Queue the neighbours and children of a tile which has just been served
+  /** @param image image being served
+      @param r resolution
+      @param t tile number
+      @param h horizontal sequence number
+      @param v vertical sequence number
+      @param l quality layers
+      @param c compression type
+      @param q compression quality
+   */
+  void prefetch( IIPImage& image, int r, int t, int h, int v, int l, CompressionType c, int q );
+
+  /// Queue the uncompressed tiles surrounding and beneath a region which has just been served
+  /** @param image image being served
+      @param r resolution
+      @param h horizontal sequence number
+      @param v vertical sequence number
+      @param l quality layers
+      @param x left offset of the region at this resolution
+      @param y top offset of the region at this resolution
+      @param w region width
+      @param ht region height
+   */
+  void prefetchRegion( IIPImage& image, int r, int h, int v, int l,
+		       unsigned int x, unsigned int y, unsigned int w, unsigned int ht );
+
+  /// Queue every tile of the lowest resolutions of an image which has just been opened
+  /** @param image image being served
+      @param levels number of resolutions, counting from the smallest
+      @param h horizontal sequence number
+      @param v vertical sequence number
+      @param l quality layers
+      @param c compression type
+      @param q compression quality
+   */
+  void preload( IIPImage& image, unsigned int levels, int h, int v, int l, CompressionType c, int q );
+
+  /// Return a summary of the prefetch statistics
+  std::string getStatistics();
+
+};
+
+
+
+#endif
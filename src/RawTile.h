@@ -27,6 +27,11 @@
 #include <string>
 #include <cstdlib>
 #include <ctime>
+#include <utility>
+
+#ifdef WIN32
+#include <intrin.h>
+#endif
 
 
 
@@ -39,6 +44,125 @@ enum CompressionType { UNCOMPRESSED, JPEG, DEFLATE, PNG };
 /// Sample Types
 enum SampleType { FIXEDPOINT, FLOATINGPOINT };
 
+/// Ownership of a tile's data buffer
+/** OWNED: allocated for and freed by the tile.
+    BORROWED: belongs to somebody else, such as a decoder's internal buffer, and must outlive the tile.
+    SHARED: a reference counted TileBuffer which may also be held by the cache or other tiles.
+ */
+enum BufferOwnership { OWNED, BORROWED, SHARED };
+
+
+/// Reference counted buffer allowing tile data to be shared between several tiles
+/** A shared buffer is immutable: a tile wishing to modify shared data must first
+    obtain its own private copy with RawTile::detach()
+ */
+
+class TileBuffer {
+
+ private:
+
+  /// Number of tiles referring to this buffer
+#ifdef WIN32
+  volatile long references;
+#else
+  volatile int references;
+#endif
+
+  /// Buffers cannot be copied
+  TileBuffer( const TileBuffer& );
+  TileBuffer& operator = ( const TileBuffer& );
+
+  /// Destructor - only called via release()
+  ~TileBuffer() { deallocate( data, bpc, sampleType ); };
+
+
+ public:
+
+  /// Pointer to the image data
+  void *data;
+
+  /// Bits per channel with which data was allocated
+  int bpc;
+
+  /// Sample type with which data was allocated
+  SampleType sampleType;
+
+
+  /// Constructor - takes ownership of the data with a single reference
+  /** @param d data allocated with allocate()
+      @param b bits per channel
+      @param s sample type
+   */
+  TileBuffer( void* d, int b, SampleType s ) : references( 1 ), data( d ), bpc( b ), sampleType( s ) {};
+
+
+  /// Add a reference
+  void retain() {
+#ifdef WIN32
+    _InterlockedIncrement( &references );
+#else
+    __sync_add_and_fetch( &references, 1 );
+#endif
+  };
+
+
+  /// Remove a reference, deleting the buffer once it is no longer referenced
+  void release() {
+#ifdef WIN32
+    if( _InterlockedDecrement( &references ) == 0 ) delete this;
+#else
+    if( __sync_sub_and_fetch( &references, 1 ) == 0 ) delete this;
+#endif
+  };
+
+
+  /// Whether we hold the only reference to this buffer
+  bool unique() const { return references == 1; };
+
+
+  /// Allocate a data array of the correct type
+  /** @param b bits per channel
+      @param s sample type
+      @param length length in bytes
+      @return pointer to the new array
+   */
+  static void* allocate( int b, SampleType s, unsigned int length ) {
+    switch( b ){
+      case 32:
+	if( s == FLOATINGPOINT ) return new float[(length+3)/4];
+	else return new unsigned int[(length+3)/4];
+      case 16:
+	return new unsigned short[(length+1)/2];
+      default:
+	return new unsigned char[length];
+    }
+  };
+
+
+  /// Free a data array allocated with allocate()
+  /** @param d data
+      @param b bits per channel
+      @param s sample type
+   */
+  static void deallocate( void* d, int b, SampleType s ) {
+    if( !d ) return;
+    switch( b ){
+      case 32:
+        if( s == FLOATINGPOINT ) delete[] (float*) d;
+        else delete[] (unsigned int*) d;
+        break;
+      case 16:
+	delete[] (unsigned short*) d;
+        break;
+      default:
+	delete[] (unsigned char*) d;
+        break;
+    }
+  };
+
+};
+
+
 
 /// Class to represent a single image tile
 
@@ -73,10 +197,9 @@ class RawTile{
   /// Pointer to the image data
   void *data;
 
-  /// This tracks whether we have allocated memory locally for data
-  /// or whether it is simply a pointer
-  /** This is used in the destructor to make sure we deallocate correctly */
-  int memoryManaged;
+  /// Shared buffer holding our data if we refer to one, otherwise NULL
+  /** When set, data points to the shared buffer's data */
+  TileBuffer *buffer;
 
   /// The size of the data pointed to by data
   int dataLength;
@@ -115,30 +238,15 @@ class RawTile{
     width = w; height = h; bpc = b; dataLength = 0; data = NULL;
     tileNum = tn; resolution = res; hSequence = hs ; vSequence = vs;
     memoryManaged = 1; channels = c; compressionType = UNCOMPRESSED; quality = 0;
-    timestamp = 0; sampleType = FIXEDPOINT; padded = false;
+    timestamp = 0; sampleType = FIXEDPOINT; padded = false; buffer = NULL;
   };
 
 
   /// Destructor to free the data array if is has previously be allocated locally
-  ~RawTile() {
-    if( data && memoryManaged ){
-      switch( bpc ){
-      case 32:
-        if( sampleType == FLOATINGPOINT ) delete[] (float*) data;
-        else delete[] (unsigned int*) data;
-        break;
-      case 16:
-	delete[] (unsigned short*) data;
-        break;
-      default:
-	delete[] (unsigned char*) data;
-        break;
-      }
-    }
-  }
+  ~RawTile() { deallocate(); }
 
 
-  /// Copy constructor - handles copying of data buffer
+  /// Copy constructor - copies our data buffer or shares it if it is a shared buffer
   RawTile( const RawTile& tile ) {
 
     dataLength = tile.dataLength;
@@ -157,29 +265,21 @@ class RawTile{
     sampleType = tile.sampleType;
     padded = tile.padded;
 
-    switch( bpc ){
-      case 32:
-	if( sampleType == FLOATINGPOINT ) data = new float[dataLength/4];
-	else data = new unsigned int[dataLength/4];
-	break;
-      case 16:
-	data = new unsigned short[dataLength/2];
-	break;
-      default:
-	data = new unsigned char[dataLength];
-	break;
-    }
-
-    if( data && (dataLength > 0) && tile.data ){
-      memcpy( data, tile.data, dataLength );
-      memoryManaged = 1;
-    }
+    data = NULL;
+    buffer = NULL;
+    memoryManaged = 1;
+    copyData( tile );
   }
 
 
-  /// Copy assignment constructor
+  /// Copy assignment constructor - copies our data buffer or shares it if it is a shared buffer
   RawTile& operator= ( const RawTile& tile ) {
 
+    if( this == &tile ) return *this;
+
+    // Free any existing data before taking on the new tile's parameters
+    deallocate();
+
     dataLength = tile.dataLength;
     width = tile.width;
     height = tile.height;
@@ -196,27 +296,171 @@ class RawTile{
     sampleType = tile.sampleType;
     padded = tile.padded;
 
-    switch( bpc ){
-      case 32:
-	if( sampleType == FLOATINGPOINT ) data = new float[dataLength/4];
-	else data = new int[dataLength/4];
-	break;
-      case 16:
-	data = new unsigned short[dataLength/2];
-	break;
-      default:
-	data = new unsigned char[dataLength];
-	break;
-    }
+    copyData( tile );
 
-    if( data && (dataLength > 0) && tile.data ){
-      memcpy( data, tile.data, dataLength );
-      memoryManaged = 1;
-    }
+    return *this;
+  }
+
+
+#if __cplusplus >= 201103L
+
+  /// Move constructor - takes over the other tile's data without copying it
+  RawTile( RawTile&& tile ) : filename( std::move( tile.filename ) ) {
+    tileNum = tile.tileNum;
+    resolution = tile.resolution;
+    hSequence = tile.hSequence;
+    vSequence = tile.vSequence;
+    compressionType = tile.compressionType;
+    quality = tile.quality;
+    timestamp = tile.timestamp;
+    width = tile.width;
+    height = tile.height;
+    channels = tile.channels;
+    bpc = tile.bpc;
+    sampleType = tile.sampleType;
+    padded = tile.padded;
+
+    data = tile.data;
+    buffer = tile.buffer;
+    memoryManaged = tile.memoryManaged;
+    dataLength = tile.dataLength;
+
+    tile.data = NULL;
+    tile.buffer = NULL;
+    tile.memoryManaged = 1;
+    tile.dataLength = 0;
+  }
+
+
+  /// Move assignment - takes over the other tile's data without copying it
+  RawTile& operator= ( RawTile&& tile ) {
+
+    if( this == &tile ) return *this;
+
+    deallocate();
+
+    tileNum = tile.tileNum;
+    resolution = tile.resolution;
+    hSequence = tile.hSequence;
+    vSequence = tile.vSequence;
+    compressionType = tile.compressionType;
+    quality = tile.quality;
+    filename = std::move( tile.filename );
+    timestamp = tile.timestamp;
+    width = tile.width;
+    height = tile.height;
+    channels = tile.channels;
+    bpc = tile.bpc;
+    sampleType = tile.sampleType;
+    padded = tile.padded;
+
+    data = tile.data;
+    buffer = tile.buffer;
+    memoryManaged = tile.memoryManaged;
+    dataLength = tile.dataLength;
+
+    tile.data = NULL;
+    tile.buffer = NULL;
+    tile.memoryManaged = 1;
+    tile.dataLength = 0;
 
     return *this;
   }
 
+#endif
+
+
+  /// Return the ownership of our data buffer
+  BufferOwnership getOwnership() const {
+    if( buffer ) return SHARED;
+    return memoryManaged ? OWNED : BORROWED;
+  }
+
+
+  /// Allocate a new owned data buffer for the current bpc and sample type, freeing any existing one
+  /** @param length length in bytes */
+  void allocate( unsigned int length ) {
+    deallocate();
+    data = TileBuffer::allocate( bpc, sampleType, length );
+    dataLength = length;
+  }
+
+
+  /// Take ownership of a data buffer
+  /** Any existing data is first freed using the current bpc and sample type
+      @param d data allocated with new[] as an array of the tile's type
+      @param length length in bytes
+   */
+  void adopt( void* d, unsigned int length ) {
+    deallocate();
+    data = d;
+    dataLength = length;
+  }
+
+
+  /// Refer to a data buffer owned by somebody else without copying it
+  /** The buffer must remain valid for as long as this tile uses it.
+      Any existing data is first freed
+      @param d data
+      @param length length in bytes
+   */
+  void borrow( void* d, unsigned int length ) {
+    deallocate();
+    data = d;
+    dataLength = length;
+    memoryManaged = 0;
+  }
+
+
+  /// Free our data or release our reference to a shared buffer
+  /** Any data subsequently assigned to this tile will be owned by it */
+  void deallocate() {
+    if( buffer ) buffer->release();
+    else if( data && memoryManaged ) TileBuffer::deallocate( data, bpc, sampleType );
+    buffer = NULL;
+    data = NULL;
+    memoryManaged = 1;
+  }
+
+
+  /// Convert our data into a shared buffer
+  /** Subsequent copies of this tile will then refer to the same data rather than
+      copying it. The data must not be modified in place after this call without
+      first calling detach()
+   */
+  void share() {
+    if( buffer || !data ) return;
+    // We cannot share data we do not own
+    if( !memoryManaged ) detach();
+    buffer = new TileBuffer( data, bpc, sampleType );
+    memoryManaged = 0;
+  }
+
+
+  /// Make sure we have a private copy of our data which we are free to modify
+  void detach() {
+    if( buffer ){
+      if( buffer->unique() ){
+	// We are the only user, so simply take ownership
+	buffer->data = NULL;
+      }
+      else{
+	void *d = TileBuffer::allocate( buffer->bpc, buffer->sampleType, dataLength );
+	memcpy( d, data, dataLength );
+	data = d;
+      }
+      buffer->release();
+      buffer = NULL;
+      memoryManaged = 1;
+    }
+    else if( data && !memoryManaged ){
+      void *d = TileBuffer::allocate( bpc, sampleType, dataLength );
+      memcpy( d, data, dataLength );
+      data = d;
+      memoryManaged = 1;
+    }
+  }
+
 
   /// Return the size of the data
   int size() { return dataLength; }
@@ -252,6 +496,32 @@ class RawTile{
   }
 
 
+ private:
+
+  /// This tracks whether we have allocated memory locally for data
+  /// or whether it is simply a pointer
+  /** This is used in the destructor to make sure we deallocate correctly.
+      Use getOwnership(), allocate(), adopt() or borrow() to query or change it */
+  int memoryManaged;
+
+
+  /// Copy or share the data of another tile. Our own data must already have been freed
+  void copyData( const RawTile& tile ) {
+    if( tile.buffer ){
+      // Shared data: just take a reference
+      tile.buffer->retain();
+      buffer = tile.buffer;
+      data = tile.data;
+      memoryManaged = 0;
+    }
+    else if( dataLength > 0 ){
+      data = TileBuffer::allocate( bpc, sampleType, dataLength );
+      if( tile.data ) memcpy( data, tile.data, dataLength );
+      memoryManaged = 1;
+    }
+  }
+
+
 };
 
 
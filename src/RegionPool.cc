@@ -0,0 +1,226 @@
+/*
+    IIPImage Server - Member functions for RegionPool.h
+
+    Copyright (C) 2014 Ruven Pillay.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#include "RegionPool.h"
+
+#include <sstream>
+
+
+using namespace std;
+
+
+
+RegionPool::~RegionPool(){
+  {
+    ScopedLock lock( mutex );
+    stopping = true;
+    wake.broadcast();
+  }
+  for( unsigned int i=0; i<threads.size(); i++ ) delete threads[i];
+  threads.clear();
+}
+
+
+
+void RegionPool::start(){
+  while( threads.size() < numThreads ){
+    Thread* thread = new Thread();
+    if( !thread->start( &RegionPool::run, this ) ){
+      delete thread;
+      break;
+    }
+    threads.push_back( thread );
+  }
+}
+
+
+
+void RegionPool::run( void* p ){
+  ((RegionPool*) p)->work();
+}
+
+
+
+RegionPool::Job* RegionPool::take( unsigned int& n ){
+  for( list<Job*>::iterator i = jobs.begin(); i != jobs.end(); i++ ){
+    Job* job = *i;
+    if( job->failed || job->next >= job->tiles->size() ) continue;
+    n = job->next++;
+    job->active++;
+    numTiles++;
+    return job;
+  }
+  return NULL;
+}
+
+
+
+void RegionPool::finish( Job* job, const string* error ){
+  ScopedLock lock( mutex );
+  if( error && !job->failed ){
+    job->failed = true;
+    job->error = *error;
+  }
+  job->active--;
+  finished.broadcast();
+}
+
+
+
+void RegionPool::work(){
+
+  // Our decoder stays open across jobs for the same image
+  IIPImage* image = NULL;
+
+  while( true ){
+
+    Job* job = NULL;
+    unsigned int n = 0;
+
+    {
+      ScopedLock lock( mutex );
+      while( !stopping && !( job = this->take( n ) ) ){
+	// Give back our file handle while we have nothing to do
+	delete image;
+	image = NULL;
+	wake.wait( mutex );
+      }
+      if( stopping ) break;
+      numShared++;
+
+      // A job for another image or a newer version of this one needs a fresh decoder
+      if( image && ( image->getImagePath() != job->image.getImagePath() || image->timestamp != job->image.timestamp ) ){
+	delete image;
+	image = NULL;
+      }
+    }
+
+    try{
+      if( !image ){
+	image = IIPImage::create( job->image );
+	image->openImage();
+      }
+      // Only uncompressed tiles are requested, so no compressor is needed
+      TileManager tilemanager( job->tileCache, image, job->watermark, NULL, NULL, 0 );
+      RawTile rawtile = tilemanager.getTile( job->resolution, (*job->tiles)[n].tile, job->xangle, job->yangle,
+					     job->layers, UNCOMPRESSED );
+      TileManager::copyTile( rawtile, (*job->tiles)[n], *job->region );
+      this->finish( job, NULL );
+    }
+    catch( const string& error ){
+      delete image;
+      image = NULL;
+      this->finish( job, &error );
+    }
+    catch( ... ){
+      delete image;
+      image = NULL;
+      string error = "RegionPool :: unable to decode tile";
+      this->finish( job, &error );
+    }
+  }
+
+  delete image;
+}
+
+
+
+void RegionPool::compose( TileManager& tilemanager, IIPImage* image, Cache* tc, Watermark* w,
+			  unsigned int res, int xangle, int yangle, int layers,
+			  const vector<RegionTile>& tiles, RawTile& region ) throw(string){
+
+  Job job;
+  job.image = *image;
+  job.tileCache = tc;
+  job.watermark = w;
+  job.resolution = res;
+  job.xangle = xangle;
+  job.yangle = yangle;
+  job.layers = layers;
+  job.tiles = &tiles;
+  job.region = &region;
+  job.next = 0;
+  job.active = 0;
+  job.failed = false;
+
+  // Only share out the tiles of images which our workers can open themselves
+  bool shared = false;
+  if( this->enabled() ){
+    try{
+      delete IIPImage::create( job.image );
+      shared = true;
+    }
+    catch( const string& ){}
+  }
+
+  {
+    ScopedLock lock( mutex );
+    numRegions++;
+    if( shared ){
+      jobs.push_back( &job );
+      wake.broadcast();
+    }
+  }
+
+  // Decode tiles ourselves alongside our workers
+  while( true ){
+
+    unsigned int n;
+    {
+      ScopedLock lock( mutex );
+      if( job.failed || job.next >= tiles.size() ) break;
+      n = job.next++;
+      job.active++;
+      numTiles++;
+    }
+
+    try{
+      RawTile rawtile = tilemanager.getTile( res, tiles[n].tile, xangle, yangle, layers, UNCOMPRESSED );
+      TileManager::copyTile( rawtile, tiles[n], region );
+      this->finish( &job, NULL );
+    }
+    catch( const string& error ){
+      this->finish( &job, &error );
+    }
+    catch( ... ){
+      string error = "RegionPool :: unable to decode tile";
+      this->finish( &job, &error );
+    }
+  }
+
+  // Wait for the tiles taken by our workers
+  {
+    ScopedLock lock( mutex );
+    while( job.active > 0 ) finished.wait( mutex );
+    if( shared ) jobs.remove( &job );
+  }
+
+  if( job.failed ) throw job.error;
+}
+
+
+
+string RegionPool::getStatistics(){
+  ScopedLock lock( mutex );
+  ostringstream s;
+  s << numRegions << " regions, " << numTiles << " tiles, " << numShared << " decoded by " << threads.size() << " workers";
+  return s.str();
+}
@@ -0,0 +1,162 @@
+// Parallel Region Composition
+
+/*  IIP Image Server
+
+    Copyright (C) 2014 Ruven Pillay.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#ifndef _REGIONPOOL_H
+#define _REGIONPOOL_H
+
+
+#include <string>
+#include <list>
+#include <vector>
+
+#include "IIPImage.h"
+#include "RawTile.h"
+#include "Cache.h"
+#include "Mutex.h"
+#include "Thread.h"
+#include "TileManager.h"
+#include "Watermark.h"
+
+
+
+/// Decodes the tiles of large regions in parallel
+/** TileManager::getRegion() hands the tiles making up a region to a pool of worker
+    threads shared by all requests. Each worker opens its own decoder for the image,
+    and so its own TIFF handle, and copies the tiles it decodes straight into their
+    part of the region. The requesting thread decodes tiles too, so that a region is
+    always completed even while every worker is busy with other requests, and the
+    number of threads decoding at once stays bounded however many requests compose
+    regions at the same time.
+
+    Regions of images which the workers cannot open themselves are composed by the
+    requesting thread alone.
+ */
+
+class RegionPool {
+
+ private:
+
+  /// A region being composed
+  struct Job {
+    IIPImage image;
+    Cache* tileCache;
+    Watermark* watermark;
+    unsigned int resolution;
+    int xangle, yangle, layers;
+    const std::vector<RegionTile>* tiles;
+    RawTile* region;
+    unsigned int next;
+    unsigned int active;
+    bool failed;
+    std::string error;
+  };
+
+  /// Number of worker threads
+  unsigned int numThreads;
+
+  /// Worker threads
+  std::vector<Thread*> threads;
+
+  /// Regions being composed, oldest first
+  std::list<Job*> jobs;
+
+  /// Lock protecting all of the above and our jobs
+  Mutex mutex;
+
+  /// Signalled when a region is added or we are stopping
+  Condition wake;
+
+  /// Signalled when a tile has been finished
+  Condition finished;
+
+  /// Whether the workers should exit
+  bool stopping;
+
+  /// Statistics
+  unsigned long numRegions, numTiles, numShared;
+
+
+  /// Worker thread entry point
+  /** @param p this pool */
+  static void run( void* p );
+
+  /// Worker loop
+  void work();
+
+  /// Take the next tile of a region, oldest region first
+  /** Must be called with the lock held
+      @param n set to the index of the tile taken
+      @return region or NULL if there is nothing to do
+   */
+  Job* take( unsigned int& n );
+
+  /// Record that a tile has been finished
+  /** @param job region
+      @param error error if the tile failed, or NULL
+   */
+  void finish( Job* job, const std::string* error );
+
+  /// The pool cannot be copied
+  RegionPool( const RegionPool& );
+  RegionPool& operator = ( const RegionPool& );
+
+
+ public:
+
+  /// Constructor
+  /** @param n number of worker threads. Regions are composed by the requesting thread alone if 0 */
+  RegionPool( unsigned int n ) : numThreads( n ), stopping( false ), numRegions( 0 ), numTiles( 0 ), numShared( 0 ) {};
+
+  /// Destructor - stops and waits for the workers
+  ~RegionPool();
+
+  /// Start the worker threads
+  void start();
+
+  /// Whether regions are composed in parallel
+  bool enabled() const { return numThreads > 0; };
+
+  /// Decode the tiles of a region and copy them into place, returning once all are done
+  /** Throws a string exception if a tile cannot be decoded
+      @param tilemanager tile manager of the requesting thread
+      @param image image decoded by the requesting thread
+      @param tc tile cache
+      @param w watermark
+      @param res resolution number
+      @param xangle horizontal sequence number
+      @param yangle vertical sequence number
+      @param layers number of quality layers
+      @param tiles tiles making up the region
+      @param region allocated region into which tiles are copied
+   */
+  void compose( TileManager& tilemanager, IIPImage* image, Cache* tc, Watermark* w,
+		unsigned int res, int xangle, int yangle, int layers,
+		const std::vector<RegionTile>& tiles, RawTile& region ) throw(std::string);
+
+  /// Return a summary of the pool statistics
+  std::string getStatistics();
+
+};
+
+
+
+#endif
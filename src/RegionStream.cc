@@ -0,0 +1,499 @@
+/*
+    IIPImage Server - Member functions for RegionStream.h
+
+    Copyright (C) 2014 Ruven Pillay.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#include "RegionStream.h"
+
+#include <cmath>
+#include <cstring>
+#include <algorithm>
+
+
+using namespace std;
+
+
+
+RegionStream::RegionStream( Cache* tc, Watermark* wm, std::ostream* s, int ll,
+			    IIPImage* im, unsigned int res, int xa, int ya, int l,
+			    unsigned int x, unsigned int y, unsigned int w, unsigned int h ) :
+  tileCache( tc ), watermark( wm ), logfile( s ), loglevel( ll ),
+  image( im ), resolution( res ), xangle( xa ), yangle( ya ), layers( l ),
+  left( x ), top( y ), width( w ), height( h ),
+  resize( false ), resampledWidth( w ), resampledHeight( h ), interpolation( 1 ),
+  cropLeft( 0 ), cropTop( 0 ), cropRight( 0 ), cropBottom( 0 ),
+  shaded( false ), gamma( 1.0 ), inverted( false ), cmapped( false ), cmap( HOT ),
+  contrast( 1.0 ), greyscale( false ), rotation( 0 ),
+  windowTop( 0 ), needed( 0 ), decoded( 0 ), row( 0 ),
+  depth( 0 ), offset( 0 ), stripHeight( 0 ),
+  started( false ), processed( false ), stopping( false ), failed( false ),
+  decodeTime( 0 ), reading( false ),
+  bandsQueued( 0 ), stripsQueued( 0 ), maxBands( 0 ), maxStrips( 0 ), numBands( 0 ), numStrips( 0 )
+{
+  shade[0] = shade[1] = 0;
+  channels = image->getNumChannels();
+  colourspace = image->getColourSpace();
+  max = image->max;
+  min = image->min;
+}
+
+
+
+RegionStream::~RegionStream(){
+
+  {
+    ScopedLock lock( mutex );
+    stopping = true;
+    changed.broadcast();
+  }
+  decoder.join();
+  processor.join();
+
+  for( list<RawTile*>::iterator i = bands.begin(); i != bands.end(); i++ ) delete *i;
+  for( list<Strip>::iterator i = strips.begin(); i != strips.end(); i++ ) delete[] i->data;
+
+  // Add the messages logged by our decoding thread
+  if( logfile && decodeLog.tellp() > 0 ) *logfile << decodeLog.str();
+}
+
+
+
+unsigned int RegionStream::bandHeight( unsigned int y ){
+  unsigned int tile_height = image->getTileHeight();
+  return std::min( ((top+y)/tile_height + 1) * tile_height, top + height ) - (top+y);
+}
+
+
+
+RawTile* RegionStream::decode() throw(string){
+
+  Timer timer;
+  timer.start();
+
+  // Decode the part of the next row of tiles which lies within our region ourselves
+  if( !started ){
+    TileManager tilemanager( tileCache, image, watermark, NULL, logfile, loglevel );
+    RawTile* band = new RawTile( tilemanager.getRegion( resolution, xangle, yangle, layers,
+							left, top + decoded, width, this->bandHeight( decoded ) ) );
+    long t = timer.getTime();
+    decodeTime += t;
+    ScopedLock lock( mutex );
+    decoding.busy += t;
+    return band;
+  }
+
+  // Otherwise wait for our decoding stage
+  ScopedLock lock( mutex );
+  while( bands.empty() && !stopping && !failed ) changed.wait( mutex );
+  long t = timer.getTime();
+  decodeTime += t;
+  processing.waiting += t;
+  if( stopping || failed ) throw string( "RegionStream :: decoding stopped" );
+
+  RawTile* band = bands.front();
+  bands.pop_front();
+  changed.broadcast();
+  return band;
+}
+
+
+
+void RegionStream::load() throw(string){
+
+  RawTile* band = this->decode();
+
+  try{
+    // Apply our pixel by pixel processing to the whole row at once
+    if( colourspace == CIELAB ) filter_LAB2sRGB( *band );
+    filter_normalize( *band, max, min );
+    if( shaded ) filter_shade( *band, shade[0], shade[1] );
+    if( gamma != 1.0 ) filter_gamma( *band, gamma );
+    if( inverted ) filter_inv( *band );
+    if( cmapped ) filter_cmap( *band, cmap );
+
+    if( band->channels != channels ){
+      throw string( "RegionStream :: unexpected number of channels in decoded region" );
+    }
+
+    float* data = (float*) band->data;
+    window.insert( window.end(), data, data + (size_t) width * band->height * channels );
+    decoded += band->height;
+  }
+  catch( ... ){
+    delete band;
+    throw;
+  }
+
+  delete band;
+}
+
+
+
+const float* RegionStream::source( unsigned int y ) throw(string){
+
+  if( y >= height ) y = height - 1;
+
+  while( y >= decoded ){
+    // Drop the rows we no longer need before adding more
+    unsigned int n = std::min( needed, decoded ) - windowTop;
+    window.erase( window.begin(), window.begin() + (size_t) n * width * channels );
+    windowTop += n;
+    this->load();
+  }
+
+  return &window[ (size_t) (y - windowTop) * width * channels ];
+}
+
+
+
+void RegionStream::resample( unsigned int j, float* out ) throw(string){
+
+  unsigned int first = cropLeft;
+  unsigned int last = ( resize ? resampledWidth : width ) - cropRight;
+
+  if( !resize ){
+    needed = j;
+    const float* in = this->source( j );
+    memcpy( out, &in[first*channels], (last-first) * channels * sizeof(float) );
+    return;
+  }
+
+  // Use exactly the same arithmetic as filter_interpolate_nearestneighbour()
+  // and filter_interpolate_bilinear() so that our output does not change
+  float xscale = (float)width / (float)resampledWidth;
+  float yscale = (float)height / (float)resampledHeight;
+  unsigned int jj = (unsigned int) floorf(j*yscale);
+  needed = jj;
+
+  if( interpolation == 0 ){
+    const float* in = this->source( jj );
+    for( unsigned int i=first; i<last; i++ ){
+      unsigned int ii = (unsigned int) floorf(i*xscale);
+      for( int k=0; k<channels; k++ ) *out++ = in[ii*channels+k];
+    }
+    return;
+  }
+
+  // Get the furthest row first, as adding rows to our window may move it
+  const float* r3 = this->source( jj+2 );
+  const float* r2 = this->source( jj+1 );
+  const float* r1 = this->source( jj );
+
+  float jscale = j*yscale;
+  float c = (float)(jj+1) - jscale;
+  float d = jscale - (float)jj;
+
+  for( unsigned int i=first; i<last; i++ ){
+
+    unsigned int ii = (unsigned int) floorf(i*xscale);
+    unsigned int p11 = (unsigned int) ( channels * ( ii + jj*width ) );
+    unsigned int resampled_index = ((i + j*resampledWidth) * channels);
+
+    // As in filter_interpolate_bilinear(), the last column takes its right hand
+    // neighbours from the start of the following rows
+    const float* d11 = &r1[ii*channels];
+    const float* d12 = &r2[ii*channels];
+    const float* d21 = ( ii+1 < width ) ? d11 + channels : r2;
+    const float* d22 = ( ii+1 < width ) ? d12 + channels : r3;
+
+    float iscale = i*xscale;
+    float a = (float)(ii+1) - iscale;
+    float b = iscale - (float)ii;
+
+    for( int k=0; k<channels; k++ ){
+      if( resampled_index == p11 ){
+	*out++ = d11[k];
+      }
+      else{
+	float tx = d11[k]*a + d21[k]*b;
+	float ty = d12[k]*a + d22[k]*b;
+	*out++ = (float)( c*tx + d*ty );
+      }
+    }
+  }
+}
+
+
+
+unsigned int RegionStream::produce( unsigned char* buffer, unsigned int rows ) throw(string){
+
+  unsigned int w = outputWidth();
+  unsigned int n = std::min( rows, outputHeight() - row );
+  if( n == 0 ) return 0;
+
+  Timer timer;
+  timer.start();
+  long waited = decodeTime;
+
+  // Resample our rows into a floating point strip
+  RawTile strip( 0, resolution, xangle, yangle, w, n, channels, 32 );
+  strip.sampleType = FLOATINGPOINT;
+  strip.allocate( w * n * channels * sizeof(float) );
+
+  for( unsigned int m=0; m<n; m++ ){
+    this->resample( row + cropTop, &((float*)strip.data)[(size_t) m * w * channels] );
+    row++;
+  }
+
+  // Clip to 8 bits with any contrast adjustment and convert to greyscale if requested
+  filter_contrast( strip, contrast );
+  if( greyscale ) filter_greyscale( strip );
+
+  memcpy( buffer, strip.data, strip.dataLength );
+
+  long t = timer.getTime() - ( decodeTime - waited );
+  ScopedLock lock( mutex );
+  processing.busy += t;
+
+  return n;
+}
+
+
+
+unsigned int RegionStream::take( unsigned char* buffer, unsigned int rows ) throw(string){
+
+  unsigned int stride = outputWidth() * getChannels();
+  unsigned int n = 0;
+
+  Timer timer;
+  timer.start();
+
+  ScopedLock lock( mutex );
+
+  while( n < rows ){
+
+    while( strips.empty() && !processed && !failed ) changed.wait( mutex );
+    if( failed ) throw error;
+    if( strips.empty() ) break;
+
+    Strip& strip = strips.front();
+    unsigned int m = std::min( rows - n, strip.rows - offset );
+    memcpy( &buffer[(size_t) n * stride], &strip.data[(size_t) offset * stride], (size_t) m * stride );
+    n += m;
+    offset += m;
+
+    if( offset == strip.rows ){
+      delete[] strip.data;
+      strips.pop_front();
+      offset = 0;
+      changed.broadcast();
+    }
+  }
+
+  output.waiting += timer.getTime();
+  return n;
+}
+
+
+
+void RegionStream::fail( const string& e ){
+  ScopedLock lock( mutex );
+  if( !failed ){
+    failed = true;
+    error = e;
+  }
+  changed.broadcast();
+}
+
+
+
+void RegionStream::runDecoder( void* p ){
+  ((RegionStream*) p)->decodeBands();
+}
+
+
+
+void RegionStream::runProcessor( void* p ){
+  ((RegionStream*) p)->processStrips();
+}
+
+
+
+void RegionStream::decodeBands(){
+
+  // Log to our own stream, as the requesting thread logs at the same time
+  TileManager tilemanager( tileCache, image, watermark, NULL, &decodeLog, loglevel );
+
+  try{
+    for( unsigned int y = 0; y < height; ){
+
+      Timer timer;
+      timer.start();
+
+      unsigned int h = this->bandHeight( y );
+      RawTile* band = new RawTile( tilemanager.getRegion( resolution, xangle, yangle, layers, left, top + y, width, h ) );
+      y += h;
+
+      ScopedLock lock( mutex );
+      decoding.busy += timer.getTime();
+
+      timer.start();
+      while( bands.size() >= depth && !stopping && !failed ) changed.wait( mutex );
+      decoding.blocked += timer.getTime();
+
+      if( stopping || failed ){
+	delete band;
+	return;
+      }
+
+      bands.push_back( band );
+      bandsQueued += bands.size();
+      maxBands = std::max( maxBands, (unsigned int) bands.size() );
+      numBands++;
+      changed.broadcast();
+    }
+  }
+  catch( const string& e ){
+    this->fail( e );
+  }
+  catch( ... ){
+    this->fail( "RegionStream :: unable to decode region" );
+  }
+}
+
+
+
+void RegionStream::processStrips(){
+
+  unsigned int stride = outputWidth() * getChannels();
+
+  while( true ){
+
+    unsigned char* data = new unsigned char[(size_t) stripHeight * stride];
+    unsigned int n;
+
+    try{
+      n = this->produce( data, stripHeight );
+    }
+    catch( const string& e ){
+      delete[] data;
+      this->fail( e );
+      return;
+    }
+    catch( ... ){
+      delete[] data;
+      this->fail( "RegionStream :: unable to process region" );
+      return;
+    }
+
+    ScopedLock lock( mutex );
+
+    if( n == 0 ){
+      delete[] data;
+      processed = true;
+      changed.broadcast();
+      return;
+    }
+
+    Timer timer;
+    timer.start();
+    while( strips.size() >= depth && !stopping && !failed ) changed.wait( mutex );
+    processing.blocked += timer.getTime();
+
+    if( stopping || failed ){
+      delete[] data;
+      return;
+    }
+
+    Strip strip = { data, n };
+    strips.push_back( strip );
+    stripsQueued += strips.size();
+    maxStrips = std::max( maxStrips, (unsigned int) strips.size() );
+    numStrips++;
+    changed.broadcast();
+  }
+}
+
+
+
+unsigned int RegionStream::read( unsigned char* buffer, unsigned int rows ) throw(string){
+
+  // Everything done by the requesting thread since our last call counts as output
+  if( reading ){
+    ScopedLock lock( mutex );
+    output.busy += outputTimer.getTime();
+  }
+
+  unsigned int n = this->next( buffer, rows );
+
+  reading = true;
+  outputTimer.start();
+  return n;
+}
+
+
+
+unsigned int RegionStream::next( unsigned char* buffer, unsigned int rows ) throw(string){
+
+  // Start our pipeline if we have more than one strip to produce. Any stage
+  // we cannot start a thread for is run by the requesting thread instead
+  if( depth > 0 && !started && !this->rotating() && outputHeight() > rows ){
+    started = decoder.start( &RegionStream::runDecoder, this );
+    stripHeight = rows;
+    if( !started || !processor.start( &RegionStream::runProcessor, this ) ) stripHeight = 0;
+  }
+
+  if( stripHeight > 0 ) return this->take( buffer, rows );
+  if( !this->rotating() ) return this->produce( buffer, rows );
+
+  // Compose our entire output at 8 bits before rotating it
+  if( !rotated.data ){
+
+    unsigned int w = outputWidth();
+    unsigned int h = outputHeight();
+    int c = getChannels();
+
+    rotated.width = w;
+    rotated.height = h;
+    rotated.channels = c;
+    rotated.bpc = 8;
+    rotated.allocate( w * h * c );
+
+    unsigned int strip_height = image->getTileHeight();
+    for( unsigned int n=0; n<h; ){
+      n += this->produce( &((unsigned char*)rotated.data)[(size_t) n * w * c], strip_height );
+    }
+
+    filter_rotate( rotated, rotation );
+    row = 0;
+  }
+
+  unsigned int stride = rotated.width * rotated.channels;
+  unsigned int n = std::min( rows, rotated.height - row );
+  memcpy( buffer, &((unsigned char*)rotated.data)[(size_t) row * stride], (size_t) n * stride );
+  row += n;
+
+  return n;
+}
+
+
+
+string RegionStream::getStatistics(){
+  ScopedLock lock( mutex );
+  ostringstream s;
+  s << "decoding " << decoding.busy << "us busy, " << decoding.blocked << "us blocked; "
+    << "processing " << processing.busy << "us busy, " << processing.waiting << "us waiting, "
+    << processing.blocked << "us blocked; "
+    << "output " << output.busy << "us busy, " << output.waiting << "us waiting";
+  if( started ){
+    s << "; queued rows of tiles " << ( numBands ? (float) bandsQueued / numBands : 0.0 ) << " (max " << maxBands << ")"
+      << ", strips " << ( numStrips ? (float) stripsQueued / numStrips : 0.0 ) << " (max " << maxStrips << ")";
+  }
+  return s.str();
+}
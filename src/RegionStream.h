@@ -0,0 +1,319 @@
+// Streaming Region Pipeline
+
+/*  IIP Image Server
+
+    Copyright (C) 2014 Ruven Pillay.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#ifndef _REGIONSTREAM_H
+#define _REGIONSTREAM_H
+
+
+#include <string>
+#include <vector>
+#include <list>
+#include <sstream>
+
+#include "IIPImage.h"
+#include "RawTile.h"
+#include "Cache.h"
+#include "Watermark.h"
+#include "TileManager.h"
+#include "Transforms.h"
+#include "Mutex.h"
+#include "Thread.h"
+#include "Timer.h"
+
+
+
+/// Produces a processed region of an image a strip of rows at a time
+/** Rows are pulled through the same stages as a region composed in one go by
+    TileManager::getRegion(): colour conversion, normalization, shading, gamma,
+    inversion and colour mapping, resizing, cropping, contrast and greyscale
+    conversion. Source rows are decoded one row of tiles at a time as they are
+    needed, so that only a row of tiles and the rows still needed for resizing are
+    held in memory, and compressed strips can be sent out while later rows are still
+    being decoded. The output is identical to that of the whole region path.
+
+    Rotation needs the whole region, so rotated regions are composed in full, at 8
+    bits per sample, before the first strip is returned.
+
+    The stages can also be run as a pipeline, with rows of tiles decoded by one thread
+    and processed into strips by another while the requesting thread compresses and
+    sends the strips it reads. Bounded queues between the stages keep memory use down
+    and let slow decoding or a stalled client overlap with compression. Each stage
+    counts the time it spends working, waiting for input and blocked on a full queue,
+    so that the stage which bounds a request shows up in getStatistics().
+ */
+
+class RegionStream {
+
+ private:
+
+  /// A strip of 8 bit output rows
+  struct Strip {
+    unsigned char* data;
+    unsigned int rows;
+  };
+
+  /// Time in microseconds spent by a stage
+  struct Stage {
+    long busy, waiting, blocked;
+    Stage() : busy( 0 ), waiting( 0 ), blocked( 0 ) {};
+  };
+
+  /// Tile cache, watermark and logging for decoding
+  Cache* tileCache;
+  Watermark* watermark;
+  std::ostream* logfile;
+  int loglevel;
+
+  /// Image and view
+  IIPImage* image;
+  unsigned int resolution;
+  int xangle, yangle, layers;
+
+  /// Region at this resolution
+  unsigned int left, top, width, height;
+
+  /// Whether and how the region is resized
+  bool resize;
+  unsigned int resampledWidth, resampledHeight;
+  unsigned int interpolation;
+
+  /// Pixels cropped from each edge of the resized region
+  int cropLeft, cropTop, cropRight, cropBottom;
+
+  /// Processing requested
+  bool shaded;
+  int shade[2];
+  float gamma;
+  bool inverted;
+  bool cmapped;
+  enum cmap_type cmap;
+  float contrast;
+  bool greyscale;
+  int rotation;
+
+  /// Number of channels of our normalized rows
+  int channels;
+
+  /// Colour space and sample range of the image, copied as decoding may update the image
+  ColourSpaces colourspace;
+  std::vector<float> max, min;
+
+  /// Normalized source rows still needed, starting from source row windowTop
+  std::vector<float> window;
+  unsigned int windowTop;
+
+  /// First source row needed for the output row being produced
+  unsigned int needed;
+
+  /// Next source row to decode
+  unsigned int decoded;
+
+  /// Next output row to produce
+  unsigned int row;
+
+  /// The complete output of a rotated region
+  RawTile rotated;
+
+  /// Number of tile rows and strips which may be queued between stages, or 0 if we are not pipelined
+  unsigned int depth;
+
+  /// Pipeline threads for decoding and processing
+  Thread decoder, processor;
+
+  /// Lock protecting our queues and statistics
+  Mutex mutex;
+
+  /// Signalled whenever a queue changes, a stage finishes or we are stopping
+  Condition changed;
+
+  /// Decoded rows of tiles waiting to be processed
+  std::list<RawTile*> bands;
+
+  /// Output strips waiting to be read and the number of rows already read from the first
+  std::list<Strip> strips;
+  unsigned int offset;
+
+  /// Height of the strips we produce when pipelined
+  unsigned int stripHeight;
+
+  /// Pipeline state
+  bool started, processed, stopping, failed;
+
+  /// First error raised by a pipeline stage
+  std::string error;
+
+  /// Log messages from our decoding thread
+  std::ostringstream decodeLog;
+
+  /// Statistics for each stage
+  Stage decoding, processing, output;
+
+  /// Time spent by our processing stage waiting for decode()
+  long decodeTime;
+
+  /// Time since output last returned from read()
+  Timer outputTimer;
+  bool reading;
+
+  /// Queue lengths after each addition: sum, maximum and number of additions
+  unsigned long bandsQueued, stripsQueued;
+  unsigned int maxBands, maxStrips;
+  unsigned long numBands, numStrips;
+
+  /// Whether our output is rotated - only multiples of 90 degrees are supported
+  bool rotating() const { return rotation % 90 == 0 && rotation % 360 != 0; };
+
+  /// Width and height of our output before any rotation
+  unsigned int outputWidth() const { return ( resize ? resampledWidth : width ) - cropLeft - cropRight; };
+  unsigned int outputHeight() const { return ( resize ? resampledHeight : height ) - cropTop - cropBottom; };
+
+  /// Return the number of source rows from source row y to the end of its row of tiles
+  unsigned int bandHeight( unsigned int y );
+
+  /// Decode the next row of tiles, or take it from our decoding stage if we are pipelined
+  RawTile* decode() throw(std::string);
+
+  /// Decode, convert and normalize the next row of tiles and add it to our window
+  void load() throw(std::string);
+
+  /// Return a source row from our window, repeating the last row of the region beyond its end
+  const float* source( unsigned int y ) throw(std::string);
+
+  /// Resample an output row
+  /** @param j row within the resized region
+      @param out buffer for the cropped row
+   */
+  void resample( unsigned int j, float* out ) throw(std::string);
+
+  /// Produce output rows without rotation
+  unsigned int produce( unsigned char* buffer, unsigned int rows ) throw(std::string);
+
+  /// Produce the next strip of output rows from our pipeline, our rotated region or ourselves
+  unsigned int next( unsigned char* buffer, unsigned int rows ) throw(std::string);
+
+  /// Read rows from the strips produced by our pipeline
+  unsigned int take( unsigned char* buffer, unsigned int rows ) throw(std::string);
+
+  /// Record the first error raised by a pipeline stage and wake everyone
+  void fail( const std::string& e );
+
+  /// Pipeline thread entry points and loops
+  /** @param p this stream */
+  static void runDecoder( void* p );
+  static void runProcessor( void* p );
+  void decodeBands();
+  void processStrips();
+
+  /// Streams cannot be copied
+  RegionStream( const RegionStream& );
+  RegionStream& operator = ( const RegionStream& );
+
+
+ public:
+
+  /// Constructor
+  /** @param tc tile cache
+      @param wm watermark
+      @param s log stream
+      @param ll logging level
+      @param im image
+      @param res resolution number
+      @param xa horizontal sequence number
+      @param ya vertical sequence number
+      @param l number of quality layers
+      @param x left of region at this resolution
+      @param y top of region at this resolution
+      @param w width of region
+      @param h height of region
+   */
+  RegionStream( Cache* tc, Watermark* wm, std::ostream* s, int ll,
+		IIPImage* im, unsigned int res, int xa, int ya, int l,
+		unsigned int x, unsigned int y, unsigned int w, unsigned int h );
+
+  /// Destructor - stops and waits for any pipeline threads
+  ~RegionStream();
+
+  /// Run our stages as a pipeline
+  /** Regions which fit into a single strip and rotated regions are always produced
+      by the requesting thread alone
+      @param d number of rows of tiles and strips which may be queued between stages
+   */
+  void setPipeline( unsigned int d ){ depth = d; };
+
+  /// Resize the region
+  /** @param w resized width
+      @param h resized height
+      @param i interpolation: 0 for nearest neighbour, otherwise bilinear
+   */
+  void setSize( unsigned int w, unsigned int h, unsigned int i ){
+    resize = true; resampledWidth = w; resampledHeight = h; interpolation = i;
+  };
+
+  /// Crop pixels from the edges of the resized region
+  void setCrop( int l, int t, int r, int b ){ cropLeft = l; cropTop = t; cropRight = r; cropBottom = b; };
+
+  /// Apply hill shading with the given incident light angles
+  void setShading( int h_angle, int v_angle ){ shaded = true; shade[0] = h_angle; shade[1] = v_angle; channels = 1; };
+
+  /// Apply a gamma correction
+  void setGamma( float g ){ gamma = g; };
+
+  /// Invert the region
+  void setInversion(){ inverted = true; };
+
+  /// Apply a colour map
+  void setColourMap( enum cmap_type c ){ cmapped = true; cmap = c; channels = 3; };
+
+  /// Apply a contrast adjustment
+  void setContrast( float c ){ contrast = c; };
+
+  /// Convert colour to greyscale
+  void setGreyscale(){ greyscale = true; };
+
+  /// Rotate the region by a multiple of 90 degrees
+  void setRotation( float angle ){ rotation = (int) angle; };
+
+  /// Return the width of our output
+  unsigned int getWidth() const { return ( rotating() && rotation % 180 == 90 ) ? outputHeight() : outputWidth(); };
+
+  /// Return the height of our output
+  unsigned int getHeight() const { return ( rotating() && rotation % 180 == 90 ) ? outputWidth() : outputHeight(); };
+
+  /// Return the number of channels of our output
+  int getChannels() const { return ( greyscale && channels == 3 ) ? 1 : channels; };
+
+  /// Produce the next strip of 8 bit output rows
+  /** Throws a string exception if the region cannot be decoded
+      @param buffer buffer for rows*getWidth()*getChannels() bytes
+      @param rows maximum number of rows to produce
+      @return number of rows produced, 0 once all have been
+   */
+  unsigned int read( unsigned char* buffer, unsigned int rows ) throw(std::string);
+
+  /// Return a summary of the time spent by each stage and the occupancy of our queues
+  std::string getStatistics();
+
+};
+
+
+
+#endif
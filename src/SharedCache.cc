@@ -0,0 +1,652 @@
+/*
+    IIPImage Server - Member functions for SharedCache.h
+
+    Copyright (C) 2014 Ruven Pillay.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#include "SharedCache.h"
+#include "Cache.h"
+#include <cstring>
+#include <cerrno>
+
+#ifndef WIN32
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <signal.h>
+#include <time.h>
+#endif
+
+
+using namespace std;
+
+
+// Size of each slab
+#define SHAREDCACHE_SLAB 1048576
+
+// Smallest chunk size and the growth factor between size classes
+#define SHAREDCACHE_MIN_CHUNK 1024
+#define SHAREDCACHE_FACTOR 1.25
+
+// Upper limit on the number of size classes
+#define SHAREDCACHE_CLASSES 48
+
+// Number of index slots examined for each key
+#define SHAREDCACHE_PROBES 8
+
+// Number of tiles which can be claimed for decoding at once
+#define SHAREDCACHE_CLAIMS 64
+
+// Seconds after which a claim is assumed to have been abandoned
+#define SHAREDCACHE_CLAIM_TIMEOUT 10
+
+#define SHAREDCACHE_MAGIC "IIPSC002"
+
+
+
+#ifndef WIN32
+
+
+/// Tile being decoded by a process: a free entry has key 0
+struct SharedCacheClaim {
+  unsigned long long key;
+  long long time;
+  int pid;
+};
+
+
+/// Header at the start of the shared memory
+struct SharedCacheHeader {
+  char magic[8];
+  unsigned long long size;                            ///< Total size of the shared memory
+  unsigned long long slabOffset;                      ///< Offset of the first slab
+  unsigned int slots;                                 ///< Number of index slots
+  unsigned int slabs;                                 ///< Number of slabs
+  unsigned int usedSlabs;                             ///< Slabs handed out so far
+  unsigned int hand;                                  ///< Next slab to reclaim once all are used
+  unsigned int classes;                               ///< Number of size classes
+  unsigned int classSize[SHAREDCACHE_CLASSES];        ///< Chunk size of each class
+  unsigned long long freeList[SHAREDCACHE_CLASSES];   ///< First free chunk of each class or 0
+  SharedCacheClaim claims[SHAREDCACHE_CLAIMS];         ///< Tiles currently being decoded
+  pthread_mutex_t mutex;
+};
+
+
+/// Index slot: an empty slot has chunk offset 0
+struct SharedCacheSlot {
+  unsigned long long key;
+  unsigned long long chunk;
+};
+
+
+/// Header of each chunk, followed by the image path and the data
+struct SharedCacheChunk {
+  unsigned long long key;                             ///< Zero if the chunk is free
+  unsigned long long next;                            ///< Next free chunk of this class
+  long long timestamp;
+  unsigned int pathLength, dataLength;
+  int resolution, tileNum, hSequence, vSequence, compressionType, quality;
+  unsigned int width, height;
+  int channels, bpc, sampleType;
+};
+
+
+#define HEADER ((SharedCacheHeader*) base)
+#define SLOTS ((SharedCacheSlot*)( base + sizeof(SharedCacheHeader) ))
+#define SLAB_CLASS ((int*)( base + sizeof(SharedCacheHeader) + HEADER->slots * sizeof(SharedCacheSlot) ))
+#define CHUNK(offset) ((SharedCacheChunk*)( base + (offset) ))
+
+
+
+SharedCache::~SharedCache(){
+  if( base ) munmap( base, size );
+  if( fd >= 0 ) close( fd );
+}
+
+
+
+void SharedCache::open() throw(string) {
+
+  if( name.empty() ) throw string( "SharedCache :: no shared memory name given" );
+
+  // Allow for twice as many index slots as tiles of an average 4kB
+  unsigned int slots = 1024;
+  while( (unsigned long long) slots < 2 * maxSize / 4096 && slots < (1U<<30) ) slots <<= 1;
+
+  // Lay out the header, index and slab table, then fit as many page aligned slabs as we can
+  unsigned int slabs = maxSize / SHAREDCACHE_SLAB;
+  unsigned long long slabOffset = sizeof(SharedCacheHeader) + slots * sizeof(SharedCacheSlot) + slabs * sizeof(int);
+  slabOffset = ( slabOffset + 4095 ) & ~4095ULL;
+  slabs = ( maxSize > slabOffset ) ? ( maxSize - slabOffset ) / SHAREDCACHE_SLAB : 0;
+  if( slabs < 2 ) throw string( "SharedCache :: cache size too small" );
+  unsigned long long requested = slabOffset + (unsigned long long) slabs * SHAREDCACHE_SLAB;
+
+  // Try to create the cache ourselves, otherwise attach to the existing one. Every process
+  // holds a shared lock on the cache for as long as it is attached, so an existing cache
+  // which is invalid or of the wrong size can be replaced if nobody else is using it
+  bool creator = false;
+  for( int attempt = 0; attempt < 4; attempt++ ){
+
+    fd = shm_open( name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600 );
+    if( fd >= 0 ){
+      creator = true;
+      flock( fd, LOCK_SH );
+      break;
+    }
+    if( errno == EEXIST ) fd = shm_open( name.c_str(), O_RDWR, 0600 );
+    if( fd < 0 ){
+      if( errno == ENOENT ) continue;
+      throw string( "SharedCache :: unable to open shared memory " + name + ": " + strerror(errno) );
+    }
+
+    // Wait for the creating process to finish initializing the cache
+    struct stat st;
+    st.st_size = 0;
+    for( int n = 0; n < 200; n++ ){
+      if( fstat( fd, &st ) == 0 && (unsigned long long) st.st_size > sizeof(SharedCacheHeader) ) break;
+      usleep( 10000 );
+    }
+
+    size = st.st_size;
+    if( size > sizeof(SharedCacheHeader) ){
+      base = (char*) mmap( NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+      if( base == MAP_FAILED ) base = NULL;
+    }
+
+    bool valid = false;
+    if( base ){
+      for( int n = 0; n < 200 && memcmp( HEADER->magic, SHAREDCACHE_MAGIC, 8 ) != 0; n++ ) usleep( 10000 );
+      __sync_synchronize();
+      valid = ( memcmp( HEADER->magic, SHAREDCACHE_MAGIC, 8 ) == 0 && HEADER->size == size );
+    }
+
+    // A cache left behind by processes which have all exited is removed and created afresh
+    // if it is unusable or not of the size we have been asked for
+    if( ( !valid || size != requested ) && flock( fd, LOCK_EX | LOCK_NB ) == 0 ){
+      if( base ) munmap( base, size );
+      base = NULL;
+      shm_unlink( name.c_str() );
+      close( fd );
+      fd = -1;
+      _replaced = true;
+      continue;
+    }
+
+    if( !valid ){
+      if( base ) munmap( base, size );
+      base = NULL;
+      close( fd );
+      fd = -1;
+      throw string( "SharedCache :: shared memory " + name + " is invalid or from an incompatible version" );
+    }
+
+    // Make sure the cache was not removed by another process before we locked it
+    flock( fd, LOCK_SH );
+    if( fstat( fd, &st ) == 0 && st.st_nlink > 0 ){
+      _connected = true;
+      return;
+    }
+    munmap( base, size );
+    base = NULL;
+    close( fd );
+    fd = -1;
+  }
+
+  if( !creator ) throw string( "SharedCache :: unable to open shared memory " + name );
+
+  size = requested;
+  if( ftruncate( fd, size ) != 0 ){
+    string error = strerror(errno);
+    close( fd );
+    fd = -1;
+    shm_unlink( name.c_str() );
+    throw string( "SharedCache :: unable to size shared memory " + name + ": " + error );
+  }
+
+  base = (char*) mmap( NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+  if( base == MAP_FAILED ){
+    base = NULL;
+    close( fd );
+    fd = -1;
+    shm_unlink( name.c_str() );
+    throw string( "SharedCache :: unable to map shared memory " + name );
+  }
+
+  SharedCacheHeader *header = HEADER;
+  header->size = size;
+  header->slabOffset = slabOffset;
+  header->slots = slots;
+  header->slabs = slabs;
+
+  // Size classes grow geometrically up to a whole slab
+  unsigned int c = 0;
+  for( double s = SHAREDCACHE_MIN_CHUNK; c < SHAREDCACHE_CLASSES - 1 && s < SHAREDCACHE_SLAB; s *= SHAREDCACHE_FACTOR ){
+    header->classSize[c++] = ( (unsigned int) s + 7 ) & ~7U;
+  }
+  header->classSize[c++] = SHAREDCACHE_SLAB;
+  header->classes = c;
+
+  pthread_mutexattr_t attr;
+  pthread_mutexattr_init( &attr );
+  pthread_mutexattr_setpshared( &attr, PTHREAD_PROCESS_SHARED );
+#ifdef __linux__
+  pthread_mutexattr_setrobust( &attr, PTHREAD_MUTEX_ROBUST );
+#endif
+  pthread_mutex_init( &header->mutex, &attr );
+  pthread_mutexattr_destroy( &attr );
+
+  this->clear();
+
+  // Only publish the cache once it is fully initialized
+  __sync_synchronize();
+  memcpy( header->magic, SHAREDCACHE_MAGIC, 8 );
+
+  _connected = true;
+}
+
+
+
+void SharedCache::lock(){
+  int status = pthread_mutex_lock( &HEADER->mutex );
+#ifdef __linux__
+  // The previous owner died, possibly half way through an update
+  if( status == EOWNERDEAD ){
+    this->clear();
+    pthread_mutex_consistent( &HEADER->mutex );
+  }
+#endif
+}
+
+
+
+void SharedCache::unlock(){
+  pthread_mutex_unlock( &HEADER->mutex );
+}
+
+
+
+void SharedCache::clear(){
+  SharedCacheHeader *header = HEADER;
+  memset( SLOTS, 0, header->slots * sizeof(SharedCacheSlot) );
+  for( unsigned int i=0; i<header->slabs; i++ ) SLAB_CLASS[i] = -1;
+  for( unsigned int c=0; c<SHAREDCACHE_CLASSES; c++ ) header->freeList[c] = 0;
+  memset( header->claims, 0, sizeof(header->claims) );
+  header->usedSlabs = 0;
+  header->hand = 0;
+}
+
+
+
+int SharedCache::sizeClass( unsigned long long length ) const {
+  for( unsigned int c=0; c<HEADER->classes; c++ ){
+    if( HEADER->classSize[c] >= length ) return c;
+  }
+  return -1;
+}
+
+
+
+void SharedCache::unindex( unsigned long long offset ){
+  unsigned long long key = CHUNK(offset)->key;
+  for( unsigned int n=0; n<SHAREDCACHE_PROBES; n++ ){
+    SharedCacheSlot& slot = SLOTS[ (key + n) & (HEADER->slots - 1) ];
+    if( slot.chunk == offset ){
+      slot.key = 0;
+      slot.chunk = 0;
+      return;
+    }
+  }
+}
+
+
+
+void SharedCache::freeChunk( unsigned long long offset ){
+  int c = SLAB_CLASS[ ( offset - HEADER->slabOffset ) / SHAREDCACHE_SLAB ];
+  SharedCacheChunk *chunk = CHUNK(offset);
+  chunk->key = 0;
+  chunk->next = HEADER->freeList[c];
+  HEADER->freeList[c] = offset;
+}
+
+
+
+unsigned long long SharedCache::allocate( int c ){
+
+  SharedCacheHeader *header = HEADER;
+
+  if( header->freeList[c] == 0 ){
+
+    // Take an unused slab if there is one, otherwise reclaim the next in turn
+    unsigned int s;
+    if( header->usedSlabs < header->slabs ) s = header->usedSlabs++;
+    else{
+      s = header->hand;
+      header->hand = ( header->hand + 1 ) % header->slabs;
+    }
+
+    unsigned long long start = header->slabOffset + (unsigned long long) s * SHAREDCACHE_SLAB;
+    unsigned long long end = start + SHAREDCACHE_SLAB;
+    int old = SLAB_CLASS[s];
+
+    if( old >= 0 ){
+      // Evict every tile held in this slab and drop its free chunks from the old class
+      unsigned int chunkSize = header->classSize[old];
+      for( unsigned long long o = start; o + chunkSize <= end; o += chunkSize ){
+	if( CHUNK(o)->key ) this->unindex( o );
+      }
+      unsigned long long *link = &header->freeList[old];
+      while( *link ){
+	if( *link >= start && *link < end ) *link = CHUNK(*link)->next;
+	else link = &CHUNK(*link)->next;
+      }
+    }
+
+    // Carve the slab into chunks of our class
+    SLAB_CLASS[s] = c;
+    unsigned int chunkSize = header->classSize[c];
+    for( unsigned long long o = start; o + chunkSize <= end; o += chunkSize ) this->freeChunk( o );
+  }
+
+  unsigned long long offset = header->freeList[c];
+  header->freeList[c] = CHUNK(offset)->next;
+  return offset;
+}
+
+
+
+bool SharedCache::_getTile( unsigned long long key, const string& f, int r, int t, int h, int v,
+			    CompressionType c, int q, RawTile& tile ){
+
+  for( unsigned int n=0; n<SHAREDCACHE_PROBES; n++ ){
+
+    SharedCacheSlot& slot = SLOTS[ (key + n) & (HEADER->slots - 1) ];
+    if( slot.key != key || slot.chunk == 0 ) continue;
+
+    // Check that the chunk really is the tile we want
+    const SharedCacheChunk *chunk = CHUNK(slot.chunk);
+    if( chunk->key != key || chunk->pathLength != f.length() ||
+	memcmp( (const char*)(chunk+1), f.data(), f.length() ) != 0 ||
+	chunk->resolution != r || chunk->tileNum != t || chunk->hSequence != h ||
+	chunk->vSequence != v || chunk->compressionType != c || chunk->quality != q ){
+      return false;
+    }
+
+    tile.deallocate();
+    tile.resolution = chunk->resolution;
+    tile.tileNum = chunk->tileNum;
+    tile.hSequence = chunk->hSequence;
+    tile.vSequence = chunk->vSequence;
+    tile.compressionType = (CompressionType) chunk->compressionType;
+    tile.quality = chunk->quality;
+    tile.timestamp = (time_t) chunk->timestamp;
+    tile.width = chunk->width;
+    tile.height = chunk->height;
+    tile.channels = chunk->channels;
+    tile.bpc = chunk->bpc;
+    tile.sampleType = (SampleType) chunk->sampleType;
+    tile.padded = false;
+    tile.filename = f;
+    tile.allocate( chunk->dataLength );
+    memcpy( tile.data, (const char*)(chunk+1) + chunk->pathLength, chunk->dataLength );
+    return true;
+  }
+
+  return false;
+}
+
+
+
+bool SharedCache::getTile( const string& f, int r, int t, int h, int v, CompressionType c, int q, RawTile& tile ){
+
+  if( !_connected ) return false;
+
+  unsigned long long key = Cache::getKey( 0, r, t, h, v, c, q ).hash( f );
+
+  this->lock();
+  bool found = this->_getTile( key, f, r, t, h, v, c, q, tile );
+  this->unlock();
+
+  return found;
+}
+
+
+
+void SharedCache::_insert( unsigned long long key, const RawTile& r ){
+
+  int c = this->sizeClass( sizeof(SharedCacheChunk) + r.filename.length() + r.dataLength );
+  if( c < 0 ) return;
+
+  // Replace any existing copy of this tile if ours is newer
+  for( unsigned int n=0; n<SHAREDCACHE_PROBES; n++ ){
+    SharedCacheSlot& slot = SLOTS[ (key + n) & (HEADER->slots - 1) ];
+    if( slot.key == key && slot.chunk ){
+      if( CHUNK(slot.chunk)->timestamp >= (long long) r.timestamp ) return;
+      this->unindex( slot.chunk );
+      this->freeChunk( slot.chunk );
+      break;
+    }
+  }
+
+  // Allocate first, as reclaiming a slab may free up index slots
+  unsigned long long offset = this->allocate( c );
+
+  // Use a free slot if there is one, otherwise evict the tile in the first slot
+  SharedCacheSlot *target = &SLOTS[ key & (HEADER->slots - 1) ];
+  for( unsigned int n=0; n<SHAREDCACHE_PROBES; n++ ){
+    SharedCacheSlot *slot = &SLOTS[ (key + n) & (HEADER->slots - 1) ];
+    if( slot->chunk == 0 ){
+      target = slot;
+      break;
+    }
+  }
+  if( target->chunk ){
+    this->freeChunk( target->chunk );
+    target->chunk = 0;
+  }
+
+  SharedCacheChunk *chunk = CHUNK(offset);
+  chunk->key = key;
+  chunk->next = 0;
+  chunk->timestamp = r.timestamp;
+  chunk->pathLength = r.filename.length();
+  chunk->dataLength = r.dataLength;
+  chunk->resolution = r.resolution;
+  chunk->tileNum = r.tileNum;
+  chunk->hSequence = r.hSequence;
+  chunk->vSequence = r.vSequence;
+  chunk->compressionType = r.compressionType;
+  chunk->quality = r.quality;
+  chunk->width = r.width;
+  chunk->height = r.height;
+  chunk->channels = r.channels;
+  chunk->bpc = r.bpc;
+  chunk->sampleType = r.sampleType;
+  memcpy( (char*)(chunk+1), r.filename.data(), chunk->pathLength );
+  memcpy( (char*)(chunk+1) + chunk->pathLength, r.data, r.dataLength );
+
+  target->key = key;
+  target->chunk = offset;
+}
+
+
+
+void SharedCache::insert( const RawTile& r ){
+
+  if( !_connected || !r.data || r.dataLength <= 0 ) return;
+
+  unsigned long long key = Cache::getKey( 0, r.resolution, r.tileNum, r.hSequence, r.vSequence,
+					  r.compressionType, r.quality ).hash( r.filename );
+
+  this->lock();
+  this->_insert( key, r );
+  this->unlock();
+}
+
+
+
+void SharedCache::remove( const string& f ){
+
+  if( !_connected ) return;
+
+  this->lock();
+  SharedCacheSlot *slots = SLOTS;
+  for( unsigned int i=0; i<HEADER->slots; i++ ){
+    if( slots[i].chunk == 0 ) continue;
+    const SharedCacheChunk *chunk = CHUNK(slots[i].chunk);
+    if( chunk->pathLength == f.length() && memcmp( (const char*)(chunk+1), f.data(), f.length() ) == 0 ){
+      this->freeChunk( slots[i].chunk );
+      slots[i].key = 0;
+      slots[i].chunk = 0;
+    }
+  }
+  this->unlock();
+}
+
+
+
+bool SharedCache::claim( const string& f, int r, int t, int h, int v, CompressionType c, int q ){
+
+  if( !_connected ) return true;
+
+  unsigned long long key = Cache::getKey( 0, r, t, h, v, c, q ).hash( f );
+  long long now = time( NULL );
+  SharedCacheClaim owner;
+  owner.key = 0;
+
+  this->lock();
+
+  // Find any live claim on this tile, otherwise a free or the oldest entry to use for ours
+  SharedCacheClaim *claims = HEADER->claims;
+  SharedCacheClaim *entry = &claims[0];
+  for( unsigned int n=0; n<SHAREDCACHE_CLAIMS; n++ ){
+    if( claims[n].key == key ){
+      bool alive = ( kill( claims[n].pid, 0 ) == 0 || errno == EPERM );
+      if( alive && now - claims[n].time < SHAREDCACHE_CLAIM_TIMEOUT ) owner = claims[n];
+      entry = &claims[n];
+      break;
+    }
+    if( entry->key && ( claims[n].key == 0 || claims[n].time < entry->time ) ) entry = &claims[n];
+  }
+
+  if( owner.key == 0 ){
+    entry->key = key;
+    entry->time = now;
+    entry->pid = getpid();
+  }
+
+  this->unlock();
+
+  if( owner.key == 0 ) return true;
+
+  // Wait for the owner to release its claim
+  bool waiting = true;
+  while( waiting && time( NULL ) - owner.time < SHAREDCACHE_CLAIM_TIMEOUT ){
+    usleep( 1000 );
+    waiting = false;
+    this->lock();
+    for( unsigned int n=0; n<SHAREDCACHE_CLAIMS; n++ ){
+      if( claims[n].key == key && claims[n].pid == owner.pid && claims[n].time == owner.time ){
+	waiting = true;
+	break;
+      }
+    }
+    this->unlock();
+  }
+
+  return false;
+}
+
+
+
+void SharedCache::release( const string& f, int r, int t, int h, int v, CompressionType c, int q ){
+
+  if( !_connected ) return;
+
+  unsigned long long key = Cache::getKey( 0, r, t, h, v, c, q ).hash( f );
+  int pid = getpid();
+
+  this->lock();
+  for( unsigned int n=0; n<SHAREDCACHE_CLAIMS; n++ ){
+    SharedCacheClaim& claim = HEADER->claims[n];
+    if( claim.key == key && claim.pid == pid ) claim.key = 0;
+  }
+  this->unlock();
+}
+
+
+
+float SharedCache::getMemorySize(){
+  if( !_connected ) return 0.0;
+  this->lock();
+  unsigned long long used = (unsigned long long) HEADER->usedSlabs * SHAREDCACHE_SLAB;
+  this->unlock();
+  return (float) ( used / 1024000.0 );
+}
+
+
+
+#else
+
+
+// POSIX shared memory is not available
+
+SharedCache::~SharedCache(){}
+
+void SharedCache::open() throw(string) {
+  throw string( "SharedCache :: not supported on this platform" );
+}
+
+void SharedCache::lock(){}
+
+void SharedCache::unlock(){}
+
+void SharedCache::clear(){}
+
+int SharedCache::sizeClass( unsigned long long length ) const { return -1; }
+
+void SharedCache::unindex( unsigned long long offset ){}
+
+void SharedCache::freeChunk( unsigned long long offset ){}
+
+unsigned long long SharedCache::allocate( int c ){ return 0; }
+
+bool SharedCache::_getTile( unsigned long long key, const string& f, int r, int t, int h, int v,
+			    CompressionType c, int q, RawTile& tile ){ return false; }
+
+bool SharedCache::getTile( const string& f, int r, int t, int h, int v, CompressionType c, int q, RawTile& tile ){
+  return false;
+}
+
+void SharedCache::_insert( unsigned long long key, const RawTile& r ){}
+
+void SharedCache::insert( const RawTile& r ){}
+
+void SharedCache::remove( const string& f ){}
+
+bool SharedCache::claim( const string& f, int r, int t, int h, int v, CompressionType c, int q ){ return true; }
+
+void SharedCache::release( const string& f, int r, int t, int h, int v, CompressionType c, int q ){}
+
+float SharedCache::getMemorySize(){ return 0.0; }
+
+
+#endif
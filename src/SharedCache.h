@@ -0,0 +1,190 @@
+// Shared Memory Tile Cache
+
+/*  IIP Image Server
+
+    Copyright (C) 2014 Ruven Pillay.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#ifndef _SHAREDCACHE_H
+#define _SHAREDCACHE_H
+
+
+#include <string>
+#include "RawTile.h"
+
+
+
+/// Tile cache held in POSIX shared memory and shared by all server processes on a host
+/** The first process to start creates a shared memory object of the requested
+    size and every subsequent process simply attaches to it, so the cache is sized
+    once for the whole machine rather than once per process.
+
+    Memory is divided into fixed size slabs, each of which is carved into equal
+    sized chunks of one of a series of size classes, as in memcached. Tiles are
+    stored in the smallest chunk which can hold them and are located through an
+    open addressing hash index keyed on the image path and tile parameters. When
+    no memory is free, slabs are reclaimed in turn and all the tiles they hold are
+    evicted. The index and allocator are protected by a process shared mutex,
+    which is recovered automatically if a process dies while holding it.
+
+    The cache also holds a small table of tiles currently being decoded, so that
+    concurrent misses on the same tile in different processes result in a single
+    decode, with the other processes waiting for its result.
+ */
+
+class SharedCache {
+
+ private:
+
+  /// Name of the shared memory object
+  std::string name;
+
+  /// Requested size in bytes if we have to create the cache
+  unsigned long long maxSize;
+
+  /// Shared memory mapping
+  char *base;
+
+  /// Size of the mapping
+  unsigned long long size;
+
+  /// Shared memory descriptor, kept open to hold our lock on the cache
+  int fd;
+
+  /// Whether we have successfully attached to the cache
+  bool _connected;
+
+  /// Whether a stale cache was replaced when we attached
+  bool _replaced;
+
+
+  /// Lock the cache, discarding its contents if the previous owner died holding the lock
+  void lock();
+
+  /// Unlock the cache
+  void unlock();
+
+  /// Empty the cache and reset the allocator
+  void clear();
+
+  /// Return the size class able to hold a chunk of a given size or -1 if it is too large
+  /** @param length chunk length in bytes */
+  int sizeClass( unsigned long long length ) const;
+
+  /// Remove the index entry pointing to a chunk
+  /** @param offset chunk offset */
+  void unindex( unsigned long long offset );
+
+  /// Return a chunk to its free list
+  /** @param offset chunk offset */
+  void freeChunk( unsigned long long offset );
+
+  /// Allocate a chunk, reclaiming a slab if necessary
+  /** @param c size class
+      @return chunk offset
+   */
+  unsigned long long allocate( int c );
+
+  /// Tile lookup with the lock held
+  bool _getTile( unsigned long long key, const std::string& f, int r, int t, int h, int v,
+		 CompressionType c, int q, RawTile& tile );
+
+  /// Tile insertion with the lock held
+  void _insert( unsigned long long key, const RawTile& r );
+
+  /// The cache cannot be copied
+  SharedCache( const SharedCache& );
+  SharedCache& operator = ( const SharedCache& );
+
+
+ public:
+
+  /// Constructor
+  /** @param n name of the shared memory object
+      @param max size in MB with which to create the cache if it does not already exist
+   */
+  SharedCache( const std::string& n, float max ) :
+    name( n ), maxSize( (unsigned long long)(max*1024000.0) ), base( NULL ), size( 0 ),
+    fd( -1 ), _connected( false ), _replaced( false ) {};
+
+  /// Destructor: detaches from, but does not remove, the shared memory
+  ~SharedCache();
+
+  /// Attach to the cache, creating it if necessary
+  /** Throws a string exception on error */
+  void open() throw(std::string);
+
+  /// Indicate whether we are attached to the cache
+  bool connected() const { return _connected; };
+
+  /// Indicate whether an existing cache no longer in use was removed and created afresh
+  bool replaced() const { return _replaced; };
+
+  /// Get a tile from the cache
+  /** @param f image path
+      @param r resolution number
+      @param t tile number
+      @param h horizontal sequence number
+      @param v vertical sequence number
+      @param c compression type
+      @param q compression quality
+      @param tile tile into which the cached data is copied
+      @return true if the tile was found
+   */
+  bool getTile( const std::string& f, int r, int t, int h, int v, CompressionType c, int q, RawTile& tile );
+
+  /// Insert a tile
+  /** An existing copy of the tile is replaced only if it has an older timestamp
+      @param r tile to be inserted, which must have its filename set
+   */
+  void insert( const RawTile& r );
+
+  /// Remove all tiles of an image
+  /** This examines every index slot
+      @param f image path
+   */
+  void remove( const std::string& f );
+
+  /// Claim the right to decode a tile, waiting if another process is already doing so
+  /** Claims left by processes which have died, or which are older than a few seconds,
+      are ignored
+      @param f image path
+      @param r resolution number
+      @param t tile number
+      @param h horizontal sequence number
+      @param v vertical sequence number
+      @param c compression type
+      @param q compression quality
+      @return true if the caller should decode the tile and then call release(), false if
+      another process has finished decoding it and the result should now be in the cache
+   */
+  bool claim( const std::string& f, int r, int t, int h, int v, CompressionType c, int q );
+
+  /// Release a claim obtained with claim()
+  void release( const std::string& f, int r, int t, int h, int v, CompressionType c, int q );
+
+  /// Return the total size of the cache in MB
+  float getSize() const { return (float) ( size / 1024000.0 ); };
+
+  /// Return the number of MB of the cache in use
+  float getMemorySize();
+
+};
+
+
+#endif
@@ -0,0 +1,178 @@
+/*
+    IIPImage Server - Member functions for TIFFMap.h
+
+    Copyright (C) 2014 Ruven Pillay.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#include "TIFFMap.h"
+#include <cstring>
+
+#ifndef WIN32
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#endif
+
+
+using namespace std;
+
+
+bool TIFFMap::enabled = true;
+
+
+
+#ifndef WIN32
+
+/// A mapped file and our position within it
+struct MappedFile {
+  int fd;
+  unsigned char *base;
+  toff_t size;
+  toff_t position;
+};
+
+
+// libtiff I/O procedures which read from the mapping
+
+static tsize_t map_read( thandle_t h, void* buffer, tsize_t length ){
+  MappedFile *m = (MappedFile*) h;
+  if( length <= 0 || m->position >= m->size ) return 0;
+  if( (toff_t) length > m->size - m->position ) length = (tsize_t)( m->size - m->position );
+  memcpy( buffer, m->base + m->position, length );
+  m->position += length;
+  return length;
+}
+
+static tsize_t map_write( thandle_t, void*, tsize_t ){
+  return 0;
+}
+
+static toff_t map_seek( thandle_t h, toff_t offset, int whence ){
+  MappedFile *m = (MappedFile*) h;
+  switch( whence ){
+    case SEEK_SET: m->position = offset; break;
+    case SEEK_CUR: m->position += offset; break;
+    case SEEK_END: m->position = m->size + offset; break;
+    default: return (toff_t) -1;
+  }
+  return m->position;
+}
+
+static int map_close( thandle_t h ){
+  MappedFile *m = (MappedFile*) h;
+  munmap( m->base, m->size );
+  ::close( m->fd );
+  delete m;
+  return 0;
+}
+
+static toff_t map_size( thandle_t h ){
+  return ((MappedFile*) h)->size;
+}
+
+static int map_map( thandle_t h, void** base, toff_t* size ){
+  MappedFile *m = (MappedFile*) h;
+  *base = m->base;
+  *size = m->size;
+  return 1;
+}
+
+static void map_unmap( thandle_t, void*, toff_t ){
+  // The mapping lasts until the file is closed
+}
+
+
+// Return our mapped file if a handle was opened by us
+static MappedFile* mapping( TIFF* tiff ){
+  if( !tiff || TIFFGetReadProc( tiff ) != (TIFFReadWriteProc) map_read ) return NULL;
+  return (MappedFile*) TIFFClientdata( tiff );
+}
+
+#endif
+
+
+
+TIFF* TIFFMap::open( const string& path ){
+
+#ifndef WIN32
+  if( enabled ){
+
+    int fd = ::open( path.c_str(), O_RDONLY );
+    if( fd == -1 ) return NULL;
+
+    struct stat sb;
+    void *base = MAP_FAILED;
+    if( fstat( fd, &sb ) == 0 && sb.st_size > 0 ){
+      base = mmap( NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0 );
+    }
+
+    if( base != MAP_FAILED ){
+
+      // Tiles are read in no particular order, so avoid reading ahead around each one
+      madvise( base, sb.st_size, MADV_RANDOM );
+
+      MappedFile *m = new MappedFile;
+      m->fd = fd;
+      m->base = (unsigned char*) base;
+      m->size = sb.st_size;
+      m->position = 0;
+
+      TIFF* tiff = TIFFClientOpen( path.c_str(), "r", (thandle_t) m,
+				   (TIFFReadWriteProc) map_read, (TIFFReadWriteProc) map_write,
+				   map_seek, map_close, map_size, (TIFFMapFileProc) map_map,
+				   (TIFFUnmapFileProc) map_unmap );
+
+      // libtiff only calls map_close() when an open handle is closed
+      if( !tiff ) map_close( (thandle_t) m );
+      return tiff;
+    }
+
+    ::close( fd );
+  }
+#endif
+
+  // Otherwise let libtiff map the file itself unless mapping has been disabled
+  return TIFFOpen( path.c_str(), enabled ? "r" : "rm" );
+}
+
+
+
+const unsigned char* TIFFMap::data( TIFF* tiff, toff_t offset, toff_t length ){
+#ifndef WIN32
+  MappedFile *m = mapping( tiff );
+  if( m && offset <= m->size && length <= m->size - offset ) return m->base + offset;
+#endif
+  return NULL;
+}
+
+
+
+void TIFFMap::advise( TIFF* tiff, toff_t offset, toff_t length ){
+#ifndef WIN32
+  MappedFile *m = mapping( tiff );
+  if( !m || length == 0 || offset >= m->size ) return;
+  if( length > m->size - offset ) length = m->size - offset;
+
+  // madvise() needs a page aligned address
+  static const toff_t page = sysconf( _SC_PAGESIZE );
+  toff_t start = offset - ( offset % page );
+  madvise( m->base + start, (size_t)( offset + length - start ), MADV_WILLNEED );
+#endif
+}
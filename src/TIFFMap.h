@@ -0,0 +1,91 @@
+// Memory Mapped TIFF Access
+
+/*  IIP Image Server
+
+    Copyright (C) 2014 Ruven Pillay.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#ifndef _TIFFMAP_H
+#define _TIFFMAP_H
+
+
+#include <string>
+#include <tiffio.h>
+
+
+
+/// Opens TIFF files through a read only memory mapping of the whole file
+/** Files are opened with TIFFClientOpen() using our own I/O procedures, which
+    serve every read, including those of the directories, by copying from the
+    mapping rather than with read() system calls. libtiff decodes tiles directly
+    from the mapping, and raw tile data can be accessed in place with data().
+    As the mapping is shared, all server processes serving the same file use the
+    same pages of the page cache.
+
+    Tiles are scattered throughout a pyramid file, so the kernel is told to expect
+    random access and not to read ahead. Callers about to read a known range of
+    tiles can ask for it to be read in with advise().
+
+    If mapping is unavailable on this platform or fails for a file, files are
+    opened with TIFFOpen() as usual. If mapping is disabled, they are opened with
+    TIFFOpen() in unmapped mode, so that all data is read with read() calls. In
+    either case data() returns NULL.
+ */
+
+class TIFFMap {
+
+ private:
+
+  /// Whether files are to be mapped
+  static bool enabled;
+
+
+ public:
+
+  /// Enable or disable mapping for files opened from now on
+  /** @param e whether to map files */
+  static void setEnabled( bool e ) { enabled = e; };
+
+  /// Open a TIFF file for reading
+  /** @param path file path
+      @return open handle, or NULL if the file cannot be opened
+   */
+  static TIFF* open( const std::string& path );
+
+  /// Return a pointer to a range of a file's data within its mapping
+  /** The pointer is valid until the handle is closed
+      @param tiff handle obtained from open()
+      @param offset offset in the file
+      @param length length of the range
+      @return pointer to the data, or NULL if the file is not mapped or the range
+      lies outside the file
+   */
+  static const unsigned char* data( TIFF* tiff, toff_t offset, toff_t length );
+
+  /// Ask for a range of a mapped file to be read in ahead of use
+  /** @param tiff handle obtained from open()
+      @param offset offset in the file
+      @param length length of the range
+   */
+  static void advise( TIFF* tiff, toff_t offset, toff_t length );
+
+};
+
+
+
+#endif
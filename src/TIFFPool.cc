@@ -0,0 +1,173 @@
+/*
+    IIPImage Server - Member functions for TIFFPool.h
+
+    Copyright (C) 2014 Ruven Pillay.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#include "TIFFPool.h"
+#include "TIFFMap.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <vector>
+#include <sstream>
+
+
+using namespace std;
+
+
+
+TIFFPool::~TIFFPool(){
+  for( list<Handle>::iterator i = idle.begin(); i != idle.end(); i++ ) TIFFClose( i->tiff );
+  idle.clear();
+}
+
+
+
+TIFF* TIFFPool::borrow( const string& path ){
+
+  bool check;
+  {
+    ScopedLock lock( mutex );
+    check = !watched;
+  }
+
+  // Files which are watched are known to be unchanged since we opened them
+  struct stat sb;
+  sb.st_mtime = 0;
+  if( check && stat( path.c_str(), &sb ) == -1 ) return NULL;
+
+  // Handles to be closed once we have released the lock
+  vector<TIFF*> victims;
+  TIFF* tiff = NULL;
+
+  {
+    ScopedLock lock( mutex );
+
+    for( list<Handle>::iterator i = idle.begin(); i != idle.end(); ){
+      if( i->path != path ){
+	i++;
+	continue;
+      }
+      // Discard handles on files which have since been modified
+      if( check && i->mtime != sb.st_mtime ){
+	victims.push_back( i->tiff );
+	idle.erase( i++ );
+	numOpen--;
+	numStale++;
+	continue;
+      }
+      tiff = i->tiff;
+      borrowed[tiff] = *i;
+      idle.erase( i );
+      numHits++;
+      break;
+    }
+
+    if( !tiff ){
+      numMisses++;
+      // Make room for the handle we are about to open
+      while( numOpen >= maxHandles && !idle.empty() ){
+	victims.push_back( idle.back().tiff );
+	idle.pop_back();
+	numOpen--;
+      }
+    }
+  }
+
+  for( unsigned int i=0; i<victims.size(); i++ ) TIFFClose( victims[i] );
+
+  if( tiff ) return tiff;
+
+  if( ( tiff = TIFFMap::open( path ) ) == NULL ) return NULL;
+
+  Handle handle;
+  handle.path = path;
+  handle.mtime = sb.st_mtime;
+  handle.tiff = tiff;
+  handle.stale = false;
+
+  ScopedLock lock( mutex );
+  borrowed[tiff] = handle;
+  numOpen++;
+  return tiff;
+}
+
+
+
+void TIFFPool::release( TIFF* tiff ){
+
+  if( !tiff ) return;
+
+  {
+    ScopedLock lock( mutex );
+
+    map<TIFF*,Handle>::iterator i = borrowed.find( tiff );
+    if( i != borrowed.end() ){
+      Handle handle = i->second;
+      borrowed.erase( i );
+      if( handle.stale ) numStale++;
+      else if( numOpen <= maxHandles ){
+	idle.push_front( handle );
+	return;
+      }
+      numOpen--;
+    }
+  }
+
+  // Not one of ours, stale or we are over budget
+  TIFFClose( tiff );
+}
+
+
+
+void TIFFPool::invalidate( const string& path ){
+
+  vector<TIFF*> victims;
+
+  {
+    ScopedLock lock( mutex );
+
+    for( list<Handle>::iterator i = idle.begin(); i != idle.end(); ){
+      if( i->path != path ){
+	i++;
+	continue;
+      }
+      victims.push_back( i->tiff );
+      idle.erase( i++ );
+      numOpen--;
+      numStale++;
+    }
+
+    for( map<TIFF*,Handle>::iterator i = borrowed.begin(); i != borrowed.end(); i++ ){
+      if( i->second.path == path ) i->second.stale = true;
+    }
+  }
+
+  for( unsigned int i=0; i<victims.size(); i++ ) TIFFClose( victims[i] );
+}
+
+
+
+string TIFFPool::getStatistics(){
+  ScopedLock lock( mutex );
+  ostringstream s;
+  s << numHits << " reused, " << numMisses << " opened, " << numStale << " stale, "
+    << idle.size() << " idle, " << borrowed.size() << " in use";
+  return s.str();
+}
@@ -0,0 +1,132 @@
+// Pool of Open TIFF Handles
+
+/*  IIP Image Server
+
+    Copyright (C) 2014 Ruven Pillay.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#ifndef _TIFFPOOL_H
+#define _TIFFPOOL_H
+
+
+#include <string>
+#include <list>
+#include <map>
+#include <ctime>
+#include <tiffio.h>
+#include "Mutex.h"
+
+
+
+/// Keeps TIFF files open between requests
+/** Opening a TIFF file and parsing its first directory is a significant part of
+    the cost of serving a tile. Rather than closing its handle at the end of each
+    request, TPTImage returns it here and borrows it again for the next request
+    on the same file, which may be for any sequence file of the same image.
+
+    A handle is only lent to one borrower at a time; several handles may be open
+    on the same file for concurrent borrowers. Idle handles are validated against
+    the modification time of their file when borrowed and reopened if the file
+    has changed, unless files are being watched for changes, in which case handles
+    are trusted until invalidate() is called for their file. The total number of
+    open handles, and therefore file descriptors, is bounded: the least recently
+    returned idle handles are closed to make room, and handles returned while the
+    pool is over budget are closed straight away.
+ */
+
+class TIFFPool {
+
+ private:
+
+  /// An open TIFF file
+  struct Handle {
+    std::string path;
+    time_t mtime;
+    TIFF* tiff;
+    bool stale;
+  };
+
+  /// Maximum number of open handles
+  unsigned int maxHandles;
+
+  /// Number of open handles, idle or borrowed
+  unsigned int numOpen;
+
+  /// Whether files are watched for changes rather than checked when borrowed
+  bool watched;
+
+  /// Idle handles, most recently returned first
+  std::list<Handle> idle;
+
+  /// Handles currently lent out
+  std::map<TIFF*,Handle> borrowed;
+
+  /// Lock protecting all of the above
+  Mutex mutex;
+
+  /// Statistics
+  unsigned long numHits, numMisses, numStale;
+
+  /// Pools cannot be copied
+  TIFFPool( const TIFFPool& );
+  TIFFPool& operator = ( const TIFFPool& );
+
+
+ public:
+
+  /// Constructor
+  /** @param n maximum number of open handles. Handles are closed as soon as they
+      are returned if this is 0
+   */
+  TIFFPool( unsigned int n ) : maxHandles( n ), numOpen( 0 ), watched( false ),
+    numHits( 0 ), numMisses( 0 ), numStale( 0 ) {};
+
+  /// Destructor - closes all idle handles
+  ~TIFFPool();
+
+  /// Borrow a handle on a file, opening it if there is no valid idle handle
+  /** @param path file path
+      @return open handle, positioned at an arbitrary directory, or NULL if the file
+      cannot be opened
+   */
+  TIFF* borrow( const std::string& path );
+
+  /// Return a borrowed handle to the pool
+  /** @param tiff handle obtained from borrow() */
+  void release( TIFF* tiff );
+
+  /// Trust idle handles without checking the modification time of their file
+  /** @param w whether files are watched for changes, with invalidate() being called
+      whenever one changes
+   */
+  void setWatched( bool w ) { ScopedLock lock( mutex ); watched = w; };
+
+  /// Close the idle handles on a file which has changed
+  /** Handles currently lent out are closed when they are returned
+      @param path file path
+   */
+  void invalidate( const std::string& path );
+
+  /// Return a summary of the pool statistics
+  std::string getStatistics();
+
+};
+
+
+
+#endif
@@ -28,6 +28,19 @@
 using namespace std;
 
 
+TIFFPool* TPTImage::pool = NULL;
+bool TPTImage::passthrough = false;
+
+
+void TPTImage::openTIFF( const string& filename ) throw (string)
+{
+  tiff = pool ? pool->borrow( filename ) : TIFFMap::open( filename );
+  if( tiff == NULL ){
+    throw string( "tiff open failed for: " + filename );
+  }
+}
+
+
 void TPTImage::openImage() throw (string)
 {
 
@@ -38,17 +51,17 @@ void TPTImage::openImage() throw (string)
 
   string filename = getFileName( currentX, currentY );
 
-  // Update our timestamp
-  updateTimestamp( filename );
+  // Reload our metadata if the file has been modified since it was loaded
+  if( revalidate( filename ) ) bpp = 0;
 
-  // Try to open and allocate a buffer
-  if( ( tiff = TIFFOpen( filename.c_str(), "r" ) ) == NULL ){
-    throw string( "tiff open failed for: " + filename );
+  // Load our metadata if not already loaded. Otherwise the file itself is only opened
+  // once a tile is needed, so that requests answered from our metadata alone need
+  // not touch the file at all
+  if( bpp == 0 ){
+    openTIFF( filename );
+    loadImageInfo( currentX, currentY );
   }
 
-  // Load our metadata if not already loaded
-  if( bpp == 0 ) loadImageInfo( currentX, currentY );
-
   // Insist on a tiled image
   if( (tile_width == 0) && (tile_height == 0) ){
     throw string( "TIFF image is not tiled" );
@@ -61,7 +74,6 @@ void TPTImage::openImage() throw (string)
 
 void TPTImage::loadImageInfo( int seq, int ang ) throw(string)
 {
-  tdir_t current_dir;
   int count;
   uint16 colour, samplesperpixel, bitspersample, sampleformat;
   double sminvalue[4] = {0.0};
@@ -70,9 +82,20 @@ void TPTImage::loadImageInfo( int seq, int ang ) throw(string)
   string filename;
   char *tmp = NULL;
 
+  // Nothing to do if we already have the metadata for this file
+  if( bpp != 0 && seq == currentX && ang == currentY && directory_offsets.size() == numResolutions ) return;
+
   currentX = seq;
   currentY = ang;
 
+  if( !tiff ) openTIFF( getFileName( seq, ang ) );
+
+  // Start from the first directory, which holds the full size image. Our handle
+  // may have been left at any directory by a previous user
+  if( !TIFFSetDirectory( tiff, 0 ) ){
+    throw string( "TIFFSetDirectory failed" );
+  }
+
   // Get the tile and image sizes
   TIFFGetField( tiff, TIFFTAG_TILEWIDTH, &tile_width );
   TIFFGetField( tiff, TIFFTAG_TILELENGTH, &tile_height );
@@ -88,22 +111,23 @@ void TPTImage::loadImageInfo( int seq, int ang ) throw(string)
   bpp = (unsigned int) bitspersample;
   sampleType = (sampleformat==3) ? FLOATINGPOINT : FIXEDPOINT;
 
-  // Check for the no. of resolutions in the pyramidal image
-  current_dir = TIFFCurrentDirectory( tiff );
-  TIFFSetDirectory( tiff, 0 );
-
-  // Store the list of image dimensions available
+  // Store the list of image dimensions available along with the offset of each
+  // directory, so that tiles can later go straight to the right directory
+  image_widths.clear();
+  image_heights.clear();
+  directory_offsets.clear();
   image_widths.push_back( w );
   image_heights.push_back( h );
+  directory_offsets.push_back( TIFFCurrentDirOffset( tiff ) );
 
+  // Check for the no. of resolutions in the pyramidal image
   for( count = 0; TIFFReadDirectory( tiff ); count++ ){
     TIFFGetField( tiff, TIFFTAG_IMAGEWIDTH, &w );
     TIFFGetField( tiff, TIFFTAG_IMAGELENGTH, &h );
     image_widths.push_back( w );
     image_heights.push_back( h );
+    directory_offsets.push_back( TIFFCurrentDirOffset( tiff ) );
   }
-  // Reset the TIFF directory
-  TIFFSetDirectory( tiff, current_dir );
 
   numResolutions = count+1;
 
@@ -154,7 +178,8 @@ void TPTImage::loadImageInfo( int seq, int ang ) throw(string)
 void TPTImage::closeImage()
 {
   if( tiff != NULL ){
-    TIFFClose( tiff );
+    if( pool ) pool->release( tiff );
+    else TIFFClose( tiff );
     tiff = NULL;
   }
   if( tile_buf != NULL ){
@@ -164,16 +189,14 @@ void TPTImage::closeImage()
 }
 
 
-RawTile TPTImage::getTile( int seq, int ang, unsigned int res, int layers, unsigned int tile ) throw (string)
+void TPTImage::selectTile( int seq, int ang, unsigned int res, unsigned int tile, uint32& tw, uint32& th ) throw (string)
 {
-  uint32 im_width, im_height, tw, th, ntlx, ntly;
+  uint32 im_width, im_height, ntlx, ntly;
   uint32 rem_x, rem_y;
-  uint16 colour;
-  string filename;
 
 
   // Check the resolution exists
-  if( res > numResolutions ){
+  if( res >= numResolutions ){
     ostringstream error;
     error << "TPTImage :: Asked for non-existant resolution: " << res;
     throw error.str();
@@ -189,10 +212,7 @@ RawTile TPTImage::getTile( int seq, int ang, unsigned int res, int layers, unsig
 
   // Open the TIFF if it's not already open
   if( !tiff ){
-    filename = getFileName( seq, ang );
-    if( ( tiff = TIFFOpen( filename.c_str(), "r" ) ) == NULL ){
-      throw string( "tiff open failed for:" + filename );
-    }
+    openTIFF( getFileName( seq, ang ) );
   }
 
 
@@ -208,8 +228,15 @@ RawTile TPTImage::getTile( int seq, int ang, unsigned int res, int layers, unsig
   int vipsres = ( numResolutions - 1 ) - res;
   
 
-  // Change to the right directory for the resolution
-  if( !TIFFSetDirectory( tiff, vipsres ) ) {
+  // Change to the right directory for the resolution. TIFFSetDirectory() would walk the
+  //  directory chain from the start, so go directly to its recorded offset instead
+  if( (unsigned int) vipsres < directory_offsets.size() ){
+    toff_t offset = (toff_t) directory_offsets[vipsres];
+    if( TIFFCurrentDirOffset( tiff ) != offset && !TIFFSetSubDirectory( tiff, offset ) ){
+      throw string( "TIFFSetSubDirectory failed" );
+    }
+  }
+  else if( !TIFFSetDirectory( tiff, vipsres ) ) {
     throw string( "TIFFSetDirectory failed" );
   }
 
@@ -222,17 +249,13 @@ RawTile TPTImage::getTile( int seq, int ang, unsigned int res, int layers, unsig
   } 
 
 
-  // Get the size of this tile, the current image,
-  //  the number of samples and the colourspace.
+  // Get the size of this tile and the current image.
   // TIFFTAG_TILEWIDTH give us the values for the resolution,
   //  not for the tile itself
   TIFFGetField( tiff, TIFFTAG_TILEWIDTH, &tw );
   TIFFGetField( tiff, TIFFTAG_TILELENGTH, &th );
   TIFFGetField( tiff, TIFFTAG_IMAGEWIDTH, &im_width );
   TIFFGetField( tiff, TIFFTAG_IMAGELENGTH, &im_height );
-  TIFFGetField( tiff, TIFFTAG_PHOTOMETRIC, &colour );
-//   TIFFGetField( tiff, TIFFTAG_SAMPLESPERPIXEL, &channels );
-//   TIFFGetField( tiff, TIFFTAG_BITSPERSAMPLE, &bpp );
 
 
   // Get the width and height for last row and column tiles
@@ -256,6 +279,24 @@ RawTile TPTImage::getTile( int seq, int ang, unsigned int res, int layers, unsig
     th = rem_y;
   }
 
+}
+
+
+RawTile TPTImage::getTile( int seq, int ang, unsigned int res, int layers, unsigned int tile ) throw (string)
+{
+  uint32 tw, th;
+  uint16 colour;
+
+
+  // Open the right file and directory and get the size of this tile
+  selectTile( seq, ang, res, tile, tw, th );
+
+
+  // Get the colourspace
+  TIFFGetField( tiff, TIFFTAG_PHOTOMETRIC, &colour );
+//   TIFFGetField( tiff, TIFFTAG_SAMPLESPERPIXEL, &channels );
+//   TIFFGetField( tiff, TIFFTAG_BITSPERSAMPLE, &bpp );
+
 
   // Handle various colour spaces
   if( colour == PHOTOMETRIC_CIELAB ) colourspace = CIELAB;
@@ -289,12 +330,11 @@ RawTile TPTImage::getTile( int seq, int ang, unsigned int res, int layers, unsig
   }
 
 
+  // Hand out our decode buffer without copying it. It remains valid until our next decode
   RawTile rawtile( tile, res, seq, ang, tw, th, channels, bpp );
-  rawtile.data = tile_buf;
-  rawtile.dataLength = length;
+  rawtile.borrow( tile_buf, length );
   rawtile.filename = getImagePath();
   rawtile.timestamp = timestamp;
-  rawtile.memoryManaged = 0;
   rawtile.padded = true;
   rawtile.sampleType = sampleType;
 
@@ -302,3 +342,113 @@ RawTile TPTImage::getTile( int seq, int ang, unsigned int res, int layers, unsig
 
 }
 
+
+
+
+bool TPTImage::getJPEGTile( int seq, int ang, unsigned int res, int layers, unsigned int tile, RawTile& rawtile ) throw (string)
+{
+  uint32 tw, th, tables_length = 0;
+  uint16 compression, colour, planar;
+  void *tables = NULL;
+  toff_t *sizes = NULL, *offsets = NULL;
+
+  if( !passthrough || bpp != 8 ) return false;
+
+  // Open the right file and directory and get the size of this tile
+  selectTile( seq, ang, res, tile, tw, th );
+
+  // Only JPEG encoded YCbCr or greyscale data is decoded in the same way by any JPEG decoder
+  TIFFGetFieldDefaulted( tiff, TIFFTAG_COMPRESSION, &compression );
+  TIFFGetFieldDefaulted( tiff, TIFFTAG_PHOTOMETRIC, &colour );
+  TIFFGetFieldDefaulted( tiff, TIFFTAG_PLANARCONFIG, &planar );
+  if( compression != COMPRESSION_JPEG || planar != PLANARCONFIG_CONTIG ) return false;
+  if( !( (colour == PHOTOMETRIC_YCBCR && channels == 3) || (colour == PHOTOMETRIC_MINISBLACK && channels == 1) ) ) return false;
+
+  // The quantization and Huffman tables are usually stored once for the whole directory
+  // as an abbreviated JPEG stream made up of SOI, the table segments and EOI
+  if( TIFFGetField( tiff, TIFFTAG_JPEGTABLES, &tables_length, &tables ) ){
+    const unsigned char *t = (const unsigned char*) tables;
+    if( tables_length < 4 || t[0] != 0xFF || t[1] != 0xD8 ||
+	t[tables_length-2] != 0xFF || t[tables_length-1] != 0xD9 ) return false;
+  }
+  else tables_length = 0;
+
+  if( !TIFFGetField( tiff, TIFFTAG_TILEBYTECOUNTS, &sizes ) || !sizes || sizes[tile] < 4 ) return false;
+  unsigned int size = (unsigned int) sizes[tile];
+
+  // Find the tile's data within the file's mapping if it is mapped
+  const unsigned char *raw = NULL;
+  if( TIFFGetField( tiff, TIFFTAG_TILEOFFSETS, &offsets ) && offsets ){
+    raw = TIFFMap::data( tiff, offsets[tile], size );
+    if( raw && ( raw[0] != 0xFF || raw[1] != 0xD8 ) ) return false;
+  }
+
+  rawtile = RawTile( tile, res, seq, ang, tw, th, channels, bpp );
+
+  // Without separate tables the tile is already a complete JPEG image, which we can
+  // send straight from the mapping without copying it
+  if( raw && tables_length == 0 ){
+    rawtile.borrow( (void*) raw, size );
+  }
+  else{
+
+    // Otherwise assemble SOI, a JFIF APP0 segment, the table segments and then the tile's
+    // own segments. The tile is copied directly into place, with its SOI marker overlapping
+    // the end of our header, which we then write over it
+    static const unsigned char jfif[] = { 0xFF, 0xD8, 0xFF, 0xE0, 0x00, 0x10, 'J', 'F', 'I', 'F', 0x00,
+					  0x01, 0x01, 0x00, 0x00, 0x01, 0x00, 0x01, 0x00, 0x00 };
+    unsigned int header = sizeof(jfif) + ( tables_length ? tables_length - 4 : 0 );
+    unsigned int length = header - 2 + size;
+    unsigned char *data = new unsigned char[length];
+
+    if( raw ) memcpy( data + header - 2, raw, size );
+    else if( TIFFReadRawTile( tiff, (ttile_t) tile, data + header - 2, (tsize_t) size ) != (tsize_t) size ||
+	     data[header-2] != 0xFF || data[header-1] != 0xD8 ){
+      delete[] data;
+      return false;
+    }
+
+    memcpy( data, jfif, sizeof(jfif) );
+    if( tables_length ) memcpy( data + sizeof(jfif), (const unsigned char*) tables + 2, tables_length - 4 );
+    rawtile.adopt( data, length );
+  }
+
+  // The encoded data always covers the full tile, so edge tiles are marked as padded
+  rawtile.filename = getImagePath();
+  rawtile.timestamp = timestamp;
+  rawtile.padded = ( tw != tile_width || th != tile_height );
+  rawtile.sampleType = sampleType;
+  rawtile.compressionType = JPEG;
+
+  return true;
+
+}
+
+
+
+void TPTImage::adviseTiles( int seq, int ang, unsigned int res, unsigned int first, unsigned int last ) throw (string)
+{
+  uint32 tw, th;
+  toff_t *offsets = NULL, *sizes = NULL;
+
+  if( last < first ) return;
+  selectTile( seq, ang, res, first, tw, th );
+
+  if( last >= TIFFNumberOfTiles( tiff ) ) last = TIFFNumberOfTiles( tiff ) - 1;
+  if( !TIFFGetField( tiff, TIFFTAG_TILEOFFSETS, &offsets ) || !offsets ) return;
+  if( !TIFFGetField( tiff, TIFFTAG_TILEBYTECOUNTS, &sizes ) || !sizes ) return;
+
+  // Tiles are usually stored in order, so ask for the whole span of the file covering
+  // them at once unless they are scattered across it
+  toff_t start = offsets[first], end = offsets[first] + sizes[first], total = 0;
+  for( unsigned int t = first; t <= last; t++ ){
+    if( offsets[t] < start ) start = offsets[t];
+    if( offsets[t] + sizes[t] > end ) end = offsets[t] + sizes[t];
+    total += sizes[t];
+  }
+
+  if( end - start <= 2 * total ) TIFFMap::advise( tiff, start, end - start );
+  else{
+    for( unsigned int t = first; t <= last; t++ ) TIFFMap::advise( tiff, offsets[t], sizes[t] );
+  }
+}
@@ -25,6 +25,8 @@
 
 
 #include "IIPImage.h"
+#include "TIFFPool.h"
+#include "TIFFMap.h"
 #include <tiff.h>
 #include <tiffio.h>
 
@@ -42,6 +44,26 @@ class TPTImage : public IIPImage {
   /// Tile data buffer pointer
   tdata_t tile_buf;
 
+  /// Pool from which TIFF handles are borrowed, if any
+  static TIFFPool* pool;
+
+  /// Whether JPEG encoded tiles may be passed through without decoding
+  static bool passthrough;
+
+  /// Open a TIFF file, borrowing a handle from our pool if we have one
+  /** @param filename file path */
+  void openTIFF( const std::string& filename ) throw (std::string);
+
+  /// Open the file and directory holding a tile and get the size of the tile
+  /** @param x horizontal sequence angle
+      @param y vertical sequence angle
+      @param r resolution
+      @param t tile number
+      @param tw set to the width of this tile
+      @param th set to the height of this tile
+   */
+  void selectTile( int x, int y, unsigned int r, unsigned int t, uint32& tw, uint32& th ) throw (std::string);
+
 
  public:
 
@@ -81,6 +103,14 @@ class TPTImage : public IIPImage {
   /// Destructor
   ~TPTImage() { closeImage(); };
 
+  /// Keep TIFF handles open between images by borrowing them from a shared pool
+  /** @param p pool, which must outlive all TPTImage objects, or NULL to open and close files directly */
+  static void setPool( TIFFPool* p ) { pool = p; };
+
+  /// Allow JPEG encoded tiles to be passed through without being decoded and re-encoded
+  /** @param p whether to pass tiles through */
+  static void setJPEGPassthrough( bool p ) { passthrough = p; };
+
   /// Overloaded function for opening a TIFF image
   void openImage() throw (std::string);
 
@@ -102,6 +132,27 @@ class TPTImage : public IIPImage {
    */
   RawTile getTile( int x, int y, unsigned int r, int l, unsigned int t ) throw (std::string);
 
+  /// Overloaded function for getting a JPEG encoded tile without decoding it
+  /** Only possible for JPEG compressed YCbCr or greyscale images and if enabled with setJPEGPassthrough()
+      @param x horizontal sequence angle
+      @param y vertical sequence angle
+      @param r resolution
+      @param l quality layers
+      @param t tile number
+      @param tile tile to fill
+      @return true if the tile was filled
+   */
+  bool getJPEGTile( int x, int y, unsigned int r, int l, unsigned int t, RawTile& tile ) throw (std::string);
+
+  /// Overloaded function for hinting that a range of tiles is about to be read
+  /** @param x horizontal sequence angle
+      @param y vertical sequence angle
+      @param r resolution
+      @param first first tile number
+      @param last last tile number
+   */
+  void adviseTiles( int x, int y, unsigned int r, unsigned int first, unsigned int last ) throw (std::string);
+
 };
 
 
@@ -34,6 +34,10 @@
 #include "Timer.h"
 #include "Writer.h"
 #include "Cache.h"
+#include "ImageCache.h"
+#include "NegativeCache.h"
+#include "Prefetcher.h"
+#include "FileWatcher.h"
 #include "Watermark.h"
 #ifdef HAVE_PNG
 #include "PNGCompressor.h"
@@ -45,21 +49,6 @@
 
 
 
-#ifdef HAVE_EXT_POOL_ALLOCATOR
-#include <ext/pool_allocator.h>
-typedef HASHMAP < const std::string, IIPImage,
-			      __gnu_cxx::hash< const std::string >,
-			      std::equal_to< const std::string >,
-			      __gnu_cxx::__pool_alloc< std::pair<const std::string,IIPImage> >
-			      > imageCacheMapType;
-#else
-typedef HASHMAP <const std::string,IIPImage> imageCacheMapType;
-#endif
-
-
-
-
-
 
 /// Structure to hold our session data
 struct Session {
@@ -72,17 +61,16 @@ struct Session {
   IIPResponse* response;
   Watermark* watermark;
   int loglevel;
-  std::ofstream* logfile;
+  std::ostream* logfile;
   std::map <const std::string, std::string> headers;
 
-  imageCacheMapType *imageCache;
+  ImageCache *imageCache;
+  NegativeCache* negativeCache;
   Cache* tileCache;
+  Prefetcher* prefetcher;
+  FileWatcher* watcher;
 
-#ifdef DEBUG
-  FileWriter* out;
-#else
-  FCGIWriter* out;
-#endif
+  Writer* out;
 
 };
 
@@ -0,0 +1,145 @@
+// Thread Class
+
+/*  IIP Image Server
+
+    Copyright (C) 2014 Ruven Pillay.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#ifndef _THREAD_H
+#define _THREAD_H
+
+
+#ifdef WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#endif
+
+
+
+/// Simple portable thread which runs a function until it returns
+
+class Thread {
+
+ private:
+
+#ifdef WIN32
+  HANDLE thread;
+#else
+  pthread_t thread;
+#endif
+
+  /// Whether the thread has been started and not yet joined
+  bool running;
+
+  /// Function to run and its argument
+  void (*function)( void* );
+  void *argument;
+
+#ifdef WIN32
+  static DWORD WINAPI entry( LPVOID t ) {
+    ((Thread*)t)->function( ((Thread*)t)->argument );
+    return 0;
+  };
+#else
+  static void* entry( void* t ) {
+    ((Thread*)t)->function( ((Thread*)t)->argument );
+    return NULL;
+  };
+#endif
+
+  /// Threads cannot be copied
+  Thread( const Thread& );
+  Thread& operator = ( const Thread& );
+
+
+ public:
+
+  /// Constructor
+  Thread() : running( false ), function( NULL ), argument( NULL ) {};
+
+
+  /// Destructor - waits for the thread to finish
+  ~Thread() { join(); };
+
+
+  /// Start running a function in a new thread
+  /** @param f function to run
+      @param a argument to pass to the function
+      @return true if the thread was started
+   */
+  bool start( void (*f)( void* ), void* a ) {
+    if( running ) return false;
+    function = f;
+    argument = a;
+#ifdef WIN32
+    thread = CreateThread( NULL, 0, entry, this, 0, NULL );
+    running = ( thread != NULL );
+#else
+    running = ( pthread_create( &thread, NULL, entry, this ) == 0 );
+#endif
+    return running;
+  };
+
+
+  /// Wait for the thread to finish
+  void join() {
+    if( !running ) return;
+#ifdef WIN32
+    WaitForSingleObject( thread, INFINITE );
+    CloseHandle( thread );
+#else
+    pthread_join( thread, NULL );
+#endif
+    running = false;
+  };
+
+
+  /// Return the number of processors available
+  static unsigned int getNumProcessors() {
+#ifdef WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo( &info );
+    long n = info.dwNumberOfProcessors;
+#elif defined(_SC_NPROCESSORS_ONLN)
+    long n = sysconf( _SC_NPROCESSORS_ONLN );
+#else
+    long n = 1;
+#endif
+    return ( n > 0 ) ? (unsigned int) n : 1;
+  };
+
+
+  /// Lower the scheduling priority of the calling thread so that it only runs when the CPU is otherwise idle
+  static void lowerPriority() {
+#ifdef WIN32
+    SetThreadPriority( GetCurrentThread(), THREAD_PRIORITY_IDLE );
+#elif defined(SCHED_IDLE)
+    struct sched_param param;
+    param.sched_priority = 0;
+    pthread_setschedparam( pthread_self(), SCHED_IDLE, &param );
+#endif
+  };
+
+};
+
+
+
+#endif
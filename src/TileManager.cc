@@ -24,23 +24,37 @@
 
 
 #include "TileManager.h"
+#include "RegionPool.h"
+
+#include <algorithm>
 
 
 using namespace std;
 
 
+RegionPool* TileManager::regionPool = NULL;
+int TileManager::passthroughQuality = -1;
+
+
 
 RawTile TileManager::getNewTile( int resolution, int tile, int xangle, int yangle, int layers, CompressionType c ){
 
   if( loglevel >= 2 ) *logfile << "TileManager :: Cache Miss for resolution: " << resolution << ", tile: " << tile << endl
 			       << "TileManager :: Cache Size: " << tileCache->getNumElements()
-			       << " tiles, " << tileCache->getMemorySize() << " MB" << endl;
+			       << " tiles, " << tileCache->getMemorySize() << " MB, "
+			       << tileCache->getNumImages() << " image ids" << endl;
+
 
+  // JPEG encoded tiles which need no watermark can be sent as they are stored in the
+  // image without being decoded and re-encoded
+  RawTile jtile;
+  if( c == JPEG && this->passthrough( resolution, tile, xangle, yangle, layers, jtile ) ) return jtile;
 
-  RawTile ttt;
 
-  // Get our raw tile from the IIPImage image object
-  ttt = image->getTile( xangle, yangle, resolution, layers, tile );
+  // Get our raw tile from the IIPImage image object. This may borrow the
+  // decoder's own buffer, in which case it is copied only once when inserted
+  // into the cache or modified
+  RawTile ttt = image->getTile( xangle, yangle, resolution, layers, tile );
 
 
   // Apply the watermark if we have one.
@@ -51,6 +65,8 @@ RawTile TileManager::getNewTile( int resolution, int tile, int xangle, int yangl
     unsigned int tw = ttt.padded? image->getTileWidth() : ttt.width;
     unsigned int th = ttt.padded? image->getTileHeight() : ttt.height;
 
+    // The watermark is applied in place, so make sure we have our own copy
+    ttt.detach();
     watermark->apply( ttt.data, tw, th, ttt.channels, ttt.bpc );
     if( loglevel >= 2 ) *logfile << "TileManager :: Watermark applied: " << insert_timer.getTime()
 				 << " microseconds" << endl;
@@ -116,6 +132,37 @@ RawTile TileManager::getNewTile( int resolution, int tile, int xangle, int yangl
 
 
 
+bool TileManager::passthrough( int resolution, int tile, int xangle, int yangle, int layers, RawTile& rawtile ){
+
+  if( watermark && watermark->isSet() ) return false;
+
+  // Stored tiles have the quality with which the image was created, so only use
+  // them when no particular quality has been asked for
+  if( passthroughQuality >= 0 && jpeg->getQuality() != passthroughQuality ) return false;
+
+  if( loglevel >= 2 ) compression_timer.start();
+  if( !image->getJPEGTile( xangle, yangle, resolution, layers, tile, rawtile ) ) return false;
+
+  // Edge tiles are cropped losslessly
+  if( rawtile.padded ){
+    if( loglevel >= 5 ) *logfile << "TileManager :: Cropping JPEG tile" << endl;
+    jpeg->Crop( rawtile );
+  }
+  rawtile.quality = jpeg->getQuality();
+
+  if( loglevel >= 2 ) *logfile << "TileManager :: JPEG tile passed through in "
+			       << compression_timer.getTime() << " microseconds" << endl;
+
+  if( loglevel >= 2 ) insert_timer.start();
+  tileCache->insert( rawtile );
+  if( loglevel >= 2 ) *logfile << "TileManager :: Tile cache insertion time: " << insert_timer.getTime()
+			       << " microseconds" << endl;
+
+  return true;
+}
+
+
+
 void TileManager::crop( RawTile *ttt ){
 
   int tw = image->getTileWidth();
@@ -127,22 +174,27 @@ void TileManager::crop( RawTile *ttt ){
 	     << endl;
   }
 
-  // Create a new buffer, fill it with the old data, then copy
-  // back the cropped part into the RawTile buffer
-  int len = tw * th * ttt->channels * ttt->bpc/8;
-  unsigned char* buffer = (unsigned char*) malloc( len );
-  unsigned char* src_ptr = (unsigned char*) memcpy( buffer, ttt->data, len );
-  unsigned char* dst_ptr = (unsigned char*) ttt->data;
+  // Copy one scanline at a time. If we own our data, we can crop in place as
+  // each cropped scanline never overlaps those still to be read. Otherwise
+  // crop into a new buffer rather than modifying shared or borrowed data
+  unsigned int len = ttt->width * ttt->channels * ttt->bpc/8;
+  unsigned int stride = tw * ttt->channels * ttt->bpc/8;
+  unsigned char* src_ptr = (unsigned char*) ttt->data;
+  unsigned char* dst_ptr = src_ptr;
+  void* buffer = NULL;
+
+  if( ttt->getOwnership() != OWNED ){
+    buffer = TileBuffer::allocate( ttt->bpc, ttt->sampleType, len * ttt->height );
+    dst_ptr = (unsigned char*) buffer;
+  }
 
-  // Copy one scanline at a time
   for( unsigned int i=0; i<ttt->height; i++ ){
-    len =  ttt->width * ttt->channels * ttt->bpc/8;
-    memcpy( dst_ptr, src_ptr, len );
+    memmove( dst_ptr, src_ptr, len );
     dst_ptr += len;
-    src_ptr += tw * ttt->channels * ttt->bpc/8;
+    src_ptr += stride;
   }
 
-  free( buffer );
+  if( buffer ) ttt->adopt( buffer, len * ttt->height );
 
   // Reset the data length
   len = ttt->width * ttt->height * ttt->channels * ttt->bpc/8;
@@ -154,74 +206,105 @@ void TileManager::crop( RawTile *ttt ){
 
 
 
-RawTile TileManager::getTile( int resolution, int tile, int xangle, int yangle, int layers, CompressionType c ){
-
-  RawTile* rawtile = NULL;
-  string tileCompression;
-  string compName;
-
-
-  // Time the tile retrieval
-  if( loglevel >= 2 ) tile_timer.start();
-
+bool TileManager::lookup( unsigned long long id, int resolution, int tile, int xangle, int yangle, CompressionType c, RawTile& rawtile ){
 
-  /* Try to get this tile from our cache first as a JPEG, then uncompressed
-     Otherwise decode one from the source image and add it to the cache
-   */
   switch( c )
     {
 
     case JPEG:
-      if( (rawtile = tileCache->getTile( image->getImagePath(), resolution, tile,
-					  xangle, yangle, JPEG, jpeg->getQuality() )) ) break;
-      if( (rawtile = tileCache->getTile( image->getImagePath(), resolution, tile,
-					 xangle, yangle, DEFLATE, 0 )) ) break;
-      if( (rawtile = tileCache->getTile( image->getImagePath(), resolution, tile,
-					 xangle, yangle, UNCOMPRESSED, 0 )) ) break;
+      if( tileCache->getTile( id, resolution, tile, xangle, yangle, JPEG, jpeg->getQuality(), rawtile ) ) return true;
+      if( tileCache->getTile( id, resolution, tile, xangle, yangle, DEFLATE, 0, rawtile ) ) return true;
+      if( tileCache->getTile( id, resolution, tile, xangle, yangle, UNCOMPRESSED, 0, rawtile ) ) return true;
       break;
 
 
     case DEFLATE:
 
-      if( (rawtile = tileCache->getTile( image->getImagePath(), resolution, tile,
-					 xangle, yangle, DEFLATE, 0 )) ) break;
-      if( (rawtile = tileCache->getTile( image->getImagePath(), resolution, tile,
-					 xangle, yangle, UNCOMPRESSED, 0 )) ) break;
+      if( tileCache->getTile( id, resolution, tile, xangle, yangle, DEFLATE, 0, rawtile ) ) return true;
+      if( tileCache->getTile( id, resolution, tile, xangle, yangle, UNCOMPRESSED, 0, rawtile ) ) return true;
       break;
 
 
     case UNCOMPRESSED:
 
-      if( (rawtile = tileCache->getTile( image->getImagePath(), resolution, tile,
-					 xangle, yangle, UNCOMPRESSED, 0 )) ) break;
+      if( tileCache->getTile( id, resolution, tile, xangle, yangle, UNCOMPRESSED, 0, rawtile ) ) return true;
       break;
 
 
-    default: 
+    default:
       break;
 
     }
 
+  return false;
+}
+
+
+
+
+RawTile TileManager::getTile( int resolution, int tile, int xangle, int yangle, int layers, CompressionType c ){
+
+  RawTile rawtile;
+  bool found = false;
+  string tileCompression;
+  string compName;
+
+
+  // Time the tile retrieval
+  if( loglevel >= 2 ) tile_timer.start();
+
+
+  /* Try to get this tile from our cache first as a JPEG, then uncompressed
+     Otherwise decode one from the source image and add it to the cache
+   */
+  unsigned long long id = tileCache->getImageId( image->getImagePath() );
+
+  found = this->lookup( id, resolution, tile, xangle, yangle, c, rawtile );
+
 
   // If we haven't been able to get a tile, get a raw one
-  if( !rawtile || (rawtile && (rawtile->timestamp < image->timestamp)) ){
+  if( !found || (found && (rawtile.timestamp < image->timestamp)) ){
 
-    if( rawtile && (rawtile->timestamp < image->timestamp) ){
+    if( found && (rawtile.timestamp < image->timestamp) ){
       if( loglevel >= 3 ) *logfile << "TileManager :: Tile has old timestamp "
-			           << rawtile->timestamp << " - " << image->timestamp
+			           << rawtile.timestamp << " - " << image->timestamp
                                    << " ... updating" << endl;
     }
 
-    RawTile newtile = this->getNewTile( resolution, tile, xangle, yangle, layers, c );
+    // Only one request at a time should decode any given tile. If another is already doing so,
+    // wait for it to finish and use its result, only decoding ourselves if that fails
+    int quality = ( c == JPEG ) ? jpeg->getQuality() : 0;
+    bool claimed = tileCache->claim( id, resolution, tile, xangle, yangle, c, quality );
+    if( !claimed ){
+      if( loglevel >= 3 ) *logfile << "TileManager :: Waited for tile to be decoded by another request" << endl;
+      found = this->lookup( id, resolution, tile, xangle, yangle, c, rawtile );
+    }
+
+    if( claimed || !found || (rawtile.timestamp < image->timestamp) ){
 
-    if( loglevel >= 2 ) *logfile << "TileManager :: Total Tile Access Time: "
-				 << tile_timer.getTime() << " microseconds" << endl;
-    return newtile;
+      RawTile newtile;
+      try{
+	newtile = this->getNewTile( resolution, tile, xangle, yangle, layers, c );
+      }
+      catch( ... ){
+	if( claimed ) tileCache->release( id, resolution, tile, xangle, yangle, c, quality );
+	throw;
+      }
+      if( claimed ) tileCache->release( id, resolution, tile, xangle, yangle, c, quality );
+
+      if( loglevel >= 2 ) *logfile << "TileManager :: Total Tile Access Time: "
+				   << tile_timer.getTime() << " microseconds" << endl;
+      return newtile;
+    }
   }
 
 
+  // Cached tiles do not store their filename
+  rawtile.filename = image->getImagePath();
+
+
   // Define our compression names
-  switch( rawtile->compressionType ){
+  switch( rawtile.compressionType ){
     case JPEG: compName = "JPEG"; break;
     case DEFLATE: compName = "DEFLATE"; break;
     case UNCOMPRESSED: compName = "UNCOMPRESSED"; break;
@@ -233,29 +316,36 @@ RawTile TileManager::getTile( int resolution, int tile, int xangle, int yangle,
 			       << ", compression: " << compName << endl
 			       << "TileManager :: Cache Size: "
 			       << tileCache->getNumElements() << " tiles, "
-			       << tileCache->getMemorySize() << " MB" << endl;
+			       << tileCache->getMemorySize() << " MB, "
+			       << tileCache->getNumImages() << " image ids" << endl;
 
 
   // Check whether the compression used for out tile matches our requested compression type.
   // If not, we must convert
 
-  if( c == JPEG && rawtile->compressionType == UNCOMPRESSED ){
+  if( c == JPEG && rawtile.compressionType == UNCOMPRESSED ){
 
-    // Rawtile is a pointer to the cache data, so we need to create a copy of it in case we compress it
-    RawTile ttt( *rawtile );
+    // Prefer the tile as it is encoded in the image, if possible, to compressing the
+    // cached one, so that the tile sent does not depend on what happens to be cached
+    RawTile jtile;
+    if( this->passthrough( resolution, tile, xangle, yangle, layers, jtile ) ){
+      if( loglevel >= 2 ) *logfile << "TileManager :: Total Tile Access Time: "
+				   << tile_timer.getTime() << " microseconds" << endl;
+      return jtile;
+    }
 
     // Do our JPEG compression iff we have an 8 bit per channel image
-    if( rawtile->bpc == 8 ){
+    if( rawtile.bpc == 8 ){
 
       // Crop if this is an edge tile
-      if( ( (ttt.width != image->getTileWidth()) || (ttt.height != image->getTileHeight()) ) && ttt.padded ){
+      if( ( (rawtile.width != image->getTileWidth()) || (rawtile.height != image->getTileHeight()) ) && rawtile.padded ){
 	if( loglevel >= 5 ) * logfile << "TileManager :: Cropping tile" << endl;
-	this->crop( &ttt );
+	this->crop( &rawtile );
       }
 
       if( loglevel >=2 ) compression_timer.start();
-      unsigned int oldlen = rawtile->dataLength;
-      unsigned int newlen = jpeg->Compress( ttt );
+      unsigned int oldlen = rawtile.dataLength;
+      unsigned int newlen = jpeg->Compress( rawtile );
       if( loglevel >= 2 ) *logfile << "TileManager :: JPEG requested, but UNCOMPRESSED compression found in cache." << endl
 				   << "TileManager :: JPEG Compression Time: "
 				   << compression_timer.getTime() << " microseconds" << endl
@@ -264,20 +354,16 @@ RawTile TileManager::getTile( int resolution, int tile, int xangle, int yangle,
 
       // Add our compressed tile to the cache
       if( loglevel >= 2 ) insert_timer.start();
-      tileCache->insert( ttt );
+      tileCache->insert( rawtile );
       if( loglevel >= 2 ) *logfile << "TileManager :: Tile cache insertion time: " << insert_timer.getTime()
 				   << " microseconds" << endl;
-
-      if( loglevel >= 2 ) *logfile << "TileManager :: Total Tile Access Time: "
-				   << tile_timer.getTime() << " microseconds" << endl;
-      return RawTile( ttt );
     }
   }
 
   if( loglevel >= 2 ) *logfile << "TileManager :: Total Tile Access Time: "
 			       << tile_timer.getTime() << " microseconds" << endl;
 
-  return RawTile( *rawtile );
+  return rawtile;
 
 
 }
@@ -299,14 +385,6 @@ RawTile TileManager::getRegion( unsigned int res, int seq, int ang, int layers,
   unsigned int src_tile_width = image->getTileWidth();
   unsigned int src_tile_height = image->getTileHeight();
 
-  // The tile size of the destination tile
-  unsigned int dst_tile_width = src_tile_width;
-  unsigned int dst_tile_height = src_tile_height;
-
-  // The basic tile size ie. not the current tile
-  unsigned int basic_tile_width = src_tile_width;
-  // unsigned int basic_tile_height = src_tile_height;
-
   int num_res = image->getNumResolutions();
   unsigned int im_width = image->image_widths[num_res-res-1];
   unsigned int im_height = image->image_heights[num_res-res-1];
@@ -318,30 +396,38 @@ RawTile TileManager::getRegion( unsigned int res, int seq, int ang, int layers,
   unsigned int ntlx = (im_width / src_tile_width) + (rem_x == 0 ? 0 : 1);
   unsigned int ntly = (im_height / src_tile_height) + (rem_y == 0 ? 0 : 1);
 
-  // Start and end tiles and pixel offsets
-  unsigned int startx, endx, starty, endy, xoffset, yoffset;
+  // Start and end tiles, only including those which overlap our region
+  unsigned int startx = x / src_tile_width;
+  unsigned int starty = y / src_tile_height;
+  unsigned int endx = std::min( (x + width + src_tile_width - 1) / src_tile_width, ntlx );
+  unsigned int endy = std::min( (y + height + src_tile_height - 1) / src_tile_height, ntly );
 
+  if( loglevel >= 3 ){
+    *logfile << "TileManager getRegion :: Tile Start: " << startx << "," << starty << ","
+	     << x % src_tile_width << "," << y % src_tile_height << endl
+	     << "TileManager getRegion :: End Tiles: " << endx << "," << endy << endl;
+  }
 
-  if( ! ( x==0 && y==0 && width==im_width && height==im_height ) ){
-    // Calculate the start tiles
-    startx = (unsigned int) ( x / src_tile_width );
-    starty = (unsigned int) ( y / src_tile_height );
-    xoffset = x % src_tile_width;
-    yoffset = y % src_tile_height;
-    endx = (unsigned int) ( (width + x) / src_tile_width ) + 1;
-    endy = (unsigned int) ( (height + y) / src_tile_height ) + 1;
 
-    if( loglevel >= 3 ){
-      *logfile << "TileManager getRegion :: Tile Start: " << startx << "," << starty << ","
-	       << xoffset << "," << yoffset << endl
-	       << "TileManager getRegion :: End Tiles: " << endx << "," << endy << endl;
+  // Work out which part of each tile makes up which part of the region
+  vector<RegionTile> tiles;
+  for( unsigned int i=starty; i<endy; i++ ){
+    unsigned int top = std::max( i*src_tile_height, y );
+    unsigned int bottom = std::min( (i+1)*src_tile_height, y + height );
+    for( unsigned int j=startx; j<endx; j++ ){
+      unsigned int left = std::max( j*src_tile_width, x );
+      unsigned int right = std::min( (j+1)*src_tile_width, x + width );
+      RegionTile t;
+      t.tile = (i*ntlx) + j;
+      t.xf = left - j*src_tile_width;
+      t.yf = top - i*src_tile_height;
+      t.width = right - left;
+      t.height = bottom - top;
+      t.x = left - x;
+      t.y = top - y;
+      tiles.push_back( t );
     }
   }
-  else{
-    startx = starty = xoffset = yoffset = 0;
-    endx = ntlx;
-    endy = ntly;
-  }
 
 
   unsigned int channels = image->getNumChannels();
@@ -350,131 +436,104 @@ RawTile TileManager::getRegion( unsigned int res, int seq, int ang, int layers,
 
   // Create an empty tile with the correct dimensions
   RawTile region( 0, res, seq, ang, width, height, channels, bpp );
-  region.dataLength = width * height * channels * bpp/8;
   region.sampleType = sampleType;
 
   // Allocate memory for the region
-  if( bpp == 8 ) region.data = new unsigned char[width*height*channels];
-  else if( bpp == 16 ) region.data = new unsigned short[width*height*channels];
-  else if( bpp == 32 && sampleType == FIXEDPOINT ) region.data = new int[width*height*channels];
-  else if( bpp == 32 && sampleType == FLOATINGPOINT ) region.data = new float[width*height*channels];
-
-  unsigned int current_height = 0;
+  region.allocate( width * height * channels * bpp/8 );
 
-  // Decode the image strip by strip
+  // Let the image start reading in each row of tiles
   for( unsigned int i=starty; i<endy; i++ ){
+    image->adviseTiles( seq, ang, res, (i*ntlx) + startx, (i*ntlx) + endx - 1 );
+  }
 
-    unsigned int buffer_index = 0;
 
-    // Keep track of the current pixel boundary horizontally. ie. only up
-    //  to the beginning of the current tile boundary.
-    unsigned int current_width = 0;
+  // Share the tiles out between our pool of threads if we have one
+  if( regionPool && regionPool->enabled() && tiles.size() > 1 ){
+    if( loglevel >= 2 ) tile_timer.start();
+    regionPool->compose( *this, image, tileCache, watermark, res, seq, ang, layers, tiles, region );
+    if( loglevel >= 2 ){
+      *logfile << "TileManager getRegion :: " << tiles.size() << " tiles decoded in parallel in "
+	       << tile_timer.getTime() << " microseconds" << endl;
+    }
+    return region;
+  }
 
-    for( unsigned int j=startx; j<endx; j++ ){
 
-      // Time the tile retrieval
-      if( loglevel >= 2 ) tile_timer.start();
+  // Otherwise decode the tiles one by one
+  for( unsigned int n=0; n<tiles.size(); n++ ){
 
-      // Get an uncompressed tile
-      RawTile rawtile = this->getTile( res, (i*ntlx) + j, seq, ang, layers, UNCOMPRESSED );
+    // Time the tile retrieval
+    if( loglevel >= 2 ) tile_timer.start();
 
-      if( loglevel >= 2 ){
-	*logfile << "TileManager getRegion :: Tile access time " << tile_timer.getTime() << " microseconds for tile "
-		 << (i*ntlx) + j << " at resolution " << res << endl;
-      }
+    // Get an uncompressed tile
+    RawTile rawtile = this->getTile( res, tiles[n].tile, seq, ang, layers, UNCOMPRESSED );
 
+    if( loglevel >= 2 ){
+      *logfile << "TileManager getRegion :: Tile access time " << tile_timer.getTime() << " microseconds for tile "
+	       << tiles[n].tile << " at resolution " << res << endl;
+    }
 
-      // Only print this out once per image
-      if( (loglevel >= 4) && (i==starty) && (j==starty) ){
-	*logfile << "TileManager getRegion :: Tile data is " << rawtile.channels << " channels, "
-		 << rawtile.bpc << " bits per channel" << endl;
-      }
+    // Only print this out once per image
+    if( (loglevel >= 4) && (n == 0) ){
+      *logfile << "TileManager getRegion :: Tile data is " << rawtile.channels << " channels, "
+	       << rawtile.bpc << " bits per channel" << endl;
+    }
 
-      // Set the tile width and height to be that of the source tile
-      // - Use the rawtile data because if we take a tile from cache
-      //   the image pointer will not necessarily be pointing to the
-      //   the current tile
-      //	src_tile_width = (*session->image)->getTileWidth();
-      //	src_tile_height = (*session->image)->getTileHeight();
-      src_tile_width = rawtile.width;
-      src_tile_height = rawtile.height;
-      dst_tile_width = src_tile_width;
-      dst_tile_height = src_tile_height;
-
-      // Variables for the pixel offset within the current tile
-      unsigned int xf = 0;
-      unsigned int yf = 0;
-
-      // If our viewport has been set, we need to modify our start
-      // and end points on the source image
-      if( !( x==0 && y==0 && width==im_width && height==im_height ) ){
-
-	if( j == startx ){
-	  // Calculate the width used in the current tile
-	  // If there is only 1 tile, the width is just the view width
-	  if( j < endx - 1 ) dst_tile_width = src_tile_width - xoffset;
-	  else dst_tile_width = width;
-	  xf = xoffset;
-	}
-	else if( j == endx-1 ){
-	  dst_tile_width = (width+x) % basic_tile_width;
-	}
-
-	if( i == starty ){
-	  // Calculate the height used in the current row of tiles
-	  // If there is only 1 row the height is just the view height
-	  if( i < endy - 1 ) dst_tile_height = src_tile_height - yoffset;
-	  else dst_tile_height = height;
-	  yf = yoffset;
-	}
-	else if( i == endy-1 ){
-	  dst_tile_height = (height+y) % basic_tile_width;
-	}
-
-	if( loglevel >= 4 ){
-	  *logfile << "TileManager getRegion :: destination tile height: " << dst_tile_height
-		   << ", tile width: " << dst_tile_width << endl;
-	}
-      }
+    if( loglevel >= 4 ){
+      *logfile << "TileManager getRegion :: destination tile height: " << tiles[n].height
+	       << ", tile width: " << tiles[n].width << endl;
+    }
+
+    this->copyTile( rawtile, tiles[n], region );
+  }
 
+  return region;
+
+}
 
-      // Copy our tile data into the appropriate part of the strip memory
-      // one whole tile width at a time
-      for( unsigned int k=0; k<dst_tile_height; k++ ){
-
-	buffer_index = (current_width*channels) + (k*width*channels) + (current_height*width*channels);
-	unsigned int inx = ((k+yf)*rawtile.width*channels) + (xf*channels);
-
-	// Simply copy the line of data across
-	if( bpp == 8 ){
-	  unsigned char* ptr = (unsigned char*) rawtile.data;
-	  unsigned char* buf = (unsigned char*) region.data;
-	  memcpy( &buf[buffer_index], &ptr[inx], dst_tile_width*channels );
-	}
-	else if( bpp ==  16 ){
-	  unsigned short* ptr = (unsigned short*) rawtile.data;
-	  unsigned short* buf = (unsigned short*) region.data;
-	  memcpy( &buf[buffer_index], &ptr[inx], dst_tile_width*channels*2 );
-	}
-	else if( bpp == 32 && sampleType == FIXEDPOINT ){
-	  unsigned int* ptr = (unsigned int*) rawtile.data;
-	  unsigned int* buf = (unsigned int*) region.data;
-	  memcpy( &buf[buffer_index], &ptr[inx], dst_tile_width*channels*4 );
-	}
-	else if( bpp == 32 && sampleType == FLOATINGPOINT ){
-	  float* ptr = (float*) rawtile.data;
-	  float* buf = (float*) region.data;
-	  memcpy( &buf[buffer_index], &ptr[inx], dst_tile_width*channels*4 );
-	}
-      }
 
-      current_width += dst_tile_width;
-    }
 
-    current_height += dst_tile_height;
+void TileManager::copyTile( const RawTile& rawtile, const RegionTile& t, RawTile& region ) throw(string){
 
+  if( rawtile.width < t.xf + t.width || rawtile.height < t.yf + t.height ){
+    throw string( "TileManager :: tile smaller than the part of the region it should cover" );
   }
 
-  return region;
+  // Copy our tile data into the appropriate part of the region one line at a time
+  unsigned int bytes = region.channels * region.bpc / 8;
+  const unsigned char* src = (const unsigned char*) rawtile.data;
+  unsigned char* dst = (unsigned char*) region.data;
+
+  for( unsigned int k=0; k<t.height; k++ ){
+    size_t buffer_index = ( (size_t)(t.y + k) * region.width + t.x ) * bytes;
+    size_t inx = ( (size_t)(t.yf + k) * rawtile.width + t.xf ) * bytes;
+    memcpy( &dst[buffer_index], &src[inx], t.width * bytes );
+  }
+}
+
+
+
+unsigned int TileManager::preload( unsigned int levels, int xangle, int yangle, int layers, CompressionType c ){
+
+  unsigned int tw = image->getTileWidth();
+  unsigned int th = image->getTileHeight();
+  unsigned int num_res = image->getNumResolutions();
+  if( tw == 0 || th == 0 ) return 0;
+
+  unsigned int n = 0;
+  for( unsigned int res = 0; res < levels && res < num_res; res++ ){
+    unsigned int ntlx = ( image->image_widths[num_res-res-1] + tw - 1 ) / tw;
+    unsigned int ntly = ( image->image_heights[num_res-res-1] + th - 1 ) / th;
+    image->adviseTiles( xangle, yangle, res, 0, ntlx*ntly - 1 );
+    for( unsigned int t = 0; t < ntlx*ntly; t++ ){
+      this->getTile( res, t, xangle, yangle, layers, c );
+      n++;
+    }
+  }
+
+  if( loglevel >= 3 ){
+    *logfile << "TileManager :: Preloaded " << n << " tiles from the lowest " << levels << " resolutions" << endl;
+  }
 
+  return n;
 }
@@ -25,6 +25,7 @@
 
 
 #include <fstream>
+#include <vector>
 
 #include "RawTile.h"
 #include "IIPImage.h"
@@ -35,6 +36,20 @@
 
 
 
+class RegionPool;
+
+
+
+/// The part of a tile making up part of a region
+struct RegionTile {
+  unsigned int tile;            ///< tile number
+  unsigned int xf, yf;          ///< offset of the part used within the tile
+  unsigned int width, height;   ///< size of the part used
+  unsigned int x, y;            ///< position within the region
+};
+
+
+
 /// Class to manage access to the tile cache and tile cropping
 
 class TileManager{
@@ -46,10 +61,16 @@ class TileManager{
   JPEGCompressor* jpeg;
   IIPImage* image;
   Watermark* watermark;
-  std::ofstream* logfile;
+  std::ostream* logfile;
   int loglevel;
   Timer compression_timer, tile_timer, insert_timer;
 
+  /// Pool of threads with which regions are composed, or NULL
+  static RegionPool* regionPool;
+
+  /// Default JPEG quality, the only one at which tiles are passed through as stored
+  static int passthroughQuality;
+
   /// Get a new tile from the image file
   /**
    *  If the JPEG tile already exists in the cache, use that, otherwise check for
@@ -66,6 +87,34 @@ class TileManager{
   RawTile getNewTile( int resolution, int tile, int xangle, int yangle, int layers, CompressionType c );
 
 
+  /// Get a JPEG tile as it is encoded in the image, crop it if necessary and add it to the cache
+  /** @param resolution resolution number
+      @param tile tile number
+      @param xangle horizontal sequence number
+      @param yangle vertical sequence number
+      @param layers number of quality layers
+      @param rawtile tile to fill
+      @return false if the image cannot supply the tile in this way, a watermark must be applied
+              or a quality other than the default has been requested
+   */
+  bool passthrough( int resolution, int tile, int xangle, int yangle, int layers, RawTile& rawtile );
+
+
+  /// Look for a tile in the cache
+  /**
+   *  Look for a JPEG tile first if requested, then a DEFLATE and finally an uncompressed tile
+   *  @param id image id obtained from the cache
+   *  @param resolution resolution number
+   *  @param tile tile number
+   *  @param xangle horizontal sequence number
+   *  @param yangle vertical sequence number
+   *  @param c CompressionType
+   *  @param rawtile tile into which any cached tile is placed
+   *  @return true if the tile was found
+   */
+  bool lookup( unsigned long long id, int resolution, int tile, int xangle, int yangle, CompressionType c, RawTile& rawtile );
+
+
   /// Crop a tile to remove padding
   /** @param t pointer to tile to crop
    */
@@ -84,7 +133,7 @@ class TileManager{
    * @param s  pointer to output file stream
    * @param l  logging level
    */
-  TileManager( Cache* tc, IIPImage* im, Watermark* w, JPEGCompressor* j, std::ofstream* s, int l ){
+  TileManager( Cache* tc, IIPImage* im, Watermark* w, JPEGCompressor* j, std::ostream* s, int l ){
     tileCache = tc; 
     image = im;
     watermark = w;
@@ -128,6 +177,44 @@ class TileManager{
    */
     RawTile getRegion( unsigned int res, int xangle, int yangle, int layers, unsigned int x, unsigned int y, unsigned int w, unsigned int h );
 
+
+
+  /// Load every tile of the lowest resolutions into the cache
+  /**
+   *  Used to pin the overview levels of an image as soon as it is opened
+   *  @param levels number of resolutions to load, counting from the smallest
+   *  @param xangle horizontal sequence number
+   *  @param yangle vertical sequence number
+   *  @param layers number of quality layers within image to decode
+   *  @param c CompressionType
+   *  @return number of tiles loaded
+   */
+  unsigned int preload( unsigned int levels, int xangle, int yangle, int layers, CompressionType c );
+
+
+
+  /// Copy the part of a tile making up part of a region into place
+  /** Throws a string exception if the tile is smaller than expected
+   *  @param rawtile uncompressed tile
+   *  @param t part of the tile used and its position
+   *  @param region allocated region
+   */
+  static void copyTile( const RawTile& rawtile, const RegionTile& t, RawTile& region ) throw(std::string);
+
+
+
+  /// Set the pool of threads with which getRegion() decodes tiles in parallel
+  /** @param p pool, or NULL to decode tiles one at a time */
+  static void setRegionPool( RegionPool* p ){ regionPool = p; };
+
+
+  /// Set the default JPEG quality
+  /** JPEG tiles are only passed through as they are stored in the image, and cached
+      under this quality, for requests made at it. Other qualities are re-encoded
+      @param q quality factor, or -1 to pass tiles through at any quality
+   */
+  static void setPassthroughQuality( int q ){ passthroughQuality = q; };
+
 };
 
 
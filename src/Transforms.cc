@@ -54,6 +54,7 @@ void filter_normalize( RawTile& in, std::vector<float>& max, std::vector<float>&
   unsigned char* ucptr; 
 
   if( in.bpc == 32 && in.sampleType == FLOATINGPOINT ) {
+    in.detach();
     normdata = (float*)in.data;
   } else {
     normdata = new float[np];
@@ -98,10 +99,8 @@ void filter_normalize( RawTile& in, std::vector<float>& max, std::vector<float>&
   }
 
   if(! (in.bpc == 32 && in.sampleType == FLOATINGPOINT) ) {
-    delete[] (float*) in.data;
-    in.data = normdata;
+    in.adopt( normdata, np * sizeof(float) );
     in.bpc = 32;
-    in.dataLength = np * in.bpc / 8;
   }
 
   return;
@@ -162,12 +161,9 @@ void filter_shade( RawTile& in, int h_angle, int v_angle ){
   }
 
 
-  // Delete old data buffer
-  delete[] (float*) in.data;
-
-  in.data = buffer;
+  // Replace the old data buffer
+  in.adopt( buffer, in.width * in.height * in.bpc / 8 );
   in.channels = 1;
-  in.dataLength = in.width * in.height * in.bpc / 8;
 }
 
 
@@ -267,6 +263,9 @@ void filter_LAB2sRGB( RawTile& in ){
 
   unsigned long np = in.width * in.height * in.channels;
 
+  // We modify the data in place
+  in.detach();
+
   // Parallelize code using OpenMP
   unsigned int nstep = in.channels;
 #pragma omp parallel for
@@ -353,11 +352,9 @@ void filter_cmap( RawTile& in, enum cmap_type cmap ){
     };
 
 
-  // Delete old data buffer
-  delete[] (float*) in.data;
-  in.data = outptr;
+  // Replace the old data buffer
+  in.adopt( outptr, ndata * out_chan * in.bpc / 8 );
   in.channels = out_chan;
-  in.dataLength = ndata * out_chan * in.bpc / 8;
 }
 
 
@@ -366,6 +363,7 @@ void filter_inv( RawTile& in ){
   float* infptr;
   unsigned int np = in.dataLength * 8 / in.bpc;
 
+  in.detach();
   infptr = (float*)in.data;
 
   // Loop through our pixels for floating values 
@@ -408,13 +406,9 @@ void filter_interpolate_nearestneighbour( RawTile& in, unsigned int resampled_wi
   }
 
   // Correctly set our Rawtile info
-  if( in.memoryManaged ) delete[] in.data;
-  in.data = buf;
-  in.memoryManaged = true;
-
+  in.adopt( buf, resampled_width * resampled_height * channels * in.bpc/8 );
   in.width = resampled_width;
   in.height = resampled_height;
-  in.dataLength = resampled_width * resampled_height * channels * in.bpc/8;
 
 }
 
@@ -480,13 +474,9 @@ void filter_interpolate_bilinear( RawTile& in, unsigned int resampled_width, uns
   }
 
   // Correctly set our Rawtile info
-  if( in.memoryManaged ) delete[] in.data;
-  in.data = buf;
-  in.memoryManaged = true;
-
+  in.adopt( buf, resampled_width * resampled_height * channels * in.bpc/8 );
   in.width = resampled_width;
   in.height = resampled_height;
-  in.dataLength = resampled_width * resampled_height * channels * in.bpc/8;
 
 }
 
@@ -507,10 +497,8 @@ void filter_contrast( RawTile& in, float c ){
   }
 
   // Replace original buffer with new
-  delete[] (float*) in.data;
-  in.data = buffer;
+  in.adopt( buffer, np );
   in.bpc = 8;
-  in.dataLength = np * in.bpc/8;
 }
 
 
@@ -522,6 +510,7 @@ void filter_gamma( RawTile& in, float g ){
 
   if( g == 1.0 ) return;
 
+  in.detach();
   infptr = (float*)in.data;
 
   // Loop through our pixels for floating values 
@@ -592,14 +581,8 @@ void filter_rotate( RawTile& in, float angle=0.0 ){
       }
     }
 
-    // Delete old data buffer
-    if( in.bpc == 8 ) delete[] (unsigned char*) in.data;
-    else if( in.bpc == 16 ) delete[] (unsigned short*) in.data;
-    else if( in.bpc == 32 && in.sampleType == FIXEDPOINT ) delete[] (unsigned int*) in.data;
-    else if( in.bpc == 32 && in.sampleType == FLOATINGPOINT ) delete[] (float*) in.data;
-
-    // Assign new data to Rawtile
-    in.data = buffer;
+    // Replace the old data buffer with the rotated data
+    in.adopt( buffer, in.dataLength );
 
     // For 90 and 270 rotation swap width and height
     if( (int)angle % 180 == 90 ){
@@ -632,18 +615,20 @@ void filter_greyscale( RawTile& rawtile ){
   }
 
   // Delete our old data buffer and instead point to our grayscale data
-  delete[] (unsigned char*) rawtile.data;
-  rawtile.data = (void*) buffer;
+  rawtile.adopt( buffer, np );
 
-  // Update our number of channels and data length
+  // Update our number of channels
   rawtile.channels = 1;
-  rawtile.dataLength = np;
 }
 
 // Crops edge pixels from image
 void filter_crop( RawTile& in, int left, int top, int right, int bottom ){
 
   unsigned int n = 0;
+
+  // We modify the data in place
+  in.detach();
+
   //Cropping
   for( int i=top; i < in.height - bottom; i++ ){
     unsigned int index1 = i * in.width;
@@ -0,0 +1,233 @@
+/*
+    IIPImage Server - Member functions for Warmup.h
+
+    Copyright (C) 2014 Ruven Pillay.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#include "Warmup.h"
+#include "TileManager.h"
+#include "Environment.h"
+#include "Thread.h"
+
+#include <sstream>
+#include <list>
+
+
+using namespace std;
+
+
+
+unsigned int Warmup::read( const string& manifest ) throw(string){
+
+  ifstream in( manifest.c_str() );
+  if( !in ) throw string( "Warmup :: unable to open manifest " ) + manifest;
+
+  string line;
+  while( getline( in, line ) ){
+    size_t first = line.find_first_not_of( " \t\r" );
+    if( first == string::npos || line[first] == '#' ) continue;
+    size_t last = line.find_last_not_of( " \t\r" );
+    paths.push_back( line.substr( first, last - first + 1 ) );
+  }
+
+  return paths.size();
+}
+
+
+
+void Warmup::load( unsigned int n, unsigned int threads, unsigned int seconds, float max,
+		   ofstream* s, int l ){
+
+  levels = n;
+  maxTime = (long) seconds * 1000000;
+  maxSize = (unsigned long)(max*1024000);
+  logfile = s;
+  loglevel = l;
+  next = 0;
+  stopped = false;
+
+  if( threads > paths.size() ) threads = paths.size();
+  if( threads == 0 ) return;
+
+  if( loglevel >= 1 ){
+    *logfile << "Warm-up :: loading " << paths.size() << " images using " << threads << " threads" << endl;
+  }
+
+  timer.start();
+
+  vector<Thread*> workers;
+  for( unsigned int i=0; i<threads; i++ ){
+    Thread* thread = new Thread();
+    if( thread->start( &Warmup::run, this ) ) workers.push_back( thread );
+    else delete thread;
+  }
+
+  // Do the work ourselves if we cannot start any threads
+  if( workers.empty() ) this->work();
+
+  for( unsigned int i=0; i<workers.size(); i++ ) delete workers[i];
+
+  if( loglevel >= 1 ) *logfile << "Warm-up :: " << this->getStatistics() << endl;
+}
+
+
+
+void Warmup::run( void* p ){
+  ((Warmup*) p)->work();
+}
+
+
+
+bool Warmup::limited(){
+  if( stopped ) return true;
+  if( timer.getTime() < maxTime && size < maxSize ) return false;
+  stopped = true;
+  if( loglevel >= 1 ){
+    *logfile << "Warm-up :: stopping as the " << ( size < maxSize ? "time" : "memory" ) << " limit has been reached" << endl;
+  }
+  return true;
+}
+
+
+
+void Warmup::work(){
+
+  string filesystem_prefix = Environment::getFileSystemPrefix();
+  string filename_pattern = Environment::getFileNamePattern();
+  JPEGCompressor jpeg( quality );
+
+  while( true ){
+
+    string path;
+    IIPImage metadata;
+    bool cached = false;
+
+    {
+      ScopedLock lock( mutex );
+      if( next >= paths.size() || this->limited() ) break;
+      path = paths[next++];
+      const IIPImage* c = imageCache->find( path );
+      if( c ){
+	metadata = *c;
+	cached = true;
+      }
+    }
+
+    IIPImage* image = NULL;
+    unsigned int n = 0;
+
+    try{
+
+      if( !cached ){
+	metadata = IIPImage( path );
+	metadata.setFileNamePattern( filename_pattern );
+	metadata.setFileSystemPrefix( filesystem_prefix );
+	metadata.Initialise();
+      }
+
+      image = IIPImage::create( metadata );
+      image->openImage();
+
+      // Add the image to our cache exactly as FIF would and watch its files
+      if( !cached ){
+	ScopedLock lock( mutex );
+	vector<string> evicted;
+	imageCache->insert( path, *image, &evicted );
+	if( watcher ){
+	  list<int> hlist = image->getHorizontalViewsList();
+	  list<int> vlist = image->getVerticalViewsList();
+	  for( list<int>::iterator h = hlist.begin(); h != hlist.end(); h++ ){
+	    for( list<int>::iterator v = vlist.begin(); v != vlist.end(); v++ ){
+	      watcher->watch( image->getFileName( *h, *v ), path );
+	    }
+	  }
+	  watcher->verify( image->getFileName( image->currentX, image->currentY ), path, image->timestamp );
+	  for( unsigned int i=0; i<evicted.size(); i++ ) watcher->unwatch( evicted[i] );
+	}
+      }
+
+      // Only images which can be served as JPEG have tiles loaded
+      if( image->getNumBitsPerPixel() <= 8 && image->getColourSpace() != CIELAB ){
+	n = this->loadTiles( image, jpeg );
+      }
+
+      ScopedLock lock( mutex );
+      numImages++;
+      unsigned int done = numImages + numFailed;
+      if( loglevel >= 2 ){
+	*logfile << "Warm-up :: [" << done << "/" << paths.size() << "] " << path
+		 << ": " << n << " tiles after " << timer.getTime() << " microseconds" << endl;
+      }
+      // Otherwise report our progress every 10%
+      else if( loglevel >= 1 && done*10/paths.size() != (done-1)*10/paths.size() ){
+	*logfile << "Warm-up :: " << done << " of " << paths.size() << " images loaded after "
+		 << timer.getTime() << " microseconds" << endl;
+      }
+    }
+    catch( const string& error ){
+      ScopedLock lock( mutex );
+      numFailed++;
+      if( loglevel >= 1 ) *logfile << "Warm-up :: unable to load " << path << ": " << error << endl;
+    }
+
+    delete image;
+  }
+}
+
+
+
+unsigned int Warmup::loadTiles( IIPImage* image, JPEGCompressor& jpeg ){
+
+  unsigned int tw = image->getTileWidth();
+  unsigned int th = image->getTileHeight();
+  unsigned int num_res = image->getNumResolutions();
+  if( tw == 0 || th == 0 ) return 0;
+
+  // Decode, compress and cache tiles just as a request with the default view would, but without logging
+  TileManager tilemanager( tileCache, image, watermark, &jpeg, NULL, 0 );
+
+  unsigned int n = 0;
+  for( unsigned int res = 0; res < levels && res < num_res; res++ ){
+    unsigned int ntlx = ( image->image_widths[num_res-res-1] + tw - 1 ) / tw;
+    unsigned int ntly = ( image->image_heights[num_res-res-1] + th - 1 ) / th;
+    image->adviseTiles( 0, 90, res, 0, ntlx*ntly - 1 );
+    for( unsigned int t = 0; t < ntlx*ntly; t++ ){
+      {
+	ScopedLock lock( mutex );
+	if( this->limited() ) return n;
+      }
+      RawTile tile = tilemanager.getTile( res, t, 0, 90, layers, JPEG );
+      ScopedLock lock( mutex );
+      size += tile.dataLength;
+      numTiles++;
+      n++;
+    }
+  }
+
+  return n;
+}
+
+
+
+string Warmup::getStatistics(){
+  ScopedLock lock( mutex );
+  ostringstream s;
+  s << numImages << " images and " << numTiles << " tiles (" << size / 1024000.0 << "MB) loaded, "
+    << numFailed << " failed, in " << timer.getTime() << " microseconds";
+  return s.str();
+}
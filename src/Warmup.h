@@ -0,0 +1,168 @@
+// Startup Cache Warm-up
+
+/*  IIP Image Server
+
+    Copyright (C) 2014 Ruven Pillay.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#ifndef _WARMUP_H
+#define _WARMUP_H
+
+
+#include <string>
+#include <vector>
+#include <fstream>
+
+#include "IIPImage.h"
+#include "ImageCache.h"
+#include "Cache.h"
+#include "FileWatcher.h"
+#include "JPEGCompressor.h"
+#include "Mutex.h"
+#include "Timer.h"
+#include "Watermark.h"
+
+
+
+/// Loads the images listed in a manifest into our caches before we start serving requests
+/** The manifest is a text file listing one image path per line, exactly as it would
+    appear in a request. Blank lines and lines starting with '#' are ignored.
+
+    Each image is opened and added to the image metadata cache, and the JPEG tiles of its
+    lowest resolutions are decoded into the tile cache, so that the first requests from
+    viewers are cache hits. Images are shared out between one worker thread per processor.
+    Warming up stops early once a time limit or a limit on the amount of tile data loaded
+    is reached.
+ */
+
+class Warmup {
+
+ private:
+
+  /// Tile cache to load tiles into
+  Cache* tileCache;
+
+  /// Image metadata cache to load images into
+  ImageCache* imageCache;
+
+  /// Watcher for the files of loaded images, or NULL
+  FileWatcher* watcher;
+
+  /// Watermark applied to decoded tiles
+  Watermark* watermark;
+
+  /// JPEG quality and number of quality layers with which tiles are requested by default
+  int quality, layers;
+
+  /// Image paths from the manifest
+  std::vector<std::string> paths;
+
+  /// Index of the next image to load
+  unsigned int next;
+
+  /// Number of resolutions to load, counting from the smallest
+  unsigned int levels;
+
+  /// Time limit in microseconds and limit in bytes on the tile data loaded
+  long maxTime;
+  unsigned long maxSize;
+
+  /// Whether a limit has been reached
+  bool stopped;
+
+  /// Timer started when we start loading
+  Timer timer;
+
+  /// Log file and logging level
+  std::ofstream* logfile;
+  int loglevel;
+
+  /// Lock protecting everything above and the image cache
+  Mutex mutex;
+
+  /// Statistics
+  unsigned int numImages, numTiles, numFailed;
+  unsigned long size;
+
+
+  /// Worker thread entry point
+  /** @param p this warm-up */
+  static void run( void* p );
+
+  /// Worker loop
+  void work();
+
+  /// Load the tiles of the lowest resolutions of an image
+  /** @param image opened image
+      @param jpeg compressor for this worker
+      @return number of tiles loaded
+   */
+  unsigned int loadTiles( IIPImage* image, JPEGCompressor& jpeg );
+
+  /// Check whether a limit has been reached, logging the first time it is
+  /** Must be called with the lock held
+      @return true if we should stop
+   */
+  bool limited();
+
+  /// The warm-up cannot be copied
+  Warmup( const Warmup& );
+  Warmup& operator = ( const Warmup& );
+
+
+ public:
+
+  /// Constructor
+  /** @param tc tile cache
+      @param ic image metadata cache
+      @param fw watcher for the files of loaded images, or NULL
+      @param w watermark
+      @param q default JPEG quality
+      @param l default number of quality layers
+   */
+  Warmup( Cache* tc, ImageCache* ic, FileWatcher* fw, Watermark* w, int q, int l ) :
+    tileCache( tc ), imageCache( ic ), watcher( fw ), watermark( w ), quality( q ), layers( l ),
+    next( 0 ), levels( 0 ), maxTime( 0 ), maxSize( 0 ), stopped( false ), logfile( NULL ), loglevel( 0 ),
+    numImages( 0 ), numTiles( 0 ), numFailed( 0 ), size( 0 ) {};
+
+  /// Read the list of images to load from a manifest
+  /** Throws a string exception if the manifest cannot be read
+      @param manifest manifest file path
+      @return number of images listed
+   */
+  unsigned int read( const std::string& manifest ) throw(std::string);
+
+  /// Load the images listed in the manifest, returning once done or once a limit is reached
+  /** @param n number of resolutions to load, counting from the smallest
+      @param threads number of worker threads
+      @param seconds time limit in seconds
+      @param max limit in MB on the tile data loaded
+      @param s log file
+      @param l logging level
+   */
+  void load( unsigned int n, unsigned int threads, unsigned int seconds, float max,
+	     std::ofstream* s, int l );
+
+  /// Return a summary of the warm-up statistics
+  std::string getStatistics();
+
+};
+
+
+
+#endif
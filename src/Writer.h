@@ -25,6 +25,8 @@
 
 #include <fcgiapp.h>
 #include <cstdio>
+#include <cstdlib>
+#include <cstring>
 
 
 /// Virtual base class for various writers
@@ -51,12 +53,21 @@ class Writer {
   /// Flush the output buffer
   virtual int flush() = 0;
 
+  /// Return a copy of everything written so far, or NULL if none is kept
+  virtual const char* getBuffer() const { return NULL; };
+
+  /// Return the number of bytes in our copy of everything written so far
+  virtual size_t getSize() const { return 0; };
+
 };
 
 
+inline Writer::~Writer() {}
+
+
 
 /// FCGI Writer Class
-class FCGIWriter {
+class FCGIWriter : public Writer {
 
  private:
 
@@ -104,13 +115,15 @@ class FCGIWriter {
   int flush(){
     return FCGX_FFlush( out );
   };
+  const char* getBuffer() const { return buffer; };
+  size_t getSize() const { return sz; };
 
 };
 
 
 
 /// File Writer Class
-class FileWriter {
+class FileWriter : public Writer {
 
  private:
 
@@ -0,0 +1,85 @@
+#!/bin/sh
+#
+# IIPImage Server - compare the embedded HTTP server with iipsrv behind nginx over FastCGI
+#
+# Runs httpbench against iipsrv started with --http and against nginx passing the same
+# requests to iipsrv started with --bind, each with the same number of request threads.
+# Build iipsrv.fcgi and httpbench ("make httpbench") first and run from the src directory:
+#
+#   FILESYSTEM_PREFIX=/path/to/images/ ./httpbench.sh image [threads] [connections] [exports] [seconds]
+#
+# The IIPSRV, HTTPBENCH and NGINX environment variables select the binaries to use and
+# BASE_PORT the first of the three local ports used (9500 by default).
+#
+# Copyright (C) 2014 Ruven Pillay. Released under the GNU General Public License
+# version 3 or later, as with the rest of iipsrv.
+
+if [ $# -lt 1 ]; then
+  echo "Usage: $0 image [threads] [connections] [exports] [seconds]" >&2
+  exit 1
+fi
+
+image=$1
+threads=${2:-4}
+connections=${3:-16}
+exports=${4:-2}
+seconds=${5:-20}
+
+iipsrv=${IIPSRV:-./iipsrv.fcgi}
+httpbench=${HTTPBENCH:-./httpbench}
+nginx=${NGINX:-nginx}
+port=${BASE_PORT:-9500}
+http_port=$port
+fcgi_port=$((port+1))
+nginx_port=$((port+2))
+
+dir=$(mktemp -d) || exit 1
+pids=""
+cleanup(){
+  for p in $pids; do kill $p 2>/dev/null; done
+  wait 2>/dev/null
+  rm -rf "$dir"
+}
+trap cleanup EXIT INT TERM
+
+cat > "$dir/nginx.conf" <<EOF
+worker_processes 1;
+daemon off;
+pid $dir/nginx.pid;
+error_log $dir/error.log;
+events { worker_connections 1024; }
+http {
+  access_log off;
+  client_body_temp_path $dir/body;
+  fastcgi_temp_path $dir/fastcgi;
+  proxy_temp_path $dir/proxy;
+  scgi_temp_path $dir/scgi;
+  uwsgi_temp_path $dir/uwsgi;
+  server {
+    listen 127.0.0.1:$nginx_port;
+    location /fcgi-bin/iipsrv.fcgi {
+      fastcgi_pass 127.0.0.1:$fcgi_port;
+      fastcgi_param QUERY_STRING \$query_string;
+      fastcgi_param REQUEST_METHOD \$request_method;
+      fastcgi_param REQUEST_URI \$request_uri;
+      fastcgi_param SCRIPT_NAME \$fastcgi_script_name;
+      fastcgi_param SERVER_PROTOCOL \$server_protocol;
+      fastcgi_param HTTP_IF_MODIFIED_SINCE \$http_if_modified_since;
+    }
+  }
+}
+EOF
+
+LOGFILE=$dir/http.log "$iipsrv" --http 127.0.0.1:$http_port --threads $threads &
+pids="$pids $!"
+LOGFILE=$dir/fcgi.log "$iipsrv" --bind 127.0.0.1:$fcgi_port --threads $threads &
+pids="$pids $!"
+"$nginx" -p "$dir" -c "$dir/nginx.conf" &
+pids="$pids $!"
+sleep 1
+
+echo "Embedded HTTP server with $threads threads"
+"$httpbench" 127.0.0.1:$http_port "$image" $connections $exports $seconds
+echo
+echo "nginx and FastCGI with $threads threads"
+"$httpbench" 127.0.0.1:$nginx_port "$image" $connections $exports $seconds